@@ -0,0 +1,446 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include <pthread.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/utils.h>
+
+#include "gtp.h"
+#include "internal.h"
+#include "ebpf.h"
+
+#ifndef AF_XDP
+#define AF_XDP		44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP		283
+#endif
+
+#define LOGEP(ep, lvl, fmt, args ...) \
+	LOGP(DEP, lvl, "%s: " fmt, (ep)->name, ## args)
+
+/***********************************************************************
+ * AF_XDP receive fast path of a GTP endpoint
+ ***********************************************************************/
+
+/* An XDP program on the interface owning the bind address of the endpoint redirects
+ * unfragmented IPv4/UDP packets for that address + port into AF_XDP sockets, one per
+ * configured RX queue.  Everything else (other traffic, IP options, fragments, queues
+ * without AF_XDP socket) passes on to the kernel stack and thus to the normal UDP
+ * socket of the endpoint, which is also always used for transmit. */
+
+/* number + size of the frames of the UMEM of each AF_XDP socket */
+#define XSK_NUM_FRAMES		4096
+#define XSK_FRAME_SIZE		4096
+/* number of descriptors of the RX / completion rings; the fill ring holds all frames */
+#define XSK_RX_RING_SIZE	2048
+#define XSK_COMP_RING_SIZE	64
+
+/* headers in front of the GTP header, as verified by the XDP program */
+#define XSK_HDRS_LEN		(ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr))
+
+struct xsk_ring {
+	uint32_t *producer;
+	uint32_t *consumer;
+	uint32_t *flags;
+	void *descs;
+	uint32_t mask;
+	void *map;
+	size_t map_len;
+};
+
+struct gtp_ep_xdp;
+
+/* one AF_XDP socket (bound to one RX queue) and its receive thread */
+struct gtp_ep_xsk {
+	struct gtp_ep_xdp *xdp;
+	unsigned int queue_id;
+	int fd;
+	uint8_t *umem;
+	struct xsk_ring rx;
+	struct xsk_ring fill;
+	struct xsk_ring comp;
+	bool thread_running;
+	pthread_t thread;
+	struct rcu_reader rcu;
+};
+
+struct gtp_ep_xdp {
+	struct gtp_endpoint *ep;
+	int ifindex;
+	int map_fd;
+	int prog_fd;
+	int link_fd;
+	unsigned int num_xsks;
+	struct gtp_ep_xsk *xsks;
+};
+
+/* index of the 'pass' label in the program below */
+#define XDP_PROG_PASS		24
+/* jump offset from instruction idx to the 'pass' label */
+#define TO_PASS(idx)		(XDP_PROG_PASS - (idx) - 1)
+
+static int xdp_prog_load(struct gtp_ep_xdp *xdp, const struct sockaddr_in *sin)
+{
+	struct bpf_insn prog[] = {
+		/* r6 = ctx; r2 = data; r3 = data_end */
+		[0] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		[1] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data), 0),
+		[2] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end), 0),
+		/* if (data + eth + ip + udp > data_end) pass */
+		[3] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+		[4] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, XSK_HDRS_LEN),
+		[5] = INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, TO_PASS(5), 0),
+		/* ethertype IPv4 */
+		[6] = INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, offsetof(struct ethhdr, h_proto), 0),
+		[7] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, TO_PASS(7), htons(ETH_P_IP)),
+		/* IPv4 without options */
+		[8] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2, ETH_HLEN, 0),
+		[9] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, TO_PASS(9), 0x45),
+		/* not a fragment */
+		[10] = INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2,
+			    ETH_HLEN + offsetof(struct iphdr, frag_off), 0),
+		[11] = INSN(BPF_JMP | BPF_JSET | BPF_K, BPF_REG_4, 0, TO_PASS(11), htons(IP_MF | IP_OFFMASK)),
+		/* UDP */
+		[12] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2,
+			    ETH_HLEN + offsetof(struct iphdr, protocol), 0),
+		[13] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, TO_PASS(13), IPPROTO_UDP),
+		/* destination address + port of the endpoint (both compared in network order) */
+		[14] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_2,
+			    ETH_HLEN + offsetof(struct iphdr, daddr), 0),
+		[15] = INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_4, 0, TO_PASS(15), (int32_t) sin->sin_addr.s_addr),
+		[16] = INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2,
+			    ETH_HLEN + sizeof(struct iphdr) + offsetof(struct udphdr, dest), 0),
+		[17] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, TO_PASS(17), sin->sin_port),
+		/* return bpf_redirect_map(&xskmap, ctx->rx_queue_index, XDP_PASS) */
+		[18] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+			    offsetof(struct xdp_md, rx_queue_index), 0),
+		[19] = INSN_LD_MAP_FD(BPF_REG_1, xdp->map_fd),
+		[21] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+		[22] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		[23] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		/* pass: return XDP_PASS */
+		[XDP_PROG_PASS] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+		[XDP_PROG_PASS+1] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	static char log_buf[4096];
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (uintptr_t) prog;
+	attr.insn_cnt = ARRAY_SIZE(prog);
+	attr.license = (uintptr_t) "GPL";
+	attr.log_buf = (uintptr_t) log_buf;
+	attr.log_size = sizeof(log_buf);
+	attr.log_level = 1;
+
+	log_buf[0] = '\0';
+	xdp->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (xdp->prog_fd < 0) {
+		LOGEP(xdp->ep, LOGL_ERROR, "Cannot load XDP program: %s\n%s\n", strerror(errno), log_buf);
+		return -1;
+	}
+	return 0;
+}
+
+static int xsk_map_ring(struct gtp_ep_xsk *xsk, struct xsk_ring *r, const struct xdp_ring_offset *off,
+			uint32_t size, size_t desc_size, off_t pgoff)
+{
+	r->map_len = off->desc + size * desc_size;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		return -1;
+	}
+	r->producer = (uint32_t *) ((uint8_t *) r->map + off->producer);
+	r->consumer = (uint32_t *) ((uint8_t *) r->map + off->consumer);
+	r->flags = (uint32_t *) ((uint8_t *) r->map + off->flags);
+	r->descs = (uint8_t *) r->map + off->desc;
+	r->mask = size - 1;
+	return 0;
+}
+
+static int xsk_open(struct gtp_ep_xsk *xsk, bool native)
+{
+	struct gtp_ep_xdp *xdp = xsk->xdp;
+	struct xdp_umem_reg umem_reg = {
+		.len = (uint64_t) XSK_NUM_FRAMES * XSK_FRAME_SIZE,
+		.chunk_size = XSK_FRAME_SIZE,
+	};
+	struct sockaddr_xdp sxdp = {
+		.sxdp_family = AF_XDP,
+		.sxdp_ifindex = xdp->ifindex,
+		.sxdp_queue_id = xsk->queue_id,
+		/* skb (generic) mode always copies */
+		.sxdp_flags = XDP_USE_NEED_WAKEUP | (native ? 0 : XDP_COPY),
+	};
+	uint32_t rx_size = XSK_RX_RING_SIZE, fill_size = XSK_NUM_FRAMES, comp_size = XSK_COMP_RING_SIZE;
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	union bpf_attr attr;
+	uint32_t key = xsk->queue_id;
+	unsigned int i;
+
+	xsk->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (xsk->fd < 0)
+		return -1;
+
+	xsk->umem = mmap(NULL, umem_reg.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (xsk->umem == MAP_FAILED) {
+		xsk->umem = NULL;
+		return -1;
+	}
+	umem_reg.addr = (uintptr_t) xsk->umem;
+
+	if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) < 0 ||
+	    setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(fill_size)) < 0 ||
+	    setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &comp_size, sizeof(comp_size)) < 0 ||
+	    setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &rx_size, sizeof(rx_size)) < 0 ||
+	    getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+		return -1;
+
+	if (xsk_map_ring(xsk, &xsk->rx, &off.rx, rx_size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+	    xsk_map_ring(xsk, &xsk->fill, &off.fr, fill_size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+	    xsk_map_ring(xsk, &xsk->comp, &off.cr, comp_size, sizeof(uint64_t),
+			 XDP_UMEM_PGOFF_COMPLETION_RING) < 0)
+		return -1;
+
+	/* hand all frames to the kernel for reception */
+	for (i = 0; i < XSK_NUM_FRAMES; i++)
+		((uint64_t *) xsk->fill.descs)[i] = (uint64_t) i * XSK_FRAME_SIZE;
+	__atomic_store_n(xsk->fill.producer, XSK_NUM_FRAMES, __ATOMIC_RELEASE);
+
+	if (bind(xsk->fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) < 0)
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = xdp->map_fd;
+	attr.key = (uintptr_t) &key;
+	attr.value = (uintptr_t) &xsk->fd;
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void xsk_close(struct gtp_ep_xsk *xsk)
+{
+	if (xsk->thread_running) {
+		pthread_cancel(xsk->thread);
+		dp_thread_join(xsk->xdp->ep->d, xsk->thread);
+	}
+	if (xsk->rx.map)
+		munmap(xsk->rx.map, xsk->rx.map_len);
+	if (xsk->fill.map)
+		munmap(xsk->fill.map, xsk->fill.map_len);
+	if (xsk->comp.map)
+		munmap(xsk->comp.map, xsk->comp.map_len);
+	if (xsk->fd >= 0)
+		close(xsk->fd);
+	if (xsk->umem)
+		munmap(xsk->umem, (size_t) XSK_NUM_FRAMES * XSK_FRAME_SIZE);
+}
+
+/* decapsulate one frame received via AF_XDP; the XDP program verified the headers */
+static void xsk_rx_one(struct gtp_ep_xsk *xsk, uint8_t *frame, uint32_t len)
+{
+	struct gtp_endpoint *ep = xsk->xdp->ep;
+	const struct udphdr *udph = (const struct udphdr *) (frame + ETH_HLEN + sizeof(struct iphdr));
+	uint8_t *gtp = frame + XSK_HDRS_LEN;
+	unsigned int gtp_len, tpdu_len;
+	int outfd, rc;
+
+	/* the frame may be padded beyond the end of the UDP datagram */
+	if (ntohs(udph->len) < sizeof(*udph))
+		return;
+	gtp_len = ntohs(udph->len) - sizeof(*udph);
+	if (gtp_len > len - XSK_HDRS_LEN)
+		return;
+
+	outfd = gtp_ep_decap_lookup(ep, gtp, gtp_len, &tpdu_len);
+	if (outfd < 0)
+		return;
+	/* like in the socket rx paths */
+	rc = write(outfd, gtp + sizeof(struct gtp1_header), tpdu_len);
+	if (rc < (int) tpdu_len) {
+		LOGEP(ep, LOGL_FATAL, "Error writing to tun device %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+static void *xsk_thread(void *arg)
+{
+	struct gtp_ep_xsk *xsk = (struct gtp_ep_xsk *)arg;
+	struct gtp_daemon *d = xsk->xdp->ep->d;
+	struct pollfd pfd = { .fd = xsk->fd, .events = POLLIN };
+
+	rcu_register_thread(&d->rcu, &xsk->rcu);
+	pthread_cleanup_push(rcu_unregister_thread, &xsk->rcu);
+	rcu_thread_online(&xsk->rcu);
+
+	while (1) {
+		uint32_t cons = *xsk->rx.consumer;
+		uint32_t prod = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE);
+		uint32_t fill_prod = *xsk->fill.producer;
+		uint32_t i;
+
+		if (cons == prod) {
+			rcu_thread_offline(&xsk->rcu);
+			poll(&pfd, 1, -1);
+			rcu_thread_online(&xsk->rcu);
+			continue;
+		}
+
+		for (i = cons; i != prod; i++) {
+			const struct xdp_desc *desc = &((struct xdp_desc *) xsk->rx.descs)[i & xsk->rx.mask];
+			xsk_rx_one(xsk, xsk->umem + desc->addr, desc->len);
+			/* hand the frame back to the kernel */
+			((uint64_t *) xsk->fill.descs)[fill_prod++ & xsk->fill.mask] =
+				desc->addr & ~((uint64_t) XSK_FRAME_SIZE - 1);
+		}
+		__atomic_store_n(xsk->rx.consumer, prod, __ATOMIC_RELEASE);
+		__atomic_store_n(xsk->fill.producer, fill_prod, __ATOMIC_RELEASE);
+		if (__atomic_load_n(xsk->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+			recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+		rcu_quiescent_state(&xsk->rcu);
+	}
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+static void gtp_ep_xdp_free(struct gtp_ep_xdp *xdp)
+{
+	unsigned int i;
+
+	/* detach the program first, so traffic goes to the UDP socket again */
+	if (xdp->link_fd >= 0)
+		close(xdp->link_fd);
+	for (i = 0; i < xdp->num_xsks; i++)
+		xsk_close(&xdp->xsks[i]);
+	if (xdp->prog_fd >= 0)
+		close(xdp->prog_fd);
+	if (xdp->map_fd >= 0)
+		close(xdp->map_fd);
+	talloc_free(xdp);
+}
+
+/* set up the AF_XDP fast path of an endpoint; on failure, only the UDP socket is used */
+int gtp_ep_xdp_start(struct gtp_endpoint *ep)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *) &ep->bind_addr;
+	struct gtp_daemon *d = ep->d;
+	struct gtp_ep_xdp *xdp;
+	union bpf_attr attr;
+	unsigned int i;
+
+	if (ep->bind_addr.ss_family != AF_INET || sin->sin_addr.s_addr == htonl(INADDR_ANY)) {
+		LOGEP(ep, LOGL_NOTICE, "AF_XDP requires binding to a specific IPv4 address\n");
+		return -1;
+	}
+
+	xdp = talloc_zero(ep, struct gtp_ep_xdp);
+	if (!xdp)
+		return -1;
+	xdp->ep = ep;
+	xdp->map_fd = xdp->prog_fd = xdp->link_fd = -1;
+	xdp->num_xsks = d->cfg.af_xdp_queues;
+	xdp->xsks = talloc_zero_array(xdp, struct gtp_ep_xsk, xdp->num_xsks);
+	if (!xdp->xsks) {
+		talloc_free(xdp);
+		return -1;
+	}
+	for (i = 0; i < xdp->num_xsks; i++) {
+		xdp->xsks[i].xdp = xdp;
+		xdp->xsks[i].queue_id = i;
+		xdp->xsks[i].fd = -1;
+	}
+
+	xdp->ifindex = netdev_find_ifindex(sin);
+	if (!xdp->ifindex) {
+		LOGEP(ep, LOGL_ERROR, "Cannot find interface of bind address for AF_XDP\n");
+		goto err;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = xdp->num_xsks;
+	xdp->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (xdp->map_fd < 0) {
+		LOGEP(ep, LOGL_ERROR, "Cannot create XSKMAP: %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (xdp_prog_load(xdp, sin) < 0)
+		goto err;
+
+	for (i = 0; i < xdp->num_xsks; i++) {
+		if (xsk_open(&xdp->xsks[i], d->cfg.af_xdp_native) < 0) {
+			LOGEP(ep, LOGL_ERROR, "Cannot set up AF_XDP socket for queue %u: %s\n", i,
+				strerror(errno));
+			goto err;
+		}
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = xdp->prog_fd;
+	attr.link_create.target_ifindex = xdp->ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = d->cfg.af_xdp_native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+	xdp->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (xdp->link_fd < 0) {
+		/* e.g. another endpoint already attached its program to the interface */
+		LOGEP(ep, LOGL_ERROR, "Cannot attach XDP program to ifindex %d: %s\n", xdp->ifindex,
+			strerror(errno));
+		goto err;
+	}
+
+	for (i = 0; i < xdp->num_xsks; i++) {
+		struct gtp_ep_xsk *xsk = &xdp->xsks[i];
+		char name[32];
+		snprintf(name, sizeof(name), "xsk/%s/%u", ep->name, xsk->queue_id);
+		if (dp_thread_create(ep->d, &xsk->thread, name, -1, xsk_thread, xsk)) {
+			LOGEP(ep, LOGL_ERROR, "Cannot start AF_XDP thread: %s\n", strerror(errno));
+			goto err;
+		}
+		xsk->thread_running = true;
+	}
+
+	ep->xdp = xdp;
+	LOGEP(ep, LOGL_INFO, "AF_XDP fast path on ifindex %d with %u queue(s) in %s mode\n",
+		xdp->ifindex, xdp->num_xsks, d->cfg.af_xdp_native ? "native" : "skb");
+	return 0;
+
+err:
+	gtp_ep_xdp_free(xdp);
+	return -1;
+}
+
+void gtp_ep_xdp_stop(struct gtp_endpoint *ep)
+{
+	if (!ep->xdp)
+		return;
+	gtp_ep_xdp_free(ep->xdp);
+	ep->xdp = NULL;
+}
@@ -0,0 +1,326 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <pthread.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/utils.h>
+
+#include "internal.h"
+
+/***********************************************************************
+ * Control-plane worker pool
+ ***********************************************************************/
+
+struct ctrl_pool {
+	/* back-pointer to daemon */
+	struct gtp_daemon *d;
+
+	/* protects runnable + completed */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* jobs to be picked up by a worker (struct ctrl_job) */
+	struct llist_head runnable;
+	/* jobs whose work() has returned, waiting for their done() */
+	struct llist_head completed;
+	/* signalled by the workers whenever they complete a job */
+	struct osmo_fd efd;
+
+	/* jobs submitted but not done yet, incl. those waiting on a strand (main thread only) */
+	unsigned int num_pending;
+	/* barriers waiting for num_pending to drop to 0, and the jobs submitted after them, in
+	 * order of submission (main thread only) */
+	struct llist_head held;
+	/* within the done() of a barrier, whose jobs are part of it (main thread only) */
+	bool in_barrier;
+
+	pthread_t *threads;
+	/* 0: work() is run by the main thread right away */
+	unsigned int num_threads;
+};
+
+static void *ctrl_worker_thread(void *arg)
+{
+	struct ctrl_pool *pool = arg;
+	struct ctrl_job *job;
+	uint64_t one = 1;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (llist_empty(&pool->runnable))
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		job = llist_first_entry(&pool->runnable, struct ctrl_job, list);
+		llist_del(&job->list);
+		pthread_mutex_unlock(&pool->lock);
+
+		job->work(job);
+
+		pthread_mutex_lock(&pool->lock);
+		llist_add_tail(&job->list, &pool->completed);
+		pthread_mutex_unlock(&pool->lock);
+		if (write(pool->efd.fd, &one, sizeof(one)) < 0)
+			LOGP(DUECUPS, LOGL_ERROR, "Cannot signal completed job: %s\n", strerror(errno));
+	}
+
+	return NULL;
+}
+
+/* hand a job to the workers; its strand (if any) has been marked busy by the caller */
+static void ctrl_pool_run(struct ctrl_pool *pool, struct ctrl_job *job)
+{
+	uint64_t one = 1;
+
+	if (!pool->num_threads) {
+		/* still completed via the event loop, like with worker threads */
+		job->work(job);
+		llist_add_tail(&job->list, &pool->completed);
+		if (write(pool->efd.fd, &one, sizeof(one)) < 0)
+			LOGP(DUECUPS, LOGL_ERROR, "Cannot signal completed job: %s\n", strerror(errno));
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	llist_add_tail(&job->list, &pool->runnable);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* account for a job, and run it unless another one of its strand is */
+static void ctrl_pool_queue(struct ctrl_pool *pool, struct ctrl_job *job)
+{
+	struct ctrl_strand *s = job->strand;
+
+	pool->num_pending++;
+	if (s && s->busy) {
+		llist_add_tail(&job->list, &s->jobs);
+		return;
+	}
+	if (s)
+		s->busy = true;
+	ctrl_pool_run(pool, job);
+}
+
+/* call done() of the barriers whose preceding jobs are all done, and queue the jobs held
+ * behind them, up to the next barrier that has to wait for those */
+static void ctrl_pool_release(struct ctrl_pool *pool)
+{
+	struct ctrl_job *job;
+
+	while (!llist_empty(&pool->held)) {
+		job = llist_first_entry(&pool->held, struct ctrl_job, list);
+		if (!job->work && pool->num_pending)
+			return;
+		llist_del(&job->list);
+		if (job->work) {
+			ctrl_pool_queue(pool, job);
+			continue;
+		}
+		pool->in_barrier = true;
+		job->done(job);
+		pool->in_barrier = false;
+	}
+}
+
+/* call done() of all completed jobs, and start the next job of their strands */
+static void ctrl_pool_complete(struct ctrl_pool *pool)
+{
+	LLIST_HEAD(completed);
+	struct ctrl_job *job, *next;
+	struct ctrl_strand *s;
+
+	pthread_mutex_lock(&pool->lock);
+	llist_splice_init(&pool->completed, &completed);
+	pthread_mutex_unlock(&pool->lock);
+
+	while (!llist_empty(&completed)) {
+		job = llist_first_entry(&completed, struct ctrl_job, list);
+		llist_del(&job->list);
+		pool->num_pending--;
+
+		/* before done(), which may release the object owning an idle strand.  Any
+		 * other job of the strand keeps that object alive */
+		next = NULL;
+		s = job->strand;
+		if (s && llist_empty(&s->jobs))
+			s->busy = false;
+		else if (s) {
+			next = llist_first_entry(&s->jobs, struct ctrl_job, list);
+			llist_del(&next->list);
+		}
+
+		job->done(job);
+
+		if (next)
+			ctrl_pool_run(pool, next);
+	}
+
+	ctrl_pool_release(pool);
+}
+
+static int ctrl_pool_efd_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct ctrl_pool *pool = ofd->data;
+	uint64_t val;
+
+	if (read(ofd->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		LOGP(DUECUPS, LOGL_ERROR, "Cannot read eventfd: %s\n", strerror(errno));
+	ctrl_pool_complete(pool);
+
+	return 0;
+}
+
+static int ctrl_pool_start(struct gtp_daemon *d)
+{
+	unsigned int num = d->cfg.num_ctrl_workers;
+	struct ctrl_pool *pool;
+	char name[16];
+	unsigned int i;
+	int fd, rc;
+
+	pool = talloc_zero(d, struct ctrl_pool);
+	if (!pool)
+		return -1;
+	pool->d = d;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	INIT_LLIST_HEAD(&pool->runnable);
+	INIT_LLIST_HEAD(&pool->completed);
+	INIT_LLIST_HEAD(&pool->held);
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		LOGP(DUECUPS, LOGL_ERROR, "Cannot create eventfd: %s\n", strerror(errno));
+		goto err_free;
+	}
+	osmo_fd_setup(&pool->efd, fd, OSMO_FD_READ, ctrl_pool_efd_cb, pool, 0);
+	if (osmo_fd_register(&pool->efd) < 0)
+		goto err_close;
+
+	pool->threads = talloc_zero_array(pool, pthread_t, num);
+	if (num && !pool->threads)
+		goto err_unregister;
+
+	/* the workers inherit the signal mask of the main thread, which blocks the signals of
+	 * its signalfd (SIGCHLD in particular); so do the programs they start */
+	for (i = 0; i < num; i++) {
+		rc = pthread_create(&pool->threads[i], NULL, ctrl_worker_thread, pool);
+		if (rc) {
+			LOGP(DUECUPS, LOGL_ERROR, "Cannot start control worker: %s\n", strerror(rc));
+			break;
+		}
+		snprintf(name, sizeof(name), "ctrl/%u", i);
+		pthread_setname_np(pool->threads[i], name);
+	}
+	/* the threads started so far are fine, as they only wait for jobs */
+	pool->num_threads = i;
+
+	d->ctrl_pool = pool;
+	LOGP(DUECUPS, LOGL_INFO, "Started control worker pool with %u thread(s)\n", pool->num_threads);
+
+	return 0;
+
+err_unregister:
+	osmo_fd_unregister(&pool->efd);
+err_close:
+	close(fd);
+err_free:
+	talloc_free(pool);
+	return -1;
+}
+
+void ctrl_strand_init(struct ctrl_strand *s)
+{
+	INIT_LLIST_HEAD(&s->jobs);
+	s->busy = false;
+}
+
+/* submit a job, of the strand s if given; the pool is started on first use.  Returns
+ * negative only if it cannot be started, then done() is never called */
+int ctrl_job_submit(struct gtp_daemon *d, struct ctrl_strand *s, struct ctrl_job *job,
+		    ctrl_job_cb work, ctrl_job_cb done)
+{
+	ASSERT_MAIN_THREAD(d);
+
+	if (!d->ctrl_pool && ctrl_pool_start(d) < 0)
+		return -1;
+
+	job->strand = s;
+	job->work = work;
+	job->done = done;
+
+	/* not before a barrier submitted earlier, unless submitted by its done() */
+	if (!llist_empty(&d->ctrl_pool->held) && !d->ctrl_pool->in_barrier) {
+		llist_add_tail(&job->list, &d->ctrl_pool->held);
+		return 0;
+	}
+	ctrl_pool_queue(d->ctrl_pool, job);
+
+	return 0;
+}
+
+/* submit a barrier: its done() is called once all jobs submitted before it are done, and
+ * the jobs submitted after it only start once it has returned.  For operations that need
+ * exclusive access to the objects the jobs may be using, without waiting like
+ * ctrl_pool_drain().  The jobs submitted by done() itself start right away, ahead of those
+ * held behind the barrier, and the next barrier waits for them, too.  done() is never
+ * called from here, but from the event loop or from ctrl_pool_drain() (i.e. maybe from
+ * within a VTY command).  Returns negative only if the pool cannot be started, then done()
+ * is never called */
+int ctrl_barrier_submit(struct gtp_daemon *d, struct ctrl_job *job, ctrl_job_cb done)
+{
+	uint64_t one = 1;
+
+	ASSERT_MAIN_THREAD(d);
+
+	if (!d->ctrl_pool && ctrl_pool_start(d) < 0)
+		return -1;
+
+	job->strand = NULL;
+	job->work = NULL;
+	job->done = done;
+	llist_add_tail(&job->list, &d->ctrl_pool->held);
+
+	/* otherwise released once the last pending job is done */
+	if (!d->ctrl_pool->num_pending &&
+	    write(d->ctrl_pool->efd.fd, &one, sizeof(one)) < 0)
+		LOGP(DUECUPS, LOGL_ERROR, "Cannot signal barrier: %s\n", strerror(errno));
+
+	return 0;
+}
+
+/* wait for all submitted jobs and barriers to be done (incl. the jobs held behind barriers,
+ * which still refer to their strands), for operations that need exclusive access to the
+ * objects the jobs may be using.  Must not be called from a done() call-back.  Only for the
+ * VTY; requests of clients use ctrl_barrier_submit(), which doesn't block the main thread */
+void ctrl_pool_drain(struct gtp_daemon *d)
+{
+	struct ctrl_pool *pool = d->ctrl_pool;
+	struct pollfd pfd;
+
+	ASSERT_MAIN_THREAD(d);
+
+	if (!pool)
+		return;
+
+	pfd.fd = pool->efd.fd;
+	pfd.events = POLLIN;
+	while (pool->num_pending || !llist_empty(&pool->held)) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			LOGP(DUECUPS, LOGL_FATAL, "Error in poll(): %s\n", strerror(errno));
+			exit(1);
+		}
+		ctrl_pool_efd_cb(&pool->efd, OSMO_FD_READ);
+	}
+}
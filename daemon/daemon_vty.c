@@ -23,15 +23,34 @@
 static void show_tun_hdr(struct vty *vty)
 {
 	vty_out(vty,
-		" tun device name | netwk  namespace | use count%s", VTY_NEWLINE);
+		" tun device name | netwk  namespace | queues | use count%s", VTY_NEWLINE);
 	vty_out(vty,
-		"---------------- | ---------------- | ---------%s", VTY_NEWLINE);
+		"---------------- | ---------------- | ------ | ---------%s", VTY_NEWLINE);
+}
+
+/* time a busy polling thread spent spinning without packets vs. sleeping */
+static void show_busy_poll(struct vty *vty, const char *prefix, unsigned int idx,
+			   const struct dp_busy_poll *bp)
+{
+	if (!bp->idle_ns)
+		return;
+	vty_out(vty, "  %s %u: busy polling %.3f s, sleeping %.3f s%s", prefix, idx,
+		__atomic_load_n(&bp->spin_ns, __ATOMIC_RELAXED) / 1e9,
+		__atomic_load_n(&bp->sleep_ns, __ATOMIC_RELAXED) / 1e9, VTY_NEWLINE);
 }
 
 static void show_one_tun(struct vty *vty, const struct tun_device *tun)
 {
-	vty_out(vty, "%16s | %16s | %lu%s",
-		tun->devname, tun->netns_name, tun->use_count, VTY_NEWLINE);
+	unsigned int i;
+
+	if (tun->kgtp_ep)
+		vty_out(vty, "%16s | %16s | kernel | %lu%s",
+			tun->devname, tun->netns_name, tun->use_count, VTY_NEWLINE);
+	else
+		vty_out(vty, "%16s | %16s | %6u | %lu%s",
+			tun->devname, tun->netns_name, tun->num_queues, tun->use_count, VTY_NEWLINE);
+	for (i = 0; i < tun->num_queues && !tun->kgtp_ep; i++)
+		show_busy_poll(vty, "queue", i, &tun->queues[i].bp);
 }
 
 DEFUN(show_tun, show_tun_cmd,
@@ -74,7 +93,37 @@ DEFUN(tun_create, tun_create_cmd,
 	if (argc > 1)
 		netns_name = argv[1];
 
-	tun = tun_device_find_or_create(g_daemon, ifname, netns_name);
+	/* the device may still be opened by a control worker */
+	ctrl_pool_drain(g_daemon);
+	tun = tun_device_find_or_create(g_daemon, ifname, netns_name, 0, NULL);
+	if (!tun) {
+		vty_out(vty, "Error creating TUN%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	return CMD_SUCCESS;
+}
+
+DEFUN(tun_create_mq, tun_create_mq_cmd,
+	"tun-device create IFNAME queues <1-256> [NETNS]",
+	TUN_STR "Create a new TUN interface\n"
+	"Name of TUN network device\n"
+	"Create a multi-queue TUN interface with one reader thread per queue\n"
+	"Number of queues\n"
+	"Name of network namespace for tun device\n"
+	)
+{
+	struct tun_device *tun;
+	const char *ifname = argv[0];
+	unsigned int num_queues = atoi(argv[1]);
+	const char *netns_name = NULL;
+
+	if (argc > 2)
+		netns_name = argv[2];
+
+	/* the device may still be opened by a control worker */
+	ctrl_pool_drain(g_daemon);
+	tun = tun_device_find_or_create(g_daemon, ifname, netns_name, num_queues, NULL);
 	if (!tun) {
 		vty_out(vty, "Error creating TUN%s", VTY_NEWLINE);
 		return CMD_WARNING;
@@ -92,6 +141,8 @@ DEFUN(tun_destroy, tun_destroy_cmd,
 	struct tun_device *tun;
 	const char *ifname = argv[0];
 
+	/* its tunnels may still be created or destroyed by the control workers */
+	ctrl_pool_drain(g_daemon);
 	pthread_rwlock_wrlock(&g_daemon->rwlock);
 	tun = _tun_device_find(g_daemon, ifname);
 	if (!tun) {
@@ -101,6 +152,7 @@ DEFUN(tun_destroy, tun_destroy_cmd,
 	}
 	_tun_device_deref_destroy(tun);
 	pthread_rwlock_unlock(&g_daemon->rwlock);
+	rcu_reclaim(&g_daemon->rcu);
 
 	return CMD_SUCCESS;
 }
@@ -109,16 +161,19 @@ DEFUN(tun_destroy, tun_destroy_cmd,
 static void show_ep_hdr(struct vty *vty)
 {
 	vty_out(vty,
-		"                    address port | use count%s", VTY_NEWLINE);
+		"                    address port | workers | use count%s", VTY_NEWLINE);
 	vty_out(vty,
-		" ------------------------------- | ---------%s", VTY_NEWLINE);
+		" ------------------------------- | ------- | ---------%s", VTY_NEWLINE);
 }
 
 static void show_one_ep(struct vty *vty, const struct gtp_endpoint *ep)
 {
-	vty_out(vty, "%32s | %lu%s",
-		ep->name, ep->use_count, VTY_NEWLINE);
+	unsigned int i;
 
+	vty_out(vty, "%32s | %7u | %lu%s",
+		ep->name, ep->num_workers, ep->use_count, VTY_NEWLINE);
+	for (i = 0; i < ep->num_workers; i++)
+		show_busy_poll(vty, "worker", i, &ep->workers[i].bp);
 }
 
 DEFUN(show_gtp, show_gtp_cmd,
@@ -213,16 +268,15 @@ DEFUN(gtp_destroy, gtp_destroy_cmd,
 		return CMD_WARNING;
 	}
 
-	pthread_rwlock_wrlock(&g_daemon->rwlock);
+	pthread_rwlock_rdlock(&g_daemon->rwlock);
 	ep = _gtp_endpoint_find(g_daemon, (struct sockaddr_storage *) ai->ai_addr);
+	pthread_rwlock_unlock(&g_daemon->rwlock);
 	if (!ep) {
-		pthread_rwlock_unlock(&g_daemon->rwlock);
 		vty_out(vty, "Cannot find to-be-destoryed endpoint%s", VTY_NEWLINE);
 		freeaddrinfo(ai);
 		return CMD_WARNING;
 	}
-	_gtp_endpoint_deref_destroy(ep);
-	pthread_rwlock_unlock(&g_daemon->rwlock);
+	gtp_endpoint_deref_destroy(ep);
 
 	freeaddrinfo(ai);
 	return CMD_SUCCESS;
@@ -232,7 +286,7 @@ static void show_one_tunnel(struct vty *vty, const struct gtp_tunnel *t)
 {
 	char remote_ip[64], remote_port[16], user_addr[64];
 
-	getnameinfo((struct sockaddr *) &t->remote_udp, sizeof(t->remote_udp),
+	getnameinfo((struct sockaddr *) &t->peer->addr, sizeof(t->peer->addr),
 		    remote_ip, sizeof(remote_ip), remote_port, sizeof(remote_port),
 		    NI_NUMERICHOST|NI_NUMERICSERV);
 
@@ -260,6 +314,55 @@ DEFUN(show_tunnel, show_tunnel_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(show_io_workers, show_io_workers_cmd,
+	"show io-workers",
+	SHOW_STR "Threads of the I/O worker pool\n")
+{
+	unsigned int i;
+
+	/* only modified by the main thread, which we are running in */
+	for (i = 0; i < g_daemon->num_io_workers; i++) {
+		vty_out(vty, "worker %u: %u fd(s)%s", i, g_daemon->io_workers[i].num_fds,
+			VTY_NEWLINE);
+	}
+	if (!g_daemon->num_io_workers)
+		vty_out(vty, "Worker pool not in use%s", VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_pkt_pools, show_pkt_pools_cmd,
+	"show packet-pools",
+	SHOW_STR "Packet buffer pools of the data-plane\n")
+{
+	struct pkt_pool *pool;
+
+	/* the list is only modified by the main thread, which we are running in */
+	llist_for_each_entry(pool, &g_daemon->pkt_pools, list) {
+		pthread_mutex_lock(&pool->lock);
+		vty_out(vty, "NUMA node %d, %u byte buffers: %u slab(s), %u buffers, %u in use, "
+			"%u free, %lu allocation failure(s)%s", pool->numa_node, pool->data_len,
+			pool->num_slabs,
+			pool->num_bufs, pool->num_bufs - pool->num_free, pool->num_free,
+			pool->alloc_failures, VTY_NEWLINE);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	if (llist_empty(&g_daemon->pkt_pools))
+		vty_out(vty, "No packet buffer pool in use%s", VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
+DEFUN(show_dp_threads, show_dp_threads_cmd,
+	"show data-plane threads",
+	SHOW_STR "GTP-U data plane\n" "Threads of the data plane with their CPU placement + usage\n")
+{
+	if (llist_empty(&g_daemon->dp_threads)) {
+		vty_out(vty, "No data-plane thread running%s", VTY_NEWLINE);
+		return CMD_SUCCESS;
+	}
+	dp_threads_vty_show(vty, g_daemon);
+	return CMD_SUCCESS;
+}
+
 #define UECUPS_NODE	(_LAST_OSMOVTY_NODE+1)
 
 static struct cmd_node uecups_node = {
@@ -272,6 +375,7 @@ static int config_write_uecups(struct vty *vty)
 {
 	vty_out(vty, "uecups%s", VTY_NEWLINE);
 	vty_out(vty, " local-ip %s%s", g_daemon->cfg.cups_local_ip, VTY_NEWLINE);
+	vty_out(vty, " ctrl-workers %u%s", g_daemon->cfg.num_ctrl_workers, VTY_NEWLINE);
 
 	return CMD_SUCCESS;
 }
@@ -293,11 +397,439 @@ DEFUN(cfg_uecups_local_ip, cfg_uecups_local_ip_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_uecups_ctrl_workers, cfg_uecups_ctrl_workers_cmd,
+	"ctrl-workers <0-64>",
+	"Number of threads completing slow requests (tun device creation, netlink, program start)"
+	" asynchronously, while the main thread serves further requests. Takes effect when the"
+	" pool is started on first use\n"
+	"Number of threads; 0 to run the requests in the main thread\n")
+{
+	g_daemon->cfg.num_ctrl_workers = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+#define DATA_PLANE_NODE	(_LAST_OSMOVTY_NODE+2)
+
+static struct cmd_node data_plane_node = {
+	DATA_PLANE_NODE,
+	"%s(config-data-plane)# ",
+	1,
+};
+
+static int config_write_data_plane(struct vty *vty)
+{
+	vty_out(vty, "data-plane%s", VTY_NEWLINE);
+	vty_out(vty, " rx-batch-size %u%s", g_daemon->cfg.rx_batch_size, VTY_NEWLINE);
+	vty_out(vty, " tx-batch-size %u%s", g_daemon->cfg.tx_batch_size, VTY_NEWLINE);
+	vty_out(vty, " %stx-udp-gso%s", g_daemon->cfg.tx_udp_gso ? "" : "no ", VTY_NEWLINE);
+	vty_out(vty, " %srx-udp-gro%s", g_daemon->cfg.rx_udp_gro ? "" : "no ", VTY_NEWLINE);
+	vty_out(vty, " tun-queues %u%s", g_daemon->cfg.tun_num_queues, VTY_NEWLINE);
+	vty_out(vty, " endpoint-workers %u%s", g_daemon->cfg.ep_num_workers, VTY_NEWLINE);
+	vty_out(vty, " %sendpoint-worker-pinning%s", g_daemon->cfg.ep_worker_pinning ? "" : "no ",
+		VTY_NEWLINE);
+	vty_out(vty, " io-workers %u%s", g_daemon->cfg.num_io_workers, VTY_NEWLINE);
+	vty_out(vty, " io-worker-engine %s%s", g_daemon->cfg.io_uring ? "io-uring" : "epoll",
+		VTY_NEWLINE);
+	vty_out(vty, " %skernel-gtp%s", g_daemon->cfg.kernel_gtp ? "" : "no ", VTY_NEWLINE);
+	vty_out(vty, " %stc-bpf-offload%s", g_daemon->cfg.tc_bpf ? "" : "no ", VTY_NEWLINE);
+	vty_out(vty, " %saf-xdp%s", g_daemon->cfg.af_xdp ? "" : "no ", VTY_NEWLINE);
+	vty_out(vty, " af-xdp-mode %s%s", g_daemon->cfg.af_xdp_native ? "native" : "skb", VTY_NEWLINE);
+	vty_out(vty, " af-xdp-queues %u%s", g_daemon->cfg.af_xdp_queues, VTY_NEWLINE);
+	if (g_daemon->cfg.pkt_pool_max_mb)
+		vty_out(vty, " packet-pool-max-size %u%s", g_daemon->cfg.pkt_pool_max_mb, VTY_NEWLINE);
+	else
+		vty_out(vty, " no packet-pool-max-size%s", VTY_NEWLINE);
+	vty_out(vty, " %spacket-pool-hugepages%s", g_daemon->cfg.pkt_pool_hugepages ? "" : "no ",
+		VTY_NEWLINE);
+	vty_out(vty, " pipeline-workers %u%s", g_daemon->cfg.pipeline_workers, VTY_NEWLINE);
+	if (g_daemon->cfg.dp_cpus)
+		vty_out(vty, " data-plane-cpus %s%s", g_daemon->cfg.dp_cpus, VTY_NEWLINE);
+	else
+		vty_out(vty, " no data-plane-cpus%s", VTY_NEWLINE);
+	if (g_daemon->cfg.numa_node >= 0)
+		vty_out(vty, " numa-node %d%s", g_daemon->cfg.numa_node, VTY_NEWLINE);
+	else
+		vty_out(vty, " no numa-node%s", VTY_NEWLINE);
+	if (g_daemon->cfg.rt_priority)
+		vty_out(vty, " rt-priority %u%s", g_daemon->cfg.rt_priority, VTY_NEWLINE);
+	else
+		vty_out(vty, " no rt-priority%s", VTY_NEWLINE);
+	if (g_daemon->cfg.ep_busy_poll_us)
+		vty_out(vty, " busy-poll endpoint %u%s", g_daemon->cfg.ep_busy_poll_us, VTY_NEWLINE);
+	else
+		vty_out(vty, " no busy-poll endpoint%s", VTY_NEWLINE);
+	if (g_daemon->cfg.tun_busy_poll_us)
+		vty_out(vty, " busy-poll tun %u%s", g_daemon->cfg.tun_busy_poll_us, VTY_NEWLINE);
+	else
+		vty_out(vty, " no busy-poll tun%s", VTY_NEWLINE);
+
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_data_plane, cfg_data_plane_cmd,
+	"data-plane",
+	"Configure the GTP-U data plane (endpoint and tun device threads)\n")
+{
+	vty->node = DATA_PLANE_NODE;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_rx_batch_size, cfg_dp_rx_batch_size_cmd,
+	"rx-batch-size <1-1024>",
+	"Maximum number of GTP packets received per system call on a GTP endpoint."
+	" Applies to newly created endpoints\n"
+	"Number of packets (1 disables batching)\n")
+{
+	g_daemon->cfg.rx_batch_size = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_tx_batch_size, cfg_dp_tx_batch_size_cmd,
+	"tx-batch-size <1-1024>",
+	"Maximum number of packets read from a tun device before sending them to the GTP"
+	" endpoint(s) with one system call each. Applies to newly created tun devices\n"
+	"Number of packets (1 disables batching)\n")
+{
+	g_daemon->cfg.tx_batch_size = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_tx_udp_gso, cfg_dp_tx_udp_gso_cmd,
+	"tx-udp-gso",
+	"Coalesce consecutive uplink packets of a tunnel into UDP GSO (UDP_SEGMENT) sends,"
+	" if supported by the kernel. Applies to newly created GTP endpoints\n")
+{
+	g_daemon->cfg.tx_udp_gso = true;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_no_tx_udp_gso, cfg_dp_no_tx_udp_gso_cmd,
+	"no tx-udp-gso",
+	NO_STR "Send every uplink packet as individual UDP datagram\n")
+{
+	g_daemon->cfg.tx_udp_gso = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_rx_udp_gro, cfg_dp_rx_udp_gro_cmd,
+	"rx-udp-gro",
+	"Let the kernel coalesce received GTP datagrams via UDP GRO, if supported."
+	" Applies to newly created GTP endpoints\n")
+{
+	g_daemon->cfg.rx_udp_gro = true;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_no_rx_udp_gro, cfg_dp_no_rx_udp_gro_cmd,
+	"no rx-udp-gro",
+	NO_STR "Receive every GTP datagram individually\n")
+{
+	g_daemon->cfg.rx_udp_gro = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_tun_queues, cfg_dp_tun_queues_cmd,
+	"tun-queues <1-256>",
+	"Default number of queues (and reader threads) of tun devices, unless specified"
+	" on creation. Applies to newly created tun devices\n"
+	"Number of queues (more than 1 creates IFF_MULTI_QUEUE devices)\n")
+{
+	g_daemon->cfg.tun_num_queues = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_ep_workers, cfg_dp_ep_workers_cmd,
+	"endpoint-workers <1-64>",
+	"Number of SO_REUSEPORT sockets (each with its own receive thread) per GTP endpoint;"
+	" datagrams are steered to them by TEID. Applies to newly created GTP endpoints\n"
+	"Number of sockets + threads\n")
+{
+	g_daemon->cfg.ep_num_workers = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_ep_worker_pinning, cfg_dp_ep_worker_pinning_cmd,
+	"endpoint-worker-pinning",
+	"Pin the N-th receive thread of each GTP endpoint to the N-th CPU."
+	" Applies to newly created GTP endpoints\n")
+{
+	g_daemon->cfg.ep_worker_pinning = true;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_no_ep_worker_pinning, cfg_dp_no_ep_worker_pinning_cmd,
+	"no endpoint-worker-pinning",
+	NO_STR "Let the scheduler place the receive threads of GTP endpoints\n")
+{
+	g_daemon->cfg.ep_worker_pinning = false;
+	return CMD_SUCCESS;
+}
+
+/* the threads of the I/O worker pool serve many fds, so none of them can busy poll one */
+static void warn_busy_poll_io_workers(struct vty *vty)
+{
+	if (g_daemon->cfg.num_io_workers &&
+	    (g_daemon->cfg.ep_busy_poll_us || g_daemon->cfg.tun_busy_poll_us))
+		vty_out(vty, "%% busy-poll is ignored with io-workers %u, as the threads of the pool "
+			"never busy poll%s", g_daemon->cfg.num_io_workers, VTY_NEWLINE);
+}
+
+DEFUN(cfg_dp_io_workers, cfg_dp_io_workers_cmd,
+	"io-workers <0-256>",
+	"Number of threads in a pool serving all GTP endpoint sockets and tun queues via epoll,"
+	" instead of one thread for each of them. Takes effect for newly created endpoints +"
+	" tun devices; the pool size is fixed once it has been started\n"
+	"Number of threads; 0 to use one thread per socket/queue\n")
+{
+	g_daemon->cfg.num_io_workers = atoi(argv[0]);
+	warn_busy_poll_io_workers(vty);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_io_worker_engine, cfg_dp_io_worker_engine_cmd,
+	"io-worker-engine (epoll|io-uring)",
+	"Mechanism used by the threads of the worker pool to serve their fds. Takes effect when"
+	" the pool is started\n"
+	"Readiness notification via epoll + batched recvmmsg/sendmmsg/read\n"
+	"Multishot receive into provided buffers + batched submission via io_uring\n")
+{
+	if (!strcmp(argv[0], "io-uring")) {
+#ifdef HAVE_LIBURING
+		g_daemon->cfg.io_uring = true;
+#else
+		vty_out(vty, "%% io_uring support was not compiled in (--enable-io-uring)%s",
+			VTY_NEWLINE);
+		return CMD_WARNING;
+#endif
+	} else
+		g_daemon->cfg.io_uring = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_kernel_gtp, cfg_dp_kernel_gtp_cmd,
+	"kernel-gtp",
+	"Let the kernel GTP driver forward eligible tunnels (IPv4, peer port 2152, endpoint with"
+	" a single socket): their tun device is created as a GTP device instead. Applies to"
+	" newly created tun devices\n")
+{
+#ifdef HAVE_LIBGTPNL
+	g_daemon->cfg.kernel_gtp = true;
+	return CMD_SUCCESS;
+#else
+	vty_out(vty, "%% kernel GTP support was not compiled in (--enable-kernel-gtp)%s",
+		VTY_NEWLINE);
+	return CMD_WARNING;
+#endif
+}
+
+DEFUN(cfg_dp_no_kernel_gtp, cfg_dp_no_kernel_gtp_cmd,
+	"no kernel-gtp",
+	NO_STR "Forward all tunnels in userspace via tun devices\n")
+{
+	g_daemon->cfg.kernel_gtp = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_tc_bpf, cfg_dp_tc_bpf_cmd,
+	"tc-bpf-offload",
+	"Let TC eBPF programs encapsulate + decapsulate IPv4 tunnels between tun devices in the"
+	" namespace of the daemon and IPv4 GTP endpoints; everything else still goes through the"
+	" userspace threads. Applies to newly created endpoints + tun devices\n")
+{
+	g_daemon->cfg.tc_bpf = true;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_no_tc_bpf, cfg_dp_no_tc_bpf_cmd,
+	"no tc-bpf-offload",
+	NO_STR "Forward all packets via the userspace threads\n")
+{
+	g_daemon->cfg.tc_bpf = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_af_xdp, cfg_dp_af_xdp_cmd,
+	"af-xdp",
+	"Receive GTP-U via AF_XDP sockets fed by an XDP program on the interface of the bind"
+	" address (IPv4 only). Applies to newly created GTP endpoints\n")
+{
+	g_daemon->cfg.af_xdp = true;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_no_af_xdp, cfg_dp_no_af_xdp_cmd,
+	"no af-xdp",
+	NO_STR "Receive GTP-U only via the UDP sockets of GTP endpoints\n")
+{
+	g_daemon->cfg.af_xdp = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_af_xdp_mode, cfg_dp_af_xdp_mode_cmd,
+	"af-xdp-mode (skb|native)",
+	"How to attach the XDP program to the interface\n"
+	"Generic mode, works with any driver (e.g. veth) but copies every packet\n"
+	"Driver mode, requires XDP support by the NIC driver\n")
+{
+	g_daemon->cfg.af_xdp_native = !strcmp(argv[0], "native");
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_af_xdp_queues, cfg_dp_af_xdp_queues_cmd,
+	"af-xdp-queues <1-64>",
+	"Number of NIC RX queues served by one AF_XDP socket + thread each. Packets arriving"
+	" on other queues are received via the UDP sockets\n"
+	"Number of queues, starting at queue 0\n")
+{
+	g_daemon->cfg.af_xdp_queues = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_pkt_pool_max_size, cfg_dp_pkt_pool_max_size_cmd,
+	"packet-pool-max-size <16-65536>",
+	"Limit of the memory of each packet buffer pool (one per NUMA node)\n"
+	"Size in MiB\n")
+{
+	g_daemon->cfg.pkt_pool_max_mb = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_no_pkt_pool_max_size, cfg_dp_no_pkt_pool_max_size_cmd,
+	"no packet-pool-max-size",
+	NO_STR "Limit of the memory of each packet buffer pool (one per NUMA node)\n")
+{
+	g_daemon->cfg.pkt_pool_max_mb = 0;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_pkt_pool_hugepages, cfg_dp_pkt_pool_hugepages_cmd,
+	"packet-pool-hugepages",
+	"Back the packet buffer pools by huge pages, falling back to regular pages if none are"
+	" available\n")
+{
+	g_daemon->cfg.pkt_pool_hugepages = true;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_no_pkt_pool_hugepages, cfg_dp_no_pkt_pool_hugepages_cmd,
+	"no packet-pool-hugepages",
+	NO_STR "Back the packet buffer pools by huge pages\n")
+{
+	g_daemon->cfg.pkt_pool_hugepages = false;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_pipeline_workers, cfg_dp_pipeline_workers_cmd,
+	"pipeline-workers <0-64>",
+	"Number of worker threads per GTP endpoint socket and per tun queue, to which its"
+	" reader thread dispatches packets by flow (TEID / inner 5-tuple). Only used without"
+	" the I/O worker pool, and disables UDP GRO. Applies to newly created endpoints +"
+	" tun devices\n"
+	"Number of threads (0: the reader processes the packets itself)\n")
+{
+	g_daemon->cfg.pipeline_workers = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_cpus, cfg_dp_cpus_cmd,
+	"data-plane-cpus LIST",
+	"CPUs to run the data-plane threads on. Programs started on behalf of clients (and"
+	" the main thread) are kept off them. Applies to newly started threads\n"
+	"List of CPUs like 2-5,8\n")
+{
+	if (cpulist_check(argv[0]) < 0) {
+		vty_out(vty, "%% Invalid CPU list '%s'%s", argv[0], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	osmo_talloc_replace_string(g_daemon, &g_daemon->cfg.dp_cpus, argv[0]);
+	dp_thread_isolate_main(g_daemon);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_no_cpus, cfg_dp_no_cpus_cmd,
+	"no data-plane-cpus",
+	NO_STR "CPUs to run the data-plane threads on\n")
+{
+	talloc_free(g_daemon->cfg.dp_cpus);
+	g_daemon->cfg.dp_cpus = NULL;
+	dp_thread_isolate_main(g_daemon);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_numa_node, cfg_dp_numa_node_cmd,
+	"numa-node <0-63>",
+	"NUMA node to run the data-plane threads on (restricting the data-plane CPUs to those"
+	" of the node) and to allocate packet buffers from. Applies to newly started threads\n"
+	"Node number\n")
+{
+	g_daemon->cfg.numa_node = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_no_numa_node, cfg_dp_no_numa_node_cmd,
+	"no numa-node",
+	NO_STR "NUMA node to run the data-plane threads on\n")
+{
+	g_daemon->cfg.numa_node = -1;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_rt_priority, cfg_dp_rt_priority_cmd,
+	"rt-priority <1-99>",
+	"Run the data-plane threads with the SCHED_FIFO real-time policy (requires"
+	" CAP_SYS_NICE, else normal scheduling is used). Applies to newly started threads\n"
+	"Real-time priority\n")
+{
+	g_daemon->cfg.rt_priority = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_no_rt_priority, cfg_dp_no_rt_priority_cmd,
+	"no rt-priority",
+	NO_STR "Run the data-plane threads with the SCHED_FIFO real-time policy\n")
+{
+	g_daemon->cfg.rt_priority = 0;
+	return CMD_SUCCESS;
+}
+
+/* Busy polling is configured per object class (all endpoints, all tun devices) rather than
+ * per object, as both are created by the clients on demand.  It is applied when an object is
+ * created, and only to threads of its own, not to those of the I/O worker pool */
+#define BUSY_POLL_STR "Busy polling of the reader threads instead of sleeping until packets arrive\n"
+#define BUSY_POLL_TYPE_STR "Threads of GTP endpoints (SO_BUSY_POLL on their UDP sockets)\n" \
+	"Threads of tun device queues\n"
+
+DEFUN(cfg_dp_busy_poll, cfg_dp_busy_poll_cmd,
+	"busy-poll (endpoint|tun) <1-1000000>",
+	BUSY_POLL_STR BUSY_POLL_TYPE_STR
+	"Time without packets after which a thread sleeps, in microseconds. Applies to newly"
+	" created endpoints + tun devices, and only to threads not using the I/O worker pool\n")
+{
+	if (!strcmp(argv[0], "endpoint"))
+		g_daemon->cfg.ep_busy_poll_us = atoi(argv[1]);
+	else
+		g_daemon->cfg.tun_busy_poll_us = atoi(argv[1]);
+	warn_busy_poll_io_workers(vty);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_dp_no_busy_poll, cfg_dp_no_busy_poll_cmd,
+	"no busy-poll (endpoint|tun)",
+	NO_STR BUSY_POLL_STR BUSY_POLL_TYPE_STR)
+{
+	if (!strcmp(argv[0], "endpoint"))
+		g_daemon->cfg.ep_busy_poll_us = 0;
+	else
+		g_daemon->cfg.tun_busy_poll_us = 0;
+	return CMD_SUCCESS;
+}
+
 
 int gtpud_vty_init(void)
 {
 	install_element_ve(&show_tun_cmd);
 	install_element(ENABLE_NODE, &tun_create_cmd);
+	install_element(ENABLE_NODE, &tun_create_mq_cmd);
 	install_element(ENABLE_NODE, &tun_destroy_cmd);
 
 	install_element_ve(&show_gtp_cmd);
@@ -305,10 +837,50 @@ int gtpud_vty_init(void)
 	install_element(ENABLE_NODE, &gtp_destroy_cmd);
 
 	install_element_ve(&show_tunnel_cmd);
+	install_element_ve(&show_io_workers_cmd);
+	install_element_ve(&show_pkt_pools_cmd);
+	install_element_ve(&show_dp_threads_cmd);
 
 	install_element(CONFIG_NODE, &cfg_uecups_cmd);
 	install_node(&uecups_node, config_write_uecups);
 	install_element(UECUPS_NODE, &cfg_uecups_local_ip_cmd);
+	install_element(UECUPS_NODE, &cfg_uecups_ctrl_workers_cmd);
+
+	install_element(CONFIG_NODE, &cfg_data_plane_cmd);
+	install_node(&data_plane_node, config_write_data_plane);
+	install_element(DATA_PLANE_NODE, &cfg_dp_rx_batch_size_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_tx_batch_size_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_tx_udp_gso_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_tx_udp_gso_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_rx_udp_gro_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_rx_udp_gro_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_tun_queues_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_ep_workers_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_ep_worker_pinning_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_ep_worker_pinning_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_io_workers_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_io_worker_engine_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_kernel_gtp_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_kernel_gtp_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_tc_bpf_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_tc_bpf_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_af_xdp_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_af_xdp_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_af_xdp_mode_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_af_xdp_queues_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_pkt_pool_max_size_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_pkt_pool_max_size_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_pkt_pool_hugepages_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_pkt_pool_hugepages_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_pipeline_workers_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_cpus_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_cpus_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_numa_node_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_numa_node_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_rt_priority_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_rt_priority_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_busy_poll_cmd);
+	install_element(DATA_PLANE_NODE, &cfg_dp_no_busy_poll_cmd);
 
 	return 0;
 }
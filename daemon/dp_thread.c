@@ -0,0 +1,418 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include <pthread.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/utils.h>
+
+#include <osmocom/vty/vty.h>
+
+#include "internal.h"
+
+/***********************************************************************
+ * Data-plane threads: placement + accounting
+ ***********************************************************************/
+
+/* All data-plane threads are started via dp_thread_create(), which applies the configured
+ * CPU set / NUMA node / real-time priority, and keeps a record for 'show data-plane threads'. */
+
+struct dp_thread {
+	/* entry in gtp_daemon->dp_threads */
+	struct llist_head list;
+	char name[32];
+	pthread_t thread;
+	/* kernel thread ID; set by the thread itself */
+	pid_t tid;
+	/* CPUs the thread may run on, and its SCHED_FIFO priority (0: none) */
+	cpu_set_t cpus;
+	int rt_priority;
+
+	void *(*fn)(void *);
+	void *arg;
+
+	/* CPU time + wall clock at the previous 'show data-plane threads' */
+	uint64_t last_cpu_ns;
+	uint64_t last_wall_ns;
+};
+
+/* parse a CPU list like "2-5,8" into set; returns 0 or negative on error */
+static int cpulist_parse(const char *str, cpu_set_t *set)
+{
+	const char *p = str;
+
+	CPU_ZERO(set);
+	while (*p) {
+		char *end;
+		unsigned long first, last;
+
+		first = strtoul(p, &end, 10);
+		if (end == p)
+			return -EINVAL;
+		last = first;
+		p = end;
+		if (*p == '-') {
+			p++;
+			last = strtoul(p, &end, 10);
+			if (end == p || last < first)
+				return -EINVAL;
+			p = end;
+		}
+		if (last >= CPU_SETSIZE)
+			return -ERANGE;
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -EINVAL;
+	}
+
+	return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
+/* validate a CPU list like "2-5,8"; returns 0 or negative on error */
+int cpulist_check(const char *str)
+{
+	cpu_set_t set;
+	return cpulist_parse(str, &set);
+}
+
+/* print set as a CPU list like "2-5,8" into buf */
+static char *cpulist_print(char *buf, size_t len, const cpu_set_t *set)
+{
+	int cpu, first = -1;
+	size_t pos = 0;
+
+	buf[0] = '\0';
+	for (cpu = 0; cpu <= CPU_SETSIZE && pos < len; cpu++) {
+		bool isset = cpu < CPU_SETSIZE && CPU_ISSET(cpu, set);
+		if (isset && first < 0)
+			first = cpu;
+		if (isset || first < 0)
+			continue;
+		if (cpu - 1 > first)
+			pos += snprintf(buf + pos, len - pos, "%s%d-%d", pos ? "," : "", first, cpu - 1);
+		else
+			pos += snprintf(buf + pos, len - pos, "%s%d", pos ? "," : "", first);
+		first = -1;
+	}
+
+	return buf;
+}
+
+/* the CPUs the daemon may run on, which need not be 0..N-1 (offline CPUs, cgroup cpuset,
+ * taskset).  Determined once, before dp_thread_isolate_main() restricts the main thread */
+static void dp_process_cpus(cpu_set_t *set)
+{
+	static cpu_set_t cpus;
+	static bool valid;
+	long cpu, num_cpus;
+
+	if (!valid) {
+		if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0 || !CPU_COUNT(&cpus)) {
+			num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			CPU_ZERO(&cpus);
+			for (cpu = 0; cpu < num_cpus && cpu < CPU_SETSIZE; cpu++)
+				CPU_SET(cpu, &cpus);
+		}
+		valid = true;
+	}
+	*set = cpus;
+}
+
+/* the CPUs the data-plane threads may run on: those of the configured set and/or of the
+ * configured NUMA node which the daemon may run on, or else all of the latter */
+static void dp_thread_allowed_cpus(const struct gtp_daemon *d, cpu_set_t *set)
+{
+	cpu_set_t process_cpus, node_cpus;
+	long cpu, max_cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	dp_process_cpus(&process_cpus);
+	if (!d->cfg.dp_cpus || cpulist_parse(d->cfg.dp_cpus, set) < 0)
+		*set = process_cpus;
+	/* configured CPUs we may not run on are dropped; if that leaves none, all are used */
+	CPU_AND(set, set, &process_cpus);
+	if (!CPU_COUNT(set))
+		*set = process_cpus;
+
+	if (d->cfg.numa_node >= 0) {
+		CPU_ZERO(&node_cpus);
+		for (cpu = 0; cpu < max_cpus && cpu < CPU_SETSIZE; cpu++) {
+			if (pkt_pool_cpu_node(cpu) == d->cfg.numa_node)
+				CPU_SET(cpu, &node_cpus);
+		}
+		/* a node without any of the configured CPUs is ignored */
+		CPU_AND(&node_cpus, &node_cpus, set);
+		if (CPU_COUNT(&node_cpus))
+			*set = node_cpus;
+	}
+}
+
+/* the CPU a thread pinned with index idx runs on: the idx-th one (modulo their number) of
+ * the data-plane CPUs */
+int dp_thread_cpu(const struct gtp_daemon *d, unsigned int idx)
+{
+	cpu_set_t set;
+	int cpu, n;
+
+	dp_thread_allowed_cpus(d, &set);
+	n = idx % CPU_COUNT(&set);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set) && n-- == 0)
+			return cpu;
+	}
+	return -1;
+}
+
+static void *dp_thread_main(void *arg)
+{
+	struct dp_thread *t = arg;
+	char comm[16];
+
+	__atomic_store_n(&t->tid, syscall(SYS_gettid), __ATOMIC_RELAXED);
+	/* the kernel limits the name to 15 characters */
+	osmo_strlcpy(comm, t->name, sizeof(comm));
+	pthread_setname_np(pthread_self(), comm);
+	/* by the thread itself rather than via its attributes: should the CPUs of our cgroup
+	 * have changed meanwhile, it runs unpinned instead of not at all */
+	if (sched_setaffinity(0, sizeof(t->cpus), &t->cpus) < 0)
+		LOGP(DPKT, LOGL_NOTICE, "Cannot set CPU affinity of thread %s: %s\n", t->name,
+			strerror(errno));
+
+	return t->fn(t->arg);
+}
+
+/* start a data-plane thread running fn(arg).  If pin_idx is non-negative, it is pinned to one
+ * CPU, see dp_thread_cpu().  Returns 0 or an errno value (also set in errno) */
+int dp_thread_create(struct gtp_daemon *d, pthread_t *thread, const char *name, int pin_idx,
+		     void *(*fn)(void *), void *arg)
+{
+	struct sched_param param = { .sched_priority = d->cfg.rt_priority };
+	struct dp_thread *t;
+	pthread_attr_t attr;
+	int rc;
+
+	/* talloc is not thread safe, all alloc/free must come from main thread */
+	ASSERT_MAIN_THREAD(d);
+
+	t = talloc_zero(d, struct dp_thread);
+	if (!t)
+		return ENOMEM;
+	osmo_strlcpy(t->name, name, sizeof(t->name));
+	t->fn = fn;
+	t->arg = arg;
+	t->rt_priority = d->cfg.rt_priority;
+	if (pin_idx >= 0) {
+		CPU_ZERO(&t->cpus);
+		CPU_SET(dp_thread_cpu(d, pin_idx), &t->cpus);
+	} else
+		dp_thread_allowed_cpus(d, &t->cpus);
+
+	pthread_attr_init(&attr);
+	if (t->rt_priority) {
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	rc = pthread_create(&t->thread, &attr, dp_thread_main, t);
+	if (rc == EPERM && t->rt_priority) {
+		/* lacking CAP_SYS_NICE / RLIMIT_RTPRIO: better run without than not at all */
+		LOGP(DPKT, LOGL_NOTICE, "Cannot use SCHED_FIFO for thread %s, not permitted\n", t->name);
+		t->rt_priority = 0;
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		rc = pthread_create(&t->thread, &attr, dp_thread_main, t);
+	}
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		talloc_free(t);
+		/* for the callers' log messages */
+		errno = rc;
+		return rc;
+	}
+
+	*thread = t->thread;
+	llist_add_tail(&t->list, &d->dp_threads);
+
+	return 0;
+}
+
+/* wait for a thread started by dp_thread_create() to terminate (see pthread_join()) */
+void dp_thread_join(struct gtp_daemon *d, pthread_t thread)
+{
+	struct dp_thread *t;
+
+	ASSERT_MAIN_THREAD(d);
+
+	pthread_join(thread, NULL);
+	llist_for_each_entry(t, &d->dp_threads, list) {
+		if (pthread_equal(t->thread, thread)) {
+			llist_del(&t->list);
+			talloc_free(t);
+			break;
+		}
+	}
+}
+
+/* keep the main thread, and thereby the programs it starts, off the configured data-plane
+ * CPUs, as far as there are others */
+void dp_thread_isolate_main(struct gtp_daemon *d)
+{
+	cpu_set_t dp_cpus, others;
+
+	ASSERT_MAIN_THREAD(d);
+
+	dp_process_cpus(&others);
+	if (d->cfg.dp_cpus && cpulist_parse(d->cfg.dp_cpus, &dp_cpus) == 0) {
+		cpu_set_t tmp;
+		CPU_XOR(&tmp, &others, &dp_cpus);
+		CPU_AND(&tmp, &tmp, &others);
+		if (CPU_COUNT(&tmp))
+			others = tmp;
+	}
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(others), &others))
+		LOGP(DPKT, LOGL_NOTICE, "Cannot set CPU affinity of main thread\n");
+}
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_ns(&ts);
+}
+
+/* CPU the thread last ran on, from /proc; -1 if unknown */
+static int dp_thread_last_cpu(pid_t tid)
+{
+	char path[64], buf[1024];
+	char *p;
+	FILE *f;
+	int i, cpu = -1;
+
+	snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	/* the 39th field 'processor'; skip the name in parentheses, which may contain spaces */
+	p = strrchr(buf, ')');
+	for (i = 2; p && i < 39; i++)
+		p = strchr(p + 1, ' ');
+	if (p)
+		cpu = atoi(p + 1);
+
+	return cpu;
+}
+
+/* print all data-plane threads with their placement and CPU usage since the last call */
+void dp_threads_vty_show(struct vty *vty, struct gtp_daemon *d)
+{
+	struct dp_thread *t;
+	struct timespec now;
+	char cpus[64];
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	vty_out(vty, " thread name     |   tid  | prio | affinity         | on CPU | CPU time [s] | usage%s",
+		VTY_NEWLINE);
+	vty_out(vty, "---------------- | ------ | ---- | ---------------- | ------ | ------------ | -----%s",
+		VTY_NEWLINE);
+	llist_for_each_entry(t, &d->dp_threads, list) {
+		pid_t tid = __atomic_load_n(&t->tid, __ATOMIC_RELAXED);
+		uint64_t cpu_ns = 0, wall_ns = timespec_ns(&now);
+		struct timespec ts;
+		clockid_t cid;
+		char usage[16] = "-";
+
+		if (pthread_getcpuclockid(t->thread, &cid) == 0 && clock_gettime(cid, &ts) == 0)
+			cpu_ns = timespec_ns(&ts);
+		if (t->last_wall_ns && wall_ns > t->last_wall_ns)
+			snprintf(usage, sizeof(usage), "%.1f%%",
+				 100.0 * (cpu_ns - t->last_cpu_ns) / (wall_ns - t->last_wall_ns));
+		t->last_cpu_ns = cpu_ns;
+		t->last_wall_ns = wall_ns;
+
+		vty_out(vty, "%-16s | %6d | %4d | %-16s | %6d | %12.3f | %s%s", t->name, tid,
+			t->rt_priority, cpulist_print(cpus, sizeof(cpus), &t->cpus),
+			dp_thread_last_cpu(tid), cpu_ns / 1e9, usage, VTY_NEWLINE);
+	}
+	vty_out(vty, "(usage is since the previous 'show data-plane threads')%s", VTY_NEWLINE);
+}
+
+/***********************************************************************
+ * Adaptive busy polling
+ ***********************************************************************/
+
+void dp_busy_poll_init(struct dp_busy_poll *bp, unsigned int idle_us)
+{
+	memset(bp, 0, sizeof(*bp));
+	bp->idle_ns = idle_us * 1000ULL;
+}
+
+/* a non-blocking read found no packet; returns true to keep spinning, or false once the
+ * thread was idle for long enough and should sleep */
+bool dp_busy_poll_idle(struct dp_busy_poll *bp)
+{
+	uint64_t now = now_ns();
+
+	if (!bp->idle_since) {
+		bp->idle_since = bp->last = now;
+		return true;
+	}
+	__atomic_store_n(&bp->spin_ns, bp->spin_ns + now - bp->last, __ATOMIC_RELAXED);
+	bp->last = now;
+	if (now - bp->idle_since < bp->idle_ns)
+		return true;
+
+	bp->idle_since = 0;
+	return false;
+}
+
+/* a non-blocking read returned packets, ending any idle period */
+void dp_busy_poll_active(struct dp_busy_poll *bp)
+{
+	uint64_t now;
+
+	if (!bp->idle_since)
+		return;
+	now = now_ns();
+	__atomic_store_n(&bp->spin_ns, bp->spin_ns + now - bp->last, __ATOMIC_RELAXED);
+	bp->idle_since = 0;
+}
+
+/* around a blocking read, for accounting of the sleep time */
+void dp_busy_poll_sleep_begin(struct dp_busy_poll *bp)
+{
+	if (bp->idle_ns)
+		bp->last = now_ns();
+}
+
+void dp_busy_poll_sleep_end(struct dp_busy_poll *bp)
+{
+	if (bp->idle_ns)
+		__atomic_store_n(&bp->sleep_ns, bp->sleep_ns + now_ns() - bp->last, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+/* Helpers for the hand-assembled eBPF programs of the data plane, which are loaded via the
+ * raw bpf() system call rather than pulling in libbpf + a BPF compiler */
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+static inline int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define INSN(c, d, s, o, i) \
+	((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+/* the two instructions loading the map referenced by fd into register d */
+#define INSN_LD_MAP_FD(d, fd) \
+	INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
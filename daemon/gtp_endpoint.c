@@ -1,4 +1,5 @@
 /* SPDX-License-Identifier: GPL-2.0 */
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -9,6 +10,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <sched.h>
 
 #include <pthread.h>
 
@@ -20,6 +24,19 @@
 #include "gtp.h"
 #include "internal.h"
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT	103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO		104
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL	69
+#endif
+
+/* time the kernel busy polls the NIC queue within a blocking read of a busy polling socket */
+#define GTP_EP_SO_BUSY_POLL_US	50
+
 #define LOGEP(ep, lvl, fmt, args ...) \
 	LOGP(DEP, lvl, "%s: " fmt, (ep)->name, ## args)
 
@@ -27,67 +44,562 @@
  * GTP Endpoint (UDP socket)
  ***********************************************************************/
 
+/* one GTP packet of a batch; a received datagram may carry several of them due to GRO */
+struct gtp_ep_rx_pkt {
+	uint8_t *data;
+	unsigned int len;
+	/* results of decapsulation + tunnel look-up */
+	unsigned int tpdu_len;
+	uint32_t teid;
+	int outfd;
+};
+
+/* control message buffer for the UDP_GRO segment size of a datagram */
+union gtp_ep_gro_cmsg {
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+};
+
+/* maximum number of datagrams the kernel coalesces via UDP GRO (UDP_GRO_CNT_MAX) */
+#define GTP_EP_GRO_MAX_SEGS	64
+
+/* state of one batch of packets received via recvmmsg() */
+struct gtp_ep_rx_batch {
+	unsigned int size;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	union gtp_ep_gro_cmsg *cmsg;
+	/* GTP packets contained in the received datagrams */
+	struct gtp_ep_rx_pkt *pkts;
+	unsigned int max_pkts;
+	/* one buffer of the packet pool per datagram, received into in place */
+	struct pkt_buf **bufs;
+};
+
+static int gtp_ep_rx_batch_destructor(struct gtp_ep_rx_batch *b)
+{
+	pkt_pool_free_bulk(b->bufs, b->size);
+	return 0;
+}
+
+/* point the receive buffers of the first n datagrams at b->bufs */
+static void gtp_ep_rx_batch_set_bufs(struct gtp_ep_rx_batch *b, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		b->iov[i].iov_base = pkt_buf_data(b->bufs[i]);
+}
+
+/* if pool is NULL, the caller provides the buffers of the batch and keeps owning them */
+struct gtp_ep_rx_batch *gtp_ep_rx_batch_alloc(void *ctx, struct pkt_pool *pool, unsigned int size,
+					      bool gro)
+{
+	struct gtp_ep_rx_batch *b = talloc_zero(ctx, struct gtp_ep_rx_batch);
+	unsigned int i;
+
+	if (!b)
+		return NULL;
+
+	b->size = size;
+	b->max_pkts = gro ? size * GTP_EP_GRO_MAX_SEGS : size;
+	b->msgs = talloc_zero_array(b, struct mmsghdr, size);
+	b->iov = talloc_zero_array(b, struct iovec, size);
+	b->pkts = talloc_zero_array(b, struct gtp_ep_rx_pkt, b->max_pkts);
+	b->bufs = talloc_zero_array(b, struct pkt_buf *, size);
+	if (gro)
+		b->cmsg = talloc_zero_array(b, union gtp_ep_gro_cmsg, size);
+	if (!b->msgs || !b->iov || !b->pkts || !b->bufs || (gro && !b->cmsg)) {
+		talloc_free(b);
+		return NULL;
+	}
+	if (pool) {
+		if (pkt_pool_alloc_bulk(pool, b->bufs, size) < 0) {
+			talloc_free(b);
+			return NULL;
+		}
+		talloc_set_destructor(b, gtp_ep_rx_batch_destructor);
+		gtp_ep_rx_batch_set_bufs(b, size);
+	}
+
+	for (i = 0; i < size; i++) {
+		b->iov[i].iov_len = MAX_UDP_PACKET;
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		if (gro) {
+			b->msgs[i].msg_hdr.msg_control = b->cmsg[i].buf;
+			b->msgs[i].msg_hdr.msg_controllen = sizeof(b->cmsg[i].buf);
+		}
+	}
+
+	return b;
+}
+
+/* split the received datagrams of a batch into GTP packets; returns number of packets */
+static unsigned int gtp_ep_rx_batch_split(struct gtp_ep_rx_batch *b, unsigned int num_msgs)
+{
+	unsigned int i, num_pkts = 0;
+
+	for (i = 0; i < num_msgs; i++) {
+		struct msghdr *mh = &b->msgs[i].msg_hdr;
+		unsigned int len = b->msgs[i].msg_len;
+		unsigned int seg_size = len;
+		unsigned int offset;
+		struct cmsghdr *cmsg;
+
+		/* a GRO-coalesced datagram indicates the size of its segments */
+		if (b->cmsg) {
+			for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+				if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+					int gso_size = *(int *) CMSG_DATA(cmsg);
+					if (gso_size > 0)
+						seg_size = gso_size;
+				}
+			}
+			/* reset for the next recvmmsg() */
+			mh->msg_controllen = sizeof(b->cmsg[i].buf);
+		}
+
+		for (offset = 0; offset < len && num_pkts < b->max_pkts; offset += seg_size) {
+			struct gtp_ep_rx_pkt *pkt = &b->pkts[num_pkts++];
+			pkt->data = (uint8_t *) b->iov[i].iov_base + offset;
+			pkt->len = OSMO_MIN(seg_size, len - offset);
+		}
+	}
+
+	return num_pkts;
+}
+
+/* validate a received GTP packet; returns length of the T-PDU or negative on error */
+static int gtp_ep_parse_tpdu(struct gtp_endpoint *ep, const uint8_t *buf, unsigned int nread,
+			     uint32_t *teid)
+{
+	const struct gtp1_header *gtph = (const struct gtp1_header *) buf;
+
+	if (nread < sizeof(*gtph)) {
+		LOGEP(ep, LOGL_NOTICE, "Short read: %u < %lu\n", nread, sizeof(*gtph));
+		return -1;
+	}
+
+	/* check GTP heaader contents */
+	if (gtph->flags != 0x30) {
+		LOGEP(ep, LOGL_NOTICE, "Unexpected GTP Flags: 0x%02x\n", gtph->flags);
+		return -1;
+	}
+	if (gtph->type != GTP_TPDU) {
+		LOGEP(ep, LOGL_NOTICE, "Unexpected GTP Message Type: 0x%02x\n", gtph->type);
+		return -1;
+	}
+	if (sizeof(*gtph)+ntohs(gtph->length) > nread) {
+		LOGEP(ep, LOGL_NOTICE, "Shotr GTP Message: %lu < len=%u\n",
+			sizeof(*gtph)+ntohs(gtph->length), nread);
+		return -1;
+	}
+	*teid = ntohl(gtph->tid);
+
+	return ntohs(gtph->length);
+}
+
+/* spread tunnels over the queues of the tun device; packets of one tunnel always use the
+ * same queue to keep them in order */
+static inline int gtp_tunnel_tun_fd(const struct gtp_tunnel *t)
+{
+	/* kernel GTP devices have no queues; the kernel decapsulates for them */
+	if (!t->tun_dev->num_queues)
+		return -1;
+	return t->tun_dev->queues[t->rx_teid % t->tun_dev->num_queues].fd;
+}
+
+/* validate a single GTP packet and look up its tunnel; returns the tun fd to write the T-PDU
+ * (at offset sizeof(struct gtp1_header), of *tpdu_len bytes) to, or negative if there is no
+ * tunnel.  Must be called under RCU read-side */
+int gtp_ep_decap_lookup(struct gtp_endpoint *ep, const uint8_t *buf, unsigned int len,
+			unsigned int *tpdu_len)
+{
+	struct gtp_tunnel *t;
+	uint32_t teid;
+	int rc;
+
+	rc = gtp_ep_parse_tpdu(ep, buf, len, &teid);
+	if (rc < 0)
+		return -1;
+	*tpdu_len = rc;
+
+	t = _gtp_tunnel_find_r(ep->d, teid, ep);
+	if (!t) {
+		LOGEP(ep, LOGL_NOTICE, "Unable to find tunnel for TEID=0x%08x\n", teid);
+		return -1;
+	}
+	return gtp_tunnel_tun_fd(t);
+}
+
+/* decapsulate a batch of received datagrams and write the T-PDUs to the tun device(s).
+ * Must be called with the RCU read-side of the calling thread online */
+static void gtp_ep_handle_batch(struct gtp_endpoint_worker *w, struct gtp_ep_rx_batch *b,
+				unsigned int num_msgs)
+{
+	struct gtp_endpoint *ep = w->ep;
+	struct gtp_daemon *d = ep->d;
+	struct gtp_tunnel *t;
+	int rc, i, n;
+
+	n = gtp_ep_rx_batch_split(b, num_msgs);
+
+	/* every segment of a GRO train is validated on its own, as the kernel
+	 * may coalesce datagrams for different TEIDs from the same peer */
+	for (i = 0; i < n; i++) {
+		struct gtp_ep_rx_pkt *pkt = &b->pkts[i];
+		rc = gtp_ep_parse_tpdu(ep, pkt->data, pkt->len, &pkt->teid);
+		pkt->tpdu_len = rc < 0 ? 0 : rc;
+		pkt->outfd = -1;
+	}
+
+	/* 2) look-up tunnels based on TEID (lock-free, under RCU) */
+	for (i = 0; i < n; i++) {
+		struct gtp_ep_rx_pkt *pkt = &b->pkts[i];
+		if (!pkt->tpdu_len)
+			continue;
+		t = _gtp_tunnel_find_r(d, pkt->teid, ep);
+		if (t)
+			pkt->outfd = gtp_tunnel_tun_fd(t);
+	}
+
+	/* 3) write to TUN device(s); the fds stay open until we go offline */
+	for (i = 0; i < n; i++) {
+		struct gtp_ep_rx_pkt *pkt = &b->pkts[i];
+		if (!pkt->tpdu_len)
+			continue;
+		if (pkt->outfd < 0) {
+			LOGEP(ep, LOGL_NOTICE, "Unable to find tunnel for TEID=0x%08x\n", pkt->teid);
+			continue;
+		}
+		rc = write(pkt->outfd, pkt->data + sizeof(struct gtp1_header), pkt->tpdu_len);
+		if (rc < pkt->tpdu_len) {
+			LOGEP(ep, LOGL_FATAL, "Error writing to tun device %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+}
+
+/* pipelined mode: hand the received datagrams to the pipeline workers by TEID, and refill
+ * the batch with free buffers */
+static void gtp_ep_dispatch_batch(struct gtp_endpoint_worker *w, struct gtp_ep_rx_batch *b,
+				  unsigned int num_msgs)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_msgs; i++) {
+		struct pkt_buf *pb = b->bufs[i];
+		const struct gtp1_header *gtph = (const struct gtp1_header *) pkt_buf_data(pb);
+		pb->len = b->msgs[i].msg_len;
+		/* packets too short for a TEID are discarded by the worker */
+		dp_pipeline_push(w->pl, pb->len >= sizeof(*gtph) ? ntohl(gtph->tid) : 0, pb);
+	}
+	dp_pipeline_flush(w->pl);
+
+	dp_pipeline_get_bufs(w->pl, b->bufs, num_msgs, &w->rcu);
+	gtp_ep_rx_batch_set_bufs(b, num_msgs);
+}
+
+/* pipeline call-back: decapsulate buffers dispatched by gtp_ep_dispatch_batch() */
+static void gtp_ep_pipeline_cb(struct dp_pipeline_worker *pw, struct pkt_buf **bufs,
+			       unsigned int n)
+{
+	struct gtp_endpoint_worker *w = pw->pl->priv;
+	struct gtp_ep_rx_batch *b = pw->priv;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		b->iov[i].iov_base = pkt_buf_data(bufs[i]);
+		b->msgs[i].msg_len = bufs[i]->len;
+	}
+	gtp_ep_handle_batch(w, b, n);
+}
+
+/* an ICMP error reported by the socket of a peer, connected to it; not an error of the
+ * socket itself */
+static inline bool gtp_ep_icmp_error(int err)
+{
+	return err == ECONNREFUSED || err == EHOSTUNREACH || err == ENETUNREACH;
+}
+
 /* one thread for reading from each GTP/UDP socket (GTP decapsulation -> tun) */
 static void *gtp_endpoint_thread(void *arg)
 {
-	struct gtp_endpoint *ep = (struct gtp_endpoint *)arg;
+	struct gtp_endpoint_worker *w = (struct gtp_endpoint_worker *)arg;
+	struct gtp_endpoint *ep = w->ep;
 	struct gtp_daemon *d = ep->d;
+	struct gtp_ep_rx_batch *b = w->rx_batch;
 
-	uint8_t buffer[MAX_UDP_PACKET+sizeof(struct gtp1_header)];
+	rcu_register_thread(&d->rcu, &w->rcu);
+	pthread_cleanup_push(rcu_unregister_thread, &w->rcu);
 
 	while (1) {
-		struct gtp_tunnel *t;
-		const struct gtp1_header *gtph;
-		int rc, nread, outfd;
-		uint32_t teid;
+		bool wait = true;
+		int rc;
+
+		/* 0) when busy polling, try without blocking first, and keep spinning as long
+		 * as we were idle for less than the configured time */
+		if (w->bp.idle_ns) {
+			rc = recvmmsg(w->fd, b->msgs, b->size, MSG_DONTWAIT, NULL);
+			if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+				wait = false;
+				if (rc > 0)
+					dp_busy_poll_active(&w->bp);
+			} else if (dp_busy_poll_idle(&w->bp)) {
+				/* we hold no references from the previous batch */
+				rcu_quiescent_state(&w->rcu);
+				continue;
+			}
+		}
 
-		/* 1) read GTP packet from UDP socket */
-		rc = recvfrom(ep->fd, buffer, sizeof(buffer), 0, (struct sockaddr *)NULL, 0);
+		/* 1) read a batch of GTP packets from UDP socket; block only for the first one.
+		 * While blocked we hold no references, so we don't delay any grace period */
+		if (wait) {
+			rcu_thread_offline(&w->rcu);
+			dp_busy_poll_sleep_begin(&w->bp);
+			rc = recvmmsg(w->fd, b->msgs, b->size, MSG_WAITFORONE, NULL);
+			dp_busy_poll_sleep_end(&w->bp);
+			rcu_thread_online(&w->rcu);
+		}
 		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (gtp_ep_icmp_error(errno)) {
+				LOGEP(ep, LOGL_NOTICE, "GTP peer unreachable: %s\n", strerror(errno));
+				continue;
+			}
 			LOGEP(ep, LOGL_FATAL, "Error reading from UDP socket: %s\n", strerror(errno));
 			exit(1);
 		}
-		nread = rc;
-		if (nread < sizeof(*gtph)) {
-			LOGEP(ep, LOGL_NOTICE, "Short read: %d < %lu\n", nread, sizeof(*gtph));
-			continue;
-		}
-		gtph = (struct gtp1_header *)buffer;
+		if (w->pl)
+			gtp_ep_dispatch_batch(w, b, rc);
+		else
+			gtp_ep_handle_batch(w, b, rc);
+	}
 
-		/* check GTP heaader contents */
-		if (gtph->flags != 0x30) {
-			LOGEP(ep, LOGL_NOTICE, "Unexpected GTP Flags: 0x%02x\n", gtph->flags);
-			continue;
-		}
-		if (gtph->type != GTP_TPDU) {
-			LOGEP(ep, LOGL_NOTICE, "Unexpected GTP Message Type: 0x%02x\n", gtph->type);
-			continue;
-		}
-		if (sizeof(*gtph)+ntohs(gtph->length) > nread) {
-			LOGEP(ep, LOGL_NOTICE, "Shotr GTP Message: %lu < len=%d\n",
-				sizeof(*gtph)+ntohs(gtph->length), nread);
-			continue;
-		}
-		teid = ntohl(gtph->tid);
-
-		/* 2) look-up tunnel based on TEID */
-		pthread_rwlock_rdlock(&d->rwlock);
-		t = _gtp_tunnel_find_r(d, teid, ep);
-		if (!t) {
-			pthread_rwlock_unlock(&d->rwlock);
-			LOGEP(ep, LOGL_NOTICE, "Unable to find tunnel for TEID=0x%08x\n", teid);
-			continue;
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/* worker pool call-back: socket of a GTP endpoint worker is readable */
+static void gtp_ep_io_read_cb(struct io_worker_fd *iofd, struct io_worker *iow)
+{
+	struct gtp_endpoint_worker *w = iofd->data;
+	int rc;
+
+	/* one batch at a time, to be fair to the other fds of the pool worker */
+	rc = recvmmsg(w->fd, iow->rx_batch->msgs, iow->rx_batch->size, MSG_DONTWAIT, NULL);
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		if (gtp_ep_icmp_error(errno)) {
+			LOGEP(w->ep, LOGL_NOTICE, "GTP peer unreachable: %s\n", strerror(errno));
+			return;
 		}
-		outfd = t->tun_dev->fd;
-		pthread_rwlock_unlock(&d->rwlock);
+		LOGEP(w->ep, LOGL_FATAL, "Error reading from UDP socket: %s\n", strerror(errno));
+		exit(1);
+	}
+	gtp_ep_handle_batch(w, iow->rx_batch, rc);
+}
 
-		/* 3) write to TUN device */
-		rc = write(outfd, buffer+sizeof(*gtph), ntohs(gtph->length));
-		if (rc < nread-sizeof(struct gtp1_header)) {
-			LOGEP(ep, LOGL_FATAL, "Error writing to tun device %s\n", strerror(errno));
-			exit(1);
+/* attach a classic BPF program to the SO_REUSEPORT group of the endpoint, selecting the
+ * socket (worker) by Rx TEID modulo the number of workers.  The program is executed on
+ * the UDP payload, i.e. the GTP header.  Packets too short to contain a TEID go to the
+ * first worker, which will discard them. */
+static int gtp_ep_attach_reuseport_bpf(struct gtp_endpoint *ep)
+{
+	struct sock_filter code[] = {
+		/* A = TEID (32bit at offset 4 of the GTP header) */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct gtp1_header, tid)),
+		/* A = A % num_workers */
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, ep->num_workers),
+		/* return A (index of socket within the group) */
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = ARRAY_SIZE(code),
+		.filter = code,
+	};
+
+	return setsockopt(ep->workers[0].fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+/* let the kernel poll the NIC queue on reads of the socket of a worker instead of waiting
+ * for interrupts, if configured */
+static void gtp_ep_busy_poll_init(struct gtp_endpoint_worker *w)
+{
+	struct gtp_endpoint *ep = w->ep;
+	struct gtp_daemon *d = ep->d;
+	int val;
+
+	if (d->cfg.ep_busy_poll_us) {
+		val = GTP_EP_SO_BUSY_POLL_US;
+		if (setsockopt(w->fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) < 0)
+			LOGEP(ep, LOGL_NOTICE, "Cannot set SO_BUSY_POLL: %s\n", strerror(errno));
+		val = 1;
+		if (setsockopt(w->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val)) < 0)
+			LOGEP(ep, LOGL_NOTICE, "Cannot set SO_PREFER_BUSY_POLL: %s\n", strerror(errno));
+	}
+	/* the worker pool never blocks on a single fd */
+	dp_busy_poll_init(&w->bp, d->cfg.num_io_workers ? 0 : d->cfg.ep_busy_poll_us);
+}
+
+/* create + bind the UDP socket of one worker; returns 0 or negative on error */
+static int gtp_ep_open_socket(struct gtp_endpoint *ep, struct gtp_endpoint_worker *w)
+{
+	struct gtp_daemon *d = ep->d;
+	int rc, val;
+
+	w->fd = socket(ep->bind_addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (w->fd < 0) {
+		LOGEP(ep, LOGL_ERROR, "Cannot create UDP socket: %s\n", strerror(errno));
+		return -1;
+	}
+	/* the kernel distributes datagrams across all sockets of the group; even with a single
+	 * worker, as the connected sockets of the peers join it */
+	val = 1;
+	rc = setsockopt(w->fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+	if (rc < 0) {
+		LOGEP(ep, LOGL_ERROR, "Cannot set SO_REUSEPORT: %s\n", strerror(errno));
+		goto out_close;
+	}
+	rc = bind(w->fd, (struct sockaddr *) &ep->bind_addr, sizeof(ep->bind_addr));
+	if (rc < 0) {
+		LOGEP(ep, LOGL_ERROR, "Cannot bind UDP socket: %s\n", strerror(errno));
+		goto out_close;
+	}
+
+	/* probe for UDP GSO (segmentation offload) support of the kernel */
+	if (w->idx == 0 && d->cfg.tx_udp_gso) {
+		val = 0;
+		if (setsockopt(w->fd, SOL_UDP, UDP_SEGMENT, &val, sizeof(val)) == 0)
+			ep->tx_gso = true;
+		else
+			LOGEP(ep, LOGL_NOTICE, "UDP GSO not supported: %s\n", strerror(errno));
+	}
+
+	gtp_ep_busy_poll_init(w);
+
+	/* let the kernel coalesce received datagrams via UDP GRO, if supported.  Not in
+	 * pipelined mode, where a coalesced datagram can only be dispatched as a whole, while
+	 * its segments may belong to different tunnels */
+	if ((w->idx == 0 && d->cfg.rx_udp_gro && !dp_pipelined(d)) || ep->rx_gro) {
+		val = 1;
+		if (setsockopt(w->fd, SOL_UDP, UDP_GRO, &val, sizeof(val)) == 0)
+			ep->rx_gro = true;
+		else
+			LOGEP(ep, LOGL_NOTICE, "UDP GRO not supported: %s\n", strerror(errno));
+	}
+
+	return 0;
+
+out_close:
+	close(w->fd);
+	return -1;
+}
+
+static void gtp_ep_close_sockets(struct gtp_endpoint *ep)
+{
+	unsigned int i;
+
+	for (i = 0; i < ep->num_workers; i++)
+		close(ep->workers[i].fd);
+}
+
+/* stop serving the socket of a worker; for a dedicated thread, cancel it and wait for it
+ * to have unregistered from RCU */
+static void gtp_ep_stop_worker(struct gtp_endpoint_worker *w)
+{
+	if (w->iofd.worker) {
+		io_worker_fd_unregister(&w->iofd);
+		return;
+	}
+	pthread_cancel(w->thread);
+	dp_thread_join(w->ep->d, w->thread);
+	if (w->pl)
+		dp_pipeline_stop(w->pl);
+}
+
+/* start the receive thread of a worker (pinned to CPU index cpu, unless negative), or hand
+ * its socket to the worker pool if enabled; returns 0 or negative on error */
+static int gtp_ep_start_worker(struct gtp_endpoint_worker *w, const char *name, int cpu)
+{
+	struct gtp_endpoint *ep = w->ep;
+
+	if (ep->d->cfg.num_io_workers) {
+		w->iofd.fd = w->fd;
+		w->iofd.type = IO_WORKER_FD_GTP_EP;
+		w->iofd.read_cb = gtp_ep_io_read_cb;
+		w->iofd.data = w;
+		if (io_worker_fd_register(ep->d, &w->iofd) < 0) {
+			LOGEP(ep, LOGL_ERROR, "Cannot add socket to worker pool\n");
+			return -1;
 		}
+		return 0;
+	}
+	if (w->pl && dp_pipeline_start(w->pl) < 0)
+		return -1;
+	if (dp_thread_create(ep->d, &w->thread, name, cpu, gtp_endpoint_thread, w)) {
+		LOGEP(ep, LOGL_ERROR, "Cannot start GTP thread: %s\n", strerror(errno));
+		if (w->pl)
+			dp_pipeline_stop(w->pl);
+		return -1;
+	}
+	return 0;
+}
+
+/* start the receive thread of each worker, or hand the sockets to the worker pool if
+ * enabled; returns 0 or negative on error */
+static int gtp_ep_start_workers(struct gtp_endpoint *ep)
+{
+	unsigned int i;
+
+	for (i = 0; i < ep->num_workers; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "%s/%u", ep->name, i);
+		if (gtp_ep_start_worker(&ep->workers[i], name,
+					ep->d->cfg.ep_worker_pinning ? i : -1) < 0)
+			goto err_cancel;
+	}
+
+	return 0;
+
+err_cancel:
+	while (i--)
+		gtp_ep_stop_worker(&ep->workers[i]);
+	/* pool workers may still be inside the read call-back */
+	rcu_synchronize(&ep->d->rcu);
+	return -1;
+}
+
+/* set up the pipeline of a worker: its thread only receives, while the pipeline workers
+ * decapsulate.  All of them use the buffers of the pipeline */
+static int gtp_ep_pipeline_alloc(struct gtp_endpoint_worker *w, struct pkt_pool *pool)
+{
+	struct gtp_endpoint *ep = w->ep;
+	struct gtp_daemon *d = ep->d;
+	char name[32];
+	unsigned int i;
+
+	snprintf(name, sizeof(name), "%s/%u", ep->name, w->idx);
+	w->pl = dp_pipeline_alloc(ep, d, pool, name, d->cfg.rx_batch_size,
+				  gtp_ep_pipeline_cb, w);
+	if (!w->pl)
+		return -1;
+	for (i = 0; i < w->pl->num_workers; i++) {
+		w->pl->workers[i].priv = gtp_ep_rx_batch_alloc(w->pl, NULL, d->cfg.rx_batch_size, false);
+		if (!w->pl->workers[i].priv)
+			return -1;
 	}
+
+	w->rx_batch = gtp_ep_rx_batch_alloc(ep, NULL, d->cfg.rx_batch_size, false);
+	if (!w->rx_batch)
+		return -1;
+	dp_pipeline_get_bufs(w->pl, w->rx_batch->bufs, w->rx_batch->size, NULL);
+	gtp_ep_rx_batch_set_bufs(w->rx_batch, w->rx_batch->size);
+
+	return 0;
 }
 
 static struct gtp_endpoint *
@@ -96,6 +608,7 @@ _gtp_endpoint_create(struct gtp_daemon *d, const struct sockaddr_storage *bind_a
 	struct gtp_endpoint *ep = talloc_zero(d, struct gtp_endpoint);
 	char ipstr[INET6_ADDRSTRLEN];
 	char portstr[8];
+	unsigned int i;
 	int rc;
 
 	if (!ep)
@@ -110,29 +623,71 @@ _gtp_endpoint_create(struct gtp_daemon *d, const struct sockaddr_storage *bind_a
 	ep->d = d;
 	ep->use_count = 1;
 	ep->bind_addr = *bind_addr;
-	ep->fd = socket(ep->bind_addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
-	if (ep->fd < 0) {
-		LOGEP(ep, LOGL_ERROR, "Cannot create UDP socket: %s\n", strerror(errno));
+	hash_init(ep->tunnels_by_rx_teid);
+	INIT_LLIST_HEAD(&ep->peers);
+
+	ep->num_workers = d->cfg.ep_num_workers;
+	ep->workers = talloc_zero_array(ep, struct gtp_endpoint_worker, ep->num_workers);
+	if (!ep->workers)
 		goto out_free;
+
+	/* the socket index within the SO_REUSEPORT group is the order of bind() */
+	for (i = 0; i < ep->num_workers; i++) {
+		struct gtp_endpoint_worker *w = &ep->workers[i];
+		w->ep = ep;
+		w->idx = i;
+		if (gtp_ep_open_socket(ep, w) < 0)
+			goto out_close;
 	}
-	rc = bind(ep->fd, (struct sockaddr *) &ep->bind_addr, sizeof(ep->bind_addr));
-	if (rc < 0) {
-		LOGEP(ep, LOGL_ERROR, "Cannot bind UDP socket: %s\n", strerror(errno));
-		goto out_close;
+	/* transmit always happens via the first socket */
+	ep->fd = ep->workers[0].fd;
+
+	if (ep->num_workers > 1 && gtp_ep_attach_reuseport_bpf(ep) < 0) {
+		/* not fatal; the kernel then distributes by hash of the UDP 4-tuple */
+		LOGEP(ep, LOGL_NOTICE, "Cannot attach TEID steering program to SO_REUSEPORT "
+			"group: %s\n", strerror(errno));
 	}
 
-	if (pthread_create(&ep->thread, NULL, gtp_endpoint_thread, ep)) {
-		LOGEP(ep, LOGL_ERROR, "Cannot start GTP thread: %s\n", strerror(errno));
+	/* with the worker pool, the packet buffers of the pool workers are used */
+	for (i = 0; i < ep->num_workers && !d->cfg.num_io_workers; i++) {
+		struct gtp_endpoint_worker *w = &ep->workers[i];
+		int node = -1;
+		/* a pinned thread uses the memory of the NUMA node of its CPU */
+		if (d->cfg.ep_worker_pinning)
+			node = pkt_pool_cpu_node(dp_thread_cpu(d, i));
+		if (dp_pipelined(d))
+			rc = gtp_ep_pipeline_alloc(w, pkt_pool_get(d, node, PKT_BUF_DATA_LEN));
+		else {
+			w->rx_batch = gtp_ep_rx_batch_alloc(ep, pkt_pool_get(d, node, PKT_BUF_DATA_LEN),
+							    d->cfg.rx_batch_size, ep->rx_gro);
+			rc = w->rx_batch ? 0 : -1;
+		}
+		if (rc < 0) {
+			LOGEP(ep, LOGL_ERROR, "Cannot allocate receive buffers\n");
+			i = ep->num_workers;
+			goto out_close;
+		}
+	}
+
+	if (gtp_ep_start_workers(ep) < 0) {
+		i = ep->num_workers;
 		goto out_close;
 	}
 
+	/* non-fatal: without it, all traffic is simply received via the sockets */
+	if (d->cfg.af_xdp)
+		gtp_ep_xdp_start(ep);
+	if (d->cfg.tc_bpf)
+		tc_bpf_ep_attach(ep);
+
 	llist_add_tail(&ep->list, &d->gtp_endpoints);
-	LOGEP(ep, LOGL_INFO, "Created\n");
+	LOGEP(ep, LOGL_INFO, "Created with %u worker(s)\n", ep->num_workers);
 
 	return ep;
 
 out_close:
-	close(ep->fd);
+	while (i--)
+		close(ep->workers[i].fd);
 out_free:
 	talloc_free(ep);
 	return NULL;
@@ -174,6 +729,9 @@ gtp_endpoint_find_or_create(struct gtp_daemon *d, const struct sockaddr_storage
 /* UNLOCKED hard/forced destroy; caller must make sure references are cleaned up */
 static void _gtp_endpoint_destroy(struct gtp_endpoint *ep)
 {
+	struct gtp_peer *peer;
+	unsigned int i;
+
 	/* talloc is not thread safe, all alloc/free must come from main thread */
 	ASSERT_MAIN_THREAD(ep->d);
 
@@ -182,9 +740,20 @@ static void _gtp_endpoint_destroy(struct gtp_endpoint *ep)
 	else
 		LOGEP(ep, LOGL_INFO, "Destroying\n");
 
-	pthread_cancel(ep->thread);
+	gtp_ep_xdp_stop(ep);
+	tc_bpf_ep_detach(ep);
+	/* only if destroyed by force; their sockets are closed together with them */
+	llist_for_each_entry(peer, &ep->peers, list) {
+		if (peer->w.fd >= 0)
+			gtp_ep_stop_worker(&peer->w);
+	}
+	for (i = 0; i < ep->num_workers; i++)
+		gtp_ep_stop_worker(&ep->workers[i]);
 	llist_del(&ep->list);
-	close(ep->fd);
+	/* tun threads may still be transmitting via our socket, or that of one of our peers,
+	 * on behalf of a tunnel destroyed just before */
+	rcu_synchronize(&ep->d->rcu);
+	gtp_ep_close_sockets(ep);
 	talloc_free(ep);
 }
 
@@ -213,6 +782,31 @@ void _gtp_endpoint_deref_destroy(struct gtp_endpoint *ep)
 		_gtp_endpoint_destroy(ep2);
 }
 
+/* remove all objects referencing this ep and then destroy */
+void gtp_endpoint_deref_destroy(struct gtp_endpoint *ep)
+{
+	struct gtp_daemon *d = ep->d;
+	struct gtp_tunnel *t;
+
+	/* talloc is not thread safe, all alloc/free must come from main thread */
+	ASSERT_MAIN_THREAD(ep->d);
+
+	/* tunnels of the endpoint may still be created or destroyed by the control workers */
+	ctrl_pool_drain(d);
+
+	/* remove the user addresses without holding the lock; the list of tunnels is
+	 * only modified by the main thread */
+	llist_for_each_entry(t, &d->gtp_tunnels, list) {
+		if (t->gtp_ep == ep)
+			gtp_tunnel_del_user_addr(t);
+	}
+
+	pthread_rwlock_wrlock(&d->rwlock);
+	_gtp_endpoint_deref_destroy(ep);
+	pthread_rwlock_unlock(&d->rwlock);
+	rcu_reclaim(&d->rcu);
+}
+
 /* UNLOCKED release a reference; destroy if refcount drops to 0 */
 bool _gtp_endpoint_release(struct gtp_endpoint *ep)
 {
@@ -247,3 +841,198 @@ bool gtp_endpoint_release(struct gtp_endpoint *ep)
 
 	return released;
 }
+
+
+/***********************************************************************
+ * GTP Peer (connected UDP socket, shared per endpoint)
+ ***********************************************************************/
+
+static int gtp_peer_destructor(struct gtp_peer *peer)
+{
+	if (peer->w.fd >= 0)
+		close(peer->w.fd);
+	return 0;
+}
+
+/* create the socket of a peer, bound to the IP:port of the endpoint and connected to the peer;
+ * returns 0 or negative on error */
+static int gtp_peer_open_socket(struct gtp_peer *peer)
+{
+	struct gtp_endpoint *ep = peer->ep;
+	struct gtp_endpoint_worker *w = &peer->w;
+	int rc, val;
+
+	w->fd = socket(ep->bind_addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (w->fd < 0)
+		return -1;
+
+	/* joins the SO_REUSEPORT group of the endpoint; for its index within the group see
+	 * gtp_ep_attach_reuseport_bpf(), which only selects among the worker sockets.  The
+	 * kernel delivers the downlink of the peer to the connected socket */
+	val = 1;
+	rc = setsockopt(w->fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+	if (rc < 0)
+		goto out_close;
+	rc = bind(w->fd, (struct sockaddr *) &ep->bind_addr, sizeof(ep->bind_addr));
+	if (rc < 0)
+		goto out_close;
+
+	/* the route + neighbour are now resolved once, rather than for every datagram */
+	rc = connect(w->fd, (struct sockaddr *) &peer->addr, sizeof(peer->addr));
+	if (rc < 0)
+		goto out_close;
+
+	gtp_ep_busy_poll_init(w);
+	if (ep->rx_gro) {
+		val = 1;
+		if (setsockopt(w->fd, SOL_UDP, UDP_GRO, &val, sizeof(val)) < 0)
+			goto out_close;
+	}
+
+	return 0;
+
+out_close:
+	close(w->fd);
+	w->fd = -1;
+	return -1;
+}
+
+/* receive the downlink of the peer on its socket, like on a socket of the endpoint */
+static int gtp_peer_start_rx(struct gtp_peer *peer)
+{
+	struct gtp_endpoint *ep = peer->ep;
+	struct gtp_daemon *d = ep->d;
+	struct gtp_endpoint_worker *w = &peer->w;
+	char name[32];
+
+	/* with the worker pool, the packet buffers of the pool workers are used; without, no
+	 * pipeline, as a peer is only one of many sources of downlink */
+	if (!d->cfg.num_io_workers) {
+		w->rx_batch = gtp_ep_rx_batch_alloc(peer, pkt_pool_get(d, -1, PKT_BUF_DATA_LEN),
+						    d->cfg.rx_batch_size, ep->rx_gro);
+		if (!w->rx_batch)
+			return -1;
+	}
+
+	snprintf(name, sizeof(name), "%s/p%u", ep->name, w->idx);
+	return gtp_ep_start_worker(w, name, -1);
+}
+
+static struct gtp_peer *
+_gtp_peer_create(struct gtp_endpoint *ep, const struct sockaddr_storage *addr, bool sock)
+{
+	struct gtp_peer *peer = talloc_zero(ep, struct gtp_peer);
+	char ipstr[INET6_ADDRSTRLEN];
+	char portstr[8];
+
+	if (!peer)
+		return NULL;
+
+	peer->ep = ep;
+	peer->use_count = 1;
+	peer->addr = *addr;
+	peer->w.ep = ep;
+	peer->w.idx = ep->num_peers_created++;
+	peer->w.fd = -1;
+	talloc_set_destructor(peer, gtp_peer_destructor);
+
+	if (getnameinfo((struct sockaddr *) addr, sizeof(*addr), ipstr, sizeof(ipstr),
+			portstr, sizeof(portstr), NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
+		talloc_free(peer);
+		return NULL;
+	}
+
+	if (sock && gtp_peer_open_socket(peer) < 0) {
+		LOGEP(ep, LOGL_ERROR, "Cannot create socket towards GTP peer %s:%s: %s\n",
+			ipstr, portstr, strerror(errno));
+		talloc_free(peer);
+		return NULL;
+	}
+	if (sock && gtp_peer_start_rx(peer) < 0) {
+		LOGEP(ep, LOGL_ERROR, "Cannot receive from GTP peer %s:%s\n", ipstr, portstr);
+		talloc_free(peer);
+		return NULL;
+	}
+
+	llist_add_tail(&peer->list, &ep->peers);
+	LOGEP(ep, LOGL_DEBUG, "Created GTP peer %s:%s%s\n", ipstr, portstr,
+		sock ? "" : " (via the socket of the endpoint)");
+
+	return peer;
+}
+
+static struct gtp_peer *
+_gtp_peer_find(struct gtp_endpoint *ep, const struct sockaddr_storage *addr)
+{
+	struct gtp_peer *peer;
+
+	llist_for_each_entry(peer, &ep->peers, list) {
+		if (sockaddr_equals((const struct sockaddr *) &peer->addr,
+				    (const struct sockaddr *) addr)) {
+			return peer;
+		}
+	}
+	return NULL;
+}
+
+/* find or create a peer.  A new one gets a socket of its own unless it is for a tunnel of a
+ * kernel GTP device (kgtp), or the endpoint is used by one: the kernel GTP device only reads
+ * the socket of the endpoint, not the connected one receiving the downlink of the peer */
+struct gtp_peer *
+gtp_peer_find_or_create(struct gtp_endpoint *ep, const struct sockaddr_storage *addr, bool kgtp)
+{
+	struct gtp_daemon *d = ep->d;
+	struct gtp_peer *peer;
+
+	/* talloc is not thread safe, all alloc/free must come from main thread */
+	ASSERT_MAIN_THREAD(d);
+
+	pthread_rwlock_wrlock(&d->rwlock);
+	peer = _gtp_peer_find(ep, addr);
+	if (peer)
+		peer->use_count++;
+	else
+		peer = _gtp_peer_create(ep, addr, !kgtp && !ep->kgtp_dev);
+	pthread_rwlock_unlock(&d->rwlock);
+
+	return peer;
+}
+
+/* UNLOCKED release a reference; destroy if refcount drops to 0.  Its socket is only closed
+ * by the next rcu_reclaim(), as tun threads may still be transmitting via it, and pool
+ * workers still be receiving from it */
+void _gtp_peer_release(struct gtp_peer *peer)
+{
+	/* talloc is not thread safe, all alloc/free must come from main thread */
+	ASSERT_MAIN_THREAD(peer->ep->d);
+
+	peer->use_count--;
+	if (peer->use_count == 0) {
+		if (peer->w.fd >= 0)
+			gtp_ep_stop_worker(&peer->w);
+		llist_del(&peer->list);
+		rcu_defer_free(&peer->ep->d->rcu, peer);
+	}
+}
+
+/* does any peer of the endpoint have a socket of its own? (main thread only) */
+bool gtp_endpoint_has_peer_sockets(const struct gtp_endpoint *ep)
+{
+	const struct gtp_peer *peer;
+
+	llist_for_each_entry(peer, &ep->peers, list) {
+		if (peer->w.fd >= 0)
+			return true;
+	}
+	return false;
+}
+
+/* release a reference; destroy if refcount drops to 0 */
+void gtp_peer_release(struct gtp_peer *peer)
+{
+	struct gtp_daemon *d = peer->ep->d;
+
+	pthread_rwlock_wrlock(&d->rwlock);
+	_gtp_peer_release(peer);
+	pthread_rwlock_unlock(&d->rwlock);
+}
@@ -14,7 +14,11 @@
 #include <osmocom/core/talloc.h>
 #include <osmocom/core/logging.h>
 
+#include <netlink/errno.h>
+
+#include "gtp.h"
 #include "internal.h"
+#include "kernel_gtp.h"
 
 #define LOGT(t, lvl, fmt, args ...) \
 	LOGP(DGT, lvl, "%s: " fmt, (t)->name, ## args)
@@ -22,34 +26,103 @@
 /***********************************************************************
  * GTP Tunnel
  ***********************************************************************/
-struct gtp_tunnel *gtp_tunnel_alloc(struct gtp_daemon *d, const struct gtp_tunnel_params *cpars)
+
+/* can the tunnel be handled entirely by the kernel GTP driver?  It only knows IPv4 and
+ * GTPv1-U on the standard port, and only sees packets arriving on the first socket, not
+ * those of the other workers or the connected sockets of the peers */
+static bool gtp_tunnel_kgtp_capable(struct gtp_tunnel *t, const struct gtp_endpoint *ep,
+				    const struct gtp_tunnel_params *cpars)
+{
+	const struct sockaddr_in *remote = (const struct sockaddr_in *) &cpars->remote_udp;
+	struct tun_device *tun;
+	bool capable;
+
+	if (!t->d->cfg.kernel_gtp)
+		return false;
+	if (cpars->user_addr.ss_family != AF_INET || remote->sin_family != AF_INET ||
+	    ntohs(remote->sin_port) != GTP1U_PORT) {
+		LOGT(t, LOGL_NOTICE, "Not eligible for kernel GTP, using the userspace path\n");
+		return false;
+	}
+	if (ep->num_workers > 1 || ep->xdp || gtp_endpoint_has_peer_sockets(ep)) {
+		LOGT(t, LOGL_NOTICE, "Endpoint uses multiple sockets or AF_XDP, "
+			"using the userspace path\n");
+		return false;
+	}
+	if (ep->kgtp_dev && strcmp(ep->kgtp_dev->devname, cpars->tun_name)) {
+		LOGT(t, LOGL_NOTICE, "Endpoint socket already used by kernel GTP device %s, "
+			"using the userspace path\n", ep->kgtp_dev->devname);
+		return false;
+	}
+	/* a device which fell back to the userspace path while the socket was taken stays so */
+	pthread_rwlock_rdlock(&t->d->rwlock);
+	tun = _tun_device_find(t->d, cpars->tun_name);
+	capable = !tun || tun->kgtp_ep;
+	pthread_rwlock_unlock(&t->d->rwlock);
+
+	return capable;
+}
+
+#ifdef HAVE_LIBGTPNL
+static int gtp_tunnel_kgtp_add(struct gtp_tunnel *t)
+{
+	struct tun_device *tun = t->tun_dev;
+	const struct sockaddr_in *ms = (const struct sockaddr_in *) &t->user_addr;
+	const struct sockaddr_in *peer = (const struct sockaddr_in *) &t->peer->addr;
+
+	return kgtp_pdp_add(tun->netns_name ? tun->netns_fd : -1, tun->ifindex, t->rx_teid,
+			    t->tx_teid, &ms->sin_addr, &peer->sin_addr);
+}
+
+static void gtp_tunnel_kgtp_del(struct gtp_tunnel *t)
+{
+	struct tun_device *tun = t->tun_dev;
+
+	if (kgtp_pdp_del(tun->netns_name ? tun->netns_fd : -1, tun->ifindex, t->rx_teid) < 0)
+		LOGT(t, LOGL_ERROR, "Cannot remove kernel PDP context: %s\n", strerror(errno));
+}
+#endif
+
+/* allocate a tunnel and obtain references to its endpoint, peer + tun device.  It is
+ * neither programmed into the kernel nor visible to the data-plane yet.  If async, the tun
+ * device may still be created by a control worker */
+static struct gtp_tunnel *gtp_tunnel_prepare(struct gtp_daemon *d, const struct gtp_tunnel_params *cpars,
+					     bool async)
 {
+	struct gtp_endpoint *kgtp_ep;
 	struct gtp_tunnel *t;
 
 	t = talloc_zero(d, struct gtp_tunnel);
 	if (!t)
-		goto out_unlock;
+		return NULL;
 	t->d = d;
 	t->name = talloc_asprintf(t, "%s-R%08x-T%08x", cpars->tun_name, cpars->rx_teid, cpars->tx_teid);
-	t->tun_dev = tun_device_find_or_create(d, cpars->tun_name, cpars->tun_netns_name);
-	if (!t->tun_dev) {
-		LOGT(t, LOGL_ERROR, "Cannot find or create tun device %s\n", cpars->tun_name);
-		goto out_free;
-	}
 
+	/* the endpoint comes first, as a kernel GTP device needs its socket */
 	t->gtp_ep = gtp_endpoint_find_or_create(d, &cpars->local_udp);
 	if (!t->gtp_ep) {
 		LOGT(t, LOGL_ERROR, "Cannot find or create GTP endpoint\n");
-		goto out_tun;
+		goto out_free;
 	}
 
-	pthread_rwlock_wrlock(&d->rwlock);
-	/* check if we already have a tunnel with same Rx-TEID + endpoint */
-	if (_gtp_tunnel_find_r(d, cpars->rx_teid, t->gtp_ep)) {
-		LOGT(t, LOGL_ERROR, "Error: We already have a tunnel for RxTEID 0x%08x "
-			"on this endpoint (%s)\n", cpars->rx_teid, t->gtp_ep->name);
+	/* before the peer, whose socket would take the downlink of a kernel GTP device */
+	kgtp_ep = gtp_tunnel_kgtp_capable(t, t->gtp_ep, cpars) ? t->gtp_ep : NULL;
+
+	t->peer = gtp_peer_find_or_create(t->gtp_ep, &cpars->remote_udp, kgtp_ep != NULL);
+	if (!t->peer) {
+		LOGT(t, LOGL_ERROR, "Cannot find or create GTP peer\n");
 		goto out_ep;
 	}
+	if (async)
+		t->tun_dev = tun_device_find_or_create_async(d, cpars->tun_name, cpars->tun_netns_name,
+							     cpars->tun_num_queues, kgtp_ep);
+	else
+		t->tun_dev = tun_device_find_or_create(d, cpars->tun_name, cpars->tun_netns_name,
+						       cpars->tun_num_queues, kgtp_ep);
+	if (!t->tun_dev) {
+		LOGT(t, LOGL_ERROR, "Cannot find or create tun device %s\n", cpars->tun_name);
+		goto out_peer;
+	}
 
 	/* FIXME: check if we already have a tunnel with same Tx-TEID + peer */
 	/* FIXME: check if we already have a tunnel with same tun + EUA + filter */
@@ -57,32 +130,494 @@ struct gtp_tunnel *gtp_tunnel_alloc(struct gtp_daemon *d, const struct gtp_tunne
 	t->rx_teid = cpars->rx_teid;
 	t->tx_teid = cpars->tx_teid;
 	memcpy(&t->user_addr, &cpars->user_addr, sizeof(t->user_addr));
-	memcpy(&t->remote_udp, &cpars->remote_udp, sizeof(t->remote_udp));
-
-	if (netdev_add_addr(t->tun_dev->nl, t->tun_dev->ifindex, &t->user_addr) < 0) {
-		LOGT(t, LOGL_ERROR, "Cannot add user addr to tun device: %s\n",
-			strerror(errno));
-	}
 
-	/* TODO: hash table? */
-	llist_add_tail(&t->list, &d->gtp_tunnels);
-	pthread_rwlock_unlock(&d->rwlock);
-	LOGT(t, LOGL_NOTICE, "Created\n");
+	/* everything but the length is the same for all uplink packets of the tunnel */
+	t->tx_hdr.flags = 0x30;
+	t->tx_hdr.type = GTP_TPDU;
+	t->tx_hdr.tid = htonl(t->tx_teid);
 
 	return t;
 
+out_peer:
+	gtp_peer_release(t->peer);
 out_ep:
-	_gtp_endpoint_release(t->gtp_ep);
-out_tun:
-	_tun_device_release(t->tun_dev);
+	gtp_endpoint_release(t->gtp_ep);
 out_free:
 	talloc_free(t);
-out_unlock:
-	pthread_rwlock_unlock(&d->rwlock);
 
 	return NULL;
 }
 
+/* undo gtp_tunnel_prepare() */
+static void gtp_tunnel_unprepare(struct gtp_tunnel *t)
+{
+	tun_device_release(t->tun_dev);
+	gtp_peer_release(t->peer);
+	gtp_endpoint_release(t->gtp_ep);
+	talloc_free(t);
+}
+
+static void gtp_tunnel_log_exists(struct gtp_tunnel *t)
+{
+	LOGT(t, LOGL_ERROR, "Error: We already have a tunnel for RxTEID 0x%08x "
+		"on this endpoint (%s)\n", t->rx_teid, t->gtp_ep->name);
+}
+
+/* add the kernel PDP context of a tunnel, if its tun device is a kernel GTP device.  Its user
+ * address is removed on error; returns 0 or negative on error.  Called by the control worker
+ * of the tun device, or by the main thread while no job is pending */
+static int gtp_tunnel_kgtp_program(struct gtp_tunnel *t)
+{
+#ifdef HAVE_LIBGTPNL
+	struct tun_device *tun = t->tun_dev;
+
+	if (tun->kgtp_ep && gtp_tunnel_kgtp_add(t) < 0) {
+		LOGT(t, LOGL_ERROR, "Cannot add kernel PDP context: %s\n", strerror(errno));
+		if (netdev_del_addr(tun->nl, tun->ifindex, &t->user_addr) < 0)
+			LOGT(t, LOGL_ERROR, "Cannot remove user address: %s\n", strerror(errno));
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+static void gtp_tunnel_kgtp_unprogram(struct gtp_tunnel *t)
+{
+#ifdef HAVE_LIBGTPNL
+	/* when destroying a whole device, its PDP contexts vanish together with it */
+	if (t->tun_dev->kgtp_ep)
+		gtp_tunnel_kgtp_del(t);
+#endif
+}
+
+/* LOCKED (write) publish a programmed tunnel to the data-plane threads */
+static void _gtp_tunnel_publish(struct gtp_tunnel *t)
+{
+	llist_add_tail(&t->list, &t->d->gtp_tunnels);
+	rcu_hash_add(t->gtp_ep->tunnels_by_rx_teid, &t->rx_teid_node, t->rx_teid);
+	rcu_hash_add(t->tun_dev->tunnels_by_eua, &t->eua_node,
+		 sockaddr_addr_hash((struct sockaddr *) &t->user_addr));
+}
+
+/* find a tunnel being created by R(x_teid) within an endpoint (main thread only) */
+static struct gtp_tunnel *
+gtp_tunnel_find_pending(struct gtp_daemon *d, uint32_t rx_teid, struct gtp_endpoint *ep)
+{
+	struct gtp_tunnel *t;
+
+	llist_for_each_entry(t, &d->gtp_tunnels_pending, list) {
+		if (t->rx_teid == rx_teid && t->gtp_ep == ep)
+			return t;
+	}
+	return NULL;
+}
+
+/* a tunnel being created or destroyed by the control workers */
+struct gtp_tunnel_op {
+	struct ctrl_job job;
+	struct gtp_daemon *d;
+	/* creation: the prepared tunnel */
+	struct gtp_tunnel *t;
+	/* destruction: the tunnel, its user address and a reference to its tun device, as the
+	 * tunnel itself may be gone by the time the job has run */
+	struct gtp_tunnel_id id;
+	struct sockaddr_storage user_addr;
+	struct tun_device *tun;
+	/* result of the netlink requests, if the tun device could be created */
+	bool tun_ready;
+	int rc;
+	int kgtp_rc;
+	gtp_tunnel_op_cb cb;
+	void *priv;
+};
+
+static void gtp_tunnel_add_addr_work(struct ctrl_job *job)
+{
+	struct gtp_tunnel_op *op = container_of(job, struct gtp_tunnel_op, job);
+	struct tun_device *tun = op->t->tun_dev;
+
+	op->tun_ready = tun_device_ready(tun);
+	if (!op->tun_ready)
+		return;
+	op->rc = netdev_add_addr(tun->nl, tun->ifindex, &op->t->user_addr);
+	/* the PDP context, too, so that the main thread never waits for the kernel */
+	op->kgtp_rc = gtp_tunnel_kgtp_program(op->t);
+}
+
+static void gtp_tunnel_alloc_done(struct ctrl_job *job)
+{
+	struct gtp_tunnel_op *op = container_of(job, struct gtp_tunnel_op, job);
+	struct gtp_tunnel *t = op->t;
+	struct gtp_daemon *d = op->d;
+	int rc = -ENODEV;
+
+	llist_del(&t->list);
+	if (!op->tun_ready)
+		LOGT(t, LOGL_ERROR, "Cannot create tun device %s\n", t->tun_dev->devname);
+	else {
+		if (op->rc < 0)
+			LOGT(t, LOGL_ERROR, "Cannot add user addr to tun device: %s\n",
+				nl_geterror(op->rc));
+		rc = op->kgtp_rc;
+	}
+	if (rc < 0) {
+		gtp_tunnel_unprepare(t);
+		goto out;
+	}
+
+	/* publish to the data-plane threads */
+	pthread_rwlock_wrlock(&d->rwlock);
+	_gtp_tunnel_publish(t);
+	pthread_rwlock_unlock(&d->rwlock);
+	tc_bpf_tunnel_add(t);
+	LOGT(t, LOGL_NOTICE, "Created\n");
+
+out:
+	op->cb(rc, op->priv);
+	talloc_free(op);
+}
+
+/* create a tunnel.  The netlink round-trips (and the creation of its tun device, if needed)
+ * are done by a control worker, after which cb is called with 0 or negative on error.
+ * Returns negative if the tunnel cannot be created right away, then cb is never called */
+int gtp_tunnel_alloc_async(struct gtp_daemon *d, const struct gtp_tunnel_params *cpars,
+			   gtp_tunnel_op_cb cb, void *priv)
+{
+	struct gtp_tunnel_op *op;
+	struct gtp_endpoint *ep;
+	struct gtp_tunnel *t;
+	bool exists;
+
+	ASSERT_MAIN_THREAD(d);
+
+	/* check if we already have a tunnel with same Rx-TEID + endpoint, published or still
+	 * being created.  Before preparing, so that a tun device being created is never
+	 * released before its creation has finished */
+	pthread_rwlock_rdlock(&d->rwlock);
+	ep = _gtp_endpoint_find(d, &cpars->local_udp);
+	exists = ep && _gtp_tunnel_find_r(d, cpars->rx_teid, ep);
+	pthread_rwlock_unlock(&d->rwlock);
+	if (exists || (ep && gtp_tunnel_find_pending(d, cpars->rx_teid, ep))) {
+		LOGP(DGT, LOGL_ERROR, "%s-R%08x-T%08x: Error: We already have a tunnel for RxTEID "
+			"0x%08x on this endpoint (%s)\n", cpars->tun_name, cpars->rx_teid,
+			cpars->tx_teid, cpars->rx_teid, ep->name);
+		return -EEXIST;
+	}
+
+	op = talloc_zero(d, struct gtp_tunnel_op);
+	if (!op)
+		return -ENOMEM;
+	op->d = d;
+	op->cb = cb;
+	op->priv = priv;
+
+	t = gtp_tunnel_prepare(d, cpars, true);
+	if (!t) {
+		talloc_free(op);
+		return -ENODEV;
+	}
+	op->t = t;
+
+	/* the jobs of the tun device run in order, so this one only runs once it is open */
+	llist_add_tail(&t->list, &d->gtp_tunnels_pending);
+	if (ctrl_job_submit(d, &t->tun_dev->strand, &op->job, gtp_tunnel_add_addr_work,
+			    gtp_tunnel_alloc_done) < 0) {
+		llist_del(&t->list);
+		gtp_tunnel_unprepare(t);
+		talloc_free(op);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* a tunnel of a bulk operation, with its index within the batch */
+struct gtp_tunnel_ref {
+	struct gtp_tunnel *t;
+	unsigned int idx;
+	/* creation: a duplicate, only released by the job of its tun device */
+	bool rejected;
+};
+
+/* order by endpoint + Rx TEID, then by position in the batch */
+static int gtp_tunnel_ref_cmp_r(const void *_a, const void *_b)
+{
+	const struct gtp_tunnel_ref *a = _a, *b = _b;
+
+	if (a->t->gtp_ep != b->t->gtp_ep)
+		return (uintptr_t) a->t->gtp_ep < (uintptr_t) b->t->gtp_ep ? -1 : 1;
+	if (a->t->rx_teid != b->t->rx_teid)
+		return a->t->rx_teid < b->t->rx_teid ? -1 : 1;
+	return a->idx < b->idx ? -1 : 1;
+}
+
+/* order by tunnel, then by position in the batch */
+static int gtp_tunnel_ref_cmp_t(const void *_a, const void *_b)
+{
+	const struct gtp_tunnel_ref *a = _a, *b = _b;
+
+	if (a->t != b->t)
+		return (uintptr_t) a->t < (uintptr_t) b->t ? -1 : 1;
+	return a->idx < b->idx ? -1 : 1;
+}
+
+/* order by tun device, the rejected tunnels last, then by position in the batch */
+static int gtp_tunnel_ref_cmp_tun(const void *_a, const void *_b)
+{
+	const struct gtp_tunnel_ref *a = _a, *b = _b;
+
+	if (a->t->tun_dev != b->t->tun_dev)
+		return (uintptr_t) a->t->tun_dev < (uintptr_t) b->t->tun_dev ? -1 : 1;
+	if (a->rejected != b->rejected)
+		return a->rejected ? 1 : -1;
+	return a->idx < b->idx ? -1 : 1;
+}
+
+struct gtp_tunnel_bulk_job;
+
+/* tunnels created or destroyed at once.  The netlink requests of each tun device are
+ * pipelined by one job of its strand, so that the main thread never waits for them */
+struct gtp_tunnel_bulk {
+	struct gtp_daemon *d;
+	bool add;
+	/* the tunnels, ordered by tun device once submitted */
+	struct gtp_tunnel_ref *refs;
+	unsigned int num;
+	/* per entry of refs: its netlink request, and the result of its PDP context */
+	struct netdev_addr_req *reqs;
+	int *kgtp_rc;
+	/* one per tun device, at most one per tunnel */
+	struct gtp_tunnel_bulk_job *jobs;
+	/* creation: per entry of the batch, has its tunnel been created? */
+	bool *created;
+	/* tunnels created or destroyed so far */
+	unsigned int num_done;
+	/* jobs whose done() is still pending, plus one while submitting them */
+	unsigned int num_pending;
+	gtp_tunnel_op_cb cb;
+	void *priv;
+};
+
+/* the tunnels of one tun device within a bulk operation */
+struct gtp_tunnel_bulk_job {
+	struct ctrl_job job;
+	struct gtp_tunnel_bulk *bulk;
+	/* range of refs[]; only the requests of the first num_reqs are sent, the others were
+	 * rejected */
+	unsigned int first, num, num_reqs;
+	bool tun_ready;
+};
+
+/* allocate a bulk operation for up to n tunnels.  Everything is allocated up front, as
+ * neither preparing nor unpublishing a tunnel can be undone right away */
+static struct gtp_tunnel_bulk *gtp_tunnel_bulk_alloc(struct gtp_daemon *d, unsigned int n, bool add,
+						     gtp_tunnel_op_cb cb, void *priv)
+{
+	struct gtp_tunnel_bulk *bulk = talloc_zero(d, struct gtp_tunnel_bulk);
+
+	if (!bulk)
+		return NULL;
+	bulk->d = d;
+	bulk->add = add;
+	bulk->cb = cb;
+	bulk->priv = priv;
+
+	bulk->refs = talloc_zero_array(bulk, struct gtp_tunnel_ref, n);
+	bulk->reqs = talloc_zero_array(bulk, struct netdev_addr_req, n);
+	bulk->kgtp_rc = talloc_zero_array(bulk, int, n);
+	bulk->jobs = talloc_zero_array(bulk, struct gtp_tunnel_bulk_job, n);
+	if (!bulk->refs || !bulk->reqs || !bulk->kgtp_rc || !bulk->jobs) {
+		talloc_free(bulk);
+		return NULL;
+	}
+
+	return bulk;
+}
+
+static void gtp_tunnel_bulk_add(struct gtp_tunnel_bulk *bulk, struct gtp_tunnel *t, unsigned int idx)
+{
+	bulk->refs[bulk->num].t = t;
+	bulk->refs[bulk->num].idx = idx;
+	bulk->num++;
+}
+
+/* add or remove the user addresses of the tunnels of one tun device, pipelined, and their
+ * PDP contexts, so that the main thread never waits for the kernel */
+static void gtp_tunnel_bulk_work(struct ctrl_job *job)
+{
+	struct gtp_tunnel_bulk_job *bj = container_of(job, struct gtp_tunnel_bulk_job, job);
+	struct gtp_tunnel_bulk *bulk = bj->bulk;
+	struct tun_device *tun = bulk->refs[bj->first].t->tun_dev;
+	unsigned int i, end = bj->first + bj->num_reqs;
+
+	bj->tun_ready = tun_device_ready(tun);
+	if (!bj->tun_ready)
+		return;
+
+	/* only now, as a tun device still being created has no ifindex yet */
+	for (i = bj->first; i < end; i++) {
+		bulk->reqs[i].ifindex = tun->ifindex;
+		bulk->reqs[i].addr = &bulk->refs[i].t->user_addr;
+		bulk->reqs[i].add = bulk->add;
+	}
+	netdev_addr_batch(tun->nl, &bulk->reqs[bj->first], bj->num_reqs);
+
+	for (i = bj->first; i < end; i++) {
+		if (bulk->add)
+			bulk->kgtp_rc[i] = gtp_tunnel_kgtp_program(bulk->refs[i].t);
+		else
+			gtp_tunnel_kgtp_unprogram(bulk->refs[i].t);
+	}
+}
+
+/* called once per job, and once after submitting them; the last call reports the result */
+static void gtp_tunnel_bulk_put(struct gtp_tunnel_bulk *bulk)
+{
+	if (--bulk->num_pending)
+		return;
+
+	/* destruction: one grace period for all of them */
+	if (!bulk->add)
+		rcu_reclaim(&bulk->d->rcu);
+	bulk->cb(bulk->num_done, bulk->priv);
+	talloc_free(bulk);
+}
+
+/* submit one job per tun device of the tunnels, each completed by done().  The jobs of a
+ * device run in order, so one only runs once the device is open */
+static void gtp_tunnel_bulk_submit(struct gtp_tunnel_bulk *bulk, ctrl_job_cb done)
+{
+	struct gtp_tunnel_bulk_job *bj = bulk->jobs;
+	struct tun_device *tun;
+	unsigned int i, first;
+
+	qsort(bulk->refs, bulk->num, sizeof(*bulk->refs), gtp_tunnel_ref_cmp_tun);
+
+	bulk->num_pending = 1;
+	for (first = 0; first < bulk->num; first = i, bj++) {
+		tun = bulk->refs[first].t->tun_dev;
+		bj->bulk = bulk;
+		bj->first = first;
+		for (i = first; i < bulk->num && bulk->refs[i].t->tun_dev == tun; i++) {
+			if (!bulk->refs[i].rejected)
+				bj->num_reqs++;
+		}
+		bj->num = i - first;
+
+		bulk->num_pending++;
+		if (ctrl_job_submit(bulk->d, &tun->strand, &bj->job, gtp_tunnel_bulk_work, done) < 0) {
+			/* the pool cannot be started, so no job is using the device */
+			gtp_tunnel_bulk_work(&bj->job);
+			done(&bj->job);
+		}
+	}
+	gtp_tunnel_bulk_put(bulk);
+}
+
+/* release the tunnels of a tun device that failed or were rejected, and publish the others
+ * to the data-plane threads under one lock acquisition */
+static void gtp_tunnel_bulk_alloc_done(struct ctrl_job *job)
+{
+	struct gtp_tunnel_bulk_job *bj = container_of(job, struct gtp_tunnel_bulk_job, job);
+	struct gtp_tunnel_bulk *bulk = bj->bulk;
+	struct gtp_daemon *d = bulk->d;
+	unsigned int i, end = bj->first + bj->num;
+	struct gtp_tunnel *t;
+
+	for (i = bj->first; i < end; i++) {
+		t = bulk->refs[i].t;
+		if (!bulk->refs[i].rejected) {
+			llist_del(&t->list);
+			if (!bj->tun_ready)
+				LOGT(t, LOGL_ERROR, "Cannot create tun device %s\n", t->tun_dev->devname);
+			else {
+				if (bulk->reqs[i].rc < 0)
+					LOGT(t, LOGL_ERROR, "Cannot add user addr to tun device: %s\n",
+						strerror(-bulk->reqs[i].rc));
+				if (bulk->kgtp_rc[i] == 0)
+					continue;
+			}
+		}
+		gtp_tunnel_unprepare(t);
+		bulk->refs[i].t = NULL;
+	}
+
+	pthread_rwlock_wrlock(&d->rwlock);
+	for (i = bj->first; i < end; i++) {
+		if (bulk->refs[i].t)
+			_gtp_tunnel_publish(bulk->refs[i].t);
+	}
+	pthread_rwlock_unlock(&d->rwlock);
+
+	for (i = bj->first; i < end; i++) {
+		t = bulk->refs[i].t;
+		if (!t)
+			continue;
+		tc_bpf_tunnel_add(t);
+		LOGT(t, LOGL_NOTICE, "Created\n");
+		bulk->created[bulk->refs[i].idx] = true;
+		bulk->num_done++;
+	}
+
+	gtp_tunnel_bulk_put(bulk);
+}
+
+/* create n tunnels like gtp_tunnel_alloc_async(), with one job per tun device, whose done()
+ * publishes its tunnels under one lock acquisition.  NULL entries of cpars are skipped.
+ * created[i] is set once the tunnel of cpars[i] has been created; not for a duplicate Rx
+ * TEID, also within the batch, where the first one wins.  cb is called with the number of
+ * tunnels created once all of them are done, maybe before this returns.  Returns negative
+ * if they cannot be created right away, then cb is never called */
+int gtp_tunnel_alloc_bulk_async(struct gtp_daemon *d, const struct gtp_tunnel_params **cpars,
+				unsigned int n, bool *created, gtp_tunnel_op_cb cb, void *priv)
+{
+	struct gtp_tunnel_bulk *bulk;
+	struct gtp_tunnel_ref *refs;
+	struct gtp_tunnel *t;
+	unsigned int i;
+
+	ASSERT_MAIN_THREAD(d);
+
+	bulk = gtp_tunnel_bulk_alloc(d, n, true, cb, priv);
+	if (!bulk)
+		return -ENOMEM;
+	bulk->created = created;
+	memset(created, 0, n * sizeof(*created));
+	refs = bulk->refs;
+
+	/* 1) references to endpoints, peers + tun devices, the latter maybe still being
+	 * created by a control worker */
+	for (i = 0; i < n; i++) {
+		t = cpars[i] ? gtp_tunnel_prepare(d, cpars[i], true) : NULL;
+		if (t)
+			gtp_tunnel_bulk_add(bulk, t, i);
+	}
+
+	/* 2) duplicates among the existing tunnels, those still being created and within the
+	 * batch.  Tunnels are only created + destroyed by the main thread, so reading the hash
+	 * tables needs no lock */
+	qsort(refs, bulk->num, sizeof(*refs), gtp_tunnel_ref_cmp_r);
+	for (i = 0; i < bulk->num; i++) {
+		t = refs[i].t;
+		if (_gtp_tunnel_find_r(d, t->rx_teid, t->gtp_ep) ||
+		    gtp_tunnel_find_pending(d, t->rx_teid, t->gtp_ep) ||
+		    (i > 0 && refs[i-1].t->gtp_ep == t->gtp_ep && refs[i-1].t->rx_teid == t->rx_teid)) {
+			gtp_tunnel_log_exists(t);
+			refs[i].rejected = true;
+		}
+	}
+	/* only now, as the look-ups above must not find the tunnels of the batch */
+	for (i = 0; i < bulk->num; i++) {
+		if (!refs[i].rejected)
+			llist_add_tail(&refs[i].t->list, &d->gtp_tunnels_pending);
+	}
+
+	/* 3) kernel: user addresses + PDP contexts */
+	gtp_tunnel_bulk_submit(bulk, gtp_tunnel_bulk_alloc_done);
+
+	return 0;
+}
+
 #if 0
 /* find tunnel by R(x_teid), T(x_teid) + A(ddr) */
 static struct gtp_tunnel *
@@ -99,73 +634,297 @@ _gtp_tunnel_find_rta(struct gtp_daemon *d, uint32_t rx_teid, uint32_t tx_teid,
 }
 #endif
 
+/* UNLOCKED find tunnel by R(x_teid) within the hash table of one endpoint; safe under
+ * RCU read-side */
+static struct gtp_tunnel *
+_gtp_ep_tunnel_find_r(struct gtp_endpoint *ep, uint32_t rx_teid)
+{
+	struct gtp_tunnel *t;
+	rcu_hash_for_each_possible(ep->tunnels_by_rx_teid, t, rx_teid_node, rx_teid) {
+		if (t->rx_teid == rx_teid)
+			return t;
+	}
+	return NULL;
+}
+
 /* find tunnel by R(x_teid) + optionally local endpoint */
 struct gtp_tunnel *
 _gtp_tunnel_find_r(struct gtp_daemon *d, uint32_t rx_teid, struct gtp_endpoint *ep)
 {
 	struct gtp_tunnel *t;
-	llist_for_each_entry(t, &d->gtp_tunnels, list) {
-		if (t->rx_teid == rx_teid) {
-			if (!ep)
-				return t;
-			if (t->gtp_ep == ep)
-				return t;
-		}
+
+	if (ep)
+		return _gtp_ep_tunnel_find_r(ep, rx_teid);
+
+	llist_for_each_entry(ep, &d->gtp_endpoints, list) {
+		t = _gtp_ep_tunnel_find_r(ep, rx_teid);
+		if (t)
+			return t;
 	}
 	return NULL;
 }
 
-/* UNLOCKED find tunnel by tun + EUA ip (+proto/port) */
+/* UNLOCKED find tunnel by tun + EUA ip (+proto/port); safe under RCU read-side */
 struct gtp_tunnel *
 _gtp_tunnel_find_eua(struct tun_device *tun, const struct sockaddr *sa, uint8_t proto)
 {
-	struct gtp_daemon *d = tun->d;
 	struct gtp_tunnel *t;
 
-	llist_for_each_entry(t, &d->gtp_tunnels, list) {
+	rcu_hash_for_each_possible(tun->tunnels_by_eua, t, eua_node, sockaddr_addr_hash(sa)) {
 		/* TODO: Find best matching filter */
-		if (t->tun_dev == tun && sockaddr_equals(sa, (struct sockaddr *) &t->user_addr))
+		if (sockaddr_addr_equals(sa, (struct sockaddr *) &t->user_addr))
 			return t;
 	}
 	return NULL;
 }
 
-/* UNLOCKED destroy of tunnel; drops references to EP + TUN */
-void _gtp_tunnel_destroy(struct gtp_tunnel *t)
+/* remove the user address of the tunnel from its tun device.  Doesn't need the lock, as
+ * only the main thread creates/destroys tunnels; call before _gtp_tunnel_destroy() to keep
+ * the netlink round-trip out of the critical section */
+void gtp_tunnel_del_user_addr(struct gtp_tunnel *t)
 {
-	LOGT(t, LOGL_NOTICE, "Destroying\n");
-	/* talloc is not thread safe, all alloc/free must come from main thread */
 	ASSERT_MAIN_THREAD(t->d);
 
 	if (netdev_del_addr(t->tun_dev->nl, t->tun_dev->ifindex, &t->user_addr) < 0)
 		LOGT(t, LOGL_ERROR, "Cannot remove user address: %s\n", strerror(errno));
+}
 
+/* UNLOCKED remove a tunnel from the look-ups of the main + data-plane threads */
+static void _gtp_tunnel_unpublish(struct gtp_tunnel *t)
+{
 	llist_del(&t->list);
+	rcu_hash_del(&t->rx_teid_node);
+	rcu_hash_del(&t->eua_node);
+	tc_bpf_tunnel_del(t);
+}
 
-	/* drop reference to endpoint + tun */
-	_gtp_endpoint_release(t->gtp_ep);
+/* UNLOCKED drop the references of an unpublished tunnel to EP + peer + TUN.  The memory is
+ * only released by the next rcu_reclaim(), as data-plane threads may still be using it */
+static void _gtp_tunnel_free(struct gtp_tunnel *t)
+{
+	/* their destruction waits for a grace period, too.  The tun goes first, as a kernel GTP
+	 * device may be using the socket of the endpoint */
 	_tun_device_release(t->tun_dev);
+	_gtp_peer_release(t->peer);
+	_gtp_endpoint_release(t->gtp_ep);
 
-	talloc_free(t);
+	rcu_defer_free(&t->d->rcu, t);
 }
 
-bool gtp_tunnel_destroy(struct gtp_daemon *d, const struct sockaddr_storage *bind_addr, uint32_t rx_teid)
+/* UNLOCKED destroy of tunnel; drops references to EP + peer + TUN.  The memory is only released
+ * by the next rcu_reclaim(), as data-plane threads may still be using the tunnel.  The user
+ * address is left on the tun device, see gtp_tunnel_del_user_addr() */
+void _gtp_tunnel_destroy(struct gtp_tunnel *t)
 {
+	LOGT(t, LOGL_NOTICE, "Destroying\n");
+	/* talloc is not thread safe, all alloc/free must come from main thread */
+	ASSERT_MAIN_THREAD(t->d);
+
+	_gtp_tunnel_unpublish(t);
+	_gtp_tunnel_free(t);
+}
+
+static void gtp_tunnel_del_addr_work(struct ctrl_job *job)
+{
+	struct gtp_tunnel_op *op = container_of(job, struct gtp_tunnel_op, job);
+
+	op->tun_ready = tun_device_ready(op->tun);
+	if (op->tun_ready)
+		op->rc = netdev_del_addr(op->tun->nl, op->tun->ifindex, &op->user_addr);
+}
+
+static void gtp_tunnel_destroy_done(struct ctrl_job *job)
+{
+	struct gtp_tunnel_op *op = container_of(job, struct gtp_tunnel_op, job);
+	struct gtp_daemon *d = op->d;
+	struct gtp_tunnel *t = NULL;
 	struct gtp_endpoint *ep;
-	bool rc = false;
+	int rc = -ENOENT;
 
-	pthread_rwlock_wrlock(&d->rwlock);
+	/* its creation may have failed, or another request destroyed it meanwhile */
+	pthread_rwlock_rdlock(&d->rwlock);
+	ep = _gtp_endpoint_find(d, &op->id.local_udp);
+	if (ep)
+		t = _gtp_tunnel_find_r(d, op->id.rx_teid, ep);
+	pthread_rwlock_unlock(&d->rwlock);
+
+	if (t && t->tun_dev == op->tun) {
+		if (op->rc < 0)
+			LOGT(t, LOGL_ERROR, "Cannot remove user address: %s\n", nl_geterror(op->rc));
+		gtp_tunnel_kgtp_unprogram(t);
+
+		pthread_rwlock_wrlock(&d->rwlock);
+		_gtp_tunnel_destroy(t);
+		pthread_rwlock_unlock(&d->rwlock);
+		rcu_reclaim(&d->rcu);
+		rc = 0;
+	}
+
+	tun_device_release(op->tun);
+	op->cb(rc, op->priv);
+	talloc_free(op);
+}
+
+/* destroy a tunnel, also one still being created.  The netlink round-trip is done by a
+ * control worker, after which cb is called with 0 or negative on error.  Returns negative if
+ * there is no such tunnel, then cb is never called */
+int gtp_tunnel_destroy_async(struct gtp_daemon *d, const struct sockaddr_storage *bind_addr,
+			     uint32_t rx_teid, gtp_tunnel_op_cb cb, void *priv)
+{
+	struct gtp_tunnel *t = NULL;
+	struct gtp_tunnel_op *op;
+	struct gtp_endpoint *ep;
+
+	ASSERT_MAIN_THREAD(d);
+
+	pthread_rwlock_rdlock(&d->rwlock);
 	/* find endpoint for bind_addr */
 	ep = _gtp_endpoint_find(d, bind_addr);
 	if (ep) {
 		/* find tunnel for rx TEID within endpoint */
-		struct gtp_tunnel *t = _gtp_tunnel_find_r(d, rx_teid, ep);
-		if (t) {
-			_gtp_tunnel_destroy(t);
-			rc = true;
-		}
+		t = _gtp_tunnel_find_r(d, rx_teid, ep);
+	}
+	pthread_rwlock_unlock(&d->rwlock);
+	if (!t && ep)
+		t = gtp_tunnel_find_pending(d, rx_teid, ep);
+	if (!t)
+		return -ENOENT;
+
+	op = talloc_zero(d, struct gtp_tunnel_op);
+	if (!op)
+		return -ENOMEM;
+	op->d = d;
+	op->id.local_udp = *bind_addr;
+	op->id.rx_teid = rx_teid;
+	op->user_addr = t->user_addr;
+	op->tun = t->tun_dev;
+	op->cb = cb;
+	op->priv = priv;
+
+	/* after any job creating the tunnel */
+	tun_device_get(op->tun);
+	if (ctrl_job_submit(d, &op->tun->strand, &op->job, gtp_tunnel_del_addr_work,
+			    gtp_tunnel_destroy_done) < 0) {
+		tun_device_release(op->tun);
+		talloc_free(op);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* drop the references of the tunnels of a tun device, now that their kernel state is gone */
+static void gtp_tunnel_bulk_destroy_done(struct ctrl_job *job)
+{
+	struct gtp_tunnel_bulk_job *bj = container_of(job, struct gtp_tunnel_bulk_job, job);
+	struct gtp_tunnel_bulk *bulk = bj->bulk;
+	struct gtp_daemon *d = bulk->d;
+	unsigned int i, end = bj->first + bj->num;
+
+	for (i = bj->first; i < end; i++) {
+		if (bulk->reqs[i].rc < 0)
+			LOGT(bulk->refs[i].t, LOGL_ERROR, "Cannot remove user address: %s\n",
+				strerror(-bulk->reqs[i].rc));
+	}
+
+	pthread_rwlock_wrlock(&d->rwlock);
+	for (i = bj->first; i < end; i++) {
+		_gtp_tunnel_free(bulk->refs[i].t);
+		bulk->num_done++;
 	}
 	pthread_rwlock_unlock(&d->rwlock);
 
-	return rc;
+	gtp_tunnel_bulk_put(bulk);
+}
+
+/* unpublish the tunnels of a bulk operation under one lock acquisition, after which nothing
+ * but the operation refers to them, and submit the jobs removing their kernel state */
+static void gtp_tunnel_bulk_destroy(struct gtp_tunnel_bulk *bulk)
+{
+	struct gtp_daemon *d = bulk->d;
+	unsigned int i;
+
+	pthread_rwlock_wrlock(&d->rwlock);
+	for (i = 0; i < bulk->num; i++) {
+		LOGT(bulk->refs[i].t, LOGL_NOTICE, "Destroying\n");
+		_gtp_tunnel_unpublish(bulk->refs[i].t);
+	}
+	pthread_rwlock_unlock(&d->rwlock);
+
+	gtp_tunnel_bulk_submit(bulk, gtp_tunnel_bulk_destroy_done);
+}
+
+/* destroy n tunnels like gtp_tunnel_destroy_async(), looking them up + unpublishing them
+ * under one lock acquisition each, with one job per tun device and a single grace period.
+ * destroyed[i] is set right away if the tunnel of ids[i] was found (only for its first
+ * occurrence in the batch).  cb is called with the number of tunnels destroyed once all of
+ * them are done, maybe before this returns.  Returns negative if they cannot be destroyed
+ * right away, then cb is never called */
+int gtp_tunnel_destroy_bulk_async(struct gtp_daemon *d, const struct gtp_tunnel_id *ids,
+				  unsigned int n, bool *destroyed, gtp_tunnel_op_cb cb, void *priv)
+{
+	struct gtp_tunnel_bulk *bulk;
+	struct gtp_tunnel_ref *refs;
+	struct gtp_endpoint *ep = NULL;
+	struct gtp_tunnel *t;
+	unsigned int i, num;
+
+	ASSERT_MAIN_THREAD(d);
+
+	bulk = gtp_tunnel_bulk_alloc(d, n, false, cb, priv);
+	if (!bulk)
+		return -ENOMEM;
+	memset(destroyed, 0, n * sizeof(*destroyed));
+	refs = bulk->refs;
+
+	/* 1) look-up; consecutive entries mostly refer to the same endpoint */
+	pthread_rwlock_rdlock(&d->rwlock);
+	for (i = 0; i < n; i++) {
+		if (!ep || !sockaddr_equals((const struct sockaddr *) &ep->bind_addr,
+					    (const struct sockaddr *) &ids[i].local_udp))
+			ep = _gtp_endpoint_find(d, &ids[i].local_udp);
+		t = ep ? _gtp_tunnel_find_r(d, ids[i].rx_teid, ep) : NULL;
+		if (t)
+			gtp_tunnel_bulk_add(bulk, t, i);
+	}
+	pthread_rwlock_unlock(&d->rwlock);
+
+	/* 2) a tunnel listed more than once is destroyed only once */
+	qsort(refs, bulk->num, sizeof(*refs), gtp_tunnel_ref_cmp_t);
+	for (i = 0, num = 0; i < bulk->num; i++) {
+		if (num > 0 && refs[num-1].t == refs[i].t)
+			continue;
+		refs[num++] = refs[i];
+		destroyed[refs[i].idx] = true;
+	}
+	bulk->num = num;
+
+	/* 3) kernel: user addresses + PDP contexts, then the references */
+	gtp_tunnel_bulk_destroy(bulk);
+
+	return 0;
+}
+
+/* destroy all tunnels like gtp_tunnel_destroy_bulk_async(); not those still being created.
+ * cb is called with the number of tunnels destroyed once all of them are done, maybe before
+ * this returns.  Returns negative if they cannot be destroyed right away, then cb is never
+ * called */
+int gtp_tunnel_destroy_all_async(struct gtp_daemon *d, gtp_tunnel_op_cb cb, void *priv)
+{
+	struct gtp_tunnel_bulk *bulk;
+	struct gtp_tunnel *t;
+	unsigned int n = 0;
+
+	ASSERT_MAIN_THREAD(d);
+
+	bulk = gtp_tunnel_bulk_alloc(d, llist_count(&d->gtp_tunnels), false, cb, priv);
+	if (!bulk)
+		return -ENOMEM;
+	/* the list is only modified by the main thread */
+	llist_for_each_entry(t, &d->gtp_tunnels, list)
+		gtp_tunnel_bulk_add(bulk, t, n++);
+
+	gtp_tunnel_bulk_destroy(bulk);
+
+	return 0;
 }
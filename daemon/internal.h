@@ -5,10 +5,15 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <osmocom/core/linuxlist.h>
+#include <osmocom/core/hashtable.h>
 #include <osmocom/core/write_queue.h>
 #include <osmocom/core/utils.h>
 
+#include "rcu.h"
+#include "gtp.h"
+
 struct nl_sock;
 struct osmo_stream_srv_link;
 
@@ -21,6 +26,8 @@ struct osmo_stream_srv_link;
 #define MAX_UDP_PACKET 65535
 
 bool sockaddr_equals(const struct sockaddr *a, const struct sockaddr *b);
+bool sockaddr_addr_equals(const struct sockaddr *a, const struct sockaddr *b);
+uint32_t sockaddr_addr_hash(const struct sockaddr *sa);
 
 struct addrinfo *addrinfo_helper(uint16_t family, uint16_t type, uint8_t proto,
 				 const char *host, uint16_t port, bool passive);
@@ -29,6 +36,8 @@ enum {
 	DEP,
 	DGT,
 	DUECUPS,
+	DIOW,
+	DPKT,
 };
 
 /***********************************************************************
@@ -37,8 +46,339 @@ enum {
 
 int netdev_add_addr(struct nl_sock *nlsk, int ifindex, const struct sockaddr_storage *ss);
 int netdev_del_addr(struct nl_sock *nlsk, int ifindex, const struct sockaddr_storage *ss);
+
+/* one address to add/remove via netdev_addr_batch() */
+struct netdev_addr_req {
+	int ifindex;
+	const struct sockaddr_storage *addr;
+	bool add;
+	/* result: 0 or negative errno */
+	int rc;
+	/* netlink sequence number of the request */
+	uint32_t seq;
+};
+int netdev_batch_sock_init(struct nl_sock *nlsk);
+int netdev_addr_batch(struct nl_sock *nlsk, struct netdev_addr_req *reqs, unsigned int n);
 int netdev_set_link(struct nl_sock *nlsk, int ifindex, bool up);
+int netdev_set_mtu(struct nl_sock *nlsk, int ifindex, unsigned int mtu);
 int netdev_add_defaultroute(struct nl_sock *nlsk, int ifindex, uint8_t family);
+int netdev_del_link(struct nl_sock *nlsk, int ifindex);
+int netdev_find_ifindex(const struct sockaddr_in *sin);
+int netdev_add_tc_bpf(struct nl_sock *nlsk, int ifindex, bool ingress, int prog_fd, const char *name);
+int netdev_del_tc_bpf(struct nl_sock *nlsk, int ifindex, bool ingress);
+
+
+/***********************************************************************
+ * Packet buffer pool
+ ***********************************************************************/
+
+/* The data-plane threads fill and drain packet buffers of a daemon-wide pool (one per NUMA
+ * node) in place; their struct pkt_buf is the handle passed between the stages */
+
+struct gtp_daemon;
+struct pkt_pool;
+
+/* room in front of the packet for prepending headers (GTP encapsulation) */
+#define PKT_BUF_HEADROOM	64
+/* room for the packet; that of a GRO-coalesced datagram, plus any metadata the kernel
+ * places in front of it (io_uring recvmsg) */
+#define PKT_BUF_DATA_LEN	(MAX_UDP_PACKET + 256)
+/* room for the packet in the buffers of the tun queue threads, which only ever read packets
+ * of up to the MTU of their device (see tun_device_open()); that of jumbo frames */
+#define PKT_BUF_MTU_DATA_LEN	9216
+/* NUMA nodes beyond this share the pool of node -1 */
+#define PKT_POOL_MAX_NODES	64
+
+struct pkt_slab;
+
+struct pkt_buf {
+	/* pool + slab this buffer belongs to */
+	struct pkt_pool *pool;
+	struct pkt_slab *slab;
+	/* next buffer in the free list of the pool */
+	struct pkt_buf *next;
+	/* length of the packet, when passed between stages */
+	unsigned int len;
+	/* PKT_BUF_HEADROOM + pool->data_len bytes */
+	uint8_t head[] __attribute__((aligned(64)));
+};
+
+/* start of the packet, behind the headroom */
+static inline uint8_t *pkt_buf_data(struct pkt_buf *pb)
+{
+	return pb->head + PKT_BUF_HEADROOM;
+}
+
+struct pkt_pool {
+	/* entry in gtp_daemon->pkt_pools */
+	struct llist_head list;
+	/* back-pointer to daemon */
+	struct gtp_daemon *d;
+	/* NUMA node the memory is bound to; -1 for none */
+	int numa_node;
+	/* room for the packet in each buffer: PKT_BUF_DATA_LEN or PKT_BUF_MTU_DATA_LEN */
+	unsigned int data_len;
+	/* size of each buffer including its struct pkt_buf, and how many fit into one slab */
+	unsigned int buf_size;
+	unsigned int bufs_per_slab;
+
+	/* protects all of the below */
+	pthread_mutex_t lock;
+	/* mmap()ed memory the buffers are carved from (struct pkt_slab) */
+	struct llist_head slabs;
+	struct pkt_buf *free_list;
+	unsigned int num_slabs;
+	unsigned int num_bufs;
+	unsigned int num_free;
+	/* number of allocations failed as the pool could not grow */
+	unsigned long alloc_failures;
+};
+
+/* room for the packet in a buffer */
+static inline unsigned int pkt_buf_data_len(const struct pkt_buf *pb)
+{
+	return pb->pool->data_len;
+}
+
+struct pkt_pool *pkt_pool_get(struct gtp_daemon *d, int numa_node, unsigned int data_len);
+int pkt_pool_alloc_bulk(struct pkt_pool *pool, struct pkt_buf **bufs, unsigned int n);
+void pkt_pool_free_bulk(struct pkt_buf **bufs, unsigned int n);
+int pkt_pool_cpu_node(unsigned int cpu);
+
+
+/***********************************************************************
+ * Data-plane threads
+ ***********************************************************************/
+
+struct vty;
+
+int dp_thread_create(struct gtp_daemon *d, pthread_t *thread, const char *name, int pin_idx,
+		     void *(*fn)(void *), void *arg);
+void dp_thread_join(struct gtp_daemon *d, pthread_t thread);
+int dp_thread_cpu(const struct gtp_daemon *d, unsigned int idx);
+void dp_thread_isolate_main(struct gtp_daemon *d);
+void dp_threads_vty_show(struct vty *vty, struct gtp_daemon *d);
+int cpulist_check(const char *str);
+
+/* adaptive busy polling of a reader thread: spin on non-blocking reads, and only sleep
+ * once no packet arrived for idle_ns */
+struct dp_busy_poll {
+	/* idle time after which the thread sleeps; 0: busy polling disabled */
+	uint64_t idle_ns;
+	/* start of the current idle period (0: not idle), and of the current interval */
+	uint64_t idle_since;
+	uint64_t last;
+	/* total time spent spinning without packets / sleeping; written by the thread only */
+	uint64_t spin_ns;
+	uint64_t sleep_ns;
+};
+
+void dp_busy_poll_init(struct dp_busy_poll *bp, unsigned int idle_us);
+bool dp_busy_poll_idle(struct dp_busy_poll *bp);
+void dp_busy_poll_active(struct dp_busy_poll *bp);
+void dp_busy_poll_sleep_begin(struct dp_busy_poll *bp);
+void dp_busy_poll_sleep_end(struct dp_busy_poll *bp);
+
+
+/***********************************************************************
+ * Software RSS pipeline
+ ***********************************************************************/
+
+/* Optionally, the thread reading a socket / tun queue only dispatches the received buffers
+ * by flow hash to a number of worker threads, which do the actual processing */
+
+struct dp_ring;
+struct dp_pipeline_worker;
+
+/* process a batch of buffers in a worker thread, with its RCU read-side online */
+typedef void (*dp_pipeline_cb)(struct dp_pipeline_worker *pw, struct pkt_buf **bufs,
+			       unsigned int n);
+
+struct dp_pipeline_worker {
+	/* back-pointer to pipeline */
+	struct dp_pipeline *pl;
+	/* index within pl->workers */
+	unsigned int idx;
+
+	pthread_t thread;
+	bool running;
+	/* RCU read-side state of the thread */
+	struct rcu_reader rcu;
+	/* stage specific state, e.g. the batch used for processing */
+	void *priv;
+
+	/* buffers from the reader, and back to it */
+	struct dp_ring *work;
+	struct dp_ring *ret;
+	/* buffers taken from work */
+	struct pkt_buf **batch;
+	/* wake-up of the thread while it is sleeping */
+	int efd;
+	int sleeping;
+	bool stop;
+
+	/* number of buffers processed */
+	unsigned long num_pkts;
+};
+
+struct dp_pipeline {
+	/* back-pointer to daemon */
+	struct gtp_daemon *d;
+	const char *name;
+	dp_pipeline_cb process;
+	/* the socket / tun queue whose reader feeds the pipeline */
+	void *priv;
+	unsigned int batch_size;
+
+	struct dp_pipeline_worker *workers;
+	unsigned int num_workers;
+
+	/* all buffers of the pipeline, from the packet pool */
+	struct pkt_buf **bufs;
+	unsigned int num_bufs;
+	/* buffers owned by the reader, not in its batch (reader only) */
+	struct pkt_buf **free;
+	unsigned int num_free;
+	/* wake-up of the reader while it is waiting for free buffers */
+	int efd;
+	int waiting;
+};
+
+struct dp_pipeline *dp_pipeline_alloc(void *ctx, struct gtp_daemon *d, struct pkt_pool *pool,
+				      const char *name, unsigned int batch_size,
+				      dp_pipeline_cb process, void *priv);
+int dp_pipeline_start(struct dp_pipeline *pl);
+void dp_pipeline_stop(struct dp_pipeline *pl);
+void dp_pipeline_get_bufs(struct dp_pipeline *pl, struct pkt_buf **bufs, unsigned int n,
+			  struct rcu_reader *rcu);
+void dp_pipeline_push(struct dp_pipeline *pl, uint32_t hash, struct pkt_buf *pb);
+void dp_pipeline_flush(struct dp_pipeline *pl);
+
+
+/***********************************************************************
+ * I/O worker pool
+ ***********************************************************************/
+
+/* Instead of one thread per GTP endpoint socket and per tun queue, a fixed number of
+ * worker threads can multiplex all of those file descriptors via epoll */
+
+struct gtp_daemon;
+struct gtp_ep_rx_batch;
+struct tun_tx_batch;
+struct io_worker;
+struct iou_worker;
+
+/* maximum number of threads in the worker pool */
+#define IO_WORKERS_MAX		256
+
+enum io_worker_fd_type {
+	/* socket of a GTP endpoint; data is a struct gtp_endpoint_worker */
+	IO_WORKER_FD_GTP_EP,
+	/* queue of a tun device; data is a struct tun_queue */
+	IO_WORKER_FD_TUN,
+};
+
+/* a file descriptor served by the worker pool */
+struct io_worker_fd {
+	int fd;
+	enum io_worker_fd_type type;
+	/* called by the epoll engine when fd is readable; must not block */
+	void (*read_cb)(struct io_worker_fd *iofd, struct io_worker *iow);
+	void *data;
+	/* the worker serving this fd; NULL if not registered */
+	struct io_worker *worker;
+
+	/* io_uring engine: pending (un)registration, handed over to the worker thread */
+	struct llist_head iou_cmd;
+	bool iou_del;
+	/* io_uring engine: receive operation is being cancelled (worker thread only) */
+	bool iou_cancelled;
+	/* io_uring engine: entry in the list of fds waiting for provided buffers to be returned
+	 * before re-arming their receive (worker thread only) */
+	struct llist_head iou_starved;
+	/* io_uring engine: set by the worker once no more completions can refer to us (under
+	 * the command lock of the worker) */
+	bool iou_done;
+};
+
+struct io_worker {
+	/* back-pointer to daemon */
+	struct gtp_daemon *d;
+	/* index within d->io_workers */
+	unsigned int idx;
+
+	/* epoll instance of all fds served by this worker */
+	int epfd;
+
+	pthread_t thread;
+	/* RCU read-side state of the thread */
+	struct rcu_reader rcu;
+
+	/* number of fds served by this worker (only used by main thread) */
+	unsigned int num_fds;
+
+	/* packet buffers shared by all fds of this worker, as it serves one at a time */
+	struct gtp_ep_rx_batch *rx_batch;
+	struct tun_tx_batch *tx_batch;
+
+	/* state of the io_uring engine, if used */
+	struct iou_worker *iou;
+};
+
+int io_worker_fd_register(struct gtp_daemon *d, struct io_worker_fd *iofd);
+void io_worker_fd_unregister(struct io_worker_fd *iofd);
+
+#ifdef HAVE_LIBURING
+bool iou_supported(void);
+int iou_worker_init(struct io_worker *iow);
+void iou_worker_stop(struct io_worker *iow);
+void *iou_worker_thread(void *arg);
+void iou_fd_register(struct io_worker *iow, struct io_worker_fd *iofd);
+void iou_fd_unregister(struct io_worker *iow, struct io_worker_fd *iofd);
+#endif
+
+
+/***********************************************************************
+ * Control-plane workers
+ ***********************************************************************/
+
+/* Slow control operations (creating a tun device in a netns, netlink round-trips, starting
+ * a program) are run by a pool of threads, so that the main thread keeps serving other
+ * requests meanwhile.  The work() of a job runs on a worker and must neither use talloc
+ * nor modify shared state; its done() runs on the main thread afterwards.  Jobs of the
+ * same strand run one after the other in the order of submission, each only after the
+ * done() of its predecessor; jobs without a strand in any order */
+
+/* default number of threads of the control-plane worker pool */
+#define DEFAULT_CTRL_WORKERS	4
+
+struct ctrl_pool;
+struct ctrl_job;
+
+typedef void (*ctrl_job_cb)(struct ctrl_job *job);
+
+/* a sequence of jobs operating on the same object (only used by the main thread) */
+struct ctrl_strand {
+	/* jobs waiting for the running one (struct ctrl_job) */
+	struct llist_head jobs;
+	/* is a job of the strand running, or its done() pending? */
+	bool busy;
+};
+
+struct ctrl_job {
+	/* entry in the strand or in a list of the pool */
+	struct llist_head list;
+	struct ctrl_strand *strand;
+	/* NULL for a barrier */
+	ctrl_job_cb work;
+	ctrl_job_cb done;
+};
+
+void ctrl_strand_init(struct ctrl_strand *s);
+int ctrl_job_submit(struct gtp_daemon *d, struct ctrl_strand *s, struct ctrl_job *job,
+		    ctrl_job_cb work, ctrl_job_cb done);
+int ctrl_barrier_submit(struct gtp_daemon *d, struct ctrl_job *job, ctrl_job_cb done);
+void ctrl_pool_drain(struct gtp_daemon *d);
 
 
 /***********************************************************************
@@ -46,6 +386,44 @@ int netdev_add_defaultroute(struct nl_sock *nlsk, int ifindex, uint8_t family);
  ***********************************************************************/
 
 struct gtp_daemon;
+struct gtp_ep_rx_batch;
+struct gtp_endpoint;
+
+/* size (log2) of the per-endpoint hash table of tunnels by Rx TEID */
+#define GTP_EP_TEID_HASH_BITS	16
+
+struct gtp_ep_rx_batch *gtp_ep_rx_batch_alloc(void *ctx, struct pkt_pool *pool, unsigned int size,
+					      bool gro);
+int gtp_ep_decap_lookup(struct gtp_endpoint *ep, const uint8_t *buf, unsigned int len,
+			unsigned int *tpdu_len);
+
+/* maximum number of SO_REUSEPORT sockets (+ threads) of one GTP endpoint */
+#define GTP_EP_MAX_WORKERS	64
+
+/* one SO_REUSEPORT socket of a GTP endpoint and its receive thread */
+struct gtp_endpoint_worker {
+	/* back-pointer to endpoint */
+	struct gtp_endpoint *ep;
+	/* index within ep->workers (and the SO_REUSEPORT group) */
+	unsigned int idx;
+
+	/* file descriptor */
+	int fd;
+
+	/* the thread handling Rx from the fd/socket */
+	pthread_t thread;
+	/* RCU read-side state of the thread */
+	struct rcu_reader rcu;
+	/* packet buffers of the thread for batched receive */
+	struct gtp_ep_rx_batch *rx_batch;
+
+	/* registration with the worker pool, used instead of the thread if enabled */
+	struct io_worker_fd iofd;
+	/* workers the thread dispatches the received datagrams to, if enabled */
+	struct dp_pipeline *pl;
+	/* busy polling state + statistics of the thread */
+	struct dp_busy_poll bp;
+};
 
 /* local UDP socket for GTP communication */
 struct gtp_endpoint {
@@ -55,17 +433,65 @@ struct gtp_endpoint {
 	struct gtp_daemon *d;
 	unsigned long use_count;
 
-	/* file descriptor */
+	/* file descriptor used for transmit (that of the first worker) */
 	int fd;
 
 	/* local IP:port */
 	struct sockaddr_storage bind_addr;
 	char *name;
 
-	/* the thread handling Rx from the fd/socket */
-	pthread_t thread;
+	/* may uplink packets be sent as UDP GSO trains on fd? */
+	bool tx_gso;
+	/* is UDP GRO enabled on fd? */
+	bool rx_gro;
+
+	/* sockets + receive threads; more than one share the port via SO_REUSEPORT */
+	struct gtp_endpoint_worker *workers;
+	unsigned int num_workers;
+
+	/* AF_XDP receive fast path, if enabled */
+	struct gtp_ep_xdp *xdp;
+	/* interface with the TC decap program attached on our behalf; 0 if none */
+	int tc_ifindex;
+	/* the kernel GTP device which took over fd; the kernel accepts only one per socket */
+	struct tun_device *kgtp_dev;
+
+	/* all tunnels terminating on this endpoint, hashed by Rx TEID */
+	DECLARE_HASHTABLE(tunnels_by_rx_teid, GTP_EP_TEID_HASH_BITS);
+
+	/* remote GTP peers of the tunnels on this endpoint (struct gtp_peer) */
+	struct llist_head peers;
+	/* number of peers created so far, to name their threads */
+	unsigned int num_peers_created;
+};
+
+/* remote GTP peer, shared by all tunnels of one endpoint towards the same IP:port.  It owns
+ * a UDP socket bound to the IP:port of the endpoint (joining its SO_REUSEPORT group) and
+ * connected to the peer, so that the kernel resolves route + neighbour once rather than for
+ * every datagram, while the uplink still originates from the endpoint's port like that of
+ * the kernel GTP device and the TC encap program.  The kernel delivers the downlink of the
+ * peer to the connected socket, which is therefore read like a socket of the endpoint */
+struct gtp_peer {
+	/* entry in gtp_endpoint->peers */
+	struct llist_head list;
+	/* back-pointer to endpoint */
+	struct gtp_endpoint *ep;
+	unsigned long use_count;
+
+	/* remote IP:port */
+	struct sockaddr_storage addr;
+	/* the connected socket (w.fd) and its receive thread or pool registration.  w.fd is -1
+	 * next to a kernel GTP device, which only reads the socket of the endpoint; then the
+	 * uplink is sent via that one */
+	struct gtp_endpoint_worker w;
 };
 
+/* socket to send the uplink of a peer via; only that of the endpoint needs an address */
+static inline int gtp_peer_tx_fd(const struct gtp_peer *peer)
+{
+	return peer->w.fd >= 0 ? peer->w.fd : peer->ep->fd;
+}
+
 
 struct gtp_endpoint *
 gtp_endpoint_find_or_create(struct gtp_daemon *d, const struct sockaddr_storage *bind_addr);
@@ -74,30 +500,107 @@ struct gtp_endpoint *
 _gtp_endpoint_find(struct gtp_daemon *d, const struct sockaddr_storage *bind_addr);
 
 void _gtp_endpoint_deref_destroy(struct gtp_endpoint *ep);
+void gtp_endpoint_deref_destroy(struct gtp_endpoint *ep);
+
+int gtp_ep_xdp_start(struct gtp_endpoint *ep);
+void gtp_ep_xdp_stop(struct gtp_endpoint *ep);
 
 bool _gtp_endpoint_release(struct gtp_endpoint *ep);
 
 bool gtp_endpoint_release(struct gtp_endpoint *ep);
 
+struct gtp_peer *
+gtp_peer_find_or_create(struct gtp_endpoint *ep, const struct sockaddr_storage *addr, bool kgtp);
+
+void _gtp_peer_release(struct gtp_peer *peer);
+
+void gtp_peer_release(struct gtp_peer *peer);
+
+bool gtp_endpoint_has_peer_sockets(const struct gtp_endpoint *ep);
 
 
 /***********************************************************************
  * TUN Device
  ***********************************************************************/
 
+struct tun_tx_batch;
+struct tun_device;
+
+struct tun_tx_batch *tun_tx_batch_alloc(void *ctx, struct pkt_pool *pool, unsigned int size);
+const struct gtp_peer *tun_encap_lookup(struct tun_device *tun, const uint8_t *pkt,
+					unsigned int len, struct gtp1_header *gtph);
+
+/* size (log2) of the per-tun hash table of tunnels by end user address */
+#define TUN_EUA_HASH_BITS	10
+
+/* maximum number of queues of a tun device (MAX_TAP_QUEUES of the kernel) */
+#define TUN_MAX_QUEUES		256
+
+/* one queue of a (multi-queue) tun device */
+struct tun_queue {
+	/* back-pointer to tun device */
+	struct tun_device *tun;
+	/* index within tun->queues */
+	unsigned int idx;
+
+	/* file descriptor */
+	int fd;
+
+	/* the thread handling Rx from the fd */
+	pthread_t thread;
+	/* RCU read-side state of the thread */
+	struct rcu_reader rcu;
+	/* packet buffers of the thread for batched transmit */
+	struct tun_tx_batch *tx_batch;
+
+	/* registration with the worker pool, used instead of the thread if enabled */
+	struct io_worker_fd iofd;
+	/* workers the thread dispatches the packets read to, if enabled */
+	struct dp_pipeline *pl;
+	/* busy polling state + statistics of the thread */
+	struct dp_busy_poll bp;
+	/* UDP GSO was rejected at runtime, don't try again on this queue.  Set by whichever
+	 * thread sends for it; a lost update only costs another rejected send */
+	bool gso_failed;
+};
+
+enum tun_device_state {
+	/* being created by a control worker */
+	TUN_S_OPENING,
+	TUN_S_READY,
+	/* creation failed; no longer in the global list, waiting for its users to let go */
+	TUN_S_FAILED,
+};
+
 struct tun_device {
 	/* entry in global list */
 	struct llist_head list;
 	/* back-pointer to daemon */
 	struct gtp_daemon *d;
 	unsigned long use_count;
+	enum tun_device_state state;
+
+	/* control worker jobs using the device (netlink socket, netns) */
+	struct ctrl_strand strand;
+	/* creation of the device by a control worker, and its result */
+	struct ctrl_job open_job;
+	int open_rc;
 
 	/* which device we refer to */
 	const char *devname;
 	int ifindex;
 
-	/* file descriptor */
-	int fd;
+	/* file descriptors + reader threads; more than one for IFF_MULTI_QUEUE */
+	struct tun_queue *queues;
+	unsigned int num_queues;
+
+	/* if set, this is a kernel GTP device encapsulating via the socket of that endpoint
+	 * instead of a tun device, and has no queues */
+	struct gtp_endpoint *kgtp_ep;
+	/* is the TC encap program attached?  Via the TCX link tc_encap_link_fd, or as cls_bpf
+	 * filter if that is -1 */
+	bool tc_encap;
+	int tc_encap_link_fd;
 
 	/* network namespace */
 	const char *netns_name;
@@ -108,12 +611,24 @@ struct tun_device {
 
 	/* list of local addresses? or simply only have the kernel know thses? */
 
-	/* the thread handling Rx from the tun fd */
-	pthread_t thread;
+	/* all tunnels using this device, hashed by end user address */
+	DECLARE_HASHTABLE(tunnels_by_eua, TUN_EUA_HASH_BITS);
 };
 
 struct tun_device *
-tun_device_find_or_create(struct gtp_daemon *d, const char *devname, const char *netns_name);
+tun_device_find_or_create(struct gtp_daemon *d, const char *devname, const char *netns_name,
+			  unsigned int num_queues, struct gtp_endpoint *kgtp_ep);
+
+struct tun_device *
+tun_device_find_or_create_async(struct gtp_daemon *d, const char *devname, const char *netns_name,
+				unsigned int num_queues, struct gtp_endpoint *kgtp_ep);
+void tun_device_get(struct tun_device *tun);
+
+/* is the device usable?  Only meaningful for jobs of its strand, or once no job is pending */
+static inline bool tun_device_ready(const struct tun_device *tun)
+{
+	return tun->state == TUN_S_READY;
+}
 
 struct tun_device *
 tun_device_find_netns(struct gtp_daemon *d, const char *netns_name);
@@ -143,8 +658,12 @@ bool tun_device_release(struct tun_device *tun);
  */
 
 struct gtp_tunnel {
-	/* entry in global list / hash table */
+	/* entry in global list */
 	struct llist_head list;
+	/* entry in gtp_ep->tunnels_by_rx_teid */
+	struct hlist_node rx_teid_node;
+	/* entry in tun_dev->tunnels_by_eua */
+	struct hlist_node eua_node;
 	/* back-pointer to daemon */
 	struct gtp_daemon *d;
 
@@ -163,8 +682,13 @@ struct gtp_tunnel {
 	/* End user Address (inner IP) */
 	struct sockaddr_storage	user_addr;
 
-	/* Remote UDP IP/Port*/
-	struct sockaddr_storage remote_udp;
+	/* the remote GTP peer (Remote UDP IP/Port), whose socket we transmit via */
+	struct gtp_peer *peer;
+	/* GTP header of uplink packets, complete but for the length */
+	struct gtp1_header tx_hdr;
+
+	/* is the tunnel installed in the maps of the TC eBPF offload? */
+	bool tc_offload;
 
 	/* TODO: Filter */
 };
@@ -192,11 +716,38 @@ struct gtp_tunnel_params {
 	/* local TUN device name (used to lookup/create local tun) */
 	const char *tun_name;
         const char *tun_netns_name;
+	/* number of queues when creating the tun device (0: configured default) */
+	unsigned int tun_num_queues;
 };
-struct gtp_tunnel *gtp_tunnel_alloc(struct gtp_daemon *d, const struct gtp_tunnel_params *cpars);
-
+/* called on completion of an asynchronous tunnel operation, with 0 or negative on error */
+typedef void (*gtp_tunnel_op_cb)(int rc, void *priv);
+int gtp_tunnel_alloc_async(struct gtp_daemon *d, const struct gtp_tunnel_params *cpars,
+			   gtp_tunnel_op_cb cb, void *priv);
+int gtp_tunnel_alloc_bulk_async(struct gtp_daemon *d, const struct gtp_tunnel_params **cpars,
+				unsigned int n, bool *created, gtp_tunnel_op_cb cb, void *priv);
+
+void gtp_tunnel_del_user_addr(struct gtp_tunnel *t);
+
+/* TC eBPF offload */
+struct tc_bpf;
+int tc_bpf_ep_attach(struct gtp_endpoint *ep);
+void tc_bpf_ep_detach(struct gtp_endpoint *ep);
+int tc_bpf_tun_attach(struct tun_device *tun);
+void tc_bpf_tun_detach(struct tun_device *tun);
+void tc_bpf_tunnel_add(struct gtp_tunnel *t);
+void tc_bpf_tunnel_del(struct gtp_tunnel *t);
 void _gtp_tunnel_destroy(struct gtp_tunnel *t);
-bool gtp_tunnel_destroy(struct gtp_daemon *d, const struct sockaddr_storage *bind_addr, uint32_t rx_teid);
+int gtp_tunnel_destroy_async(struct gtp_daemon *d, const struct sockaddr_storage *bind_addr,
+			     uint32_t rx_teid, gtp_tunnel_op_cb cb, void *priv);
+
+/* identification of a tunnel: local GTP/UDP IP+Port and Rx TEID */
+struct gtp_tunnel_id {
+	struct sockaddr_storage local_udp;
+	uint32_t rx_teid;
+};
+int gtp_tunnel_destroy_bulk_async(struct gtp_daemon *d, const struct gtp_tunnel_id *ids,
+				  unsigned int n, bool *destroyed, gtp_tunnel_op_cb cb, void *priv);
+int gtp_tunnel_destroy_all_async(struct gtp_daemon *d, gtp_tunnel_op_cb cb, void *priv);
 
 
 /***********************************************************************
@@ -205,6 +756,13 @@ bool gtp_tunnel_destroy(struct gtp_daemon *d, const struct sockaddr_storage *bin
 
 #define UECUPS_SCTP_PORT	4268
 
+/* default number of packets received per recvmmsg() call of a GTP endpoint */
+#define DEFAULT_RX_BATCH_SIZE	32
+/* default number of packets read from a tun device before flushing via sendmmsg() */
+#define DEFAULT_TX_BATCH_SIZE	32
+/* default limit of the size of one packet buffer pool in MiB; 0 for none */
+#define DEFAULT_PKT_POOL_MAX_MB	0
+
 struct osmo_signalfd;
 
 struct gtp_daemon {
@@ -213,8 +771,28 @@ struct gtp_daemon {
 	struct llist_head tun_devices;
 	struct llist_head gtp_tunnels;
 	struct llist_head subprocesses;
-	/* lock protecting all of the above lists */
+	/* subprocesses terminated while programs are being started by the control workers, as
+	 * they may be one of those; only kept while num_subprocesses_starting != 0 */
+	struct llist_head subprocesses_exited;
+	unsigned int num_subprocesses_starting;
+	/* tunnels being created by the control workers, not published yet */
+	struct llist_head gtp_tunnels_pending;
+	/* lock serializing modifications of the above lists (and readers on the main thread);
+	 * the data-plane threads don't take it, but look up tunnels under RCU */
 	pthread_rwlock_t rwlock;
+	/* RCU domain of the data-plane threads */
+	struct rcu_domain rcu;
+	/* worker pool; started on first use if cfg.num_io_workers != 0 */
+	struct io_worker *io_workers;
+	unsigned int num_io_workers;
+	/* packet buffer pools (struct pkt_pool), one per NUMA node in use */
+	struct llist_head pkt_pools;
+	/* all threads started via dp_thread_create() */
+	struct llist_head dp_threads;
+	/* TC eBPF offload; set up on first use if cfg.tc_bpf */
+	struct tc_bpf *tc_bpf;
+	/* control-plane worker pool; started on first use */
+	struct ctrl_pool *ctrl_pool;
 	/* main thread ID */
 	pthread_t main_thread;
 	/* client CUPS interface */
@@ -225,8 +803,59 @@ struct gtp_daemon {
 	struct {
 		char *cups_local_ip;
 		uint16_t cups_local_port;
+		/* number of threads of the control-plane worker pool; 0: run jobs inline */
+		unsigned int num_ctrl_workers;
+		/* maximum number of packets per recvmmsg() on a GTP endpoint */
+		unsigned int rx_batch_size;
+		/* maximum number of packets per sendmmsg() from a tun device */
+		unsigned int tx_batch_size;
+		/* use UDP GSO (UDP_SEGMENT) for uplink, if the kernel supports it */
+		bool tx_udp_gso;
+		/* use UDP GRO on GTP endpoint sockets, if the kernel supports it */
+		bool rx_udp_gro;
+		/* default number of queues of newly created tun devices */
+		unsigned int tun_num_queues;
+		/* number of SO_REUSEPORT sockets + threads of newly created GTP endpoints */
+		unsigned int ep_num_workers;
+		/* pin the GTP endpoint worker threads to one CPU each */
+		bool ep_worker_pinning;
+		/* number of threads in the worker pool; 0: one thread per socket/tun queue */
+		unsigned int num_io_workers;
+		/* let the worker pool use io_uring instead of epoll */
+		bool io_uring;
+		/* offload eligible tunnels to the kernel GTP driver */
+		bool kernel_gtp;
+		/* offload forwarding of new tunnels to TC eBPF programs */
+		bool tc_bpf;
+		/* receive GTP-U of newly created endpoints via AF_XDP */
+		bool af_xdp;
+		/* attach the XDP program in native (driver) instead of skb (generic) mode */
+		bool af_xdp_native;
+		/* number of NIC RX queues served via AF_XDP sockets */
+		unsigned int af_xdp_queues;
+		/* maximum size of each packet buffer pool in MiB */
+		unsigned int pkt_pool_max_mb;
+		/* back the packet buffer pools by huge pages, if available */
+		bool pkt_pool_hugepages;
+		/* number of pipeline workers per endpoint socket / tun queue; 0: none */
+		unsigned int pipeline_workers;
+		/* list of CPUs for the data-plane threads (e.g. "2-5,8"); NULL: all */
+		char *dp_cpus;
+		/* NUMA node for the data-plane threads + packet buffers; -1: any */
+		int numa_node;
+		/* SCHED_FIFO priority of the data-plane threads; 0: normal scheduling */
+		unsigned int rt_priority;
+		/* idle time [us] after which busy polling endpoint / tun threads sleep; 0: off */
+		unsigned int ep_busy_poll_us;
+		unsigned int tun_busy_poll_us;
 	} cfg;
 };
 extern struct gtp_daemon *g_daemon;
 
+/* the worker pool serves its fds itself, so the pipeline is only used without it */
+static inline bool dp_pipelined(const struct gtp_daemon *d)
+{
+	return d->cfg.pipeline_workers && !d->cfg.num_io_workers;
+}
+
 int gtpud_vty_init(void);
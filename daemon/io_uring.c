@@ -0,0 +1,500 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <netinet/udp.h>
+
+#include <pthread.h>
+#include <liburing.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/utils.h>
+
+#include "gtp.h"
+#include "internal.h"
+
+#ifndef UDP_GRO
+#define UDP_GRO		104
+#endif
+
+#define LOGIOW(iow, lvl, fmt, args ...) \
+	LOGP(DIOW, lvl, "worker%u: " fmt, (iow)->idx, ## args)
+
+/***********************************************************************
+ * io_uring engine of the I/O worker pool
+ ***********************************************************************/
+
+/* All fds of a worker receive via multishot operations into one ring of provided buffers.
+ * A buffer then stays in use until the write (decapsulation -> tun) or sendmsg
+ * (encapsulation -> GTP endpoint) referencing it has completed, after which it is handed
+ * back to the kernel.  So the same buffers are used for both directions. */
+
+/* number of entries of the submission queue; the completion queue has twice as many */
+#define IOU_SQ_ENTRIES		4096
+/* number of provided buffers (must be a power of 2) */
+#define IOU_NUM_BUFS		1024
+/* size of each buffer (of the packet pool); room for a GRO-coalesced datagram and the
+ * recvmsg() header */
+#define IOU_BUF_SIZE		PKT_BUF_DATA_LEN
+/* buffer group ID of the provided buffers */
+#define IOU_BGID		0
+
+/* The user_data of a SQE/CQE is either the pointer to a struct io_worker_fd (receive),
+ * or a buffer ID (transmit) or a constant, distinguished by the two least significant bits */
+#define IOU_UD_RECV		0
+#define IOU_UD_TX		1
+#define IOU_UD_CTRL		2
+#define IOU_UD_CANCEL		3
+#define IOU_UD_MASK		3
+#define IOU_UD_TX_BID(bid)	(((uint64_t)(bid) << 2) | IOU_UD_TX)
+
+/* transmit state of one provided buffer */
+struct iou_buf_op {
+	/* number of pending writes/sends referencing this buffer */
+	unsigned int refs;
+};
+
+struct iou_worker {
+	struct io_worker *iow;
+	struct io_uring ring;
+
+	/* provided buffers */
+	struct io_uring_buf_ring *br;
+	struct pkt_buf **bufs;
+	struct iou_buf_op *ops;
+	/* number of buffers handed back but not yet made visible to the kernel */
+	unsigned int num_recycled;
+
+	/* template for multishot recvmsg(), requesting the UDP GRO segment size */
+	struct msghdr recv_mh;
+
+	/* fds whose receive ran out of provided buffers (struct io_worker_fd) */
+	struct llist_head starved;
+
+	/* (un)registration requests from the main thread, signalled via eventfd */
+	pthread_mutex_t cmd_lock;
+	struct llist_head cmds;
+	int cmd_efd;
+	uint64_t cmd_efd_val;
+	/* signalled whenever an fd is done (see io_worker_fd->iou_done) */
+	pthread_cond_t cmd_cond;
+	/* the thread is asked to exit */
+	bool stop;
+};
+
+static struct io_uring_sqe *iou_get_sqe(struct iou_worker *iou)
+{
+	struct io_uring_sqe *sqe;
+
+	while (!(sqe = io_uring_get_sqe(&iou->ring))) {
+		/* submission queue full: flush it */
+		io_uring_submit(&iou->ring);
+	}
+	return sqe;
+}
+
+static inline uint8_t *iou_buf(struct iou_worker *iou, unsigned int bid)
+{
+	return pkt_buf_data(iou->bufs[bid]);
+}
+
+static void iou_buf_recycle(struct iou_worker *iou, unsigned int bid)
+{
+	io_uring_buf_ring_add(iou->br, iou_buf(iou, bid), IOU_BUF_SIZE, bid,
+			      io_uring_buf_ring_mask(IOU_NUM_BUFS), iou->num_recycled++);
+}
+
+static void iou_buf_put(struct iou_worker *iou, unsigned int bid)
+{
+	if (--iou->ops[bid].refs == 0)
+		iou_buf_recycle(iou, bid);
+}
+
+static void iou_arm_recv(struct iou_worker *iou, struct io_worker_fd *iofd)
+{
+	struct io_uring_sqe *sqe = iou_get_sqe(iou);
+
+	if (iofd->type == IO_WORKER_FD_GTP_EP)
+		io_uring_prep_recvmsg_multishot(sqe, iofd->fd, &iou->recv_mh, 0);
+	else
+		io_uring_prep_read_multishot(sqe, iofd->fd, 0, 0, IOU_BGID);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = IOU_BGID;
+	io_uring_sqe_set_data64(sqe, (uintptr_t) iofd | IOU_UD_RECV);
+}
+
+static void iou_arm_ctrl(struct iou_worker *iou)
+{
+	struct io_uring_sqe *sqe = iou_get_sqe(iou);
+
+	io_uring_prep_read(sqe, iou->cmd_efd, &iou->cmd_efd_val, sizeof(iou->cmd_efd_val), 0);
+	io_uring_sqe_set_data64(sqe, IOU_UD_CTRL);
+}
+
+/* CMD_LOCKED let the main thread know iofd is done */
+static void _iou_fd_done(struct iou_worker *iou, struct io_worker_fd *iofd)
+{
+	iofd->iou_done = true;
+	pthread_cond_broadcast(&iou->cmd_cond);
+}
+
+/* process (un)registration requests of the main thread; returns whether to exit */
+static bool iou_handle_cmds(struct iou_worker *iou)
+{
+	struct io_worker_fd *iofd, *iofd2;
+	struct io_uring_sqe *sqe;
+	bool stop;
+
+	pthread_mutex_lock(&iou->cmd_lock);
+	llist_for_each_entry_safe(iofd, iofd2, &iou->cmds, iou_cmd) {
+		llist_del(&iofd->iou_cmd);
+		if (!iofd->iou_del) {
+			iou_arm_recv(iou, iofd);
+			continue;
+		}
+		if (!llist_empty(&iofd->iou_starved)) {
+			/* no receive operation to cancel */
+			llist_del_init(&iofd->iou_starved);
+			_iou_fd_done(iou, iofd);
+			continue;
+		}
+		/* the final completion of the multishot operation tells when we're done */
+		iofd->iou_cancelled = true;
+		sqe = iou_get_sqe(iou);
+		io_uring_prep_cancel64(sqe, (uintptr_t) iofd | IOU_UD_RECV, 0);
+		io_uring_sqe_set_data64(sqe, IOU_UD_CANCEL);
+	}
+	stop = iou->stop;
+	pthread_mutex_unlock(&iou->cmd_lock);
+
+	return stop;
+}
+
+/* re-arm the receive of all fds that ran out of buffers, once some have been returned */
+static void iou_rearm_starved(struct iou_worker *iou)
+{
+	struct io_worker_fd *iofd, *iofd2;
+
+	llist_for_each_entry_safe(iofd, iofd2, &iou->starved, iou_starved) {
+		llist_del_init(&iofd->iou_starved);
+		iou_arm_recv(iou, iofd);
+	}
+}
+
+/* decapsulate a datagram received on a GTP endpoint; GRO may have coalesced several */
+static void iou_rx_gtp(struct iou_worker *iou, struct io_worker_fd *iofd, unsigned int bid, int len)
+{
+	struct gtp_endpoint_worker *w = iofd->data;
+	struct io_uring_recvmsg_out *out;
+	struct iou_buf_op *op = &iou->ops[bid];
+	struct cmsghdr *cmsg;
+	unsigned int plen, seg_size, offset, tpdu_len;
+	uint8_t *payload;
+	int outfd;
+
+	out = io_uring_recvmsg_validate(iou_buf(iou, bid), len, &iou->recv_mh);
+	if (!out || (out->flags & MSG_TRUNC))
+		goto out_put;
+	payload = io_uring_recvmsg_payload(out, &iou->recv_mh);
+	plen = io_uring_recvmsg_payload_length(out, len, &iou->recv_mh);
+
+	seg_size = plen;
+	for (cmsg = io_uring_recvmsg_cmsg_firsthdr(out, &iou->recv_mh); cmsg;
+	     cmsg = io_uring_recvmsg_cmsg_nexthdr(out, &iou->recv_mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO &&
+		    *(int *) CMSG_DATA(cmsg) > 0)
+			seg_size = *(int *) CMSG_DATA(cmsg);
+	}
+
+	for (offset = 0; offset < plen; offset += seg_size) {
+		struct io_uring_sqe *sqe;
+		uint8_t *seg = payload + offset;
+
+		outfd = gtp_ep_decap_lookup(w->ep, seg, OSMO_MIN(seg_size, plen - offset), &tpdu_len);
+		if (outfd < 0)
+			continue;
+		sqe = iou_get_sqe(iou);
+		io_uring_prep_write(sqe, outfd, seg + sizeof(struct gtp1_header), tpdu_len, 0);
+		io_uring_sqe_set_data64(sqe, IOU_UD_TX_BID(bid));
+		op->refs++;
+	}
+
+out_put:
+	iou_buf_put(iou, bid);
+}
+
+/* encapsulate a packet read from a tun queue; the GTP header goes into the headroom of the
+ * buffer, in front of the packet */
+static void iou_rx_tun(struct iou_worker *iou, struct io_worker_fd *iofd, unsigned int bid, int len)
+{
+	struct tun_queue *q = iofd->data;
+	struct iou_buf_op *op = &iou->ops[bid];
+	struct gtp1_header *gtph = (struct gtp1_header *) (iou_buf(iou, bid) - sizeof(*gtph));
+	const struct gtp_peer *peer;
+	struct io_uring_sqe *sqe;
+
+	peer = tun_encap_lookup(q->tun, iou_buf(iou, bid), len, gtph);
+	if (peer) {
+		sqe = iou_get_sqe(iou);
+		io_uring_prep_send(sqe, gtp_peer_tx_fd(peer), gtph, sizeof(*gtph) + len, 0);
+		/* only for the socket of the endpoint.  Copied while submitting, which happens
+		 * before the next grace period */
+		if (peer->w.fd < 0)
+			io_uring_prep_send_set_addr(sqe, (const struct sockaddr *) &peer->addr,
+						    sizeof(peer->addr));
+		io_uring_sqe_set_data64(sqe, IOU_UD_TX_BID(bid));
+		op->refs++;
+	}
+	iou_buf_put(iou, bid);
+}
+
+static void iou_handle_recv_cqe(struct iou_worker *iou, struct io_uring_cqe *cqe)
+{
+	struct io_worker_fd *iofd = (struct io_worker_fd *) (uintptr_t) (cqe->user_data & ~IOU_UD_MASK);
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		/* the reference of the receive operation */
+		iou->ops[bid].refs = 1;
+		if (cqe->res <= 0)
+			iou_buf_put(iou, bid);
+		else if (iofd->type == IO_WORKER_FD_GTP_EP)
+			iou_rx_gtp(iou, iofd, bid, cqe->res);
+		else
+			iou_rx_tun(iou, iofd, bid, cqe->res);
+	}
+
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+
+	/* the multishot operation has terminated: cancelled, or out of buffers */
+	if (iofd->iou_cancelled) {
+		pthread_mutex_lock(&iou->cmd_lock);
+		_iou_fd_done(iou, iofd);
+		pthread_mutex_unlock(&iou->cmd_lock);
+		return;
+	}
+	if (cqe->res == -ENOBUFS) {
+		/* re-arming right away would only fail again until buffers are returned */
+		llist_add_tail(&iofd->iou_starved, &iou->starved);
+		return;
+	}
+	if (cqe->res < 0)
+		LOGIOW(iou->iow, LOGL_ERROR, "Receive on fd %d terminated: %s\n", iofd->fd,
+			strerror(-cqe->res));
+	iou_arm_recv(iou, iofd);
+}
+
+void *iou_worker_thread(void *arg)
+{
+	struct io_worker *iow = (struct io_worker *)arg;
+	struct iou_worker *iou = iow->iou;
+	bool stop = false;
+
+	rcu_register_thread(&iow->d->rcu, &iow->rcu);
+	pthread_cleanup_push(rcu_unregister_thread, &iow->rcu);
+	rcu_thread_online(&iow->rcu);
+
+	iou_arm_ctrl(iou);
+
+	while (!stop) {
+		struct io_uring_cqe *cqe;
+		unsigned int head, n = 0;
+
+		io_uring_for_each_cqe(&iou->ring, head, cqe) {
+			n++;
+			switch (cqe->user_data & IOU_UD_MASK) {
+			case IOU_UD_RECV:
+				iou_handle_recv_cqe(iou, cqe);
+				break;
+			case IOU_UD_TX:
+				if (cqe->res < 0)
+					LOGIOW(iow, LOGL_NOTICE, "Error transmitting packet: %s\n",
+						strerror(-cqe->res));
+				iou_buf_put(iou, cqe->user_data >> 2);
+				break;
+			case IOU_UD_CTRL:
+				stop = iou_handle_cmds(iou);
+				iou_arm_ctrl(iou);
+				break;
+			case IOU_UD_CANCEL:
+				/* see the final completion of the receive operation instead */
+				break;
+			}
+		}
+		io_uring_cq_advance(&iou->ring, n);
+
+		if (iou->num_recycled) {
+			io_uring_buf_ring_advance(iou->br, iou->num_recycled);
+			iou->num_recycled = 0;
+			iou_rearm_starved(iou);
+		}
+
+		/* Submit while still online, as the kernel resolves the fds of the new operations
+		 * during submission; after a grace period, they may have been closed */
+		io_uring_submit(&iou->ring);
+		rcu_quiescent_state(&iow->rcu);
+
+		if (!n) {
+			rcu_thread_offline(&iow->rcu);
+			io_uring_wait_cqe(&iou->ring, &cqe);
+			rcu_thread_online(&iow->rcu);
+		}
+	}
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/* whether the kernel supports the operations used; multishot read needs Linux 6.7 */
+bool iou_supported(void)
+{
+	struct io_uring_probe *probe = io_uring_get_probe();
+	bool supported;
+
+	if (!probe)
+		return false;
+	supported = io_uring_opcode_supported(probe, IORING_OP_READ_MULTISHOT) &&
+		    io_uring_opcode_supported(probe, IORING_OP_RECVMSG);
+	io_uring_free_probe(probe);
+
+	return supported;
+}
+
+static int iou_worker_destructor(struct iou_worker *iou)
+{
+	io_uring_queue_exit(&iou->ring);
+	close(iou->cmd_efd);
+	if (iou->bufs)
+		pkt_pool_free_bulk(iou->bufs, IOU_NUM_BUFS);
+	return 0;
+}
+
+/* set up the io_uring engine of a worker (from the main thread) */
+int iou_worker_init(struct io_worker *iow)
+{
+	struct io_uring_params params = {
+		.flags = IORING_SETUP_CQSIZE,
+		.cq_entries = 2 * IOU_SQ_ENTRIES,
+	};
+	struct iou_worker *iou;
+	struct pkt_pool *pool;
+	unsigned int i;
+	int rc;
+
+	iou = talloc_zero(iow->d->io_workers, struct iou_worker);
+	if (!iou)
+		return -1;
+	iou->iow = iow;
+	iou->cmd_efd = -1;
+	pthread_mutex_init(&iou->cmd_lock, NULL);
+	pthread_cond_init(&iou->cmd_cond, NULL);
+	INIT_LLIST_HEAD(&iou->cmds);
+	INIT_LLIST_HEAD(&iou->starved);
+
+	rc = io_uring_queue_init_params(IOU_SQ_ENTRIES, &iou->ring, &params);
+	if (rc < 0) {
+		LOGIOW(iow, LOGL_ERROR, "Cannot set up io_uring: %s\n", strerror(-rc));
+		talloc_free(iou);
+		return -1;
+	}
+	talloc_set_destructor(iou, iou_worker_destructor);
+
+	iou->cmd_efd = eventfd(0, EFD_CLOEXEC);
+	iou->ops = talloc_zero_array(iou, struct iou_buf_op, IOU_NUM_BUFS);
+	pool = pkt_pool_get(iow->d, -1, PKT_BUF_DATA_LEN);
+	iou->bufs = talloc_zero_array(iou, struct pkt_buf *, IOU_NUM_BUFS);
+	if (iou->bufs && (!pool || pkt_pool_alloc_bulk(pool, iou->bufs, IOU_NUM_BUFS) < 0)) {
+		talloc_free(iou->bufs);
+		iou->bufs = NULL;
+	}
+	if (iou->cmd_efd < 0 || !iou->ops || !iou->bufs) {
+		LOGIOW(iow, LOGL_ERROR, "Cannot allocate io_uring resources\n");
+		goto err_free;
+	}
+
+	iou->br = io_uring_setup_buf_ring(&iou->ring, IOU_NUM_BUFS, IOU_BGID, 0, &rc);
+	if (!iou->br) {
+		LOGIOW(iow, LOGL_ERROR, "Cannot register provided buffer ring: %s\n", strerror(-rc));
+		goto err_free;
+	}
+	for (i = 0; i < IOU_NUM_BUFS; i++)
+		iou_buf_recycle(iou, i);
+	io_uring_buf_ring_advance(iou->br, iou->num_recycled);
+	iou->num_recycled = 0;
+
+	/* no source address; room for the UDP_GRO control message */
+	iou->recv_mh.msg_controllen = CMSG_SPACE(sizeof(int));
+
+	iow->iou = iou;
+	return 0;
+
+err_free:
+	talloc_free(iou);
+	return -1;
+}
+
+static void iou_post_cmd(struct iou_worker *iou)
+{
+	uint64_t val = 1;
+
+	if (write(iou->cmd_efd, &val, sizeof(val)) < 0)
+		LOGIOW(iou->iow, LOGL_ERROR, "Cannot signal worker: %s\n", strerror(errno));
+}
+
+/* ask the worker thread to exit and wait for it; unlike epoll_wait(), io_uring_enter() is
+ * no cancellation point */
+void iou_worker_stop(struct io_worker *iow)
+{
+	struct iou_worker *iou = iow->iou;
+
+	pthread_mutex_lock(&iou->cmd_lock);
+	iou->stop = true;
+	pthread_mutex_unlock(&iou->cmd_lock);
+	iou_post_cmd(iou);
+	dp_thread_join(iow->d, iow->thread);
+}
+
+void iou_fd_register(struct io_worker *iow, struct io_worker_fd *iofd)
+{
+	struct iou_worker *iou = iow->iou;
+
+	iofd->iou_del = false;
+	iofd->iou_cancelled = false;
+	INIT_LLIST_HEAD(&iofd->iou_starved);
+	iofd->iou_done = false;
+	pthread_mutex_lock(&iou->cmd_lock);
+	llist_add_tail(&iofd->iou_cmd, &iou->cmds);
+	pthread_mutex_unlock(&iou->cmd_lock);
+	iou_post_cmd(iou);
+}
+
+/* cancel the receive operation of iofd and wait for its final completion */
+void iou_fd_unregister(struct io_worker *iow, struct io_worker_fd *iofd)
+{
+	struct iou_worker *iou = iow->iou;
+	struct io_worker_fd *pending;
+
+	pthread_mutex_lock(&iou->cmd_lock);
+	/* if the worker didn't even pick up the registration, we're done */
+	llist_for_each_entry(pending, &iou->cmds, iou_cmd) {
+		if (pending == iofd) {
+			llist_del(&iofd->iou_cmd);
+			pthread_mutex_unlock(&iou->cmd_lock);
+			return;
+		}
+	}
+	iofd->iou_del = true;
+	llist_add_tail(&iofd->iou_cmd, &iou->cmds);
+	iou_post_cmd(iou);
+
+	while (!iofd->iou_done)
+		pthread_cond_wait(&iou->cmd_cond, &iou->cmd_lock);
+	pthread_mutex_unlock(&iou->cmd_lock);
+}
@@ -0,0 +1,222 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+#include <pthread.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/utils.h>
+
+#include "internal.h"
+
+#define LOGIOW(iow, lvl, fmt, args ...) \
+	LOGP(DIOW, lvl, "worker%u: " fmt, (iow)->idx, ## args)
+
+/* maximum number of events handled per epoll_wait() */
+#define IO_WORKER_MAX_EVENTS	64
+
+/***********************************************************************
+ * I/O worker pool
+ ***********************************************************************/
+
+static void *io_worker_thread(void *arg)
+{
+	struct io_worker *iow = (struct io_worker *)arg;
+	struct epoll_event ev[IO_WORKER_MAX_EVENTS];
+	struct pollfd pfd = { .fd = iow->epfd, .events = POLLIN };
+
+	rcu_register_thread(&iow->d->rcu, &iow->rcu);
+	pthread_cleanup_push(rcu_unregister_thread, &iow->rcu);
+	rcu_thread_online(&iow->rcu);
+
+	while (1) {
+		int i, n;
+
+		/* Events are only harvested while online: once an fd has been unregistered and
+		 * a grace period has passed, we cannot hold a stale event for it.  So we only
+		 * sleep (offline) in poll() on the epoll fd, which doesn't consume events */
+		n = epoll_wait(iow->epfd, ev, ARRAY_SIZE(ev), 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGIOW(iow, LOGL_FATAL, "Error in epoll_wait(): %s\n", strerror(errno));
+			exit(1);
+		}
+		if (n == 0) {
+			rcu_thread_offline(&iow->rcu);
+			poll(&pfd, 1, -1);
+			rcu_thread_online(&iow->rcu);
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct io_worker_fd *iofd = ev[i].data.ptr;
+			iofd->read_cb(iofd, iow);
+		}
+
+		/* we hold no references from the previous batch of events */
+		rcu_quiescent_state(&iow->rcu);
+	}
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/* set up the epoll engine of a worker */
+static int io_worker_epoll_init(struct io_worker *iow)
+{
+	struct gtp_daemon *d = iow->d;
+	struct pkt_pool *pool = pkt_pool_get(d, -1, PKT_BUF_DATA_LEN);
+
+	/* always with room for the GRO segment size, as endpoints created after 'rx-udp-gro'
+	 * has been enabled use it */
+	iow->rx_batch = gtp_ep_rx_batch_alloc(d->io_workers, pool, d->cfg.rx_batch_size, true);
+	iow->tx_batch = tun_tx_batch_alloc(d->io_workers, pool, d->cfg.tx_batch_size);
+	if (!iow->rx_batch || !iow->tx_batch) {
+		LOGIOW(iow, LOGL_ERROR, "Cannot allocate packet buffers\n");
+		return -1;
+	}
+	iow->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (iow->epfd < 0) {
+		LOGIOW(iow, LOGL_ERROR, "Cannot create epoll instance: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int io_workers_start(struct gtp_daemon *d)
+{
+	unsigned int num = d->cfg.num_io_workers;
+	void *(*thread_fn)(void *) = io_worker_thread;
+	bool use_iou = false;
+	char name[32];
+	unsigned int i;
+	int rc;
+
+#ifdef HAVE_LIBURING
+	if (d->cfg.io_uring && !(use_iou = iou_supported()))
+		LOGP(DIOW, LOGL_NOTICE, "Kernel lacks io_uring multishot read (Linux >= 6.7), "
+			"using epoll instead\n");
+#endif
+
+	d->io_workers = talloc_zero_array(d, struct io_worker, num);
+	if (!d->io_workers)
+		return -1;
+
+	for (i = 0; i < num; i++) {
+		struct io_worker *iow = &d->io_workers[i];
+
+		iow->d = d;
+		iow->idx = i;
+		iow->epfd = -1;
+#ifdef HAVE_LIBURING
+		if (use_iou) {
+			rc = iou_worker_init(iow);
+			thread_fn = iou_worker_thread;
+		} else
+#endif
+			rc = io_worker_epoll_init(iow);
+		if (rc < 0)
+			goto err_stop;
+		snprintf(name, sizeof(name), "io-worker/%u", i);
+		if (dp_thread_create(d, &iow->thread, name, -1, thread_fn, iow)) {
+			LOGIOW(iow, LOGL_ERROR, "Cannot start thread: %s\n", strerror(errno));
+			goto err_stop;
+		}
+	}
+	d->num_io_workers = num;
+	LOGP(DIOW, LOGL_INFO, "Started worker pool with %u thread(s) using %s\n", num,
+		use_iou ? "io_uring" : "epoll");
+
+	return 0;
+
+err_stop:
+	/* the resources of the engines are released together with d->io_workers */
+	if (d->io_workers[i].epfd >= 0)
+		close(d->io_workers[i].epfd);
+	while (i--) {
+#ifdef HAVE_LIBURING
+		if (d->io_workers[i].iou)
+			iou_worker_stop(&d->io_workers[i]);
+		else
+#endif
+		{
+			pthread_cancel(d->io_workers[i].thread);
+			dp_thread_join(d, d->io_workers[i].thread);
+		}
+		if (d->io_workers[i].epfd >= 0)
+			close(d->io_workers[i].epfd);
+	}
+	talloc_free(d->io_workers);
+	d->io_workers = NULL;
+	return -1;
+}
+
+/* let the least loaded worker of the pool serve iofd; starts the pool on first use */
+int io_worker_fd_register(struct gtp_daemon *d, struct io_worker_fd *iofd)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = iofd,
+	};
+	struct io_worker *iow = NULL;
+	unsigned int i;
+
+	/* talloc is not thread safe, all alloc/free must come from main thread */
+	ASSERT_MAIN_THREAD(d);
+
+	if (!d->io_workers && io_workers_start(d) < 0)
+		return -1;
+
+	for (i = 0; i < d->num_io_workers; i++) {
+		if (!iow || d->io_workers[i].num_fds < iow->num_fds)
+			iow = &d->io_workers[i];
+	}
+
+#ifdef HAVE_LIBURING
+	if (iow->iou) {
+		iou_fd_register(iow, iofd);
+		iofd->worker = iow;
+		iow->num_fds++;
+		return 0;
+	}
+#endif
+
+	if (epoll_ctl(iow->epfd, EPOLL_CTL_ADD, iofd->fd, &ev) < 0) {
+		LOGIOW(iow, LOGL_ERROR, "Cannot add fd %d: %s\n", iofd->fd, strerror(errno));
+		return -1;
+	}
+	iofd->worker = iow;
+	iow->num_fds++;
+
+	return 0;
+}
+
+/* stop serving iofd.  The worker may still be inside read_cb, so the caller must wait for an
+ * RCU grace period before closing the fd or releasing iofd */
+void io_worker_fd_unregister(struct io_worker_fd *iofd)
+{
+	struct io_worker *iow = iofd->worker;
+
+	if (!iow)
+		return;
+
+	ASSERT_MAIN_THREAD(iow->d);
+
+#ifdef HAVE_LIBURING
+	if (iow->iou)
+		iou_fd_unregister(iow, iofd);
+	else
+#endif
+	if (epoll_ctl(iow->epfd, EPOLL_CTL_DEL, iofd->fd, NULL) < 0)
+		LOGIOW(iow, LOGL_ERROR, "Cannot remove fd %d: %s\n", iofd->fd, strerror(errno));
+	iow->num_fds--;
+	iofd->worker = NULL;
+}
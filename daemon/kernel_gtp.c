@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libmnl/libmnl.h>
+#include <libgtpnl/gtp.h>
+#include <libgtpnl/gtpnl.h>
+
+#include "kernel_gtp.h"
+
+/***********************************************************************
+ * Kernel GTP driver
+ ***********************************************************************/
+
+/* The kernel device plays the SGSN role: uplink packets are matched by their source
+ * address (the MS address), downlink packets by TEID and then their destination address.
+ * PDP contexts are added by the control workers, so the generic netlink socket is shared
+ * under g_genl_lock */
+
+static pthread_mutex_t g_genl_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mnl_socket *g_genl;
+static int g_genl_id = -1;
+
+/* LOCKED */
+static int kgtp_genl_open(void)
+{
+	if (g_genl)
+		return 0;
+
+	g_genl = genl_socket_open();
+	if (!g_genl)
+		return -1;
+	g_genl_id = genl_lookup_family(g_genl, "gtp");
+	if (g_genl_id < 0) {
+		mnl_socket_close(g_genl);
+		g_genl = NULL;
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+/* create a GTP network device in the current netns, encapsulating via the GTPv1-U
+ * socket fd1 (which lives on in the default netns) */
+int kgtp_dev_create(const char *ifname, int fd1)
+{
+	return gtp_dev_create_sgsn(-1, ifname, -1, fd1);
+}
+
+static struct gtp_tunnel *kgtp_pdp_alloc(int netns_fd, int ifindex, uint32_t rx_teid)
+{
+	struct gtp_tunnel *pdp = gtp_tunnel_alloc();
+
+	if (!pdp)
+		return NULL;
+	if (netns_fd >= 0)
+		gtp_tunnel_set_ifns(pdp, netns_fd);
+	gtp_tunnel_set_ifidx(pdp, ifindex);
+	gtp_tunnel_set_version(pdp, 1);
+	gtp_tunnel_set_i_tei(pdp, rx_teid);
+	return pdp;
+}
+
+/* install a PDP context on the GTP device ifindex in netns_fd (-1: default netns) */
+int kgtp_pdp_add(int netns_fd, int ifindex, uint32_t rx_teid, uint32_t tx_teid,
+		 const struct in_addr *ms_addr, const struct in_addr *peer_addr)
+{
+	struct gtp_tunnel *pdp;
+	struct in_addr ms = *ms_addr, peer = *peer_addr;
+	int rc;
+
+	pdp = kgtp_pdp_alloc(netns_fd, ifindex, rx_teid);
+	if (!pdp)
+		return -1;
+	gtp_tunnel_set_o_tei(pdp, tx_teid);
+	gtp_tunnel_set_ms_ip4(pdp, &ms);
+	gtp_tunnel_set_sgsn_ip4(pdp, &peer);
+
+	pthread_mutex_lock(&g_genl_lock);
+	rc = kgtp_genl_open();
+	if (rc == 0)
+		rc = gtp_add_tunnel(g_genl_id, g_genl, pdp);
+	pthread_mutex_unlock(&g_genl_lock);
+	gtp_tunnel_free(pdp);
+	return rc;
+}
+
+/* remove the PDP context with the given Rx TEID from the GTP device */
+int kgtp_pdp_del(int netns_fd, int ifindex, uint32_t rx_teid)
+{
+	struct gtp_tunnel *pdp;
+	int rc;
+
+	pdp = kgtp_pdp_alloc(netns_fd, ifindex, rx_teid);
+	if (!pdp)
+		return -1;
+
+	pthread_mutex_lock(&g_genl_lock);
+	rc = kgtp_genl_open();
+	if (rc == 0)
+		rc = gtp_del_tunnel(g_genl_id, g_genl, pdp);
+	pthread_mutex_unlock(&g_genl_lock);
+	gtp_tunnel_free(pdp);
+	return rc;
+}
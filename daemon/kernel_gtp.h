@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+/* Offload of GTP tunnels to the Linux kernel GTP driver via libgtpnl.  This is kept apart
+ * from internal.h, as libgtpnl has its own struct gtp_tunnel and gtp_tunnel_alloc() */
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+int kgtp_dev_create(const char *ifname, int fd1);
+int kgtp_pdp_add(int netns_fd, int ifindex, uint32_t rx_teid, uint32_t tx_teid,
+		 const struct in_addr *ms_addr, const struct in_addr *peer_addr);
+int kgtp_pdp_del(int netns_fd, int ifindex, uint32_t rx_teid);
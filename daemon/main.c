@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -38,6 +39,7 @@
 #include "internal.h"
 #include "netns.h"
 #include "gtp.h"
+#include "uecups_bin.h"
 
 /***********************************************************************
  * Client (Contol/User Plane Separation) Socket
@@ -45,11 +47,20 @@
 
 #include <pwd.h>
 
-#define CUPS_MSGB_SIZE	1024
+/* initial size of the receive buffer of a client; it grows with the SCTP messages */
+#define CUPS_RX_BUF_SIZE	4096
+/* limit of one SCTP message received, which may contain several JSON documents */
+#define CUPS_RX_MAX_SIZE	(16 * 1024 * 1024)
 
 #define LOGCC(cc, lvl, fmt, args ...)	\
 	LOGP(DUECUPS, lvl, "%s: " fmt, (cc)->sockname, ## args)
 
+/* optional transaction ID of a request, echoed in the response(s) to it */
+struct cups_trans {
+	bool present;
+	uint32_t id;
+};
+
 struct cups_client {
 	/* member in daemon->cups_clients */
 	struct llist_head list;
@@ -58,15 +69,91 @@ struct cups_client {
 	/* client socket */
 	struct osmo_stream_srv *srv;
 	char sockname[OSMO_SOCK_NAME_MAXLEN];
+
+	/* reassembly of the SCTP message being received (until MSG_EOR) */
+	char *rx_buf;
+	size_t rx_len;
+
+	/* messages to transmit (struct cups_tx_msg), and a dup() of the socket to write them
+	 * to, as the msgb of osmo_stream_srv_send() is limited to 64k */
+	struct llist_head tx_queue;
+	struct osmo_fd tx_ofd;
+
+	/* encoding of the messages we send, as negotiated by set_encoding */
+	enum uecups_encoding enc;
+	/* binary messages are encoded here, and only copied if they need to be queued */
+	struct uecups_bin_buf tx_bin;
+
+	/* requests being completed by the control workers (struct cups_req) */
+	struct llist_head pending;
+	/* a request without transaction ID is among them: the responses to those must keep
+	 * the order of the requests, so everything received meanwhile waits in deferred
+	 * (struct cups_rx_defer) */
+	bool untagged_busy;
+	struct llist_head deferred;
+	/* in cups_client_resume() */
+	bool resuming;
+};
+
+/* the rest of a received SCTP message, not handled yet */
+struct cups_rx_defer {
+	/* entry in cups_client->deferred */
+	struct llist_head list;
+	size_t len;
+	char data[];
 };
 
+/* one message to transmit, as one SCTP message, waiting for the socket */
+struct cups_tx_msg {
+	/* entry in cups_client->tx_queue */
+	struct llist_head list;
+	void *data;
+	size_t len;
+};
+
+/* a request whose response is sent once the control workers have completed it; allocated
+ * from the daemon, as the client may be gone by then */
+struct cups_req {
+	/* member in cups_client->pending */
+	struct llist_head list;
+	/* client that sent the request; NULL once it is gone */
+	struct cups_client *cc;
+	struct cups_trans trans;
+};
+
+static void cups_client_resume(struct cups_client *cc);
+
+static void cups_req_init(struct cups_req *req, struct cups_client *cc, const struct cups_trans *tr)
+{
+	req->cc = cc;
+	req->trans = *tr;
+	llist_add_tail(&req->list, &cc->pending);
+	if (!tr->present)
+		cc->untagged_busy = true;
+}
+
+/* after the response has been sent */
+static void cups_req_fini(struct cups_req *req)
+{
+	/* a no-op if the client is gone */
+	llist_del(&req->list);
+	if (req->cc && !req->trans.present) {
+		req->cc->untagged_busy = false;
+		cups_client_resume(req->cc);
+	}
+}
+
 struct subprocess {
-	/* member in daemon->cups_clients */
+	/* member in daemon->subprocesses or daemon->subprocesses_exited */
 	struct llist_head list;
 	/* pointer to the client that started us */
 	struct cups_client *cups_client;
+	/* transaction ID of the start_program request */
+	struct cups_trans trans;
 	/* PID of the process */
 	pid_t pid;
+	/* exit status, if in daemon->subprocesses_exited */
+	int status;
 };
 
 /* kill the specified subprocess and forget about it */
@@ -77,48 +164,138 @@ static void subprocess_destroy(struct subprocess *p, int signal)
 	talloc_free(p);
 }
 
+/* write as many queued messages as the socket takes; wait for it to become writable if
+ * there are more */
+static void cups_client_tx_flush(struct cups_client *cc)
+{
+	struct cups_tx_msg *m, *m2;
+	int rc;
+
+	llist_for_each_entry_safe(m, m2, &cc->tx_queue, list) {
+		/* SCTP transmits each message as a whole, or not at all */
+		rc = send(cc->tx_ofd.fd, m->data, m->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				cc->tx_ofd.when |= OSMO_FD_WRITE;
+				return;
+			}
+			/* the read call-back will notice the connection is gone */
+			LOGCC(cc, LOGL_ERROR, "Error sending message: %s\n", strerror(errno));
+		}
+		llist_del(&m->list);
+		talloc_free(m);
+	}
+	cc->tx_ofd.when &= ~OSMO_FD_WRITE;
+}
+
+static int cups_client_tx_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	if (what & OSMO_FD_WRITE)
+		cups_client_tx_flush(ofd->data);
+	return 0;
+}
+
+/* Send one message to a given client/connection; data is copied only if the socket doesn't
+ * take it right away */
+static void cups_client_tx(struct cups_client *cc, const void *data, size_t len)
+{
+	struct cups_tx_msg *m;
+	int rc;
+
+	/* unless earlier messages are still waiting for the socket */
+	if (llist_empty(&cc->tx_queue)) {
+		rc = send(cc->tx_ofd.fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rc >= 0)
+			return;
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			/* the read call-back will notice the connection is gone */
+			LOGCC(cc, LOGL_ERROR, "Error sending message: %s\n", strerror(errno));
+			return;
+		}
+	}
+
+	m = talloc_zero(cc, struct cups_tx_msg);
+	if (!m)
+		return;
+	m->data = talloc_memdup(m, data, len);
+	if (!m->data) {
+		talloc_free(m);
+		return;
+	}
+	m->len = len;
+	llist_add_tail(&m->list, &cc->tx_queue);
+	cc->tx_ofd.when |= OSMO_FD_WRITE;
+}
+
 /* Send JSON to a given client/connection */
 static int cups_client_tx_json(struct cups_client *cc, json_t *jtx)
 {
-	struct msgb *msg = msgb_alloc(CUPS_MSGB_SIZE, "Tx JSON");
 	char *json_str = json_dumps(jtx, JSON_SORT_KEYS);
-	char *out;
-	int json_strlen;
 
 	json_decref(jtx);
 	if (!json_str) {
 		LOGCC(cc, LOGL_ERROR, "Error encoding JSON\n");
 		return 0;
 	}
-	json_strlen = strlen(json_str);
 
 	LOGCC(cc, LOGL_DEBUG, "JSON Tx '%s'\n", json_str);
-
-	if (json_strlen > msgb_tailroom(msg)) {
-		LOGCC(cc, LOGL_ERROR, "Not enough room for JSON in msgb\n");
-		free(json_str);
-		return 0;
-	}
-
-	out = (char *)msgb_put(msg, json_strlen);
-	memcpy(out, json_str, json_strlen);
+	cups_client_tx(cc, json_str, strlen(json_str));
 	free(json_str);
-	osmo_stream_srv_send(cc->srv, msg);
 
 	return 0;
 }
 
-static json_t *gen_uecups_result(const char *name, const char *res)
+/* Send the binary message encoded in cc->tx_bin */
+static void cups_client_tx_bin(struct cups_client *cc)
+{
+	size_t len = uecups_bin_enc_end(&cc->tx_bin);
+
+	LOGCC(cc, LOGL_DEBUG, "Binary Tx %s (%zu bytes)\n",
+	      get_value_string(uecups_msg_type_names, cc->tx_bin.data[1]), len);
+	cups_client_tx(cc, cc->tx_bin.data, len);
+}
+
+/* Begin a binary message, with the transaction ID of the request (if any) as first IE */
+static void cups_client_enc_begin(struct cups_client *cc, uint8_t msg_type, const struct cups_trans *tr)
+{
+	uecups_bin_enc_begin(&cc->tx_bin, msg_type);
+	if (tr->present)
+		uecups_bin_put_u32(&cc->tx_bin, UECUPS_IE_TRANS_ID, tr->id);
+}
+
+static void json_set_trans(json_t *jobj, const struct cups_trans *tr)
+{
+	if (tr->present)
+		json_object_set_new(jobj, "trans_id", json_integer(tr->id));
+}
+
+static json_t *gen_uecups_result(const char *name, const char *res, const struct cups_trans *tr)
 {
 	json_t *jres = json_object();
 	json_t *jret = json_object();
 
 	json_object_set_new(jres, "result", json_string(res));
+	json_set_trans(jres, tr);
 	json_object_set_new(jret, name, jres);
 
 	return jret;
 }
 
+/* Send a response carrying just a result, in the encoding of the client */
+static void cups_client_tx_result(struct cups_client *cc, uint8_t msg_type, enum uecups_result res,
+				  const struct cups_trans *tr)
+{
+	if (cc->enc == UECUPS_ENC_BINARY) {
+		cups_client_enc_begin(cc, msg_type, tr);
+		uecups_bin_put_u8(&cc->tx_bin, UECUPS_IE_RESULT, res);
+		cups_client_tx_bin(cc);
+		return;
+	}
+
+	cups_client_tx_json(cc, gen_uecups_result(get_value_string(uecups_msg_type_names, msg_type),
+						  get_value_string(uecups_result_names, res), tr));
+}
+
 static int parse_ep(struct sockaddr_storage *out, json_t *in)
 {
 	json_t *jaddr_type, *jport, *jip;
@@ -201,7 +378,7 @@ static int parse_create_tun(struct gtp_tunnel_params *out, json_t *ctun)
 {
 	json_t *jlocal_gtp_ep, *jremote_gtp_ep;
 	json_t *jrx_teid, *jtx_teid;
-	json_t *jtun_dev_name, *jtun_netns_name;
+	json_t *jtun_dev_name, *jtun_netns_name, *jtun_num_queues;
 	json_t *juser_addr, *juser_addr_type;
 	int rc;
 
@@ -250,16 +427,57 @@ static int parse_create_tun(struct gtp_tunnel_params *out, json_t *ctun)
 			return -EINVAL;
 		out->tun_netns_name = talloc_strdup(out, json_string_value(jtun_netns_name));
 	}
+	jtun_num_queues = json_object_get(ctun, "tun_num_queues");
+	if (jtun_num_queues) {
+		if (!json_is_integer(jtun_num_queues))
+			return -EINVAL;
+		if (json_integer_value(jtun_num_queues) < 1 ||
+		    json_integer_value(jtun_num_queues) > TUN_MAX_QUEUES)
+			return -EINVAL;
+		out->tun_num_queues = json_integer_value(jtun_num_queues);
+	}
 
 	return 0;
 }
 
 
-static int cups_client_handle_create_tun(struct cups_client *cc, json_t *ctun)
+static void cups_client_create_tun_done(int rc, void *priv)
+{
+	struct cups_req *req = priv;
+	struct cups_client *cc = req->cc;
+
+	if (cc && rc < 0) {
+		LOGCC(cc, LOGL_NOTICE, "Failed to allocate tunnel\n");
+		cups_client_tx_result(cc, UECUPS_MSGT_CREATE_TUN_RES, UECUPS_RES_ERR_NOT_FOUND, &req->trans);
+	} else if (cc) {
+		cups_client_tx_result(cc, UECUPS_MSGT_CREATE_TUN_RES, UECUPS_RES_OK, &req->trans);
+	}
+	cups_req_fini(req);
+	talloc_free(req);
+}
+
+/* the response is sent once the tunnel is created (or not), meanwhile other requests are
+ * served */
+static int cups_client_create_tun(struct cups_client *cc, const struct gtp_tunnel_params *tpars,
+				  const struct cups_trans *tr)
+{
+	struct cups_req *req = talloc_zero(cc->d, struct cups_req);
+	int rc;
+
+	if (!req)
+		return -ENOMEM;
+	cups_req_init(req, cc, tr);
+
+	rc = gtp_tunnel_alloc_async(g_daemon, tpars, cups_client_create_tun_done, req);
+	if (rc < 0)
+		cups_client_create_tun_done(rc, req);
+	return 0;
+}
+
+static int cups_client_handle_create_tun(struct cups_client *cc, json_t *ctun, const struct cups_trans *tr)
 {
 	int rc;
 	struct gtp_tunnel_params *tpars = talloc_zero(cc, struct gtp_tunnel_params);
-	struct gtp_tunnel *t;
 
 	rc = parse_create_tun(tpars, ctun);
 	if (rc < 0) {
@@ -267,25 +485,20 @@ static int cups_client_handle_create_tun(struct cups_client *cc, json_t *ctun)
 		return rc;
 	}
 
-	t = gtp_tunnel_alloc(g_daemon, tpars);
-	if (!t) {
-		LOGCC(cc, LOGL_NOTICE, "Failed to allocate tunnel\n");
-		cups_client_tx_json(cc, gen_uecups_result("create_tun_res", "ERR_NOT_FOUND"));
-	} else {
-		cups_client_tx_json(cc, gen_uecups_result("create_tun_res", "OK"));
-	}
+	rc = cups_client_create_tun(cc, tpars, tr);
 
 	talloc_free(tpars);
-	return 0;
+	return rc;
 }
 
-static int cups_client_handle_destroy_tun(struct cups_client *cc, json_t *dtun)
+static int parse_destroy_tun(struct gtp_tunnel_id *out, json_t *dtun)
 {
-	struct sockaddr_storage local_ep_addr;
 	json_t *jlocal_gtp_ep, *jrx_teid;
-	uint32_t rx_teid;
 	int rc;
 
+	if (!json_is_object(dtun))
+		return -EINVAL;
+
 	jlocal_gtp_ep = json_object_get(dtun, "local_gtp_ep");
 	jrx_teid = json_object_get(dtun, "rx_teid");
 
@@ -295,40 +508,328 @@ static int cups_client_handle_destroy_tun(struct cups_client *cc, json_t *dtun)
 	if (!json_is_object(jlocal_gtp_ep) || !json_is_integer(jrx_teid))
 		return -EINVAL;
 
-	rc = parse_ep(&local_ep_addr, jlocal_gtp_ep);
+	rc = parse_ep(&out->local_udp, jlocal_gtp_ep);
 	if (rc < 0)
 		return rc;
-	rx_teid = json_integer_value(jrx_teid);
+	out->rx_teid = json_integer_value(jrx_teid);
 
-	rc = gtp_tunnel_destroy(g_daemon, &local_ep_addr, rx_teid);
-	if (rc < 0) {
+	return 0;
+}
+
+static void cups_client_destroy_tun_done(int rc, void *priv)
+{
+	struct cups_req *req = priv;
+	struct cups_client *cc = req->cc;
+
+	if (cc && rc < 0) {
 		LOGCC(cc, LOGL_NOTICE, "Failed to destroy tunnel\n");
-		cups_client_tx_json(cc, gen_uecups_result("destroy_tun_res", "ERR_NOT_FOUND"));
-	} else {
-		cups_client_tx_json(cc, gen_uecups_result("destroy_tun_res", "OK"));
+		cups_client_tx_result(cc, UECUPS_MSGT_DESTROY_TUN_RES, UECUPS_RES_ERR_NOT_FOUND, &req->trans);
+	} else if (cc) {
+		cups_client_tx_result(cc, UECUPS_MSGT_DESTROY_TUN_RES, UECUPS_RES_OK, &req->trans);
 	}
+	cups_req_fini(req);
+	talloc_free(req);
+}
 
+static int cups_client_destroy_tun(struct cups_client *cc, const struct gtp_tunnel_id *id,
+				   const struct cups_trans *tr)
+{
+	struct cups_req *req = talloc_zero(cc->d, struct cups_req);
+	int rc;
+
+	if (!req)
+		return -ENOMEM;
+	cups_req_init(req, cc, tr);
+
+	rc = gtp_tunnel_destroy_async(g_daemon, &id->local_udp, id->rx_teid,
+				      cups_client_destroy_tun_done, req);
+	if (rc < 0)
+		cups_client_destroy_tun_done(rc, req);
 	return 0;
 }
 
-static json_t *gen_uecups_term_ind(pid_t pid, int status)
+static int cups_client_handle_destroy_tun(struct cups_client *cc, json_t *dtun, const struct cups_trans *tr)
 {
-	json_t *jterm = json_object();
-	json_t *jret = json_object();
+	struct gtp_tunnel_id id;
+	int rc;
+
+	rc = parse_destroy_tun(&id, dtun);
+	if (rc < 0)
+		return rc;
+
+	return cups_client_destroy_tun(cc, &id, tr);
+}
+
+/* Send the response to a batch request, with one result per tunnel */
+static void cups_client_tx_batch_result(struct cups_client *cc, uint8_t msg_type,
+					const uint8_t *results, unsigned int n, const struct cups_trans *tr)
+{
+	json_t *jret, *jresults;
+	unsigned int i, chunk;
+
+	if (cc->enc == UECUPS_ENC_BINARY) {
+		cups_client_enc_begin(cc, msg_type, tr);
+		uecups_bin_put_u8(&cc->tx_bin, UECUPS_IE_RESULT, UECUPS_RES_OK);
+		/* as many IEs as the 16 bit length requires */
+		for (i = 0; i < n; i += chunk) {
+			chunk = OSMO_MIN(n - i, UINT16_MAX);
+			uecups_bin_put_ie(&cc->tx_bin, UECUPS_IE_RESULT_LIST, results + i, chunk);
+		}
+		cups_client_tx_bin(cc);
+		return;
+	}
+
+	/* '{"<name>":{"result":"OK","results":["OK","ERR_NOT_FOUND",...]}}' */
+	jresults = json_array();
+	for (i = 0; i < n; i++)
+		json_array_append_new(jresults, json_string(get_value_string(uecups_result_names, results[i])));
+	jret = gen_uecups_result(get_value_string(uecups_msg_type_names, msg_type), "OK", tr);
+	json_object_set_new(json_object_get(jret, get_value_string(uecups_msg_type_names, msg_type)),
+			    "results", jresults);
+	cups_client_tx_json(cc, jret);
+}
+
+/* a batch of tunnels created or destroyed at once.  The bulk operation starts once the
+ * control workers are done with the requests before it (a barrier), and its netlink requests
+ * are then made by control workers, too */
+struct cups_batch_req {
+	struct cups_req req;
+	struct ctrl_job job;
+	unsigned int n;
+	/* creation: NULL entries were malformed */
+	const struct gtp_tunnel_params **tpars;
+	/* destruction: entries not valid were malformed */
+	const struct gtp_tunnel_id *ids;
+	const bool *valid;
+	/* per entry: created / destroyed */
+	bool *ok;
+};
+
+/* submit the barrier of a batch; its parameters are owned by ctx, which it takes over (also
+ * on error) */
+static int cups_batch_req_submit(struct cups_batch_req *br, struct cups_client *cc, void *ctx,
+				 const struct cups_trans *tr, ctrl_job_cb done)
+{
+	talloc_steal(br, ctx);
+	if (ctrl_barrier_submit(cc->d, &br->job, done) < 0) {
+		talloc_free(br);
+		return -ENOMEM;
+	}
+	cups_req_init(&br->req, cc, tr);
+	return 0;
+}
+
+/* send the result of a batch, once the bulk operation is done */
+static void cups_client_tun_batch_res(struct cups_batch_req *br, uint8_t msg_type, unsigned int num)
+{
+	struct cups_client *cc = br->req.cc;
+	unsigned int i, n = br->n;
+	uint8_t *results;
+	bool valid;
+
+	if (!cc)
+		return;
+	if (num < n)
+		LOGCC(cc, LOGL_NOTICE, "Failed to %s %u of %u tunnels\n",
+		      msg_type == UECUPS_MSGT_CREATE_TUN_BATCH_RES ? "allocate" : "destroy", n - num, n);
+
+	results = talloc_array(br, uint8_t, n);
+	if (!results) {
+		cups_client_tx_result(cc, msg_type, UECUPS_RES_ERR_INVALID_DATA, &br->req.trans);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		valid = br->tpars ? br->tpars[i] != NULL : br->valid[i];
+		if (!valid)
+			results[i] = UECUPS_RES_ERR_INVALID_DATA;
+		else if (!br->ok[i])
+			results[i] = UECUPS_RES_ERR_NOT_FOUND;
+		else
+			results[i] = UECUPS_RES_OK;
+	}
+	cups_client_tx_batch_result(cc, msg_type, results, n, &br->req.trans);
+}
+
+static void cups_client_create_tun_batch_res(int num, void *priv)
+{
+	struct cups_batch_req *br = priv;
+
+	cups_client_tun_batch_res(br, UECUPS_MSGT_CREATE_TUN_BATCH_RES, num);
+	cups_req_fini(&br->req);
+	talloc_free(br);
+}
+
+/* the barrier: start the bulk operation */
+static void cups_client_create_tun_batch_done(struct ctrl_job *job)
+{
+	struct cups_batch_req *br = container_of(job, struct cups_batch_req, job);
+
+	br->ok = talloc_array(br, bool, br->n);
+	if (br->ok && gtp_tunnel_alloc_bulk_async(g_daemon, br->tpars, br->n, br->ok,
+						  cups_client_create_tun_batch_res, br) == 0)
+		return;
+
+	if (br->req.cc)
+		cups_client_tx_result(br->req.cc, UECUPS_MSGT_CREATE_TUN_BATCH_RES,
+				      UECUPS_RES_ERR_INVALID_DATA, &br->req.trans);
+	cups_req_fini(&br->req);
+	talloc_free(br);
+}
+
+/* create a batch of tunnels at once, once the control workers are done with the requests
+ * before it; NULL entries of tpars were malformed.  tpars is owned by ctx, which is taken
+ * over (also on error) */
+static int cups_client_create_tun_batch(struct cups_client *cc, void *ctx,
+					const struct gtp_tunnel_params **tpars, unsigned int n,
+					const struct cups_trans *tr)
+{
+	struct cups_batch_req *br = talloc_zero(cc->d, struct cups_batch_req);
+
+	if (!br) {
+		talloc_free(ctx);
+		return -ENOMEM;
+	}
+	br->n = n;
+	br->tpars = tpars;
+
+	return cups_batch_req_submit(br, cc, ctx, tr, cups_client_create_tun_batch_done);
+}
+
+/* '{"create_tun_batch":{"tunnels":[<create_tun>, ...]}}'; all tunnels are created at once,
+ * with one result per tunnel in the response */
+static int cups_client_handle_create_tun_batch(struct cups_client *cc, json_t *cbatch,
+					       const struct cups_trans *tr)
+{
+	json_t *jtunnels = json_object_get(cbatch, "tunnels");
+	struct gtp_tunnel_params **tpars;
+	size_t i, n;
+
+	if (!json_is_array(jtunnels))
+		return -EINVAL;
+	n = json_array_size(jtunnels);
+
+	tpars = talloc_zero_array(cc, struct gtp_tunnel_params *, n);
+	if (!tpars)
+		return -ENOMEM;
+
+	/* malformed entries are reported individually */
+	for (i = 0; i < n; i++) {
+		tpars[i] = talloc_zero(tpars, struct gtp_tunnel_params);
+		if (tpars[i] && parse_create_tun(tpars[i], json_array_get(jtunnels, i)) < 0) {
+			talloc_free(tpars[i]);
+			tpars[i] = NULL;
+		}
+	}
+
+	return cups_client_create_tun_batch(cc, tpars, (const struct gtp_tunnel_params **) tpars, n, tr);
+}
+
+static void cups_client_destroy_tun_batch_res(int num, void *priv)
+{
+	struct cups_batch_req *br = priv;
+
+	cups_client_tun_batch_res(br, UECUPS_MSGT_DESTROY_TUN_BATCH_RES, num);
+	cups_req_fini(&br->req);
+	talloc_free(br);
+}
+
+/* the barrier: start the bulk operation */
+static void cups_client_destroy_tun_batch_done(struct ctrl_job *job)
+{
+	struct cups_batch_req *br = container_of(job, struct cups_batch_req, job);
+
+	br->ok = talloc_array(br, bool, br->n);
+	if (br->ok && gtp_tunnel_destroy_bulk_async(g_daemon, br->ids, br->n, br->ok,
+						    cups_client_destroy_tun_batch_res, br) == 0)
+		return;
+
+	if (br->req.cc)
+		cups_client_tx_result(br->req.cc, UECUPS_MSGT_DESTROY_TUN_BATCH_RES,
+				      UECUPS_RES_ERR_INVALID_DATA, &br->req.trans);
+	cups_req_fini(&br->req);
+	talloc_free(br);
+}
+
+/* destroy a batch of tunnels at once, once the control workers are done with the requests
+ * before it; entries not valid were malformed.  ids + valid are owned by ctx, which is
+ * taken over (also on error) */
+static int cups_client_destroy_tun_batch(struct cups_client *cc, void *ctx, const struct gtp_tunnel_id *ids,
+					 const bool *valid, unsigned int n, const struct cups_trans *tr)
+{
+	struct cups_batch_req *br = talloc_zero(cc->d, struct cups_batch_req);
+
+	if (!br) {
+		talloc_free(ctx);
+		return -ENOMEM;
+	}
+	br->n = n;
+	br->ids = ids;
+	br->valid = valid;
+
+	return cups_batch_req_submit(br, cc, ctx, tr, cups_client_destroy_tun_batch_done);
+}
+
+/* '{"destroy_tun_batch":{"tunnels":[<destroy_tun>, ...]}}'; all tunnels are destroyed at
+ * once, with one result per tunnel in the response */
+static int cups_client_handle_destroy_tun_batch(struct cups_client *cc, json_t *dbatch,
+						const struct cups_trans *tr)
+{
+	json_t *jtunnels = json_object_get(dbatch, "tunnels");
+	struct gtp_tunnel_id *ids;
+	bool *valid;
+	size_t i, n;
+
+	if (!json_is_array(jtunnels))
+		return -EINVAL;
+	n = json_array_size(jtunnels);
+
+	ids = talloc_zero_array(cc, struct gtp_tunnel_id, n);
+	valid = talloc_zero_array(ids, bool, n);
+	if (!ids || !valid) {
+		talloc_free(ids);
+		return -ENOMEM;
+	}
+
+	/* malformed entries are reported individually; their all-zero id matches no tunnel */
+	for (i = 0; i < n; i++) {
+		valid[i] = parse_destroy_tun(&ids[i], json_array_get(jtunnels, i)) == 0;
+		if (!valid[i])
+			memset(&ids[i], 0, sizeof(ids[i]));
+	}
+
+	return cups_client_destroy_tun_batch(cc, ids, ids, valid, n, tr);
+}
+
+static void cups_client_tx_term_ind(struct cups_client *cc, pid_t pid, int status,
+				    const struct cups_trans *tr)
+{
+	json_t *jterm, *jret;
+
+	if (cc->enc == UECUPS_ENC_BINARY) {
+		cups_client_enc_begin(cc, UECUPS_MSGT_PROGRAM_TERM_IND, tr);
+		uecups_bin_put_u32(&cc->tx_bin, UECUPS_IE_PID, pid);
+		uecups_bin_put_u32(&cc->tx_bin, UECUPS_IE_EXIT_CODE, status);
+		cups_client_tx_bin(cc);
+		return;
+	}
+
+	jterm = json_object();
+	jret = json_object();
 
 	json_object_set_new(jterm, "pid", json_integer(pid));
 	json_object_set_new(jterm, "exit_code", json_integer(status));
+	json_set_trans(jterm, tr);
 
 	json_object_set_new(jret, "program_term_ind", jterm);
 
-	return jret;
+	cups_client_tx_json(cc, jret);
 }
 
 
-static struct subprocess *subprocess_by_pid(struct gtp_daemon *d, pid_t pid)
+static struct subprocess *subprocess_by_pid(struct llist_head *list, pid_t pid)
 {
 	struct subprocess *sproc;
-	llist_for_each_entry(sproc, &d->subprocesses, list) {
+	llist_for_each_entry(sproc, list, list) {
 		if (sproc->pid == pid)
 			return sproc;
 	}
@@ -338,11 +839,20 @@ static struct subprocess *subprocess_by_pid(struct gtp_daemon *d, pid_t pid)
 static void child_terminated(struct gtp_daemon *d, int pid, int status)
 {
 	struct subprocess *sproc;
-	json_t *jterm_ind;
 
 	LOGP(DUECUPS, LOGL_DEBUG, "SIGCHLD receive from pid %u; status=%d\n", pid, status);
 
-	sproc = subprocess_by_pid(d, pid);
+	sproc = subprocess_by_pid(&d->subprocesses, pid);
+	if (!sproc && d->num_subprocesses_starting) {
+		/* possibly started by a control worker, and its start is not done yet */
+		sproc = talloc_zero(d, struct subprocess);
+		if (!sproc)
+			return;
+		sproc->pid = pid;
+		sproc->status = status;
+		llist_add_tail(&sproc->list, &d->subprocesses_exited);
+		return;
+	}
 	if (!sproc) {
 		LOGP(DUECUPS, LOGL_NOTICE, "subprocess %u terminated (status=%d) but we don't know it?\n",
 			pid, status);
@@ -350,11 +860,7 @@ static void child_terminated(struct gtp_daemon *d, int pid, int status)
 	}
 
 	/* generate prog_term_ind towards control plane */
-	jterm_ind = gen_uecups_term_ind(pid, status);
-	if (!jterm_ind)
-		return;
-
-	cups_client_tx_json(sproc->cups_client, jterm_ind);
+	cups_client_tx_term_ind(sproc->cups_client, pid, status, &sproc->trans);
 
 	llist_del(&sproc->list);
 	talloc_free(sproc);
@@ -382,22 +888,176 @@ static void sigchild_cb(struct osmo_signalfd *osfd, const struct signalfd_siginf
 
 }
 
-static json_t *gen_uecups_start_res(pid_t pid, const char *result)
+static void cups_client_tx_start_res(struct cups_client *cc, pid_t pid, enum uecups_result res,
+				     const struct cups_trans *tr)
 {
-	json_t *ret = gen_uecups_result("start_program_res", result);
-	json_object_set_new(json_object_get(ret, "start_program_res"), "pid", json_integer(pid));
+	json_t *jret;
+
+	if (cc->enc == UECUPS_ENC_BINARY) {
+		cups_client_enc_begin(cc, UECUPS_MSGT_START_PROGRAM_RES, tr);
+		uecups_bin_put_u8(&cc->tx_bin, UECUPS_IE_RESULT, res);
+		uecups_bin_put_u32(&cc->tx_bin, UECUPS_IE_PID, pid);
+		cups_client_tx_bin(cc);
+		return;
+	}
 
-	return ret;
+	jret = gen_uecups_result("start_program_res", get_value_string(uecups_result_names, res), tr);
+	json_object_set_new(json_object_get(jret, "start_program_res"), "pid", json_integer(pid));
+	cups_client_tx_json(cc, jret);
 }
 
-static int cups_client_handle_start_program(struct cups_client *cc, json_t *sprog)
+/* a program being started by a control worker, in the network namespace of a tun device */
+struct cups_start_req {
+	struct cups_req req;
+	struct ctrl_job job;
+	/* reference to the tun device whose netns to start it in, if any */
+	struct tun_device *tun;
+	char *cmd;
+	char *user;
+	char **addl_env;
+	/* PID, or negative on error */
+	int rc;
+};
+
+static void cups_client_start_program_work(struct ctrl_job *job)
+{
+	struct cups_start_req *sr = container_of(job, struct cups_start_req, job);
+	sigset_t oldmask;
+
+	if (sr->tun) {
+		/* its creation may have failed */
+		if (!tun_device_ready(sr->tun)) {
+			sr->rc = -ENODEV;
+			return;
+		}
+		if (switch_ns(sr->tun->netns_fd, &oldmask) < 0) {
+			sr->rc = -EIO;
+			return;
+		}
+	}
+
+	sr->rc = osmo_system_nowait2(sr->cmd, osmo_environment_whitelist, sr->addl_env, sr->user);
+
+	if (sr->tun) {
+		OSMO_ASSERT(restore_ns(&oldmask) == 0);
+	}
+}
+
+static void cups_client_start_program_done(struct ctrl_job *job)
+{
+	struct cups_start_req *sr = container_of(job, struct cups_start_req, job);
+	struct cups_client *cc = sr->req.cc;
+	struct gtp_daemon *d = g_daemon;
+	struct subprocess *sproc, *exited = NULL;
+
+	d->num_subprocesses_starting--;
+	if (sr->rc > 0)
+		exited = subprocess_by_pid(&d->subprocesses_exited, sr->rc);
+
+	if (sr->rc <= 0) {
+		if (cc)
+			cups_client_tx_start_res(cc, 0, UECUPS_RES_ERR_INVALID_DATA, &sr->req.trans);
+	} else if (!cc) {
+		/* like all subprocesses of a client that is gone */
+		if (!exited)
+			kill(sr->rc, SIGKILL);
+	} else if (exited) {
+		cups_client_tx_start_res(cc, sr->rc, UECUPS_RES_OK, &sr->req.trans);
+		cups_client_tx_term_ind(cc, sr->rc, exited->status, &sr->req.trans);
+	} else if ((sproc = talloc_zero(cc, struct subprocess))) {
+		/* create a record about the subprocess we started, so we can notify the
+		 * client that crated it upon termination */
+		sproc->cups_client = cc;
+		sproc->trans = sr->req.trans;
+		sproc->pid = sr->rc;
+		llist_add_tail(&sproc->list, &d->subprocesses);
+		cups_client_tx_start_res(cc, sproc->pid, UECUPS_RES_OK, &sr->req.trans);
+	} else {
+		kill(sr->rc, SIGKILL);
+		cups_client_tx_start_res(cc, 0, UECUPS_RES_ERR_INVALID_DATA, &sr->req.trans);
+	}
+
+	if (exited) {
+		llist_del(&exited->list);
+		talloc_free(exited);
+	}
+	/* the others terminated without having been started by us */
+	if (!d->num_subprocesses_starting) {
+		while (!llist_empty(&d->subprocesses_exited)) {
+			exited = llist_first_entry(&d->subprocesses_exited, struct subprocess, list);
+			LOGP(DUECUPS, LOGL_NOTICE, "subprocess %u terminated (status=%d) but we don't "
+				"know it?\n", exited->pid, exited->status);
+			llist_del(&exited->list);
+			talloc_free(exited);
+		}
+	}
+
+	if (sr->tun)
+		tun_device_release(sr->tun);
+	cups_req_fini(&sr->req);
+	talloc_free(sr);
+}
+
+/* start a program; netns and addl_env are optional.  The fork + exec is done by a control
+ * worker, in the order of other requests on the tun device of netns (if given) */
+static int cups_client_start_program(struct cups_client *cc, const char *cmd, const char *user,
+				     const char *netns, char **addl_env, const struct cups_trans *tr)
 {
-	json_t *juser, *jcmd, *jenv, *jnetns, *jres;
 	struct gtp_daemon *d = cc->d;
-	const char *cmd, *user;
+	struct tun_device *tun = NULL;
+	struct cups_start_req *sr;
+	unsigned int i, n = 0;
+
+	if (netns) {
+		tun = tun_device_find_netns(d, netns);
+		if (!tun)
+			return -ENODEV;
+	}
+
+	/* copies, as the request is only parsed into the receive buffer */
+	sr = talloc_zero(d, struct cups_start_req);
+	if (!sr)
+		return -ENOMEM;
+	sr->cmd = talloc_strdup(sr, cmd);
+	sr->user = talloc_strdup(sr, user);
+	while (addl_env && addl_env[n])
+		n++;
+	if (addl_env)
+		sr->addl_env = talloc_zero_array(sr, char *, n + 1);
+	if (!sr->cmd || !sr->user || (addl_env && !sr->addl_env))
+		goto out_free;
+	for (i = 0; i < n; i++) {
+		sr->addl_env[i] = talloc_strdup(sr->addl_env, addl_env[i]);
+		if (!sr->addl_env[i])
+			goto out_free;
+	}
+
+	if (tun) {
+		tun_device_get(tun);
+		sr->tun = tun;
+	}
+	if (ctrl_job_submit(d, tun ? &tun->strand : NULL, &sr->job, cups_client_start_program_work,
+			    cups_client_start_program_done) < 0) {
+		if (tun)
+			tun_device_release(tun);
+		goto out_free;
+	}
+	cups_req_init(&sr->req, cc, tr);
+	d->num_subprocesses_starting++;
+
+	return 0;
+
+out_free:
+	talloc_free(sr);
+	return -ENOMEM;
+}
+
+static int cups_client_handle_start_program(struct cups_client *cc, json_t *sprog,
+					    const struct cups_trans *tr)
+{
+	json_t *juser, *jcmd, *jenv, *jnetns;
 	char **addl_env = NULL;
-	sigset_t oldmask;
-	int nsfd = -1, rc;
+	int rc;
 
 	juser = json_object_get(sprog, "run_as_user");
 	jcmd = json_object_get(sprog, "command");
@@ -416,15 +1076,6 @@ static int cups_client_handle_start_program(struct cups_client *cc, json_t *spro
 	if (jnetns && !json_is_string(jnetns))
 		return -EINVAL;
 
-	cmd = json_string_value(jcmd);
-	user = json_string_value(juser);
-	if (jnetns) {
-		struct tun_device *tun = tun_device_find_netns(d, json_string_value(jnetns));
-		if (!tun)
-			return -ENODEV;
-		nsfd = tun->netns_fd;
-	}
-
 	/* build environment */
 	if (jenv) {
 		json_t *j;
@@ -437,63 +1088,107 @@ static int cups_client_handle_start_program(struct cups_client *cc, json_t *spro
 		}
 	}
 
-	if (jnetns) {
-		rc = switch_ns(nsfd, &oldmask);
-		if (rc < 0) {
-			talloc_free(addl_env);
-			return -EIO;
-		}
-	}
+	rc = cups_client_start_program(cc, json_string_value(jcmd), json_string_value(juser),
+				       jnetns ? json_string_value(jnetns) : NULL, addl_env, tr);
+
+	talloc_free(addl_env);
+	return rc;
+}
 
-	rc = osmo_system_nowait2(cmd, osmo_environment_whitelist, addl_env, user);
+/* a reset, once the control workers are done with the requests before it */
+struct cups_reset_req {
+	struct cups_req req;
+	struct ctrl_job job;
+};
 
-	if (jnetns) {
-		OSMO_ASSERT(restore_ns(&oldmask) == 0);
+static void cups_client_reset_all_state_res(struct cups_reset_req *rr, uint8_t res)
+{
+	if (rr->req.cc)
+		cups_client_tx_result(rr->req.cc, UECUPS_MSGT_RESET_ALL_STATE_RES, res, &rr->req.trans);
+	cups_req_fini(&rr->req);
+	talloc_free(rr);
+}
+
+/* the tunnels are gone, now the programs */
+static void cups_client_reset_all_state_tunnels_done(int num, void *priv)
+{
+	struct cups_reset_req *rr = priv;
+	struct subprocess *p, *p2;
+
+	/* no locking needed as this list is only used by main thread */
+	llist_for_each_entry_safe(p, p2, &g_daemon->subprocesses, list) {
+		subprocess_destroy(p, SIGKILL);
 	}
 
-	talloc_free(addl_env);
+	cups_client_reset_all_state_res(rr, UECUPS_RES_OK);
+}
 
-	if (rc > 0) {
-		/* create a record about the subprocess we started, so we can notify the
-		 * client that crated it upon termination */
-		struct subprocess *sproc = talloc_zero(cc, struct subprocess);
-		if (!sproc)
-			return -ENOMEM;
+/* the barrier: destroy all tunnels, their netlink requests made by control workers */
+static void cups_client_reset_all_state_done(struct ctrl_job *job)
+{
+	struct cups_reset_req *rr = container_of(job, struct cups_reset_req, job);
 
-		sproc->cups_client = cc;
-		sproc->pid = rc;
-		llist_add_tail(&sproc->list, &d->subprocesses);
-		jres = gen_uecups_start_res(sproc->pid, "OK");
-	} else {
-		jres = gen_uecups_start_res(0, "ERR_INVALID_DATA");
+	if (gtp_tunnel_destroy_all_async(g_daemon, cups_client_reset_all_state_tunnels_done, rr) < 0)
+		cups_client_reset_all_state_res(rr, UECUPS_RES_ERR_INVALID_DATA);
+}
+
+/* requests in progress complete first, including the programs being started */
+static int cups_client_reset_all_state(struct cups_client *cc, const struct cups_trans *tr)
+{
+	struct cups_reset_req *rr = talloc_zero(cc->d, struct cups_reset_req);
+
+	if (!rr)
+		return -ENOMEM;
+	if (ctrl_barrier_submit(cc->d, &rr->job, cups_client_reset_all_state_done) < 0) {
+		talloc_free(rr);
+		return -ENOMEM;
 	}
+	cups_req_init(&rr->req, cc, tr);
 
-	cups_client_tx_json(cc, jres);
+	return 0;
+}
+
+/* the response is sent in the previous encoding, everything after it in the new one */
+static int cups_client_set_encoding(struct cups_client *cc, int enc, const struct cups_trans *tr)
+{
+	if (enc != UECUPS_ENC_JSON && enc != UECUPS_ENC_BINARY)
+		return -EINVAL;
+
+	cups_client_tx_result(cc, UECUPS_MSGT_SET_ENCODING_RES, UECUPS_RES_OK, tr);
+	if (cc->enc != enc)
+		LOGCC(cc, LOGL_INFO, "Switching to %s encoding\n", get_value_string(uecups_encoding_names, enc));
+	cc->enc = enc;
 
 	return 0;
 }
 
-static int cups_client_handle_reset_all_state(struct cups_client *cc, json_t *sprog)
+/* '{"set_encoding":{"encoding":"BINARY"}}' */
+static int cups_client_handle_set_encoding(struct cups_client *cc, json_t *jset,
+					   const struct cups_trans *tr)
 {
-	struct gtp_daemon *d = cc->d;
-	struct gtp_tunnel *t, *t2;
-	struct subprocess *p, *p2;
-	json_t *jres;
+	json_t *jenc = json_object_get(jset, "encoding");
 
-	pthread_rwlock_wrlock(&d->rwlock);
-	llist_for_each_entry_safe(t, t2, &d->gtp_tunnels, list) {
-		_gtp_tunnel_destroy(t);
-	}
-	pthread_rwlock_unlock(&d->rwlock);
+	if (!json_is_string(jenc))
+		return -EINVAL;
 
-	/* no locking needed as this list is only used by main thread */
-	llist_for_each_entry_safe(p, p2, &d->subprocesses, list) {
-		subprocess_destroy(p, SIGKILL);
-	}
+	return cups_client_set_encoding(cc, get_string_value(uecups_encoding_names, json_string_value(jenc)),
+					tr);
+}
+
+/* '{"<command>":{...,"trans_id":1234}}' */
+static int parse_trans(struct cups_trans *out, json_t *cmd)
+{
+	json_t *jtrans = json_object_get(cmd, "trans_id");
 
-	jres = gen_uecups_result("reset_all_state_res", "OK");
-	cups_client_tx_json(cc, jres);
+	memset(out, 0, sizeof(*out));
+	if (!jtrans)
+		return 0;
+	if (!json_is_integer(jtrans) || json_integer_value(jtrans) < 0 ||
+	    json_integer_value(jtrans) > UINT32_MAX)
+		return -EINVAL;
 
+	out->present = true;
+	out->id = json_integer_value(jtrans);
 	return 0;
 }
 
@@ -501,8 +1196,9 @@ static int cups_client_handle_json(struct cups_client *cc, json_t *jroot)
 {
 	void *iter;
 	const char *key;
+	struct cups_trans tr;
 	json_t *cmd;
-	int rc;
+	int rc, type;
 
 	if (!json_is_object(jroot))
 		return -EINVAL;
@@ -513,87 +1209,411 @@ static int cups_client_handle_json(struct cups_client *cc, json_t *jroot)
 	if (!iter || !key || !cmd)
 		return -EINVAL;
 
-	if (!strcmp(key, "create_tun")) {
-		rc = cups_client_handle_create_tun(cc, cmd);
-	} else if (!strcmp(key, "destroy_tun")) {
-		rc = cups_client_handle_destroy_tun(cc, cmd);
-	} else if (!strcmp(key, "start_program")) {
-		rc = cups_client_handle_start_program(cc, cmd);
-	} else if (!strcmp(key, "reset_all_state")) {
-		rc = cups_client_handle_reset_all_state(cc, cmd);
-	} else {
+	/* without a valid transaction ID, a response could not be matched anyway */
+	if (parse_trans(&tr, cmd) < 0) {
+		LOGCC(cc, LOGL_NOTICE, "Invalid trans_id in '%s' command\n", key);
+		return -EINVAL;
+	}
+
+	type = get_string_value(uecups_msg_type_names, key);
+	switch (type) {
+	case UECUPS_MSGT_CREATE_TUN:
+		rc = cups_client_handle_create_tun(cc, cmd, &tr);
+		break;
+	case UECUPS_MSGT_DESTROY_TUN:
+		rc = cups_client_handle_destroy_tun(cc, cmd, &tr);
+		break;
+	case UECUPS_MSGT_CREATE_TUN_BATCH:
+		rc = cups_client_handle_create_tun_batch(cc, cmd, &tr);
+		break;
+	case UECUPS_MSGT_DESTROY_TUN_BATCH:
+		rc = cups_client_handle_destroy_tun_batch(cc, cmd, &tr);
+		break;
+	case UECUPS_MSGT_START_PROGRAM:
+		rc = cups_client_handle_start_program(cc, cmd, &tr);
+		break;
+	case UECUPS_MSGT_RESET_ALL_STATE:
+		rc = cups_client_reset_all_state(cc, &tr);
+		break;
+	case UECUPS_MSGT_SET_ENCODING:
+		rc = cups_client_handle_set_encoding(cc, cmd, &tr);
+		break;
+	default:
 		LOGCC(cc, LOGL_NOTICE, "Unknown command '%s' received\n", key);
 		return -EINVAL;
 	}
 
 	if (rc < 0) {
 		LOGCC(cc, LOGL_NOTICE, "Error %d handling '%s' command\n", rc, key);
-		char buf[64];
-		snprintf(buf, sizeof(buf), "%s_res", key);
-		cups_client_tx_json(cc, gen_uecups_result(buf, "ERR_INVALID_DATA"));
+		cups_client_tx_result(cc, UECUPS_MSGT_RES(type), UECUPS_RES_ERR_INVALID_DATA, &tr);
 		return -EINVAL;
 	}
 
 	return 0;
 }
 
+/***********************************************************************
+ * Binary encoded commands (see uecups_bin.h)
+ ***********************************************************************/
+
+static int cups_client_handle_bin_create_tun(struct cups_client *cc, const struct uecups_bin_msg *msg,
+					     const struct cups_trans *tr)
+{
+	struct gtp_tunnel_params tpars;
+	int rc;
+
+	rc = uecups_bin_dec_create_tun(&tpars, msg->ies, msg->ies_len);
+	if (rc < 0)
+		return rc;
+
+	return cups_client_create_tun(cc, &tpars, tr);
+}
+
+static int cups_client_handle_bin_destroy_tun(struct cups_client *cc, const struct uecups_bin_msg *msg,
+					      const struct cups_trans *tr)
+{
+	struct gtp_tunnel_id id;
+	int rc;
+
+	rc = uecups_bin_dec_destroy_tun(&id, msg->ies, msg->ies_len);
+	if (rc < 0)
+		return rc;
+
+	return cups_client_destroy_tun(cc, &id, tr);
+}
+
+/* one UECUPS_IE_TUNNEL per create_tun */
+static int cups_client_handle_bin_create_tun_batch(struct cups_client *cc, const struct uecups_bin_msg *msg,
+						   const struct cups_trans *tr)
+{
+	unsigned int n = uecups_bin_ie_count(msg->ies, msg->ies_len, UECUPS_IE_TUNNEL);
+	const struct gtp_tunnel_params **tpars;
+	struct gtp_tunnel_params *params;
+	const uint8_t *pos = msg->ies;
+	struct uecups_bin_ie ie;
+	unsigned int i = 0;
+	int rc;
+
+	params = talloc_array(cc, struct gtp_tunnel_params, n);
+	tpars = talloc_array(params, const struct gtp_tunnel_params *, n);
+	if (!params || !tpars) {
+		talloc_free(params);
+		return -ENOMEM;
+	}
+
+	/* malformed entries are reported individually */
+	while ((rc = uecups_bin_ie_next(&ie, &pos, msg->ies + msg->ies_len)) > 0 && i < n) {
+		if (ie.tag != UECUPS_IE_TUNNEL)
+			continue;
+		tpars[i] = &params[i];
+		if (uecups_bin_dec_create_tun(&params[i], ie.val, ie.len) < 0)
+			tpars[i] = NULL;
+		i++;
+	}
+	if (rc < 0) {
+		talloc_free(params);
+		return rc;
+	}
+
+	return cups_client_create_tun_batch(cc, params, tpars, n, tr);
+}
+
+/* one UECUPS_IE_TUNNEL per destroy_tun */
+static int cups_client_handle_bin_destroy_tun_batch(struct cups_client *cc, const struct uecups_bin_msg *msg,
+						    const struct cups_trans *tr)
+{
+	unsigned int n = uecups_bin_ie_count(msg->ies, msg->ies_len, UECUPS_IE_TUNNEL);
+	const uint8_t *pos = msg->ies;
+	struct gtp_tunnel_id *ids;
+	struct uecups_bin_ie ie;
+	unsigned int i = 0;
+	bool *valid;
+	int rc;
+
+	ids = talloc_array(cc, struct gtp_tunnel_id, n);
+	valid = talloc_array(ids, bool, n);
+	if (!ids || !valid) {
+		talloc_free(ids);
+		return -ENOMEM;
+	}
+
+	/* malformed entries are reported individually; their all-zero id matches no tunnel */
+	while ((rc = uecups_bin_ie_next(&ie, &pos, msg->ies + msg->ies_len)) > 0 && i < n) {
+		if (ie.tag != UECUPS_IE_TUNNEL)
+			continue;
+		valid[i] = uecups_bin_dec_destroy_tun(&ids[i], ie.val, ie.len) == 0;
+		if (!valid[i])
+			memset(&ids[i], 0, sizeof(ids[i]));
+		i++;
+	}
+	if (rc < 0) {
+		talloc_free(ids);
+		return rc;
+	}
+
+	return cups_client_destroy_tun_batch(cc, ids, ids, valid, n, tr);
+}
+
+static int cups_client_handle_bin_start_program(struct cups_client *cc, const struct uecups_bin_msg *msg,
+						 const struct cups_trans *tr)
+{
+	unsigned int num_env = uecups_bin_ie_count(msg->ies, msg->ies_len, UECUPS_IE_ENVIRONMENT);
+	const char *cmd = NULL, *user = NULL, *netns = NULL;
+	const uint8_t *pos = msg->ies;
+	struct uecups_bin_ie ie;
+	char **addl_env = NULL;
+	unsigned int i = 0;
+	int rc;
+
+	/* the environment entries are used in place */
+	if (num_env) {
+		addl_env = talloc_zero_array(cc, char *, num_env + 1);
+		if (!addl_env)
+			return -ENOMEM;
+	}
+
+	while ((rc = uecups_bin_ie_next(&ie, &pos, msg->ies + msg->ies_len)) > 0) {
+		switch (ie.tag) {
+		case UECUPS_IE_COMMAND:
+			cmd = uecups_bin_ie_str(&ie);
+			break;
+		case UECUPS_IE_RUN_AS_USER:
+			user = uecups_bin_ie_str(&ie);
+			break;
+		case UECUPS_IE_TUN_NETNS_NAME:
+			netns = uecups_bin_ie_str(&ie);
+			if (!netns)
+				rc = -EINVAL;
+			break;
+		case UECUPS_IE_ENVIRONMENT:
+			if (i < num_env) {
+				addl_env[i] = (char *) uecups_bin_ie_str(&ie);
+				if (!addl_env[i++])
+					rc = -EINVAL;
+			}
+			break;
+		}
+		if (rc < 0)
+			break;
+	}
+
+	/* mandatory parts */
+	if (rc < 0 || !cmd || !user)
+		rc = -EINVAL;
+	else
+		rc = cups_client_start_program(cc, cmd, user, netns, addl_env, tr);
+
+	talloc_free(addl_env);
+	return rc;
+}
+
+static int cups_client_handle_bin_set_encoding(struct cups_client *cc, const struct uecups_bin_msg *msg,
+					       const struct cups_trans *tr)
+{
+	const uint8_t *pos = msg->ies;
+	struct uecups_bin_ie ie;
+	int rc;
+
+	while ((rc = uecups_bin_ie_next(&ie, &pos, msg->ies + msg->ies_len)) > 0) {
+		if (ie.tag == UECUPS_IE_ENCODING)
+			return cups_client_set_encoding(cc, uecups_bin_ie_u8(&ie), tr);
+	}
+	return -EINVAL;
+}
+
+static int cups_client_handle_bin(struct cups_client *cc, const struct uecups_bin_msg *msg)
+{
+	const char *name = get_value_string(uecups_msg_type_names, msg->type);
+	struct cups_trans tr = {};
+	int rc;
+
+	LOGCC(cc, LOGL_DEBUG, "Binary Rx %s (%zu bytes)\n", name, msg->len);
+
+	/* without a valid transaction ID, a response could not be matched anyway */
+	rc = uecups_bin_ie_find_u32(msg->ies, msg->ies_len, UECUPS_IE_TRANS_ID, &tr.id);
+	if (rc < 0) {
+		LOGCC(cc, LOGL_NOTICE, "Invalid TRANS_ID IE in '%s' command\n", name);
+		return -EINVAL;
+	}
+	tr.present = rc > 0;
+
+	switch (msg->type) {
+	case UECUPS_MSGT_CREATE_TUN:
+		rc = cups_client_handle_bin_create_tun(cc, msg, &tr);
+		break;
+	case UECUPS_MSGT_DESTROY_TUN:
+		rc = cups_client_handle_bin_destroy_tun(cc, msg, &tr);
+		break;
+	case UECUPS_MSGT_CREATE_TUN_BATCH:
+		rc = cups_client_handle_bin_create_tun_batch(cc, msg, &tr);
+		break;
+	case UECUPS_MSGT_DESTROY_TUN_BATCH:
+		rc = cups_client_handle_bin_destroy_tun_batch(cc, msg, &tr);
+		break;
+	case UECUPS_MSGT_START_PROGRAM:
+		rc = cups_client_handle_bin_start_program(cc, msg, &tr);
+		break;
+	case UECUPS_MSGT_RESET_ALL_STATE:
+		rc = cups_client_reset_all_state(cc, &tr);
+		break;
+	case UECUPS_MSGT_SET_ENCODING:
+		rc = cups_client_handle_bin_set_encoding(cc, msg, &tr);
+		break;
+	default:
+		LOGCC(cc, LOGL_NOTICE, "Unknown binary command %u received\n", msg->type);
+		return -EINVAL;
+	}
+
+	if (rc < 0) {
+		LOGCC(cc, LOGL_NOTICE, "Error %d handling '%s' command\n", rc, name);
+		cups_client_tx_result(cc, UECUPS_MSGT_RES(msg->type), UECUPS_RES_ERR_INVALID_DATA, &tr);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* keep the rest of a received message until the request without transaction ID in progress
+ * is done; in front of the other ones, if it is the rest of one of them */
+static void cups_client_defer(struct cups_client *cc, const char *buf, size_t len, bool front)
+{
+	struct cups_rx_defer *def = talloc_size(cc, sizeof(*def) + len);
+
+	if (!def) {
+		LOGCC(cc, LOGL_ERROR, "Cannot defer %zu bytes of received message\n", len);
+		return;
+	}
+	def->len = len;
+	memcpy(def->data, buf, len);
+	if (front)
+		llist_add(&def->list, &cc->deferred);
+	else
+		llist_add_tail(&def->list, &cc->deferred);
+}
+
+/* handle a complete SCTP message, which may contain several concatenated JSON documents
+ * and/or binary messages.  resumed: it was deferred */
+static void cups_client_rx_msg(struct cups_client *cc, const char *buf, size_t len, bool resumed)
+{
+	struct uecups_bin_msg msg;
+	json_error_t jerr;
+	json_t *jroot;
+	size_t offset = 0;
+
+	while (1) {
+		/* white space (or NUL termination) between/after the documents */
+		while (offset < len && (isspace((unsigned char) buf[offset]) || buf[offset] == '\0'))
+			offset++;
+		if (offset >= len)
+			break;
+
+		/* after the response to the request without transaction ID in progress, and
+		 * after the messages deferred before */
+		if (cc->untagged_busy || (!resumed && !llist_empty(&cc->deferred))) {
+			cups_client_defer(cc, buf + offset, len - offset, resumed);
+			break;
+		}
+
+		if (uecups_bin_is_bin(buf[offset])) {
+			if (uecups_bin_msg_dec(&msg, (const uint8_t *) buf + offset, len - offset) < 0) {
+				LOGCC(cc, LOGL_ERROR, "Error decoding binary message\n");
+				break;
+			}
+			offset += msg.len;
+			cups_client_handle_bin(cc, &msg);
+			continue;
+		}
+
+		/* Parse the JSON; stop after one document, whose size is then in position */
+		jroot = json_loadb(buf + offset, len - offset, JSON_DISABLE_EOF_CHECK, &jerr);
+		if (!jroot) {
+			LOGCC(cc, LOGL_ERROR, "Error decoding JSON (%s)\n", jerr.text);
+			break;
+		}
+		LOGCC(cc, LOGL_DEBUG, "JSON Rx '%.*s'\n", (int) jerr.position, buf + offset);
+		offset += jerr.position;
+
+		/* Dispatch */
+		cups_client_handle_json(cc, jroot);
+		json_decref(jroot);
+	}
+}
+
+/* handle the deferred messages, until the next request without transaction ID is in
+ * progress */
+static void cups_client_resume(struct cups_client *cc)
+{
+	struct cups_rx_defer *def;
+
+	/* completed while handling one of them: the loop below continues */
+	if (cc->resuming)
+		return;
+
+	cc->resuming = true;
+	while (!cc->untagged_busy && !llist_empty(&cc->deferred)) {
+		def = llist_first_entry(&cc->deferred, struct cups_rx_defer, list);
+		llist_del(&def->list);
+		cups_client_rx_msg(cc, def->data, def->len, true);
+		talloc_free(def);
+	}
+	cc->resuming = false;
+}
+
 /* control/user plane separation per-client read cb */
 static int cups_client_read_cb(struct osmo_stream_srv *conn)
 {
 	struct osmo_fd *ofd = osmo_stream_srv_get_ofd(conn);
 	struct cups_client *cc = osmo_stream_srv_get_data(conn);
-	struct msgb *msg = msgb_alloc(CUPS_MSGB_SIZE, "Rx JSON");
+	size_t size = talloc_get_size(cc->rx_buf);
 	struct sctp_sndrcvinfo sinfo;
-	json_error_t jerr;
-	json_t *jroot;
 	int flags = 0;
 	int rc = 0;
 
+	/* a message not fitting the buffer is received in parts; make room for the next one */
+	if (cc->rx_len == size) {
+		if (size * 2 > CUPS_RX_MAX_SIZE) {
+			LOGCC(cc, LOGL_ERROR, "Message exceeds %u bytes, closing connection\n",
+				CUPS_RX_MAX_SIZE);
+			osmo_stream_srv_destroy(conn);
+			return -1;
+		}
+		cc->rx_buf = talloc_realloc_size(cc, cc->rx_buf, size * 2);
+		OSMO_ASSERT(cc->rx_buf);
+		size *= 2;
+	}
+
 	/* Read message from socket */
 	/* we cannot use osmo_stream_srv_recv() here, as we might get some out-of-band info from
 	 * SCTP. FIXME: add something like osmo_stream_srv_recv_sctp() to libosmo-netif and use
 	 * it here as well as in libosmo-sigtran and osmo-msc */
-	rc = sctp_recvmsg(ofd->fd, msg->tail, msgb_tailroom(msg), NULL, NULL, &sinfo,&flags);
+	rc = sctp_recvmsg(ofd->fd, cc->rx_buf + cc->rx_len, size - cc->rx_len, NULL, NULL,
+			  &sinfo, &flags);
 	if (rc <= 0) {
 		osmo_stream_srv_destroy(conn);
-		rc = -1;
-		goto out;
-	} else
-		msgb_put(msg, rc);
+		return -1;
+	}
 
 	if (flags & MSG_NOTIFICATION) {
-		union sctp_notification *notif = (union sctp_notification *) msgb_data(msg);
-		switch (notif->sn_header.sn_type) {
-		case SCTP_SHUTDOWN_EVENT:
+		/* left behind any partial message in the buffer, which it doesn't extend */
+		union sctp_notification *notif = (union sctp_notification *) (cc->rx_buf + cc->rx_len);
+		if (rc >= sizeof(notif->sn_header) && notif->sn_header.sn_type == SCTP_SHUTDOWN_EVENT) {
 			osmo_stream_srv_destroy(conn);
-			rc = -EBADF;
-			goto out;
-		default:
-			break;
+			return -EBADF;
 		}
-		goto out;
-	}
-
-	LOGCC(cc, LOGL_DEBUG, "Rx '%s'\n", msgb_data(msg));
-
-	/* Parse the JSON */
-	jroot = json_loadb((const char *) msgb_data(msg), msgb_length(msg), 0, &jerr);
-	if (!jroot) {
-		LOGCC(cc, LOGL_ERROR, "Error decoding JSON (%s)", jerr.text);
-		rc = -1;
-		goto out;
+		return 0;
 	}
 
-	/* Dispatch */
-	rc = cups_client_handle_json(cc, jroot);
+	cc->rx_len += rc;
+	if (!(flags & MSG_EOR))
+		return 0;
 
-	json_decref(jroot);
-	msgb_free(msg);
+	cups_client_rx_msg(cc, cc->rx_buf, cc->rx_len, false);
+	cc->rx_len = 0;
+	/* don't keep the memory of a single huge message */
+	if (size > CUPS_RX_BUF_SIZE * 16)
+		cc->rx_buf = talloc_realloc_size(cc, cc->rx_buf, CUPS_RX_BUF_SIZE);
 
 	return 0;
-out:
-	msgb_free(msg);
-	return rc;
 }
 
 static int cups_client_closed_cb(struct osmo_stream_srv *conn)
@@ -601,6 +1621,13 @@ static int cups_client_closed_cb(struct osmo_stream_srv *conn)
 	struct cups_client *cc = osmo_stream_srv_get_data(conn);
 	struct gtp_daemon *d = cc->d;
 	struct subprocess *p, *p2;
+	struct cups_req *req, *req2;
+
+	/* requests in progress complete without a response (and kill a program started) */
+	llist_for_each_entry_safe(req, req2, &cc->pending, list) {
+		llist_del_init(&req->list);
+		req->cc = NULL;
+	}
 
 	/* kill + forget about all subprocesses of this client */
 	/* We need no locking here as the subprocess list is only used from the main thread */
@@ -610,6 +1637,19 @@ static int cups_client_closed_cb(struct osmo_stream_srv *conn)
 	}
 
 	LOGCC(cc, LOGL_INFO, "UECUPS connection lost\n");
+	osmo_fd_unregister(&cc->tx_ofd);
+	close(cc->tx_ofd.fd);
+	cc->tx_ofd.fd = -1;
+	while (!llist_empty(&cc->tx_queue)) {
+		struct cups_tx_msg *m = llist_first_entry(&cc->tx_queue, struct cups_tx_msg, list);
+		llist_del(&m->list);
+		talloc_free(m);
+	}
+	while (!llist_empty(&cc->deferred)) {
+		struct cups_rx_defer *def = llist_first_entry(&cc->deferred, struct cups_rx_defer, list);
+		llist_del(&def->list);
+		talloc_free(def);
+	}
 	llist_del(&cc->list);
 	return 0;
 }
@@ -627,16 +1667,38 @@ static int cups_accept_cb(struct osmo_stream_srv_link *link, int fd)
 
 	cc->d = d;
 	osmo_sock_get_name_buf(cc->sockname, sizeof(cc->sockname), fd);
+	INIT_LLIST_HEAD(&cc->tx_queue);
+	INIT_LLIST_HEAD(&cc->pending);
+	INIT_LLIST_HEAD(&cc->deferred);
+	cc->rx_buf = talloc_size(cc, CUPS_RX_BUF_SIZE);
+	if (!cc->rx_buf)
+		goto out_free;
+	if (uecups_bin_buf_init(&cc->tx_bin, cc) < 0)
+		goto out_free;
+
+	/* with its own fd number, this can be registered in addition to the fd of cc->srv */
+	osmo_fd_setup(&cc->tx_ofd, dup(fd), 0, cups_client_tx_cb, cc, 0);
+	if (cc->tx_ofd.fd < 0)
+		goto out_free;
+	if (osmo_fd_register(&cc->tx_ofd) < 0)
+		goto out_close;
+
 	cc->srv = osmo_stream_srv_create(cc, link, fd, cups_client_read_cb, cups_client_closed_cb, cc);
 	if (!cc->srv) {
-		talloc_free(cc);
-		return -1;
+		osmo_fd_unregister(&cc->tx_ofd);
+		goto out_close;
 	}
 	LOGCC(cc, LOGL_INFO, "Accepted new UECUPS connection\n");
 
 	llist_add_tail(&cc->list, &d->cups_clients);
 
 	return 0;
+
+out_close:
+	close(cc->tx_ofd.fd);
+out_free:
+	talloc_free(cc);
+	return -1;
 }
 
 /***********************************************************************
@@ -677,13 +1739,31 @@ static struct gtp_daemon *gtp_daemon_alloc(void *ctx)
 	INIT_LLIST_HEAD(&d->tun_devices);
 	INIT_LLIST_HEAD(&d->gtp_tunnels);
 	INIT_LLIST_HEAD(&d->subprocesses);
+	INIT_LLIST_HEAD(&d->subprocesses_exited);
+	INIT_LLIST_HEAD(&d->gtp_tunnels_pending);
+	INIT_LLIST_HEAD(&d->pkt_pools);
+	INIT_LLIST_HEAD(&d->dp_threads);
 	pthread_rwlock_init(&d->rwlock, NULL);
+	if (rcu_domain_init(&d->rcu, d) < 0) {
+		talloc_free(d);
+		return NULL;
+	}
 	d->main_thread = pthread_self();
 
 	INIT_LLIST_HEAD(&d->cups_clients);
 
 	d->cfg.cups_local_ip = talloc_strdup(d, "localhost");
 	d->cfg.cups_local_port = UECUPS_SCTP_PORT;
+	d->cfg.num_ctrl_workers = DEFAULT_CTRL_WORKERS;
+	d->cfg.rx_batch_size = DEFAULT_RX_BATCH_SIZE;
+	d->cfg.tx_batch_size = DEFAULT_TX_BATCH_SIZE;
+	d->cfg.tx_udp_gso = true;
+	d->cfg.rx_udp_gro = true;
+	d->cfg.tun_num_queues = 1;
+	d->cfg.ep_num_workers = 1;
+	d->cfg.af_xdp_queues = 1;
+	d->cfg.pkt_pool_max_mb = DEFAULT_PKT_POOL_MAX_MB;
+	d->cfg.numa_node = -1;
 
 	return d;
 }
@@ -709,6 +1789,16 @@ static const struct log_info_cat log_categories[] = {
 		.description = "UE Control User Plane Separation",
 		.enabled = 1, .loglevel = LOGL_DEBUG,
 	},
+	[DIOW] = {
+		.name = "DIOW",
+		.description = "I/O worker pool",
+		.enabled = 1, .loglevel = LOGL_INFO,
+	},
+	[DPKT] = {
+		.name = "DPKT",
+		.description = "Packet buffer pool",
+		.enabled = 1, .loglevel = LOGL_INFO,
+	},
 
 };
 
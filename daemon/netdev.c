@@ -1,4 +1,5 @@
 /* SPDX-License-Identifier: GPL-2.0 */
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -6,8 +7,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <ifaddrs.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <net/if.h>
 
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
@@ -17,6 +20,13 @@
 #include <sys/ioctl.h>
 
 #include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <linux/if_ether.h>
+#include <arpa/inet.h>
+#include <netlink/msg.h>
+#include <netlink/attr.h>
 #include <netlink/socket.h>
 #include <netlink/route/link.h>
 #include <netlink/route/addr.h>
@@ -25,17 +35,18 @@
 
 #include <osmocom/core/utils.h>
 
+#include "internal.h"
+
 /***********************************************************************
  * netlink helper functions
  ***********************************************************************/
 
-static int _netdev_addr(struct nl_sock *nlsk, int ifindex, const struct sockaddr_storage *ss, bool add)
+static struct rtnl_addr *netdev_rtnl_addr_alloc(int ifindex, const struct sockaddr_storage *ss)
 {
 	const struct sockaddr_in6 *sin6;
 	const struct sockaddr_in *sin;
 	struct nl_addr *local = NULL;
 	struct rtnl_addr *addr;
-	int rc;
 
 	switch (ss->ss_family) {
 	case AF_INET:
@@ -53,6 +64,15 @@ static int _netdev_addr(struct nl_sock *nlsk, int ifindex, const struct sockaddr
 	OSMO_ASSERT(addr);
 	rtnl_addr_set_ifindex(addr, ifindex);
 	OSMO_ASSERT(rtnl_addr_set_local(addr, local) == 0);
+	nl_addr_put(local);
+
+	return addr;
+}
+
+static int _netdev_addr(struct nl_sock *nlsk, int ifindex, const struct sockaddr_storage *ss, bool add)
+{
+	struct rtnl_addr *addr = netdev_rtnl_addr_alloc(ifindex, ss);
+	int rc;
 
 	if (add)
 		rc = rtnl_addr_add(nlsk, addr, 0);
@@ -74,6 +94,154 @@ int netdev_del_addr(struct nl_sock *nlsk, int ifindex, const struct sockaddr_sto
 	return _netdev_addr(nlsk, ifindex, ss, false);
 }
 
+/* Requests of netdev_addr_batch() are sent in chunks of NETDEV_BATCH_MAX_MSGS messages with
+ * one sendmsg(), which the kernel processes one after the other, queueing an ACK (or error)
+ * for each.  The ACKs of a chunk are then collected via recvmmsg() and matched to their
+ * requests by sequence number.  The chunk size keeps the ACKs within the receive buffer */
+#define NETDEV_BATCH_MAX_MSGS	64
+#define NETDEV_BATCH_BUF_SIZE	(NETDEV_BATCH_MAX_MSGS * 256)
+/* an ACK is a struct nlmsgerr; with NETLINK_CAP_ACK it doesn't contain the request */
+#define NETDEV_ACK_BUF_SIZE	128
+/* receive buffer for the ACKs of a chunk, each accounted with the overhead of its skb (the
+ * default of libnl, 32k, only fits some of them) */
+#define NETDEV_BATCH_RCVBUF	(NETDEV_BATCH_MAX_MSGS * 2048)
+
+/* prepare a netlink socket for netdev_addr_batch(), once after nl_connect() */
+int netdev_batch_sock_init(struct nl_sock *nlsk)
+{
+	int rc;
+
+	rc = nl_socket_set_buffer_size(nlsk, NETDEV_BATCH_RCVBUF, 0);
+	if (rc < 0)
+		return rc;
+
+#ifdef NETLINK_CAP_ACK
+	/* don't copy the request into the ACK; not fatal, the ACK is then truncated */
+	int val = 1;
+	setsockopt(nl_socket_get_fd(nlsk), SOL_NETLINK, NETLINK_CAP_ACK, &val, sizeof(val));
+#endif
+	return 0;
+}
+
+/* append the message of a request to buf, unless it doesn't fit; returns false then */
+static bool netdev_batch_append(struct nl_sock *nlsk, struct netdev_addr_req *req,
+				uint8_t *buf, size_t *len)
+{
+	struct rtnl_addr *addr = netdev_rtnl_addr_alloc(req->ifindex, req->addr);
+	struct nlmsghdr *nlh;
+	struct nl_msg *msg;
+	int rc;
+
+	if (req->add)
+		rc = rtnl_addr_build_add_request(addr, 0, &msg);
+	else
+		rc = rtnl_addr_build_delete_request(addr, 0, &msg);
+	rtnl_addr_put(addr);
+	OSMO_ASSERT(rc == 0);
+
+	nlh = nlmsg_hdr(msg);
+	if (*len + NLMSG_ALIGN(nlh->nlmsg_len) > NETDEV_BATCH_BUF_SIZE) {
+		nlmsg_free(msg);
+		return false;
+	}
+	/* sets NLM_F_ACK and the next sequence number of the socket */
+	nl_complete_msg(nlsk, msg);
+	req->seq = nlh->nlmsg_seq;
+	req->rc = -EINPROGRESS;
+	memcpy(buf + *len, nlh, nlh->nlmsg_len);
+	*len += NLMSG_ALIGN(nlh->nlmsg_len);
+	nlmsg_free(msg);
+
+	return true;
+}
+
+/* collect the ACKs of the n requests of a chunk, whose sequence numbers are consecutive;
+ * returns 0 or negative errno if the socket failed */
+static int netdev_batch_wait_acks(int fd, struct netdev_addr_req *reqs, unsigned int n)
+{
+	uint8_t bufs[NETDEV_BATCH_MAX_MSGS][NETDEV_ACK_BUF_SIZE];
+	struct iovec iov[NETDEV_BATCH_MAX_MSGS];
+	struct mmsghdr msgs[NETDEV_BATCH_MAX_MSGS];
+	unsigned int i, pending = n;
+	int rc;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < NETDEV_BATCH_MAX_MSGS; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (pending) {
+		/* the kernel has queued the ACKs by the time sendmsg() returned */
+		rc = recvmmsg(fd, msgs, OSMO_MIN(pending, NETDEV_BATCH_MAX_MSGS), MSG_WAITFORONE, NULL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		for (i = 0; i < rc; i++) {
+			const struct nlmsghdr *nlh = (const struct nlmsghdr *) bufs[i];
+			const struct nlmsgerr *err = NLMSG_DATA(nlh);
+			uint32_t idx = nlh->nlmsg_seq - reqs[0].seq;
+
+			/* anything else is a left-over of an earlier request on the socket */
+			if (msgs[i].msg_len < NLMSG_HDRLEN + sizeof(err->error) ||
+			    nlh->nlmsg_type != NLMSG_ERROR || idx >= n || reqs[idx].rc != -EINPROGRESS)
+				continue;
+			reqs[idx].rc = err->error;
+			pending--;
+		}
+	}
+
+	return 0;
+}
+
+/* add/remove the addresses of n requests, pipelined instead of waiting for the ACK of each;
+ * see netdev_batch_sock_init() for nlsk.  The result of each is stored in its rc.  Returns
+ * 0, or negative errno if the socket failed, in which case the rc of all unconfirmed
+ * requests is that error.  Blocks until all ACKs have arrived, so it is called by the
+ * control worker of the tun device */
+int netdev_addr_batch(struct nl_sock *nlsk, struct netdev_addr_req *reqs, unsigned int n)
+{
+	int fd = nl_socket_get_fd(nlsk);
+	unsigned int i, first;
+	uint8_t *buf;
+	size_t len;
+	int rc = 0;
+
+	buf = malloc(NETDEV_BATCH_BUF_SIZE);
+	if (!buf)
+		rc = -ENOMEM;
+
+	first = i = 0;
+	while (first < n && rc == 0) {
+		len = 0;
+		for (i = first; i < n && i - first < NETDEV_BATCH_MAX_MSGS; i++) {
+			if (!netdev_batch_append(nlsk, &reqs[i], buf, &len))
+				break;
+		}
+		if (send(fd, buf, len, 0) < 0)
+			rc = -errno;
+		else
+			rc = netdev_batch_wait_acks(fd, &reqs[first], i - first);
+		if (rc == 0)
+			first = i;
+	}
+	free(buf);
+
+	if (rc < 0) {
+		/* the unconfirmed requests of the chunk that failed, and all after it */
+		for (; first < n; first++) {
+			if (first >= i || reqs[first].rc == -EINPROGRESS)
+				reqs[first].rc = rc;
+		}
+	}
+
+	return rc;
+}
+
 int netdev_set_link(struct nl_sock *nlsk, int ifindex, bool up)
 {
 	struct rtnl_link *link, *change;
@@ -99,6 +267,42 @@ int netdev_set_link(struct nl_sock *nlsk, int ifindex, bool up)
 	return rc;
 }
 
+int netdev_set_mtu(struct nl_sock *nlsk, int ifindex, unsigned int mtu)
+{
+	struct rtnl_link *link, *change;
+	int rc;
+
+	rc = rtnl_link_get_kernel(nlsk, ifindex, NULL, &link);
+	if (rc < 0)
+		return rc;
+
+	change = rtnl_link_alloc();
+	OSMO_ASSERT(change);
+
+	rtnl_link_set_mtu(change, mtu);
+	rc = rtnl_link_change(nlsk, link, change, 0);
+
+	rtnl_link_put(change);
+	rtnl_link_put(link);
+
+	return rc;
+}
+
+int netdev_del_link(struct nl_sock *nlsk, int ifindex)
+{
+	struct rtnl_link *link = rtnl_link_alloc();
+	int rc;
+
+	OSMO_ASSERT(link);
+
+	rtnl_link_set_ifindex(link, ifindex);
+	rc = rtnl_link_delete(nlsk, link);
+
+	rtnl_link_put(link);
+
+	return rc;
+}
+
 int netdev_add_defaultroute(struct nl_sock *nlsk, int ifindex, uint8_t family)
 {
 	struct rtnl_route *route = rtnl_route_alloc();
@@ -138,3 +342,100 @@ int netdev_add_defaultroute(struct nl_sock *nlsk, int ifindex, uint8_t family)
 
 	return rc;
 }
+
+/* find the interface owning an IPv4 address in the current netns; 0 if there is none */
+int netdev_find_ifindex(const struct sockaddr_in *sin)
+{
+	struct ifaddrs *ifaddr, *ifa;
+	int ifindex = 0;
+
+	if (getifaddrs(&ifaddr) < 0)
+		return 0;
+	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET)
+			continue;
+		if (((struct sockaddr_in *) ifa->ifa_addr)->sin_addr.s_addr == sin->sin_addr.s_addr) {
+			ifindex = if_nametoindex(ifa->ifa_name);
+			break;
+		}
+	}
+	freeifaddrs(ifaddr);
+	return ifindex;
+}
+
+/* our cls_bpf filters use a fixed priority + handle, so that we can find them again */
+#define NETDEV_TC_BPF_PRIO	0x4754
+#define NETDEV_TC_BPF_HANDLE	1
+
+static struct nl_msg *netdev_tc_msg_alloc(int type, int flags, int ifindex, uint32_t parent,
+					  uint32_t handle, uint32_t info)
+{
+	struct tcmsg tcm = {
+		.tcm_family = AF_UNSPEC,
+		.tcm_ifindex = ifindex,
+		.tcm_parent = parent,
+		.tcm_handle = handle,
+		.tcm_info = info,
+	};
+	struct nl_msg *msg = nlmsg_alloc_simple(type, flags);
+
+	OSMO_ASSERT(msg);
+	OSMO_ASSERT(nlmsg_append(msg, &tcm, sizeof(tcm), NLMSG_ALIGNTO) == 0);
+
+	return msg;
+}
+
+static struct nl_msg *netdev_tc_bpf_msg_alloc(int type, int flags, int ifindex, bool ingress)
+{
+	return netdev_tc_msg_alloc(type, flags, ifindex,
+				   TC_H_MAKE(TC_H_CLSACT, ingress ? TC_H_MIN_INGRESS : TC_H_MIN_EGRESS),
+				   NETDEV_TC_BPF_HANDLE,
+				   TC_H_MAKE(NETDEV_TC_BPF_PRIO << 16, htons(ETH_P_ALL)));
+}
+
+/* attach a BPF program in direct-action mode to the ingress or egress hook of the clsact
+ * qdisc of a device, creating that qdisc if required */
+int netdev_add_tc_bpf(struct nl_sock *nlsk, int ifindex, bool ingress, int prog_fd, const char *name)
+{
+	struct nl_msg *msg;
+	struct nlattr *opts;
+	int rc;
+
+	msg = netdev_tc_msg_alloc(RTM_NEWQDISC, NLM_F_CREATE, ifindex, TC_H_CLSACT,
+				  TC_H_MAKE(TC_H_CLSACT, 0), 0);
+	NLA_PUT_STRING(msg, TCA_KIND, "clsact");
+	rc = nl_send_sync(nlsk, msg);
+	if (rc < 0 && rc != -NLE_EXIST)
+		return rc;
+
+	msg = netdev_tc_bpf_msg_alloc(RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL, ifindex, ingress);
+	NLA_PUT_STRING(msg, TCA_KIND, "bpf");
+	opts = nla_nest_start(msg, TCA_OPTIONS);
+	if (!opts)
+		goto nla_put_failure;
+	NLA_PUT_U32(msg, TCA_BPF_FD, prog_fd);
+	NLA_PUT_STRING(msg, TCA_BPF_NAME, name);
+	NLA_PUT_U32(msg, TCA_BPF_FLAGS, TCA_BPF_FLAG_ACT_DIRECT);
+	nla_nest_end(msg, opts);
+
+	return nl_send_sync(nlsk, msg);
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return -NLE_NOMEM;
+}
+
+/* detach the BPF program attached by netdev_add_tc_bpf(); the clsact qdisc remains */
+int netdev_del_tc_bpf(struct nl_sock *nlsk, int ifindex, bool ingress)
+{
+	struct nl_msg *msg;
+
+	msg = netdev_tc_bpf_msg_alloc(RTM_DELTFILTER, 0, ifindex, ingress);
+	NLA_PUT_STRING(msg, TCA_KIND, "bpf");
+
+	return nl_send_sync(nlsk, msg);
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return -NLE_NOMEM;
+}
@@ -41,6 +41,7 @@
 #include <sys/param.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <osmocom/core/utils.h>
 
@@ -51,6 +52,9 @@
 /*! default namespace of the GGSN process */
 static int default_nsfd = -1;
 
+/*! serializes get_nsfd(), which may be called by several threads for the same name */
+static pthread_mutex_t nsfd_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*! switch to a (non-default) namespace, store existing signal mask in oldmask.
  *  \param[in] nsfd file descriptor representing the namespace to whch we shall switch
  *  \param[out] oldmaks caller-provided memory location to which old signal mask is stored
@@ -203,11 +207,8 @@ int init_netns()
 	return 0;
 }
 
-/*! create obtain file descriptor for network namespace of give name.
- *  Creates /var/run/netns  if it doesn't exist already.
- *  \param[in] name Name of the network namespace (in /var/run/netns/)
- *  \returns File descriptor of network namespace; negative errno in case of error */
-int get_nsfd(const char *name)
+/* get_nsfd() with nsfd_lock held */
+static int _get_nsfd(const char *name)
 {
 	int ret = 0;
 	int rc;
@@ -247,7 +248,8 @@ int get_nsfd(const char *name)
 		ret = -errno;
 		goto restore_sigmask;
 	}
-	if (mount("/proc/self/ns/net", path, "none", MS_BIND, NULL) < 0)
+	/* not /proc/self, which is the namespace of the main thread */
+	if (mount("/proc/thread-self/ns/net", path, "none", MS_BIND, NULL) < 0)
 		ret = -errno;
 
 	/* switch back to default namespace */
@@ -270,4 +272,20 @@ restore_sigmask:
 	return fd;
 }
 
+/*! create obtain file descriptor for network namespace of give name.
+ *  Creates /var/run/netns  if it doesn't exist already.  May be called by any thread.
+ *  \param[in] name Name of the network namespace (in /var/run/netns/)
+ *  \returns File descriptor of network namespace; negative errno in case of error */
+int get_nsfd(const char *name)
+{
+	int fd;
+
+	/* the file of a namespace only becomes usable once it is mounted */
+	pthread_mutex_lock(&nsfd_lock);
+	fd = _get_nsfd(name);
+	pthread_mutex_unlock(&nsfd_lock);
+
+	return fd;
+}
+
 #endif
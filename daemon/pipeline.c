@@ -0,0 +1,342 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <pthread.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/utils.h>
+
+#include "internal.h"
+
+#define LOGPL(pl, lvl, fmt, args ...) \
+	LOGP(DPKT, lvl, "pipeline %s: " fmt, (pl)->name, ## args)
+
+/***********************************************************************
+ * Software RSS pipeline
+ ***********************************************************************/
+
+/* The reader thread of a socket / tun queue hands the buffers it received to one of the
+ * pipeline workers, chosen by a hash of the flow, via a single-producer single-consumer
+ * ring.  The worker processes them and passes them back via a second ring.  As the rings
+ * are FIFO and a flow always maps to the same worker, the packets of a flow stay in order.
+ *
+ * All buffers of a pipeline are allocated once; the rings are large enough to hold all of
+ * them, so they never overflow. */
+
+struct dp_ring {
+	/* producer side: published + not yet published entries */
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int head_pending;
+	/* consumer side */
+	unsigned int tail __attribute__((aligned(64)));
+	/* read-only */
+	unsigned int mask __attribute__((aligned(64)));
+	struct pkt_buf **slots;
+};
+
+static struct dp_ring *dp_ring_alloc(void *ctx, unsigned int min_size)
+{
+	struct dp_ring *r = talloc_zero(ctx, struct dp_ring);
+	unsigned int size = 1;
+
+	if (!r)
+		return NULL;
+	while (size < min_size)
+		size <<= 1;
+	r->mask = size - 1;
+	r->slots = talloc_zero_array(r, struct pkt_buf *, size);
+	if (!r->slots) {
+		talloc_free(r);
+		return NULL;
+	}
+	return r;
+}
+
+/* producer: append an entry, visible to the consumer after dp_ring_publish() */
+static inline void dp_ring_push(struct dp_ring *r, struct pkt_buf *pb)
+{
+	r->slots[r->head_pending++ & r->mask] = pb;
+}
+
+/* producer: returns true if there were unpublished entries */
+static inline bool dp_ring_publish(struct dp_ring *r)
+{
+	if (r->head_pending == r->head)
+		return false;
+	__atomic_store_n(&r->head, r->head_pending, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* consumer: take up to max entries; returns their number */
+static inline unsigned int dp_ring_pop(struct dp_ring *r, struct pkt_buf **bufs, unsigned int max)
+{
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	unsigned int i, n = OSMO_MIN(head - r->tail, max);
+
+	for (i = 0; i < n; i++)
+		bufs[i] = r->slots[(r->tail + i) & r->mask];
+	__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/* consumer: is there nothing to pop? */
+static inline bool dp_ring_empty(struct dp_ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail;
+}
+
+/* Sleeping + waking up: the consumer announces it is about to sleep, checks its ring(s)
+ * once more and then blocks on its eventfd.  The producer checks the announcement after
+ * publishing.  Both sides use a full barrier in between, so that either the consumer sees
+ * the new entries or the producer sees it sleeping. */
+
+static void dp_wake(int *sleeping, int efd)
+{
+	uint64_t val = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(sleeping, __ATOMIC_RELAXED)) {
+		if (write(efd, &val, sizeof(val)) < 0)
+			LOGP(DPKT, LOGL_ERROR, "Cannot wake up pipeline thread: %s\n", strerror(errno));
+	}
+}
+
+static void dp_sleep(int efd, struct rcu_reader *rcu)
+{
+	uint64_t val;
+
+	/* we hold no references while blocked */
+	if (rcu)
+		rcu_thread_offline(rcu);
+	if (read(efd, &val, sizeof(val)) < 0 && errno != EINTR)
+		LOGP(DPKT, LOGL_ERROR, "Cannot wait in pipeline thread: %s\n", strerror(errno));
+	if (rcu)
+		rcu_thread_online(rcu);
+}
+
+static void *dp_pipeline_thread(void *arg)
+{
+	struct dp_pipeline_worker *pw = arg;
+	struct dp_pipeline *pl = pw->pl;
+
+	rcu_register_thread(&pl->d->rcu, &pw->rcu);
+	pthread_cleanup_push(rcu_unregister_thread, &pw->rcu);
+	rcu_thread_online(&pw->rcu);
+
+	while (1) {
+		unsigned int n = dp_ring_pop(pw->work, pw->batch, pl->batch_size);
+
+		if (!n) {
+			if (__atomic_load_n(&pw->stop, __ATOMIC_ACQUIRE))
+				break;
+			__atomic_store_n(&pw->sleeping, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (dp_ring_empty(pw->work))
+				dp_sleep(pw->efd, &pw->rcu);
+			__atomic_store_n(&pw->sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		pl->process(pw, pw->batch, n);
+		pw->num_pkts += n;
+
+		/* hand the buffers back to the reader */
+		while (n--)
+			dp_ring_push(pw->ret, pw->batch[n]);
+		dp_ring_publish(pw->ret);
+		dp_wake(&pl->waiting, pl->efd);
+
+		/* we hold no references to tunnels from the previous batch */
+		rcu_quiescent_state(&pw->rcu);
+	}
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/* reader: move the buffers handed back by the workers to the free list */
+static void dp_pipeline_collect(struct dp_pipeline *pl)
+{
+	unsigned int i;
+
+	for (i = 0; i < pl->num_workers; i++)
+		pl->num_free += dp_ring_pop(pl->workers[i].ret, pl->free + pl->num_free,
+					    pl->num_bufs - pl->num_free);
+}
+
+/* reader: obtain n free buffers, waiting for the workers to hand back enough of them.  rcu is
+ * the RCU read-side state of the calling thread, or NULL if it isn't a data-plane thread */
+void dp_pipeline_get_bufs(struct dp_pipeline *pl, struct pkt_buf **bufs, unsigned int n,
+			  struct rcu_reader *rcu)
+{
+	while (pl->num_free < n) {
+		dp_pipeline_collect(pl);
+		if (pl->num_free >= n)
+			break;
+		__atomic_store_n(&pl->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		dp_pipeline_collect(pl);
+		if (pl->num_free < n)
+			dp_sleep(pl->efd, rcu);
+		__atomic_store_n(&pl->waiting, 0, __ATOMIC_RELAXED);
+	}
+
+	pl->num_free -= n;
+	memcpy(bufs, pl->free + pl->num_free, n * sizeof(*bufs));
+}
+
+/* reader: hand a buffer to the worker selected by hash; see dp_pipeline_flush().  The hash
+ * is mixed before mapping it to a worker: the TEIDs reaching one endpoint worker are already
+ * congruent modulo the number of endpoint workers (see gtp_ep_attach_reuseport_bpf()), which
+ * would leave all pipeline workers idle but those of one residue class */
+void dp_pipeline_push(struct dp_pipeline *pl, uint32_t hash, struct pkt_buf *pb)
+{
+	uint32_t mixed = hash * 0x9e3779b1U;
+
+	/* use the upper bits of the product, which depend on all bits of hash */
+	dp_ring_push(pl->workers[((uint64_t) mixed * pl->num_workers) >> 32].work, pb);
+}
+
+/* reader: make the pushed buffers visible to the workers and wake them up */
+void dp_pipeline_flush(struct dp_pipeline *pl)
+{
+	unsigned int i;
+
+	for (i = 0; i < pl->num_workers; i++) {
+		struct dp_pipeline_worker *pw = &pl->workers[i];
+		if (dp_ring_publish(pw->work))
+			dp_wake(&pw->sleeping, pw->efd);
+	}
+}
+
+static int dp_pipeline_destructor(struct dp_pipeline *pl)
+{
+	unsigned int i;
+
+	for (i = 0; i < pl->num_workers; i++) {
+		if (pl->workers[i].efd >= 0)
+			close(pl->workers[i].efd);
+	}
+	if (pl->efd >= 0)
+		close(pl->efd);
+	if (pl->bufs)
+		pkt_pool_free_bulk(pl->bufs, pl->num_bufs);
+	return 0;
+}
+
+/* allocate a pipeline of d->cfg.pipeline_workers workers, processing up to batch_size
+ * buffers (of pool) at a time.  The workers are only started by dp_pipeline_start(), so
+ * that the caller can set up their priv first */
+struct dp_pipeline *dp_pipeline_alloc(void *ctx, struct gtp_daemon *d, struct pkt_pool *pool,
+				      const char *name, unsigned int batch_size,
+				      dp_pipeline_cb process, void *priv)
+{
+	struct dp_pipeline *pl;
+	unsigned int i;
+
+	/* talloc is not thread safe, all alloc/free must come from main thread */
+	ASSERT_MAIN_THREAD(d);
+
+	if (!pool)
+		return NULL;
+	pl = talloc_zero(ctx, struct dp_pipeline);
+	if (!pl)
+		return NULL;
+
+	pl->d = d;
+	pl->name = talloc_strdup(pl, name);
+	pl->process = process;
+	pl->priv = priv;
+	pl->batch_size = batch_size;
+	pl->efd = -1;
+	pl->num_workers = d->cfg.pipeline_workers;
+	pl->workers = talloc_zero_array(pl, struct dp_pipeline_worker, pl->num_workers);
+	if (!pl->workers)
+		goto out_free;
+	for (i = 0; i < pl->num_workers; i++)
+		pl->workers[i].efd = -1;
+	talloc_set_destructor(pl, dp_pipeline_destructor);
+
+	/* the batch of the reader, one in the free list and one in flight per worker */
+	pl->num_bufs = batch_size * 2 * (pl->num_workers + 1);
+	pl->bufs = talloc_zero_array(pl, struct pkt_buf *, pl->num_bufs);
+	pl->free = talloc_zero_array(pl, struct pkt_buf *, pl->num_bufs);
+	if (!pl->bufs || !pl->free)
+		goto out_free;
+	if (pkt_pool_alloc_bulk(pool, pl->bufs, pl->num_bufs) < 0) {
+		LOGPL(pl, LOGL_ERROR, "Cannot allocate packet buffers\n");
+		goto out_free;
+	}
+	memcpy(pl->free, pl->bufs, pl->num_bufs * sizeof(*pl->free));
+	pl->num_free = pl->num_bufs;
+
+	pl->efd = eventfd(0, EFD_CLOEXEC);
+	if (pl->efd < 0)
+		goto out_free;
+
+	for (i = 0; i < pl->num_workers; i++) {
+		struct dp_pipeline_worker *pw = &pl->workers[i];
+		pw->pl = pl;
+		pw->idx = i;
+		pw->work = dp_ring_alloc(pl, pl->num_bufs);
+		pw->ret = dp_ring_alloc(pl, pl->num_bufs);
+		pw->batch = talloc_zero_array(pl, struct pkt_buf *, batch_size);
+		pw->efd = eventfd(0, EFD_CLOEXEC);
+		if (!pw->work || !pw->ret || !pw->batch || pw->efd < 0)
+			goto out_free;
+	}
+
+	return pl;
+
+out_free:
+	talloc_free(pl);
+	return NULL;
+}
+
+/* stop the workers of a pipeline; its reader must have been stopped before */
+void dp_pipeline_stop(struct dp_pipeline *pl)
+{
+	uint64_t val = 1;
+	unsigned int i;
+
+	for (i = 0; i < pl->num_workers; i++) {
+		struct dp_pipeline_worker *pw = &pl->workers[i];
+		if (!pw->running)
+			continue;
+		__atomic_store_n(&pw->stop, true, __ATOMIC_RELEASE);
+		if (write(pw->efd, &val, sizeof(val)) < 0)
+			LOGPL(pl, LOGL_ERROR, "Cannot wake up worker %u: %s\n", i, strerror(errno));
+		dp_thread_join(pl->d, pw->thread);
+		pw->running = false;
+	}
+}
+
+/* start the worker threads; returns 0 or negative on error */
+int dp_pipeline_start(struct dp_pipeline *pl)
+{
+	unsigned int i;
+
+	for (i = 0; i < pl->num_workers; i++) {
+		struct dp_pipeline_worker *pw = &pl->workers[i];
+		char name[32];
+		pw->stop = false;
+		snprintf(name, sizeof(name), "%s-w%u", pl->name, i);
+		if (dp_thread_create(pl->d, &pw->thread, name, -1, dp_pipeline_thread, pw)) {
+			LOGPL(pl, LOGL_ERROR, "Cannot start worker %u: %s\n", i, strerror(errno));
+			dp_pipeline_stop(pl);
+			return -1;
+		}
+		pw->running = true;
+	}
+
+	return 0;
+}
@@ -0,0 +1,264 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <pthread.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+
+#include "internal.h"
+
+#define LOGPOOL(pool, lvl, fmt, args ...) \
+	LOGP(DPKT, lvl, "pool(node %d, %u): " fmt, (pool)->numa_node, (pool)->data_len, ## args)
+
+/***********************************************************************
+ * Packet buffer pool
+ ***********************************************************************/
+
+/* Buffers are carved from slabs of PKT_SLAB_SIZE bytes, which are mmap()ed on demand (backed
+ * by a huge page if configured).  A slab whose buffers are all free again is returned, as
+ * long as the pool keeps another slab worth of free buffers.  Each pool has one size of
+ * buffers: those of the tun queue threads only need room for the MTU, all others for a
+ * GRO-coalesced datagram. */
+
+/* size of one slab: that of a (x86_64) huge page */
+#define PKT_SLAB_SIZE		(2 * 1024 * 1024)
+
+struct pkt_slab {
+	/* entry in pkt_pool->slabs */
+	struct llist_head list;
+	void *mem;
+	bool hugepage;
+	/* number of its buffers in the free list of the pool */
+	unsigned int num_free;
+};
+
+static int pkt_slab_destructor(struct pkt_slab *slab)
+{
+	munmap(slab->mem, PKT_SLAB_SIZE);
+	return 0;
+}
+
+/* prefer the memory of the NUMA node of the pool for a slab */
+static void pkt_slab_bind(struct pkt_pool *pool, struct pkt_slab *slab)
+{
+	unsigned long nodemask;
+
+	if (pool->numa_node < 0)
+		return;
+	nodemask = 1UL << pool->numa_node;
+	/* maxnode is the number of bits of nodemask + 1 */
+	if (syscall(SYS_mbind, slab->mem, PKT_SLAB_SIZE, MPOL_PREFERRED, &nodemask,
+		    sizeof(nodemask) * 8 + 1, 0) < 0)
+		LOGPOOL(pool, LOGL_NOTICE, "Cannot bind slab to NUMA node: %s\n", strerror(errno));
+}
+
+/* UNLOCKED add a slab to the pool and its buffers to the free list */
+static int _pkt_pool_grow(struct pkt_pool *pool)
+{
+	struct pkt_slab *slab;
+	unsigned int i;
+
+	if (pool->d->cfg.pkt_pool_max_mb &&
+	    (pool->num_slabs + 1) * PKT_SLAB_SIZE > pool->d->cfg.pkt_pool_max_mb * 1024UL * 1024UL)
+		return -1;
+
+	slab = talloc_zero(pool, struct pkt_slab);
+	if (!slab)
+		return -1;
+
+	slab->mem = MAP_FAILED;
+	if (pool->d->cfg.pkt_pool_hugepages) {
+		slab->mem = mmap(NULL, PKT_SLAB_SIZE, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (slab->mem == MAP_FAILED)
+			LOGPOOL(pool, LOGL_NOTICE, "Cannot allocate huge page: %s\n", strerror(errno));
+		else
+			slab->hugepage = true;
+	}
+	if (slab->mem == MAP_FAILED)
+		slab->mem = mmap(NULL, PKT_SLAB_SIZE, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab->mem == MAP_FAILED) {
+		LOGPOOL(pool, LOGL_ERROR, "Cannot allocate slab: %s\n", strerror(errno));
+		talloc_free(slab);
+		return -1;
+	}
+	talloc_set_destructor(slab, pkt_slab_destructor);
+	/* before the first write faults in the pages */
+	pkt_slab_bind(pool, slab);
+
+	for (i = 0; i < pool->bufs_per_slab; i++) {
+		struct pkt_buf *pb = (struct pkt_buf *) ((uint8_t *) slab->mem + i * pool->buf_size);
+		pb->pool = pool;
+		pb->slab = slab;
+		pb->next = pool->free_list;
+		pool->free_list = pb;
+	}
+	slab->num_free = pool->bufs_per_slab;
+	llist_add_tail(&slab->list, &pool->slabs);
+	pool->num_slabs++;
+	pool->num_bufs += pool->bufs_per_slab;
+	pool->num_free += pool->bufs_per_slab;
+
+	return 0;
+}
+
+/* UNLOCKED return the slabs whose buffers are all free, keeping another slab worth of free
+ * buffers so that creating + destroying a device doesn't map + unmap a slab each time */
+static void _pkt_pool_shrink(struct pkt_pool *pool)
+{
+	struct pkt_slab *slab, *slab2;
+	struct pkt_buf **pb;
+
+	llist_for_each_entry_safe(slab, slab2, &pool->slabs, list) {
+		if (slab->num_free < pool->bufs_per_slab)
+			continue;
+		if (pool->num_free < 2 * pool->bufs_per_slab)
+			return;
+
+		for (pb = &pool->free_list; *pb; ) {
+			if ((*pb)->slab == slab)
+				*pb = (*pb)->next;
+			else
+				pb = &(*pb)->next;
+		}
+		llist_del(&slab->list);
+		pool->num_slabs--;
+		pool->num_bufs -= pool->bufs_per_slab;
+		pool->num_free -= pool->bufs_per_slab;
+		talloc_free(slab);
+	}
+}
+
+/* allocate n buffers; all or none.  Returns 0 or negative if the pool is exhausted.  Only
+ * called from the main thread, as growing the pool allocates via talloc */
+int pkt_pool_alloc_bulk(struct pkt_pool *pool, struct pkt_buf **bufs, unsigned int n)
+{
+	unsigned int i;
+	int rc = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->num_free < n) {
+		if (_pkt_pool_grow(pool) < 0) {
+			pool->alloc_failures++;
+			rc = -1;
+			goto out_unlock;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		bufs[i] = pool->free_list;
+		pool->free_list = bufs[i]->next;
+		bufs[i]->slab->num_free--;
+	}
+	pool->num_free -= n;
+out_unlock:
+	pthread_mutex_unlock(&pool->lock);
+
+	return rc;
+}
+
+/* return n buffers (of the same pool) obtained by pkt_pool_alloc_bulk(); NULL entries
+ * are skipped.  Only called from the main thread, as empty slabs are released via talloc */
+void pkt_pool_free_bulk(struct pkt_buf **bufs, unsigned int n)
+{
+	struct pkt_pool *pool = NULL;
+	bool shrink = false;
+	unsigned int i;
+
+	for (i = 0; i < n && !pool; i++) {
+		if (bufs[i])
+			pool = bufs[i]->pool;
+	}
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < n; i++) {
+		if (!bufs[i])
+			continue;
+		bufs[i]->next = pool->free_list;
+		pool->free_list = bufs[i];
+		pool->num_free++;
+		if (++bufs[i]->slab->num_free == pool->bufs_per_slab)
+			shrink = true;
+		bufs[i] = NULL;
+	}
+	if (shrink)
+		_pkt_pool_shrink(pool);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static struct pkt_pool *pkt_pool_create(struct gtp_daemon *d, int numa_node, unsigned int data_len)
+{
+	struct pkt_pool *pool = talloc_zero(d, struct pkt_pool);
+
+	if (!pool)
+		return NULL;
+
+	pool->d = d;
+	pool->numa_node = numa_node;
+	pool->data_len = data_len;
+	pool->buf_size = (sizeof(struct pkt_buf) + PKT_BUF_HEADROOM + data_len + 63) & ~63;
+	pool->bufs_per_slab = PKT_SLAB_SIZE / pool->buf_size;
+	pthread_mutex_init(&pool->lock, NULL);
+	INIT_LLIST_HEAD(&pool->slabs);
+	llist_add_tail(&pool->list, &d->pkt_pools);
+	LOGPOOL(pool, LOGL_INFO, "Created\n");
+
+	return pool;
+}
+
+/* find or create the pool of a NUMA node (-1: that configured for the data-plane, if any)
+ * with buffers of given room for the packet (PKT_BUF_DATA_LEN or PKT_BUF_MTU_DATA_LEN) */
+struct pkt_pool *pkt_pool_get(struct gtp_daemon *d, int numa_node, unsigned int data_len)
+{
+	struct pkt_pool *pool;
+
+	/* talloc is not thread safe, all alloc/free must come from main thread */
+	ASSERT_MAIN_THREAD(d);
+
+	if (numa_node < 0)
+		numa_node = d->cfg.numa_node;
+	if (numa_node >= PKT_POOL_MAX_NODES)
+		numa_node = -1;
+
+	llist_for_each_entry(pool, &d->pkt_pools, list) {
+		if (pool->numa_node == numa_node && pool->data_len == data_len)
+			return pool;
+	}
+	return pkt_pool_create(d, numa_node, data_len);
+}
+
+/* NUMA node of a CPU, or -1 if unknown */
+int pkt_pool_cpu_node(unsigned int cpu)
+{
+	char path[64];
+	struct dirent *de;
+	DIR *dir;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((de = readdir(dir))) {
+		if (sscanf(de->d_name, "node%d", &node) == 1)
+			break;
+	}
+	closedir(dir);
+
+	return node;
+}
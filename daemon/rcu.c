@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <sched.h>
+#include <pthread.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/talloc.h>
+
+#include "rcu.h"
+
+/***********************************************************************
+ * Quiescent-state based RCU
+ ***********************************************************************/
+
+int rcu_domain_init(struct rcu_domain *dom, void *ctx)
+{
+	pthread_mutex_init(&dom->lock, NULL);
+	INIT_LLIST_HEAD(&dom->readers);
+	dom->gp_ctr = 1;
+	dom->deferred = talloc_named_const(ctx, 0, "rcu_deferred");
+	if (!dom->deferred)
+		return -1;
+	return 0;
+}
+
+/* register the calling thread as reader; it starts offline */
+void rcu_register_thread(struct rcu_domain *dom, struct rcu_reader *r)
+{
+	r->dom = dom;
+	r->ctr = 0;
+	pthread_mutex_lock(&dom->lock);
+	llist_add_tail(&r->list, &dom->readers);
+	pthread_mutex_unlock(&dom->lock);
+}
+
+/* unregister a reader; suitable as pthread cleanup handler */
+void rcu_unregister_thread(void *arg)
+{
+	struct rcu_reader *r = arg;
+
+	rcu_thread_offline(r);
+	pthread_mutex_lock(&r->dom->lock);
+	llist_del(&r->list);
+	pthread_mutex_unlock(&r->dom->lock);
+}
+
+/* wait until all readers online at the time of the call have passed a quiescent state */
+void rcu_synchronize(struct rcu_domain *dom)
+{
+	struct rcu_reader *r;
+	unsigned long gp;
+
+	pthread_mutex_lock(&dom->lock);
+
+	gp = dom->gp_ctr + 1;
+	if (gp == 0)
+		gp = 1;
+	__atomic_store_n(&dom->gp_ctr, gp, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	llist_for_each_entry(r, &dom->readers, list) {
+		while (1) {
+			unsigned long ctr = __atomic_load_n(&r->ctr, __ATOMIC_RELAXED);
+			if (ctr == 0 || ctr == gp)
+				break;
+			sched_yield();
+		}
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&dom->lock);
+}
+
+/* free talloc_obj (and its children) after the next grace period, see rcu_reclaim() */
+void rcu_defer_free(struct rcu_domain *dom, void *talloc_obj)
+{
+	talloc_steal(dom->deferred, talloc_obj);
+}
+
+/* wait for a grace period and free all objects passed to rcu_defer_free() before */
+void rcu_reclaim(struct rcu_domain *dom)
+{
+	/* nothing but the context itself */
+	if (talloc_total_blocks(dom->deferred) <= 1)
+		return;
+	rcu_synchronize(dom);
+	talloc_free_children(dom->deferred);
+}
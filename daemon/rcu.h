@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+/* Minimal quiescent-state based RCU (read-copy-update) for the data plane.
+ *
+ * Readers (the data-plane threads) never take a lock and only ever write to their own
+ * struct rcu_reader.  A reader is "online" while it may hold references to RCU protected
+ * objects, and goes "offline" before any potentially blocking call.
+ *
+ * The (single) writer is the main thread.  It unpublishes an object, then calls
+ * rcu_synchronize() to wait until every reader has gone through a quiescent state, after
+ * which nobody can hold a reference anymore and the object can be freed. */
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/hashtable.h>
+
+struct rcu_domain {
+	/* protects the list of readers */
+	pthread_mutex_t lock;
+	/* all registered struct rcu_reader */
+	struct llist_head readers;
+	/* grace period counter; incremented by every rcu_synchronize() */
+	unsigned long gp_ctr;
+	/* talloc context for objects awaiting the end of a grace period */
+	void *deferred;
+};
+
+struct rcu_reader {
+	struct llist_head list;
+	struct rcu_domain *dom;
+	/* 0 while offline, else the value of gp_ctr at the last quiescent state */
+	unsigned long ctr;
+} __attribute__((aligned(64)));
+
+int rcu_domain_init(struct rcu_domain *dom, void *ctx);
+
+void rcu_register_thread(struct rcu_domain *dom, struct rcu_reader *r);
+void rcu_unregister_thread(void *r);
+
+void rcu_synchronize(struct rcu_domain *dom);
+void rcu_defer_free(struct rcu_domain *dom, void *talloc_obj);
+void rcu_reclaim(struct rcu_domain *dom);
+
+static inline void rcu_thread_online(struct rcu_reader *r)
+{
+	__atomic_store_n(&r->ctr, __atomic_load_n(&r->dom->gp_ctr, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_thread_offline(struct rcu_reader *r)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	__atomic_store_n(&r->ctr, 0, __ATOMIC_RELAXED);
+}
+
+/* announce that the calling reader holds no references to RCU protected objects */
+static inline void rcu_quiescent_state(struct rcu_reader *r)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	rcu_thread_online(r);
+}
+
+#define rcu_dereference(p)	__atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* hlist / hashtable variants that may be traversed concurrently by readers */
+
+static inline void rcu_hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	n->pprev = &h->first;
+	if (first)
+		first->pprev = &n->next;
+	rcu_assign_pointer(h->first, n);
+}
+
+/* leaves n->next intact, as readers may still be positioned on n */
+static inline void rcu_hlist_del(struct hlist_node *n)
+{
+	struct hlist_node *next = n->next;
+	struct hlist_node **pprev = n->pprev;
+
+	rcu_assign_pointer(*pprev, next);
+	if (next)
+		next->pprev = pprev;
+	n->pprev = NULL;
+}
+
+#define rcu_hlist_for_each_entry(pos, head, member) \
+	for (pos = hlist_entry_safe(rcu_dereference((head)->first), typeof(*(pos)), member); \
+	     pos; \
+	     pos = hlist_entry_safe(rcu_dereference((pos)->member.next), typeof(*(pos)), member))
+
+#define rcu_hash_add(hashtable, node, key) \
+	rcu_hlist_add_head(node, &hashtable[hash_min(key, HASH_BITS(hashtable))])
+
+#define rcu_hash_del(node) rcu_hlist_del(node)
+
+#define rcu_hash_for_each_possible(name, obj, member, key) \
+	rcu_hlist_for_each_entry(obj, &name[hash_min(key, HASH_BITS(name))], member)
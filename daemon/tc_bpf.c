@@ -0,0 +1,636 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h>
+
+#include <linux/netlink.h>
+#include <netlink/netlink.h>
+#include <netlink/socket.h>
+#include <netlink/errno.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/utils.h>
+
+#include "gtp.h"
+#include "internal.h"
+#include "ebpf.h"
+
+#define LOGTC(lvl, fmt, args ...) \
+	LOGP(DTUN, lvl, "tc-bpf: " fmt, ## args)
+
+/***********************************************************************
+ * TC eBPF offload of GTP-U encapsulation + decapsulation
+ ***********************************************************************/
+
+/* Two programs in direct-action mode at the clsact hooks:
+ *
+ * - decap, at ingress of the interface owning the bind address of a GTP endpoint: looks up
+ *   (outer destination address, port, TEID) of plain GTPv1-U T-PDUs carrying IPv4, strips
+ *   the outer headers and redirects the inner packet to ingress of the tun device.
+ * - encap, at egress of a tun device: looks up (tun ifindex, source address) of IPv4
+ *   packets, prepends Ethernet/IPv4/UDP/GTP headers and redirects them to egress of the
+ *   interface of the endpoint, letting the kernel fill in the Ethernet addresses.
+ *
+ * The maps are populated from the tunnel table.  Anything the programs do not handle
+ * (unknown tunnels, GTP extension headers / sequence numbers, IPv6, IP fragments) continues
+ * on its normal path to the userspace threads.  Redirects cannot cross network namespaces,
+ * so only tun devices in the namespace of the daemon are offloaded. */
+
+#ifndef BPF_F_BEFORE
+/* the TCX attach types of Linux 6.6, missing from older headers */
+#define BPF_TCX_INGRESS		46
+#define BPF_TCX_EGRESS		47
+#endif
+
+/* maximum number of offloaded tunnels */
+#define TC_BPF_MAX_TUNNELS	65536
+
+/* outer headers in front of the inner IP packet */
+#define TC_OUTER_LEN		(sizeof(struct iphdr) + sizeof(struct udphdr) + sizeof(struct gtp1_header))
+#define TC_HDRS_LEN		(ETH_HLEN + TC_OUTER_LEN)
+
+/* all fields as they appear in the packet (network byte order) */
+struct tc_decap_key {
+	uint32_t daddr;
+	uint32_t dport;
+	uint32_t teid;
+};
+
+struct tc_decap_val {
+	uint32_t ifindex;
+};
+
+struct tc_encap_key {
+	uint32_t ifindex;
+	uint32_t saddr;
+};
+
+struct tc_encap_val {
+	/* outer addresses + ports, network byte order */
+	uint32_t saddr;
+	uint32_t daddr;
+	uint16_t sport;
+	uint16_t dport;
+	/* Tx TEID, network byte order */
+	uint32_t teid;
+	/* IPv4 header checksum over all fields but the total length, not yet folded */
+	uint32_t csum;
+	/* interface to transmit on */
+	uint32_t ifindex;
+};
+
+/* an interface with the decap program attached, shared by all endpoints on it */
+struct tc_bpf_if {
+	struct llist_head list;
+	int ifindex;
+	unsigned long use_count;
+	/* TCX link of the decap program, or -1 if attached as cls_bpf filter */
+	int link_fd;
+};
+
+struct tc_bpf {
+	/* netlink socket in the namespace of the daemon */
+	struct nl_sock *nl;
+	int decap_map_fd;
+	int encap_map_fd;
+	int decap_prog_fd;
+	int encap_prog_fd;
+	/* list of struct tc_bpf_if */
+	struct llist_head ifs;
+};
+
+static int tc_map_create(uint32_t key_size, uint32_t value_size)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_HASH;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = TC_BPF_MAX_TUNNELS;
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int tc_prog_load(const struct bpf_insn *insns, unsigned int insn_cnt, const char *name)
+{
+	static char log_buf[4096];
+	union bpf_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+	attr.insns = (uintptr_t) insns;
+	attr.insn_cnt = insn_cnt;
+	attr.license = (uintptr_t) "GPL";
+	attr.log_buf = (uintptr_t) log_buf;
+	attr.log_size = sizeof(log_buf);
+	attr.log_level = 1;
+	strncpy(attr.prog_name, name, sizeof(attr.prog_name) - 1);
+
+	log_buf[0] = '\0';
+	fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0)
+		LOGTC(LOGL_ERROR, "Cannot load %s program: %s\n%s\n", name, strerror(errno), log_buf);
+	return fd;
+}
+
+/* index of the 'pass' label in the decap program */
+#define DECAP_PASS		42
+#define TO_DECAP_PASS(idx)	(DECAP_PASS - (idx) - 1)
+
+static int tc_decap_prog_load(struct tc_bpf *tb)
+{
+	const struct bpf_insn prog[] = {
+		/* r6 = skb; r2 = data; r3 = data_end */
+		[0] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		[1] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct __sk_buff, data), 0),
+		[2] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct __sk_buff, data_end), 0),
+		/* outer headers + first byte of the inner IP header */
+		[3] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+		[4] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, TC_HDRS_LEN + 1),
+		[5] = INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, TO_DECAP_PASS(5), 0),
+		/* IPv4 without options, not a fragment, UDP */
+		[6] = INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, offsetof(struct ethhdr, h_proto), 0),
+		[7] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, TO_DECAP_PASS(7), htons(ETH_P_IP)),
+		[8] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2, ETH_HLEN, 0),
+		[9] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, TO_DECAP_PASS(9), 0x45),
+		[10] = INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2,
+			    ETH_HLEN + offsetof(struct iphdr, frag_off), 0),
+		[11] = INSN(BPF_JMP | BPF_JSET | BPF_K, BPF_REG_4, 0, TO_DECAP_PASS(11), htons(IP_MF | IP_OFFMASK)),
+		[12] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2,
+			    ETH_HLEN + offsetof(struct iphdr, protocol), 0),
+		[13] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, TO_DECAP_PASS(13), IPPROTO_UDP),
+		/* GTPv1 T-PDU without optional fields or extension headers */
+		[14] = INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2,
+			    ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr), 0),
+		[15] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, TO_DECAP_PASS(15), htons(0x3000 | GTP_TPDU)),
+		/* inner IPv4 */
+		[16] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2, TC_HDRS_LEN, 0),
+		[17] = INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_4, 0, 0, 0xf0),
+		[18] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, TO_DECAP_PASS(18), 0x40),
+		/* struct tc_decap_key on the stack */
+		[19] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_2,
+			    ETH_HLEN + offsetof(struct iphdr, daddr), 0),
+		[20] = INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_4, -12, 0),
+		[21] = INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2,
+			    ETH_HLEN + sizeof(struct iphdr) + offsetof(struct udphdr, dest), 0),
+		[22] = INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_4, -8, 0),
+		[23] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_2,
+			    ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr) +
+			    offsetof(struct gtp1_header, tid), 0),
+		[24] = INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_4, -4, 0),
+		/* r0 = bpf_map_lookup_elem(&decap_map, &key) */
+		[25] = INSN_LD_MAP_FD(BPF_REG_1, tb->decap_map_fd),
+		[27] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+		[28] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -12),
+		[29] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		[30] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, TO_DECAP_PASS(30), 0),
+		[31] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_0, offsetof(struct tc_decap_val, ifindex), 0),
+		/* strip the outer IP/UDP/GTP headers behind the Ethernet header */
+		[32] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+		[33] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, -(int) TC_OUTER_LEN),
+		[34] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, BPF_ADJ_ROOM_MAC),
+		[35] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+		[36] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_adjust_room),
+		[37] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, TO_DECAP_PASS(37), 0),
+		/* return bpf_redirect(ifindex, BPF_F_INGRESS) */
+		[38] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0),
+		[39] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, BPF_F_INGRESS),
+		[40] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect),
+		[41] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		/* pass: continue to the UDP socket */
+		[DECAP_PASS] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, TC_ACT_OK),
+		[DECAP_PASS+1] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+
+	tb->decap_prog_fd = tc_prog_load(prog, ARRAY_SIZE(prog), "uecups_decap");
+	return tb->decap_prog_fd;
+}
+
+/* index of the 'pass' and 'drop' labels in the encap program */
+#define ENCAP_PASS		75
+#define ENCAP_DROP		77
+#define TO_ENCAP_PASS(idx)	(ENCAP_PASS - (idx) - 1)
+#define TO_ENCAP_DROP(idx)	(ENCAP_DROP - (idx) - 1)
+
+/* offsets of the outer headers in the packet */
+#define OFF_IP			ETH_HLEN
+#define OFF_UDP			(OFF_IP + sizeof(struct iphdr))
+#define OFF_GTP			(OFF_UDP + sizeof(struct udphdr))
+
+static int tc_encap_prog_load(struct tc_bpf *tb)
+{
+	const struct bpf_insn prog[] = {
+		/* r6 = skb; r2 = data; r3 = data_end */
+		[0] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		[1] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct __sk_buff, data), 0),
+		[2] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct __sk_buff, data_end), 0),
+		/* IPv4 */
+		[3] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+		[4] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, sizeof(struct iphdr)),
+		[5] = INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, TO_ENCAP_PASS(5), 0),
+		[6] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2, 0, 0),
+		[7] = INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_4, 0, 0, 0xf0),
+		[8] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, TO_ENCAP_PASS(8), 0x40),
+		/* struct tc_encap_key on the stack */
+		[9] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_2, offsetof(struct iphdr, saddr), 0),
+		[10] = INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_4, -4, 0),
+		[11] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_6, offsetof(struct __sk_buff, ifindex), 0),
+		[12] = INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_4, -8, 0),
+		/* r7 = bpf_map_lookup_elem(&encap_map, &key) */
+		[13] = INSN_LD_MAP_FD(BPF_REG_1, tb->encap_map_fd),
+		[15] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+		[16] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+		[17] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		[18] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, TO_ENCAP_PASS(18), 0),
+		[19] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0),
+		/* r8 = length of the inner packet */
+		[20] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_8, BPF_REG_6, offsetof(struct __sk_buff, len), 0),
+		/* make room for Ethernet + outer headers; leaves the packet as is on failure */
+		[21] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+		[22] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, TC_HDRS_LEN),
+		[23] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0),
+		[24] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_change_head),
+		[25] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, TO_ENCAP_PASS(25), 0),
+		[26] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, data), 0),
+		[27] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct __sk_buff, data_end), 0),
+		[28] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+		[29] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, TC_HDRS_LEN),
+		[30] = INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, TO_ENCAP_DROP(30), 0),
+		/* Ethernet: the addresses (zeroed) are filled in by bpf_redirect_neigh() */
+		[31] = INSN(BPF_ST | BPF_MEM | BPF_H, BPF_REG_2, 0, offsetof(struct ethhdr, h_proto), htons(ETH_P_IP)),
+		/* IPv4: version/IHL/TOS, total length, ID/fragment offset, TTL/protocol */
+		[32] = INSN(BPF_ST | BPF_MEM | BPF_H, BPF_REG_2, 0, OFF_IP, htons(0x4500)),
+		[33] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_5, BPF_REG_8, 0, 0),
+		[34] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_5, 0, 0, TC_OUTER_LEN),
+		[35] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_5, 0, 0),
+		[36] = INSN(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_4, 0, 0, 16),
+		[37] = INSN(BPF_STX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_4, OFF_IP + offsetof(struct iphdr, tot_len), 0),
+		[38] = INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_2, 0, OFF_IP + offsetof(struct iphdr, id), 0),
+		[39] = INSN(BPF_ST | BPF_MEM | BPF_H, BPF_REG_2, 0, OFF_IP + offsetof(struct iphdr, ttl),
+			    htons(64 << 8 | IPPROTO_UDP)),
+		/* IPv4 header checksum: add the total length (r5), fold, complement */
+		[40] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_7, offsetof(struct tc_encap_val, csum), 0),
+		[41] = INSN(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_5, BPF_REG_4, 0, 0),
+		[42] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_5, 0, 0),
+		[43] = INSN(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_4, 0, 0, 16),
+		[44] = INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0xffff),
+		[45] = INSN(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_5, BPF_REG_4, 0, 0),
+		[46] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_5, 0, 0),
+		[47] = INSN(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_4, 0, 0, 16),
+		[48] = INSN(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_5, BPF_REG_4, 0, 0),
+		[49] = INSN(BPF_ALU64 | BPF_XOR | BPF_K, BPF_REG_5, 0, 0, 0xffff),
+		[50] = INSN(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_5, 0, 0, 16),
+		[51] = INSN(BPF_STX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_5, OFF_IP + offsetof(struct iphdr, check), 0),
+		/* IPv4 addresses */
+		[52] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_7, offsetof(struct tc_encap_val, saddr), 0),
+		[53] = INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_4, OFF_IP + offsetof(struct iphdr, saddr), 0),
+		[54] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_7, offsetof(struct tc_encap_val, daddr), 0),
+		[55] = INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_4, OFF_IP + offsetof(struct iphdr, daddr), 0),
+		/* UDP: both ports at once, length, no checksum */
+		[56] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_7, offsetof(struct tc_encap_val, sport), 0),
+		[57] = INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_4, OFF_UDP + offsetof(struct udphdr, source), 0),
+		[58] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_8, 0, 0),
+		[59] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0,
+			    sizeof(struct udphdr) + sizeof(struct gtp1_header)),
+		[60] = INSN(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_4, 0, 0, 16),
+		[61] = INSN(BPF_STX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_4, OFF_UDP + offsetof(struct udphdr, len), 0),
+		[62] = INSN(BPF_ST | BPF_MEM | BPF_H, BPF_REG_2, 0, OFF_UDP + offsetof(struct udphdr, check), 0),
+		/* GTPv1: flags/type, length, TEID */
+		[63] = INSN(BPF_ST | BPF_MEM | BPF_H, BPF_REG_2, 0, OFF_GTP, htons(0x3000 | GTP_TPDU)),
+		[64] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_8, 0, 0),
+		[65] = INSN(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_4, 0, 0, 16),
+		[66] = INSN(BPF_STX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_4, OFF_GTP + offsetof(struct gtp1_header, length), 0),
+		[67] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_7, offsetof(struct tc_encap_val, teid), 0),
+		[68] = INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_4, OFF_GTP + offsetof(struct gtp1_header, tid), 0),
+		/* return bpf_redirect_neigh(ifindex, NULL, 0, 0) */
+		[69] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_7, offsetof(struct tc_encap_val, ifindex), 0),
+		[70] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 0),
+		[71] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0),
+		[72] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+		[73] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_neigh),
+		[74] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		/* pass: continue to the tun file descriptor */
+		[ENCAP_PASS] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, TC_ACT_OK),
+		[ENCAP_PASS+1] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		[ENCAP_DROP] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, TC_ACT_SHOT),
+		[ENCAP_DROP+1] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+
+	tb->encap_prog_fd = tc_prog_load(prog, ARRAY_SIZE(prog), "uecups_encap");
+	return tb->encap_prog_fd;
+}
+
+static void tc_bpf_free(struct tc_bpf *tb)
+{
+	if (tb->encap_prog_fd >= 0)
+		close(tb->encap_prog_fd);
+	if (tb->decap_prog_fd >= 0)
+		close(tb->decap_prog_fd);
+	if (tb->encap_map_fd >= 0)
+		close(tb->encap_map_fd);
+	if (tb->decap_map_fd >= 0)
+		close(tb->decap_map_fd);
+	if (tb->nl)
+		nl_socket_free(tb->nl);
+	talloc_free(tb);
+}
+
+/* create the maps + load the programs on first use; they live as long as the daemon */
+static struct tc_bpf *tc_bpf_get(struct gtp_daemon *d)
+{
+	struct tc_bpf *tb;
+
+	if (d->tc_bpf)
+		return d->tc_bpf;
+
+	tb = talloc_zero(d, struct tc_bpf);
+	if (!tb)
+		return NULL;
+	INIT_LLIST_HEAD(&tb->ifs);
+	tb->decap_map_fd = tb->encap_map_fd = tb->decap_prog_fd = tb->encap_prog_fd = -1;
+
+	tb->nl = nl_socket_alloc();
+	if (!tb->nl || nl_connect(tb->nl, NETLINK_ROUTE) < 0) {
+		LOGTC(LOGL_ERROR, "Cannot create netlink socket\n");
+		goto err;
+	}
+
+	tb->decap_map_fd = tc_map_create(sizeof(struct tc_decap_key), sizeof(struct tc_decap_val));
+	tb->encap_map_fd = tc_map_create(sizeof(struct tc_encap_key), sizeof(struct tc_encap_val));
+	if (tb->decap_map_fd < 0 || tb->encap_map_fd < 0) {
+		LOGTC(LOGL_ERROR, "Cannot create maps: %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (tc_decap_prog_load(tb) < 0 || tc_encap_prog_load(tb) < 0)
+		goto err;
+
+	d->tc_bpf = tb;
+	return tb;
+
+err:
+	tc_bpf_free(tb);
+	return NULL;
+}
+
+static struct tc_bpf_if *tc_bpf_if_find(struct tc_bpf *tb, int ifindex)
+{
+	struct tc_bpf_if *tif;
+
+	llist_for_each_entry(tif, &tb->ifs, list) {
+		if (tif->ifindex == ifindex)
+			return tif;
+	}
+	return NULL;
+}
+
+/* attach a program to the ingress or egress hook of a device.  Preferably as TCX link
+ * (Linux 6.6), which detaches itself once its fd is closed, at the latest when the daemon
+ * exits; *link_fd is -1 if attached as cls_bpf filter instead.  Returns 0 or a negative
+ * netlink error code */
+static int tc_bpf_attach(struct nl_sock *nl, int ifindex, bool ingress, int prog_fd,
+			 const char *name, int *link_fd)
+{
+	union bpf_attr attr;
+
+	/* a filter left behind by an earlier run would keep redirecting with its stale maps,
+	 * and block adding ours */
+	netdev_del_tc_bpf(nl, ifindex, ingress);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = ingress ? BPF_TCX_INGRESS : BPF_TCX_EGRESS;
+	*link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (*link_fd >= 0)
+		return 0;
+
+	return netdev_add_tc_bpf(nl, ifindex, ingress, prog_fd, name);
+}
+
+static void tc_bpf_detach(struct nl_sock *nl, int ifindex, bool ingress, int link_fd)
+{
+	if (link_fd >= 0)
+		close(link_fd);
+	else
+		netdev_del_tc_bpf(nl, ifindex, ingress);
+}
+
+/* attach the decap program to the interface of the endpoint, unless already done for
+ * another endpoint on it */
+int tc_bpf_ep_attach(struct gtp_endpoint *ep)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *) &ep->bind_addr;
+	struct tc_bpf *tb;
+	struct tc_bpf_if *tif;
+	int ifindex, link_fd, rc;
+
+	ASSERT_MAIN_THREAD(ep->d);
+
+	if (ep->bind_addr.ss_family != AF_INET || sin->sin_addr.s_addr == htonl(INADDR_ANY)) {
+		LOGTC(LOGL_NOTICE, "%s: offload requires binding to a specific IPv4 address\n", ep->name);
+		return -1;
+	}
+	ifindex = netdev_find_ifindex(sin);
+	if (!ifindex) {
+		LOGTC(LOGL_ERROR, "%s: cannot find interface of bind address\n", ep->name);
+		return -1;
+	}
+
+	tb = tc_bpf_get(ep->d);
+	if (!tb)
+		return -1;
+
+	tif = tc_bpf_if_find(tb, ifindex);
+	if (!tif) {
+		rc = tc_bpf_attach(tb->nl, ifindex, true, tb->decap_prog_fd, "uecups_decap", &link_fd);
+		if (rc < 0) {
+			LOGTC(LOGL_ERROR, "%s: cannot attach decap program to ifindex %d: %s\n",
+				ep->name, ifindex, nl_geterror(rc));
+			return -1;
+		}
+		tif = talloc_zero(tb, struct tc_bpf_if);
+		OSMO_ASSERT(tif);
+		tif->ifindex = ifindex;
+		tif->link_fd = link_fd;
+		llist_add_tail(&tif->list, &tb->ifs);
+	}
+	tif->use_count++;
+	ep->tc_ifindex = ifindex;
+
+	LOGTC(LOGL_INFO, "%s: offloading decapsulation on ifindex %d\n", ep->name, ifindex);
+	return 0;
+}
+
+void tc_bpf_ep_detach(struct gtp_endpoint *ep)
+{
+	struct tc_bpf *tb = ep->d->tc_bpf;
+	struct tc_bpf_if *tif;
+
+	if (!ep->tc_ifindex)
+		return;
+
+	tif = tc_bpf_if_find(tb, ep->tc_ifindex);
+	OSMO_ASSERT(tif);
+	ep->tc_ifindex = 0;
+	if (--tif->use_count)
+		return;
+
+	tc_bpf_detach(tb->nl, tif->ifindex, true, tif->link_fd);
+	llist_del(&tif->list);
+	talloc_free(tif);
+}
+
+/* attach the encap program to a tun device */
+int tc_bpf_tun_attach(struct tun_device *tun)
+{
+	struct tc_bpf *tb;
+	int rc;
+
+	ASSERT_MAIN_THREAD(tun->d);
+
+	if (tun->netns_name) {
+		LOGTC(LOGL_NOTICE, "%s: tun devices in other namespaces are not offloaded\n",
+			tun->devname);
+		return -1;
+	}
+
+	tb = tc_bpf_get(tun->d);
+	if (!tb)
+		return -1;
+
+	rc = tc_bpf_attach(tun->nl, tun->ifindex, false, tb->encap_prog_fd, "uecups_encap",
+			   &tun->tc_encap_link_fd);
+	if (rc < 0) {
+		LOGTC(LOGL_ERROR, "%s: cannot attach encap program: %s\n", tun->devname,
+			nl_geterror(rc));
+		return -1;
+	}
+	tun->tc_encap = true;
+
+	LOGTC(LOGL_INFO, "%s: offloading encapsulation\n", tun->devname);
+	return 0;
+}
+
+/* undo tc_bpf_tun_attach(), before the device is closed */
+void tc_bpf_tun_detach(struct tun_device *tun)
+{
+	if (!tun->tc_encap)
+		return;
+	tc_bpf_detach(tun->nl, tun->ifindex, false, tun->tc_encap_link_fd);
+	tun->tc_encap = false;
+}
+
+static void tc_bpf_tunnel_keys(const struct gtp_tunnel *t, struct tc_decap_key *dkey,
+			       struct tc_encap_key *ekey)
+{
+	const struct sockaddr_in *local = (const struct sockaddr_in *) &t->gtp_ep->bind_addr;
+	const struct sockaddr_in *ue = (const struct sockaddr_in *) &t->user_addr;
+
+	memset(dkey, 0, sizeof(*dkey));
+	dkey->daddr = local->sin_addr.s_addr;
+	dkey->dport = local->sin_port;
+	dkey->teid = htonl(t->rx_teid);
+
+	memset(ekey, 0, sizeof(*ekey));
+	ekey->ifindex = t->tun_dev->ifindex;
+	ekey->saddr = ue->sin_addr.s_addr;
+}
+
+static int tc_map_update(int map_fd, const void *key, const void *val)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t) key;
+	attr.value = (uintptr_t) val;
+	attr.flags = BPF_NOEXIST;
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void tc_map_delete(int map_fd, const void *key)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t) key;
+	sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/* install a tunnel into the maps, if both its endpoint and tun device are offloaded */
+void tc_bpf_tunnel_add(struct gtp_tunnel *t)
+{
+	struct tc_bpf *tb = t->d->tc_bpf;
+	const struct sockaddr_in *local = (const struct sockaddr_in *) &t->gtp_ep->bind_addr;
+	const struct sockaddr_in *remote = (const struct sockaddr_in *) &t->peer->addr;
+	struct tc_decap_key dkey;
+	struct tc_decap_val dval;
+	struct tc_encap_key ekey;
+	struct tc_encap_val eval;
+	uint32_t s, da;
+
+	ASSERT_MAIN_THREAD(t->d);
+
+	if (!t->gtp_ep->tc_ifindex || !t->tun_dev->tc_encap)
+		return;
+	if (t->user_addr.ss_family != AF_INET || remote->sin_family != AF_INET)
+		return;
+
+	tc_bpf_tunnel_keys(t, &dkey, &ekey);
+
+	memset(&dval, 0, sizeof(dval));
+	dval.ifindex = t->tun_dev->ifindex;
+
+	memset(&eval, 0, sizeof(eval));
+	eval.saddr = local->sin_addr.s_addr;
+	eval.daddr = remote->sin_addr.s_addr;
+	/* the port of the endpoint, like all uplink (see struct gtp_peer) */
+	eval.sport = local->sin_port;
+	eval.dport = remote->sin_port;
+	eval.teid = htonl(t->tx_teid);
+	eval.ifindex = t->gtp_ep->tc_ifindex;
+	s = ntohl(eval.saddr);
+	da = ntohl(eval.daddr);
+	eval.csum = 0x4500 + (64 << 8 | IPPROTO_UDP) + (s >> 16) + (s & 0xffff) + (da >> 16) + (da & 0xffff);
+
+	if (tc_map_update(tb->decap_map_fd, &dkey, &dval) < 0) {
+		LOGP(DGT, LOGL_NOTICE, "%s: not offloaded: %s\n", t->name, strerror(errno));
+		return;
+	}
+	if (tc_map_update(tb->encap_map_fd, &ekey, &eval) < 0) {
+		LOGP(DGT, LOGL_NOTICE, "%s: not offloaded: %s\n", t->name, strerror(errno));
+		tc_map_delete(tb->decap_map_fd, &dkey);
+		return;
+	}
+	t->tc_offload = true;
+}
+
+void tc_bpf_tunnel_del(struct gtp_tunnel *t)
+{
+	struct tc_bpf *tb = t->d->tc_bpf;
+	struct tc_decap_key dkey;
+	struct tc_encap_key ekey;
+
+	if (!t->tc_offload)
+		return;
+
+	tc_bpf_tunnel_keys(t, &dkey, &ekey);
+	tc_map_delete(tb->decap_map_fd, &dkey);
+	tc_map_delete(tb->encap_map_fd, &ekey);
+	t->tc_offload = false;
+}
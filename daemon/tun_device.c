@@ -1,4 +1,5 @@
 /* SPDX-License-Identifier: GPL-2.0 */
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -12,9 +13,11 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <netdb.h>
+#include <poll.h>
 
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
+#include <netinet/udp.h>
 
 #include <pthread.h>
 
@@ -34,11 +37,16 @@
 #include "gtp.h"
 #include "internal.h"
 #include "netns.h"
+#include "kernel_gtp.h"
 
 /***********************************************************************
  * TUN Device
  ***********************************************************************/
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT	103
+#endif
+
 #define LOGTUN(tun, lvl, fmt, args ...) \
 	LOGP(DTUN, lvl, "%s: " fmt, (tun)->devname, ## args)
 
@@ -120,73 +128,523 @@ static int parse_pkt(struct pkt_info *out, const uint8_t *in, unsigned int in_le
 	return 0;
 }
 
-/* one thread for reading from each TUN device (TUN -> GTP encapsulation) */
-static void *tun_device_thread(void *arg)
+/* state of one batch of packets read from the tun device and sent via sendmmsg() */
+struct tun_tx_batch {
+	unsigned int size;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	/* per-packet parse and tunnel look-up results */
+	struct pkt_info *pinfo;
+	const struct gtp_peer **peer;
+	/* may the packet be coalesced with others by UDP GSO? */
+	bool *gso;
+	/* scratch arrays for grouping packets by GTP peer + GSO train */
+	struct mmsghdr *out;
+	struct iovec *out_iov;
+	union tun_gso_cmsg *out_cmsg;
+	/* one buffer of the packet pool per packet; the GTP header goes into its headroom */
+	struct pkt_buf **bufs;
+};
+
+/* control message buffer carrying the UDP_SEGMENT size of one GSO train */
+union tun_gso_cmsg {
+	char buf[CMSG_SPACE(sizeof(uint16_t))];
+	struct cmsghdr align;
+};
+
+/* maximum number of segments in one UDP GSO send (UDP_MAX_SEGMENTS of the kernel) */
+#define TUN_GSO_MAX_SEGS	64
+/* maximum UDP payload of one UDP GSO send; bounded by the IPv4 total length */
+#define TUN_GSO_MAX_BYTES	(65535 - 20 - 8)
+
+static int tun_tx_batch_destructor(struct tun_tx_batch *b)
 {
-	struct tun_device *tun = (struct tun_device *)arg;
-	struct gtp_daemon *d = tun->d;
+	pkt_pool_free_bulk(b->bufs, b->size);
+	return 0;
+}
 
-	uint8_t base_buffer[MAX_UDP_PACKET+sizeof(struct gtp1_header)];
-	struct gtp1_header *gtph = (struct gtp1_header *)base_buffer;
-	uint8_t *buffer = base_buffer + sizeof(struct gtp1_header);
+/* point the first n packets at b->bufs, leaving room for the GTP header */
+static void tun_tx_batch_set_bufs(struct tun_tx_batch *b, unsigned int n)
+{
+	unsigned int i;
 
-	struct sockaddr_storage daddr;
+	for (i = 0; i < n; i++)
+		b->iov[i].iov_base = pkt_buf_data(b->bufs[i]) - sizeof(struct gtp1_header);
+}
 
-	/* initialize the fixed part of the GTP header */
-	gtph->flags = 0x30;
-	gtph->type = GTP_TPDU;
+/* if pool is NULL, the caller provides the buffers of the batch and keeps owning them */
+struct tun_tx_batch *tun_tx_batch_alloc(void *ctx, struct pkt_pool *pool, unsigned int size)
+{
+	struct tun_tx_batch *b = talloc_zero(ctx, struct tun_tx_batch);
+	unsigned int i;
 
-	while (1) {
-		struct gtp_tunnel *t;
-		struct pkt_info pinfo;
-		int rc, nread, outfd;
+	if (!b)
+		return NULL;
 
-		/* 1) read from tun */
-		rc = read(tun->fd, buffer, MAX_UDP_PACKET);
+	b->size = size;
+	b->msgs = talloc_zero_array(b, struct mmsghdr, size);
+	b->iov = talloc_zero_array(b, struct iovec, size);
+	b->pinfo = talloc_zero_array(b, struct pkt_info, size);
+	b->peer = talloc_zero_array(b, const struct gtp_peer *, size);
+	b->gso = talloc_zero_array(b, bool, size);
+	b->out = talloc_zero_array(b, struct mmsghdr, size);
+	b->out_iov = talloc_zero_array(b, struct iovec, size);
+	b->out_cmsg = talloc_zero_array(b, union tun_gso_cmsg, size);
+	b->bufs = talloc_zero_array(b, struct pkt_buf *, size);
+	if (!b->msgs || !b->iov || !b->pinfo || !b->peer || !b->gso ||
+	    !b->out || !b->out_iov || !b->out_cmsg || !b->bufs) {
+		talloc_free(b);
+		return NULL;
+	}
+	if (pool) {
+		if (pkt_pool_alloc_bulk(pool, b->bufs, size) < 0) {
+			talloc_free(b);
+			return NULL;
+		}
+		talloc_set_destructor(b, tun_tx_batch_destructor);
+		tun_tx_batch_set_bufs(b, size);
+	}
+
+	for (i = 0; i < size; i++) {
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return b;
+}
+
+/* read packets from the tun queue until it would block or the batch is full.  If block is
+ * set, wait for the first packet; else return 0 if there is none */
+static int tun_read_batch(struct tun_queue *q, struct tun_tx_batch *b, bool block)
+{
+	struct tun_device *tun = q->tun;
+	struct pollfd pfd = { .fd = q->fd, .events = POLLIN };
+	unsigned int n = 0;
+	int rc;
+
+	while (n < b->size) {
+		uint8_t *buffer = (uint8_t *) b->iov[n].iov_base + sizeof(struct gtp1_header);
+
+		rc = read(q->fd, buffer, pkt_buf_data_len(b->bufs[n]));
 		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (n || !block)
+					break;
+				/* nothing read yet: sleep until the device becomes readable,
+				 * without holding up RCU grace periods */
+				rcu_thread_offline(&q->rcu);
+				poll(&pfd, 1, -1);
+				rcu_thread_online(&q->rcu);
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
 			LOGTUN(tun, LOGL_FATAL, "Error readingfrom tun device: %s\n", strerror(errno));
 			exit(1);
 		}
-		nread = rc;
-		gtph->length = htons(nread);
+		b->iov[n].iov_len = rc;
+		n++;
+	}
+
+	return n;
+}
+
+/* try to append packet idx to the UDP GSO train in out; all segments but the last one must
+ * have the same size, and all must belong to the same tunnel.  The caller only passes
+ * packets for the peer of the train */
+static bool tun_gso_append(struct tun_queue *q, struct tun_tx_batch *b, struct mmsghdr *out,
+			   unsigned int idx)
+{
+	struct msghdr *mh = &out->msg_hdr;
+	const struct iovec *first = &mh->msg_iov[0];
+	const struct iovec *last = &mh->msg_iov[mh->msg_iovlen-1];
+	const struct gtp1_header *gtph_first = first->iov_base;
+	const struct gtp1_header *gtph = b->iov[idx].iov_base;
+	struct cmsghdr *cmsg;
+	unsigned int i, total = 0;
+
+	if (q->gso_failed || !b->gso[idx])
+		return false;
+	if (mh->msg_iovlen >= TUN_GSO_MAX_SEGS)
+		return false;
+	/* only the last segment may be shorter than the GSO size */
+	if (last->iov_len != first->iov_len || b->iov[idx].iov_len > first->iov_len)
+		return false;
+	if (gtph->tid != gtph_first->tid)
+		return false;
+	for (i = 0; i < mh->msg_iovlen; i++)
+		total += mh->msg_iov[i].iov_len;
+	if (total + b->iov[idx].iov_len > TUN_GSO_MAX_BYTES)
+		return false;
+
+	/* the iovecs of the last train are at the end of out_iov, so we can simply grow it */
+	mh->msg_iov[mh->msg_iovlen++] = b->iov[idx];
+
+	cmsg = CMSG_FIRSTHDR(mh);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	*(uint16_t *) CMSG_DATA(cmsg) = first->iov_len;
+
+	return true;
+}
+
+/* send the segments of a GSO train rejected by the kernel as individual datagrams */
+static int tun_gso_fallback(struct tun_queue *q, struct tun_tx_batch *b, int fd,
+			    struct mmsghdr *out)
+{
+	struct msghdr mh = out->msg_hdr;
+	unsigned int i;
+	int rc;
+
+	LOGTUN(q->tun, LOGL_NOTICE, "UDP GSO send failed (%s) on queue %u, disabling it\n",
+		strerror(errno), q->idx);
+	q->gso_failed = true;
+
+	mh.msg_control = NULL;
+	mh.msg_controllen = 0;
+	mh.msg_iovlen = 1;
+	for (i = 0; i < out->msg_hdr.msg_iovlen; i++) {
+		mh.msg_iov = &out->msg_hdr.msg_iov[i];
+		rc = sendmsg(fd, &mh, 0);
+		if (rc < 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+/* send all encapsulated packets of a batch, one sendmmsg() per GTP peer via its connected
+ * socket (or that of its endpoint, see struct gtp_peer) */
+static void tun_flush_batch(struct tun_queue *q, struct tun_tx_batch *b, unsigned int n)
+{
+	unsigned int i, j, num_out, num_iov, sent;
+	const struct gtp_peer *peer;
+	bool retried;
+	int fd, rc;
+
+	for (i = 0; i < n; i++) {
+		peer = b->peer[i];
+		if (!peer)
+			continue;
+		fd = gtp_peer_tx_fd(peer);
+
+		/* gather all packets for the same peer, preserving their order, and
+		 * coalesce consecutive packets of the same tunnel into GSO trains */
+		num_out = 0;
+		num_iov = 0;
+		for (j = i; j < n; j++) {
+			struct msghdr *mh;
+
+			if (b->peer[j] != peer)
+				continue;
+			b->peer[j] = NULL;
+			if (num_out && tun_gso_append(q, b, &b->out[num_out-1], j)) {
+				num_iov++;
+				continue;
+			}
+
+			mh = &b->out[num_out].msg_hdr;
+			*mh = b->msgs[j].msg_hdr;
+			if (fd == peer->ep->fd) {
+				mh->msg_name = (void *) &peer->addr;
+				mh->msg_namelen = sizeof(peer->addr);
+			} else {
+				mh->msg_name = NULL;
+				mh->msg_namelen = 0;
+			}
+			b->out_iov[num_iov] = b->iov[j];
+			mh->msg_iov = &b->out_iov[num_iov++];
+			mh->msg_control = b->out_cmsg[num_out].buf;
+			mh->msg_controllen = sizeof(b->out_cmsg[num_out].buf);
+			num_out++;
+		}
+		/* pass the UDP_SEGMENT cmsg only for real trains */
+		for (j = 0; j < num_out; j++) {
+			if (b->out[j].msg_hdr.msg_iovlen == 1) {
+				b->out[j].msg_hdr.msg_control = NULL;
+				b->out[j].msg_hdr.msg_controllen = 0;
+			}
+		}
+
+		retried = false;
+		for (sent = 0; sent < num_out; sent += rc) {
+			rc = sendmmsg(fd, b->out + sent, num_out - sent, 0);
+			if (rc < 0) {
+				if (errno == EINTR) {
+					rc = 0;
+					continue;
+				}
+				/* an ICMP error of an earlier datagram, reported once by the connected
+				 * socket before this one was sent: retry it once.  Otherwise there is
+				 * no route to the peer: drop this datagram, not the daemon */
+				if (errno == ECONNREFUSED || errno == EHOSTUNREACH ||
+				    errno == ENETUNREACH) {
+					LOGTUN(q->tun, LOGL_NOTICE, "GTP peer unreachable: %s\n",
+						strerror(errno));
+					rc = retried ? 1 : 0;
+					retried = !retried;
+					continue;
+				}
+				if (b->out[sent].msg_hdr.msg_iovlen > 1 &&
+				    (errno == EIO || errno == EINVAL || errno == EMSGSIZE)) {
+					if (tun_gso_fallback(q, b, fd, &b->out[sent]) == 0) {
+						rc = 1;
+						continue;
+					}
+				}
+				LOGTUN(q->tun, LOGL_FATAL, "Error Writing to UDP socket: %s\n", strerror(errno));
+				exit(1);
+			}
+			retried = false;
+		}
+	}
+}
 
-		rc = parse_pkt(&pinfo, buffer, nread);
+static void tun_log_no_tunnel(struct tun_device *tun, const struct pkt_info *pinfo)
+{
+	char host[128];
+	char port[8];
+
+	getnameinfo((const struct sockaddr *)&pinfo->saddr, sizeof(pinfo->saddr),
+		    host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
+	LOGTUN(tun, LOGL_NOTICE, "No tunnel found for source address %s:%s\n", host, port);
+}
+
+/* look up the tunnel of a single packet read from tun and fill in the GTP header for its
+ * encapsulation; returns the GTP peer to send it to (see gtp_peer_tx_fd()), or NULL if
+ * there's no tunnel.  Must be called under RCU read-side */
+const struct gtp_peer *tun_encap_lookup(struct tun_device *tun, const uint8_t *pkt,
+					unsigned int len, struct gtp1_header *gtph)
+{
+	struct pkt_info pinfo;
+	struct gtp_tunnel *t;
+
+	if (parse_pkt(&pinfo, pkt, len) < 0) {
+		LOGTUN(tun, LOGL_NOTICE, "Error parsing IP packet: %s\n", osmo_hexdump(pkt, len));
+		return NULL;
+	}
+	t = _gtp_tunnel_find_eua(tun, (struct sockaddr *) &pinfo.saddr, pinfo.proto);
+	if (!t) {
+		tun_log_no_tunnel(tun, &pinfo);
+		return NULL;
+	}
+
+	*gtph = t->tx_hdr;
+	gtph->length = htons(len);
+
+	return t->peer;
+}
+
+/* encapsulate a batch of packets read from a tun queue and send them to the GTP peers.
+ * Must be called with the RCU read-side of the calling thread online */
+static void tun_handle_batch(struct tun_queue *q, struct tun_tx_batch *b, unsigned int n)
+{
+	struct tun_device *tun = q->tun;
+	struct gtp_tunnel *t;
+	int rc, i;
+
+	for (i = 0; i < n; i++) {
+		uint8_t *buffer = (uint8_t *) b->iov[i].iov_base + sizeof(struct gtp1_header);
+		unsigned int nread = b->iov[i].iov_len;
+
+		b->peer[i] = NULL;
+		rc = parse_pkt(&b->pinfo[i], buffer, nread);
 		if (rc < 0) {
 			LOGTUN(tun, LOGL_NOTICE, "Error parsing IP packet: %s\n",
 				osmo_hexdump(buffer, nread));
+			b->pinfo[i].saddr.ss_family = AF_UNSPEC;
 			continue;
 		}
 
-		if (pinfo.saddr.ss_family == AF_INET6 && pinfo.proto == IPPROTO_ICMPV6) {
+		if (b->pinfo[i].saddr.ss_family == AF_INET6 && b->pinfo[i].proto == IPPROTO_ICMPV6) {
 			/* 2) TODO: magic voodoo for IPv6 neighbor discovery */
 		}
+	}
 
-		/* 3) look-up tunnel based on source IP address (+ filter) */
-		pthread_rwlock_rdlock(&d->rwlock);
-		t = _gtp_tunnel_find_eua(tun, (struct sockaddr *) &pinfo.saddr, pinfo.proto);
-		if (!t) {
-			char host[128];
-			char port[8];
-			pthread_rwlock_unlock(&d->rwlock);
-			getnameinfo((const struct sockaddr *)&pinfo.saddr,
-				    sizeof(pinfo.saddr), host, sizeof(host), port, sizeof(port),
-				    NI_NUMERICHOST | NI_NUMERICSERV);
-			LOGTUN(tun, LOGL_NOTICE, "No tunnel found for source address %s:%s\n", host, port);
+	/* 3) look-up tunnels based on source IP address (+ filter), lock-free under RCU */
+	for (i = 0; i < n; i++) {
+		struct gtp1_header *gtph = (struct gtp1_header *) b->iov[i].iov_base;
+		struct pkt_info *pinfo = &b->pinfo[i];
+
+		if (pinfo->saddr.ss_family == AF_UNSPEC)
+			continue;
+		t = _gtp_tunnel_find_eua(tun, (struct sockaddr *) &pinfo->saddr, pinfo->proto);
+		if (!t)
+			continue;
+		b->peer[i] = t->peer;
+		b->gso[i] = t->gtp_ep->tx_gso;
+		*gtph = t->tx_hdr;
+		gtph->length = htons(b->iov[i].iov_len);
+		b->iov[i].iov_len += sizeof(*gtph);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (b->peer[i] || b->pinfo[i].saddr.ss_family == AF_UNSPEC)
 			continue;
+		tun_log_no_tunnel(tun, &b->pinfo[i]);
+	}
+
+	/* 4) write to GTP/UDP socket(s) */
+	tun_flush_batch(q, b, n);
+}
+
+/* hash of the 5-tuple (3-tuple for other than TCP/UDP, and for IPv4 fragments) of an IP
+ * packet, to keep the packets of a flow on one pipeline worker */
+static uint32_t tun_flow_hash(const uint8_t *pkt, unsigned int len)
+{
+	const uint8_t *addrs;
+	unsigned int i, addrs_len, l4_off;
+	bool ports;
+	uint8_t proto;
+	uint32_t h = 0;
+
+	if (len < 20)
+		return 0;
+	switch (pkt[0] >> 4) {
+	case 4:
+		addrs = pkt + 12;
+		addrs_len = 8;
+		proto = pkt[9];
+		l4_off = (pkt[0] & 0x0f) * 4;
+		/* no ports in non-first fragments: MF flag or fragment offset set */
+		ports = !((pkt[6] & 0x3f) | pkt[7]);
+		break;
+	case 6:
+		if (len < 40)
+			return 0;
+		addrs = pkt + 8;
+		addrs_len = 32;
+		proto = pkt[6];
+		l4_off = 40;
+		ports = true;
+		break;
+	default:
+		return 0;
+	}
+
+	for (i = 0; i < addrs_len; i++)
+		h = h * 31 + addrs[i];
+	h = h * 31 + proto;
+	if (ports && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) && len >= l4_off + 4) {
+		for (i = 0; i < 4; i++)
+			h = h * 31 + pkt[l4_off + i];
+	}
+
+	return h ^ (h >> 16);
+}
+
+/* pipelined mode: hand the packets read to the pipeline workers by flow, and refill the
+ * batch with free buffers */
+static void tun_dispatch_batch(struct tun_queue *q, struct tun_tx_batch *b, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		struct pkt_buf *pb = b->bufs[i];
+		pb->len = b->iov[i].iov_len;
+		dp_pipeline_push(q->pl, tun_flow_hash(pkt_buf_data(pb), pb->len), pb);
+	}
+	dp_pipeline_flush(q->pl);
+
+	dp_pipeline_get_bufs(q->pl, b->bufs, n, &q->rcu);
+	tun_tx_batch_set_bufs(b, n);
+}
+
+/* pipeline call-back: encapsulate buffers dispatched by tun_dispatch_batch() */
+static void tun_pipeline_cb(struct dp_pipeline_worker *pw, struct pkt_buf **bufs, unsigned int n)
+{
+	struct tun_queue *q = pw->pl->priv;
+	struct tun_tx_batch *b = pw->priv;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		b->iov[i].iov_base = pkt_buf_data(bufs[i]) - sizeof(struct gtp1_header);
+		b->iov[i].iov_len = bufs[i]->len;
+	}
+	tun_handle_batch(q, b, n);
+}
+
+/* set up the pipeline of a queue: its thread only reads, while the pipeline workers
+ * encapsulate.  All of them use the buffers of the pipeline */
+static int tun_queue_pipeline_alloc(struct tun_queue *q)
+{
+	struct tun_device *tun = q->tun;
+	struct gtp_daemon *d = tun->d;
+	char name[32];
+	unsigned int i;
+
+	snprintf(name, sizeof(name), "%s/%u", tun->devname, q->idx);
+	q->pl = dp_pipeline_alloc(tun, d, pkt_pool_get(d, -1, PKT_BUF_MTU_DATA_LEN), name,
+				  d->cfg.tx_batch_size, tun_pipeline_cb, q);
+	if (!q->pl)
+		return -1;
+	for (i = 0; i < q->pl->num_workers; i++) {
+		q->pl->workers[i].priv = tun_tx_batch_alloc(q->pl, NULL, d->cfg.tx_batch_size);
+		if (!q->pl->workers[i].priv)
+			return -1;
+	}
+
+	q->tx_batch = tun_tx_batch_alloc(tun, NULL, d->cfg.tx_batch_size);
+	if (!q->tx_batch)
+		return -1;
+	dp_pipeline_get_bufs(q->pl, q->tx_batch->bufs, q->tx_batch->size, NULL);
+	tun_tx_batch_set_bufs(q->tx_batch, q->tx_batch->size);
+
+	return 0;
+}
+
+/* one thread for reading from each queue of each TUN device (TUN -> GTP encapsulation) */
+static void *tun_device_thread(void *arg)
+{
+	struct tun_queue *q = (struct tun_queue *)arg;
+	struct gtp_daemon *d = q->tun->d;
+	struct tun_tx_batch *b = q->tx_batch;
+
+	rcu_register_thread(&d->rcu, &q->rcu);
+	pthread_cleanup_push(rcu_unregister_thread, &q->rcu);
+	rcu_thread_online(&q->rcu);
+
+	while (1) {
+		int n = 0;
+
+		/* we hold no references to tunnels from the previous batch */
+		rcu_quiescent_state(&q->rcu);
+
+		/* 1) read from tun; when busy polling, spin as long as we were idle for less
+		 * than the configured time */
+		if (q->bp.idle_ns) {
+			n = tun_read_batch(q, b, false);
+			if (n)
+				dp_busy_poll_active(&q->bp);
+			else if (dp_busy_poll_idle(&q->bp))
+				continue;
 		}
-		outfd = t->gtp_ep->fd;
-		memcpy(&daddr, &t->remote_udp, sizeof(daddr));
-		gtph->tid = htonl(t->tx_teid);
-		pthread_rwlock_unlock(&d->rwlock);
-
-		/* 4) write to GTP/UDP socket */
-		rc = sendto(outfd, base_buffer, nread+sizeof(*gtph), 0,
-			    (struct sockaddr *)&daddr, sizeof(daddr));
-		if (rc < 0) {
-			LOGTUN(tun, LOGL_FATAL, "Error Writing to UDP socket: %s\n", strerror(errno));
-			exit(1);
+		if (!n) {
+			dp_busy_poll_sleep_begin(&q->bp);
+			n = tun_read_batch(q, b, true);
+			dp_busy_poll_sleep_end(&q->bp);
 		}
+		if (q->pl)
+			tun_dispatch_batch(q, b, n);
+		else
+			tun_handle_batch(q, b, n);
 	}
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/* worker pool call-back: a tun queue is readable */
+static void tun_io_read_cb(struct io_worker_fd *iofd, struct io_worker *iow)
+{
+	struct tun_queue *q = iofd->data;
+	int n;
+
+	/* one batch at a time, to be fair to the other fds of the pool worker */
+	n = tun_read_batch(q, iow->tx_batch, false);
+	if (n > 0)
+		tun_handle_batch(q, iow->tx_batch, n);
 }
 
 static int tun_open(int flags, const char *name)
@@ -221,13 +679,115 @@ static int tun_open(int flags, const char *name)
 	return fd;
 }
 
+/* open all queues of a tun device (in the current netns); returns 0 or negative on error */
+static int tun_open_queues(struct tun_device *tun)
+{
+	int flags = tun->num_queues > 1 ? IFF_MULTI_QUEUE : 0;
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < tun->num_queues; i++) {
+		struct tun_queue *q = &tun->queues[i];
+
+		q->fd = tun_open(flags, tun->devname);
+		if (q->fd < 0) {
+			LOGTUN(tun, LOGL_ERROR, "Cannot open TUN device queue %u: %s\n", i, strerror(errno));
+			goto err_close;
+		}
+		/* the reader thread drains the queue until it would block */
+		rc = fcntl(q->fd, F_SETFL, fcntl(q->fd, F_GETFL) | O_NONBLOCK);
+		if (rc < 0) {
+			LOGTUN(tun, LOGL_ERROR, "Cannot set TUN device non-blocking: %s\n", strerror(errno));
+			close(q->fd);
+			goto err_close;
+		}
+	}
+
+	return 0;
+
+err_close:
+	while (i--)
+		close(tun->queues[i].fd);
+	return -1;
+}
+
+static void tun_close_queues(struct tun_device *tun)
+{
+	unsigned int i;
+
+	for (i = 0; i < tun->num_queues; i++)
+		close(tun->queues[i].fd);
+}
+
+/* cancel the reader thread of a queue and wait for it to have unregistered from RCU */
+static void tun_stop_queue_thread(struct tun_queue *q)
+{
+	if (q->iofd.worker) {
+		io_worker_fd_unregister(&q->iofd);
+		return;
+	}
+	pthread_cancel(q->thread);
+	dp_thread_join(q->tun->d, q->thread);
+	if (q->pl)
+		dp_pipeline_stop(q->pl);
+}
+
+/* start one reader thread per queue, or hand the queues to the worker pool if enabled;
+ * returns 0 or negative on error */
+static int tun_start_queue_threads(struct tun_device *tun)
+{
+	unsigned int i;
+
+	for (i = 0; i < tun->num_queues; i++) {
+		struct tun_queue *q = &tun->queues[i];
+		char name[32];
+		if (tun->d->cfg.num_io_workers) {
+			q->iofd.fd = q->fd;
+			q->iofd.type = IO_WORKER_FD_TUN;
+			q->iofd.read_cb = tun_io_read_cb;
+			q->iofd.data = q;
+			if (io_worker_fd_register(tun->d, &q->iofd) < 0) {
+				LOGTUN(tun, LOGL_ERROR, "Cannot add queue to worker pool\n");
+				goto err_cancel;
+			}
+			continue;
+		}
+		if (q->pl && dp_pipeline_start(q->pl) < 0)
+			goto err_cancel;
+		snprintf(name, sizeof(name), "%s/%u", tun->devname, i);
+		if (dp_thread_create(tun->d, &q->thread, name, -1, tun_device_thread, q)) {
+			LOGTUN(tun, LOGL_ERROR, "Cannot create TUN thread: %s\n", strerror(errno));
+			if (q->pl)
+				dp_pipeline_stop(q->pl);
+			goto err_cancel;
+		}
+	}
+
+	return 0;
+
+err_cancel:
+	while (i--)
+		tun_stop_queue_thread(&tun->queues[i]);
+	/* pool workers may still be inside the read call-back */
+	rcu_synchronize(&tun->d->rcu);
+	return -1;
+}
+
+static int tun_device_destructor(struct tun_device *tun)
+{
+	/* a device whose creation failed may already have been replaced by a new one */
+	if (tun->kgtp_ep && tun->kgtp_ep->kgtp_dev == tun)
+		tun->kgtp_ep->kgtp_dev = NULL;
+	return 0;
+}
+
+/* allocate a tun device in TUN_S_OPENING state, not in the list yet */
 static struct tun_device *
-_tun_device_create(struct gtp_daemon *d, const char *devname, const char *netns_name)
+tun_device_alloc(struct gtp_daemon *d, const char *devname, const char *netns_name,
+		 unsigned int num_queues, struct gtp_endpoint *kgtp_ep)
 {
-	struct rtnl_link *link;
 	struct tun_device *tun;
-	sigset_t oldmask;
-	int rc;
+	unsigned int i;
 
 	tun = talloc_zero(d, struct tun_device);
 	if (!tun)
@@ -236,14 +796,65 @@ _tun_device_create(struct gtp_daemon *d, const char *devname, const char *netns_
 	tun->d = d;
 	tun->use_count = 1;
 	tun->devname = talloc_strdup(tun, devname);
+	tun->netns_fd = -1;
+	hash_init(tun->tunnels_by_eua);
+	ctrl_strand_init(&tun->strand);
+	INIT_LLIST_HEAD(&tun->list);
+
+	tun->kgtp_ep = kgtp_ep;
+	if (kgtp_ep) {
+		kgtp_ep->kgtp_dev = tun;
+		talloc_set_destructor(tun, tun_device_destructor);
+		tun->num_queues = 0;
+	} else
+		tun->num_queues = num_queues ? num_queues : d->cfg.tun_num_queues;
+	tun->queues = talloc_zero_array(tun, struct tun_queue, tun->num_queues);
+	if (!tun->queues)
+		goto err_free;
+	for (i = 0; i < tun->num_queues; i++) {
+		struct tun_queue *q = &tun->queues[i];
+		q->tun = tun;
+		q->idx = i;
+		dp_busy_poll_init(&q->bp, d->cfg.num_io_workers ? 0 : d->cfg.tun_busy_poll_us);
+		/* with the worker pool, the packet buffers of the pool workers are used */
+		if (d->cfg.num_io_workers)
+			continue;
+		if (dp_pipelined(d)) {
+			if (tun_queue_pipeline_alloc(q) < 0)
+				goto err_free;
+			continue;
+		}
+		q->tx_batch = tun_tx_batch_alloc(tun, pkt_pool_get(d, -1, PKT_BUF_MTU_DATA_LEN),
+						 d->cfg.tx_batch_size);
+		if (!q->tx_batch)
+			goto err_free;
+	}
 
-	if (netns_name) {
+	if (netns_name)
 		tun->netns_name = talloc_strdup(tun, netns_name);
+
+	return tun;
+
+err_free:
+	talloc_free(tun);
+	return NULL;
+}
+
+/* create the kernel device in its netns, with the queues + netlink socket, and bring it up.
+ * May be called by a control worker; returns 0 or negative on error */
+static int tun_device_open(struct tun_device *tun)
+{
+	struct rtnl_link *link;
+	unsigned int mtu;
+	sigset_t oldmask;
+	int rc;
+
+	if (tun->netns_name) {
 		tun->netns_fd = get_nsfd(tun->netns_name);
 		if (tun->netns_fd < 0) {
 			LOGTUN(tun, LOGL_ERROR, "Cannot obtain netns file descriptor: %s\n",
 				strerror(errno));
-			goto err_free;
+			return -1;
 		}
 	}
 
@@ -257,11 +868,17 @@ _tun_device_create(struct gtp_daemon *d, const char *devname, const char *netns_
 		}
 	}
 
-	tun->fd = tun_open(0, tun->devname);
-	if (tun->fd < 0) {
-		LOGTUN(tun, LOGL_ERROR, "Cannot open TUN device: %s\n", strerror(errno));
+#ifdef HAVE_LIBGTPNL
+	if (tun->kgtp_ep) {
+		if (kgtp_dev_create(tun->devname, tun->kgtp_ep->fd) < 0) {
+			LOGTUN(tun, LOGL_ERROR, "Cannot create kernel GTP device: %s\n",
+				strerror(errno));
+			goto err_restore_ns;
+		}
+	} else
+#endif
+	if (tun_open_queues(tun) < 0)
 		goto err_restore_ns;
-	}
 
 	tun->nl = nl_socket_alloc();
 	if (!tun->nl || nl_connect(tun->nl, NETLINK_ROUTE) < 0) {
@@ -269,6 +886,10 @@ _tun_device_create(struct gtp_daemon *d, const char *devname, const char *netns_
 			tun->netns_name);
 		goto err_close;
 	}
+	if (netdev_batch_sock_init(tun->nl) < 0) {
+		LOGTUN(tun, LOGL_ERROR, "Cannot set up netlink socket for batches\n");
+		goto err_free_nl;
+	}
 
 	rc = rtnl_link_get_kernel(tun->nl, 0, tun->devname, &link);
 	if (rc < 0) {
@@ -276,12 +897,20 @@ _tun_device_create(struct gtp_daemon *d, const char *devname, const char *netns_
 		goto err_free_nl;
 	}
 	tun->ifindex = rtnl_link_get_ifindex(link);
+	mtu = rtnl_link_get_mtu(link);
 	rtnl_link_put(link);
 
-	/* switch back to default namespace before creating new thread */
+	/* switch back to default namespace, in which all other threads are */
 	if (tun->netns_name)
 		OSMO_ASSERT(restore_ns(&oldmask) == 0);
 
+	/* the buffers of our queue threads only have room for packets of up to that size */
+	if (tun->num_queues && !tun->d->cfg.num_io_workers && mtu > PKT_BUF_MTU_DATA_LEN) {
+		LOGTUN(tun, LOGL_NOTICE, "Lowering MTU from %u to %u\n", mtu, PKT_BUF_MTU_DATA_LEN);
+		if (netdev_set_mtu(tun->nl, tun->ifindex, PKT_BUF_MTU_DATA_LEN) < 0)
+			LOGTUN(tun, LOGL_ERROR, "Cannot set MTU\n");
+	}
+
 	/* bring the network device up */
 	rc = netdev_set_link(tun->nl, tun->ifindex, true);
 	if (rc < 0)
@@ -301,31 +930,136 @@ _tun_device_create(struct gtp_daemon *d, const char *devname, const char *netns_
 			LOGTUN(tun, LOGL_INFO, "Added IPv6 default route\n");
 	}
 
-	if (pthread_create(&tun->thread, NULL, tun_device_thread, tun)) {
-		LOGTUN(tun, LOGL_ERROR, "Cannot create TUN thread: %s\n", strerror(errno));
-		goto err_free_nl;
-	}
-
-	LOGTUN(tun, LOGL_INFO, "Created (in netns '%s')\n", tun->netns_name);
-	llist_add_tail(&tun->list, &d->tun_devices);
-
-	return tun;
+	return 0;
 
 err_free_nl:
+	if (tun->kgtp_ep && tun->ifindex)
+		netdev_del_link(tun->nl, tun->ifindex);
 	nl_socket_free(tun->nl);
+	tun->nl = NULL;
 err_close:
-	close(tun->fd);
+	tun_close_queues(tun);
 err_restore_ns:
 	if (tun->netns_name)
 		OSMO_ASSERT(restore_ns(&oldmask) == 0);
 err_close_ns:
+	if (tun->netns_name) {
+		close(tun->netns_fd);
+		tun->netns_fd = -1;
+	}
+	return -1;
+}
+
+/* undo tun_device_open() */
+static void tun_device_close(struct tun_device *tun)
+{
+	tun_close_queues(tun);
+	/* unlike a tun device, a GTP device doesn't vanish with its file descriptors */
+	if (tun->kgtp_ep && netdev_del_link(tun->nl, tun->ifindex) < 0)
+		LOGTUN(tun, LOGL_ERROR, "Cannot delete kernel GTP device\n");
+	nl_socket_free(tun->nl);
 	if (tun->netns_name)
 		close(tun->netns_fd);
+}
+
+/* start the data-plane of an opened device; returns 0 or negative on error */
+static int tun_device_start(struct tun_device *tun)
+{
+	struct gtp_daemon *d = tun->d;
+
+	ASSERT_MAIN_THREAD(d);
+
+	if (tun_start_queue_threads(tun) < 0)
+		return -1;
+
+	/* non-fatal: without it, all packets are simply read from the queues */
+	if (d->cfg.tc_bpf && !tun->kgtp_ep)
+		tc_bpf_tun_attach(tun);
+
+	if (tun->kgtp_ep)
+		LOGTUN(tun, LOGL_INFO, "Created as kernel GTP device on %s (in netns '%s')\n",
+			tun->kgtp_ep->name, tun->netns_name);
+	else
+		LOGTUN(tun, LOGL_INFO, "Created with %u queue(s) (in netns '%s')\n",
+			tun->num_queues, tun->netns_name);
+	tun->state = TUN_S_READY;
+
+	return 0;
+}
+
+static struct tun_device *
+_tun_device_create(struct gtp_daemon *d, const char *devname, const char *netns_name,
+		   unsigned int num_queues, struct gtp_endpoint *kgtp_ep)
+{
+	struct tun_device *tun;
+
+	tun = tun_device_alloc(d, devname, netns_name, num_queues, kgtp_ep);
+	if (!tun)
+		return NULL;
+
+	if (tun_device_open(tun) < 0)
+		goto err_free;
+	if (tun_device_start(tun) < 0)
+		goto err_close;
+	llist_add_tail(&tun->list, &d->tun_devices);
+
+	return tun;
+
+err_close:
+	tun_device_close(tun);
 err_free:
 	talloc_free(tun);
 	return NULL;
 }
 
+static void tun_device_open_work(struct ctrl_job *job)
+{
+	struct tun_device *tun = container_of(job, struct tun_device, open_job);
+
+	tun->open_rc = tun_device_open(tun);
+}
+
+static void tun_device_open_done(struct ctrl_job *job)
+{
+	struct tun_device *tun = container_of(job, struct tun_device, open_job);
+	struct gtp_daemon *d = tun->d;
+
+	if (tun->open_rc == 0 && tun_device_start(tun) == 0)
+		return;
+	if (tun->open_rc == 0)
+		tun_device_close(tun);
+
+	/* the device is released by its users, whose jobs fail; the next request creates
+	 * it anew */
+	LOGTUN(tun, LOGL_ERROR, "Creation failed\n");
+	tun->state = TUN_S_FAILED;
+	pthread_rwlock_wrlock(&d->rwlock);
+	llist_del_init(&tun->list);
+	pthread_rwlock_unlock(&d->rwlock);
+}
+
+/* LOCKED create a tun device by a control worker; its jobs submitted to tun->strand from
+ * now on run once it is open (or has failed) */
+static struct tun_device *
+_tun_device_create_async(struct gtp_daemon *d, const char *devname, const char *netns_name,
+			 unsigned int num_queues, struct gtp_endpoint *kgtp_ep)
+{
+	struct tun_device *tun;
+
+	tun = tun_device_alloc(d, devname, netns_name, num_queues, kgtp_ep);
+	if (!tun)
+		return NULL;
+
+	if (ctrl_job_submit(d, &tun->strand, &tun->open_job, tun_device_open_work,
+			    tun_device_open_done) < 0) {
+		talloc_free(tun);
+		return NULL;
+	}
+	llist_add_tail(&tun->list, &d->tun_devices);
+
+	return tun;
+}
+
 struct tun_device *
 _tun_device_find(struct gtp_daemon *d, const char *devname)
 {
@@ -355,8 +1089,9 @@ tun_device_find_netns(struct gtp_daemon *d, const char *netns_name)
 	return NULL;
 }
 
-struct tun_device *
-tun_device_find_or_create(struct gtp_daemon *d, const char *devname, const char *netns_name)
+static struct tun_device *
+tun_device_get_or_create(struct gtp_daemon *d, const char *devname, const char *netns_name,
+			 unsigned int num_queues, struct gtp_endpoint *kgtp_ep, bool async)
 {
 	struct tun_device *tun;
 
@@ -365,32 +1100,90 @@ tun_device_find_or_create(struct gtp_daemon *d, const char *devname, const char
 
 	pthread_rwlock_wrlock(&d->rwlock);
 	tun = _tun_device_find(d, devname);
-	if (tun)
+	if (tun && tun->kgtp_ep != kgtp_ep) {
+		/* a kernel GTP device is bound to one endpoint, and must only be referenced by
+		 * its tunnels so that it never outlives that endpoint */
+		LOGTUN(tun, LOGL_ERROR, "Device already exists as %s device%s%s\n",
+			tun->kgtp_ep ? "kernel GTP" : "tun", tun->kgtp_ep ? " on " : "",
+			tun->kgtp_ep ? tun->kgtp_ep->name : "");
+		tun = NULL;
+	} else if (tun) {
+		/* a device still being opened is only ever found by asynchronous callers, as
+		 * the others drain the control workers first */
+		OSMO_ASSERT(async || tun->state == TUN_S_READY);
+		if (num_queues && num_queues != tun->num_queues)
+			LOGTUN(tun, LOGL_NOTICE, "Ignoring request for %u queues, device already "
+				"exists with %u queue(s)\n", num_queues, tun->num_queues);
 		tun->use_count++;
+	} else if (async)
+		tun = _tun_device_create_async(d, devname, netns_name, num_queues, kgtp_ep);
 	else
-		tun = _tun_device_create(d, devname, netns_name);
+		tun = _tun_device_create(d, devname, netns_name, num_queues, kgtp_ep);
 	pthread_rwlock_unlock(&d->rwlock);
 
 	return tun;
 }
 
+/* find or create a tun device; or a kernel GTP device using the socket of kgtp_ep, if given.
+ * No control worker may be busy (see ctrl_pool_drain()) */
+struct tun_device *
+tun_device_find_or_create(struct gtp_daemon *d, const char *devname, const char *netns_name,
+			  unsigned int num_queues, struct gtp_endpoint *kgtp_ep)
+{
+	return tun_device_get_or_create(d, devname, netns_name, num_queues, kgtp_ep, false);
+}
+
+/* like tun_device_find_or_create(), but the device may still be created by a control worker.
+ * Jobs using it must be submitted to tun->strand, and check tun_device_ready() */
+struct tun_device *
+tun_device_find_or_create_async(struct gtp_daemon *d, const char *devname, const char *netns_name,
+				unsigned int num_queues, struct gtp_endpoint *kgtp_ep)
+{
+	return tun_device_get_or_create(d, devname, netns_name, num_queues, kgtp_ep, true);
+}
+
+/* take another reference */
+void tun_device_get(struct tun_device *tun)
+{
+	struct gtp_daemon *d = tun->d;
+
+	ASSERT_MAIN_THREAD(d);
+
+	pthread_rwlock_wrlock(&d->rwlock);
+	tun->use_count++;
+	pthread_rwlock_unlock(&d->rwlock);
+}
+
 /* UNLOCKED hard/forced destroy; caller must make sure references are cleaned up */
 static void _tun_device_destroy(struct tun_device *tun)
 {
+	unsigned int i;
+
 	/* talloc is not thread safe, all alloc/free must come from main thread */
 	ASSERT_MAIN_THREAD(tun->d);
+	/* jobs of the strand hold a reference */
+	OSMO_ASSERT(!tun->strand.busy);
 
-	pthread_cancel(tun->thread);
-	llist_del(&tun->list);
-	if (tun->netns_name)
-		close(tun->netns_fd);
-	close(tun->fd);
-	nl_socket_free(tun->nl);
 	LOGTUN(tun, LOGL_INFO, "Destroying\n");
+	llist_del(&tun->list);
+	if (tun->state != TUN_S_READY) {
+		/* the creation failed, and has cleaned up after itself */
+		talloc_free(tun);
+		return;
+	}
+
+	for (i = 0; i < tun->num_queues; i++)
+		tun_stop_queue_thread(&tun->queues[i]);
+	/* GTP endpoint threads may still be writing to our queues on behalf of a tunnel
+	 * destroyed just before */
+	rcu_synchronize(&tun->d->rcu);
+	tc_bpf_tun_detach(tun);
+	tun_device_close(tun);
 	talloc_free(tun);
 }
 
-/* UNLOCKED remove all objects referencing this tun and then destroy */
+/* UNLOCKED remove all objects referencing this tun and then destroy.  The user addresses
+ * of the tunnels are not removed via netlink, they vanish together with the device */
 void _tun_device_deref_destroy(struct tun_device *tun)
 {
 	struct gtp_daemon *d = tun->d;
@@ -0,0 +1,338 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/talloc.h>
+
+#include "internal.h"
+#include "uecups_bin.h"
+
+/***********************************************************************
+ * UECUPS binary encoding
+ ***********************************************************************/
+
+/* initial size of an encoding buffer */
+#define UECUPS_BIN_BUF_SIZE	256
+
+#define UECUPS_BIN_ADDR_IPV4	1
+#define UECUPS_BIN_ADDR_IPV6	2
+
+const struct value_string uecups_msg_type_names[] = {
+	{ UECUPS_MSGT_CREATE_TUN,		"create_tun" },
+	{ UECUPS_MSGT_CREATE_TUN_RES,		"create_tun_res" },
+	{ UECUPS_MSGT_DESTROY_TUN,		"destroy_tun" },
+	{ UECUPS_MSGT_DESTROY_TUN_RES,		"destroy_tun_res" },
+	{ UECUPS_MSGT_START_PROGRAM,		"start_program" },
+	{ UECUPS_MSGT_START_PROGRAM_RES,	"start_program_res" },
+	{ UECUPS_MSGT_PROGRAM_TERM_IND,		"program_term_ind" },
+	{ UECUPS_MSGT_RESET_ALL_STATE,		"reset_all_state" },
+	{ UECUPS_MSGT_RESET_ALL_STATE_RES,	"reset_all_state_res" },
+	{ UECUPS_MSGT_CREATE_TUN_BATCH,		"create_tun_batch" },
+	{ UECUPS_MSGT_CREATE_TUN_BATCH_RES,	"create_tun_batch_res" },
+	{ UECUPS_MSGT_DESTROY_TUN_BATCH,	"destroy_tun_batch" },
+	{ UECUPS_MSGT_DESTROY_TUN_BATCH_RES,	"destroy_tun_batch_res" },
+	{ UECUPS_MSGT_SET_ENCODING,		"set_encoding" },
+	{ UECUPS_MSGT_SET_ENCODING_RES,		"set_encoding_res" },
+	{ 0, NULL }
+};
+
+const struct value_string uecups_result_names[] = {
+	{ UECUPS_RES_OK,		"OK" },
+	{ UECUPS_RES_ERR_INVALID_DATA,	"ERR_INVALID_DATA" },
+	{ UECUPS_RES_ERR_NOT_FOUND,	"ERR_NOT_FOUND" },
+	{ 0, NULL }
+};
+
+const struct value_string uecups_encoding_names[] = {
+	{ UECUPS_ENC_JSON,	"JSON" },
+	{ UECUPS_ENC_BINARY,	"BINARY" },
+	{ 0, NULL }
+};
+
+/* decode the header of the message at the start of buf; returns 0 or negative if it is
+ * malformed or exceeds len */
+int uecups_bin_msg_dec(struct uecups_bin_msg *msg, const uint8_t *buf, size_t len)
+{
+	struct uecups_bin_hdr hdr;
+
+	if (len < sizeof(hdr))
+		return -EINVAL;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.version != UECUPS_BIN_VERSION)
+		return -EINVAL;
+	if (ntohl(hdr.len) > len - sizeof(hdr))
+		return -EINVAL;
+
+	msg->type = hdr.type;
+	msg->ies = buf + sizeof(hdr);
+	msg->ies_len = ntohl(hdr.len);
+	msg->len = sizeof(hdr) + msg->ies_len;
+
+	return 0;
+}
+
+/* get the IE at *pos and advance it; returns 1, 0 at the end or negative if malformed */
+int uecups_bin_ie_next(struct uecups_bin_ie *ie, const uint8_t **pos, const uint8_t *end)
+{
+	struct uecups_bin_ie_hdr hdr;
+
+	if (*pos == end)
+		return 0;
+	if (end - *pos < sizeof(hdr))
+		return -EINVAL;
+	memcpy(&hdr, *pos, sizeof(hdr));
+	if (ntohs(hdr.len) > end - *pos - sizeof(hdr))
+		return -EINVAL;
+
+	ie->tag = hdr.tag;
+	ie->len = ntohs(hdr.len);
+	ie->val = *pos + sizeof(hdr);
+	*pos = ie->val + ie->len;
+
+	return 1;
+}
+
+/* number of IEs with the given tag */
+unsigned int uecups_bin_ie_count(const uint8_t *ies, size_t len, uint8_t tag)
+{
+	const uint8_t *pos = ies;
+	struct uecups_bin_ie ie;
+	unsigned int n = 0;
+
+	while (uecups_bin_ie_next(&ie, &pos, ies + len) > 0) {
+		if (ie.tag == tag)
+			n++;
+	}
+	return n;
+}
+
+/* the string value of an IE, in place; NULL if it is not NUL terminated */
+const char *uecups_bin_ie_str(const struct uecups_bin_ie *ie)
+{
+	if (ie->len < 1 || ie->val[ie->len - 1] != '\0')
+		return NULL;
+	return (const char *) ie->val;
+}
+
+int uecups_bin_ie_u8(const struct uecups_bin_ie *ie)
+{
+	if (ie->len != 1)
+		return -EINVAL;
+	return ie->val[0];
+}
+
+static int uecups_bin_ie_u32(uint32_t *out, const struct uecups_bin_ie *ie)
+{
+	uint32_t val;
+
+	if (ie->len != sizeof(val))
+		return -EINVAL;
+	memcpy(&val, ie->val, sizeof(val));
+	*out = ntohl(val);
+	return 0;
+}
+
+/* find the first IE with the given tag; returns 1 if found, 0 if not, negative if malformed */
+int uecups_bin_ie_find_u32(const uint8_t *ies, size_t len, uint8_t tag, uint32_t *out)
+{
+	const uint8_t *pos = ies;
+	struct uecups_bin_ie ie;
+	int rc;
+
+	while ((rc = uecups_bin_ie_next(&ie, &pos, ies + len)) > 0) {
+		if (ie.tag == tag)
+			return uecups_bin_ie_u32(out, &ie) < 0 ? -EINVAL : 1;
+	}
+	return rc;
+}
+
+static int uecups_bin_ie_addr(struct sockaddr_storage *out, const struct uecups_bin_ie *ie)
+{
+	uint16_t port;
+
+	memset(out, 0, sizeof(*out));
+	if (ie->len < 4)
+		return -EINVAL;
+	memcpy(&port, ie->val + 2, sizeof(port));
+
+	if (ie->val[0] == UECUPS_BIN_ADDR_IPV4 && ie->len == 4 + 4) {
+		struct sockaddr_in *sin = (struct sockaddr_in *) out;
+		memcpy(&sin->sin_addr, ie->val + 4, 4);
+		sin->sin_family = AF_INET;
+		sin->sin_port = port;
+	} else if (ie->val[0] == UECUPS_BIN_ADDR_IPV6 && ie->len == 4 + 16) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) out;
+		memcpy(&sin6->sin6_addr, ie->val + 4, 16);
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = port;
+	} else
+		return -EINVAL;
+
+	return 0;
+}
+
+/* decode the IEs of a create_tun without allocating anything: the strings of the params
+ * point into the message */
+int uecups_bin_dec_create_tun(struct gtp_tunnel_params *out, const uint8_t *ies, size_t len)
+{
+	const uint8_t *pos = ies;
+	struct uecups_bin_ie ie;
+	unsigned int seen = 0;
+	uint32_t num_queues;
+	int rc;
+
+	memset(out, 0, sizeof(*out));
+
+	while ((rc = uecups_bin_ie_next(&ie, &pos, ies + len)) > 0) {
+		switch (ie.tag) {
+		case UECUPS_IE_TX_TEID:
+			rc = uecups_bin_ie_u32(&out->tx_teid, &ie);
+			break;
+		case UECUPS_IE_RX_TEID:
+			rc = uecups_bin_ie_u32(&out->rx_teid, &ie);
+			break;
+		case UECUPS_IE_USER_ADDR:
+			rc = uecups_bin_ie_addr(&out->user_addr, &ie);
+			break;
+		case UECUPS_IE_LOCAL_GTP_EP:
+			rc = uecups_bin_ie_addr(&out->local_udp, &ie);
+			break;
+		case UECUPS_IE_REMOTE_GTP_EP:
+			rc = uecups_bin_ie_addr(&out->remote_udp, &ie);
+			break;
+		case UECUPS_IE_TUN_DEV_NAME:
+			out->tun_name = uecups_bin_ie_str(&ie);
+			rc = out->tun_name ? 0 : -EINVAL;
+			break;
+		case UECUPS_IE_TUN_NETNS_NAME:
+			out->tun_netns_name = uecups_bin_ie_str(&ie);
+			rc = out->tun_netns_name ? 0 : -EINVAL;
+			break;
+		case UECUPS_IE_TUN_NUM_QUEUES:
+			if (ie.len != 2)
+				return -EINVAL;
+			num_queues = (ie.val[0] << 8) | ie.val[1];
+			if (num_queues < 1 || num_queues > TUN_MAX_QUEUES)
+				return -EINVAL;
+			out->tun_num_queues = num_queues;
+			break;
+		default:
+			continue;
+		}
+		if (rc < 0)
+			return rc;
+		seen |= 1 << ie.tag;
+	}
+	if (rc < 0)
+		return rc;
+
+	/* mandatory IEs */
+	if (!(seen & (1 << UECUPS_IE_TX_TEID)) || !(seen & (1 << UECUPS_IE_RX_TEID)) ||
+	    !(seen & (1 << UECUPS_IE_USER_ADDR)) || !(seen & (1 << UECUPS_IE_LOCAL_GTP_EP)) ||
+	    !(seen & (1 << UECUPS_IE_REMOTE_GTP_EP)) || !(seen & (1 << UECUPS_IE_TUN_DEV_NAME)))
+		return -EINVAL;
+
+	return 0;
+}
+
+int uecups_bin_dec_destroy_tun(struct gtp_tunnel_id *out, const uint8_t *ies, size_t len)
+{
+	const uint8_t *pos = ies;
+	struct uecups_bin_ie ie;
+	bool have_ep = false, have_teid = false;
+	int rc;
+
+	memset(out, 0, sizeof(*out));
+
+	while ((rc = uecups_bin_ie_next(&ie, &pos, ies + len)) > 0) {
+		switch (ie.tag) {
+		case UECUPS_IE_LOCAL_GTP_EP:
+			if (uecups_bin_ie_addr(&out->local_udp, &ie) < 0)
+				return -EINVAL;
+			have_ep = true;
+			break;
+		case UECUPS_IE_RX_TEID:
+			if (uecups_bin_ie_u32(&out->rx_teid, &ie) < 0)
+				return -EINVAL;
+			have_teid = true;
+			break;
+		}
+	}
+	if (rc < 0 || !have_ep || !have_teid)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* make room for n more bytes */
+static void uecups_bin_reserve(struct uecups_bin_buf *b, size_t n)
+{
+	size_t size = talloc_get_size(b->data);
+
+	if (b->len + n <= size)
+		return;
+	while (b->len + n > size)
+		size *= 2;
+	/* a re-allocation keeps the talloc parent */
+	b->data = talloc_realloc_size(NULL, b->data, size);
+	OSMO_ASSERT(b->data);
+}
+
+int uecups_bin_buf_init(struct uecups_bin_buf *b, void *ctx)
+{
+	b->data = talloc_size(ctx, UECUPS_BIN_BUF_SIZE);
+	b->len = 0;
+	return b->data ? 0 : -ENOMEM;
+}
+
+/* start encoding a message, replacing the previous one */
+void uecups_bin_enc_begin(struct uecups_bin_buf *b, uint8_t type)
+{
+	struct uecups_bin_hdr hdr = {
+		.version = UECUPS_BIN_VERSION,
+		.type = type,
+	};
+
+	b->len = 0;
+	uecups_bin_reserve(b, sizeof(hdr));
+	memcpy(b->data, &hdr, sizeof(hdr));
+	b->len = sizeof(hdr);
+}
+
+void uecups_bin_put_ie(struct uecups_bin_buf *b, uint8_t tag, const void *val, uint16_t len)
+{
+	struct uecups_bin_ie_hdr hdr = {
+		.tag = tag,
+		.len = htons(len),
+	};
+
+	uecups_bin_reserve(b, sizeof(hdr) + len);
+	memcpy(b->data + b->len, &hdr, sizeof(hdr));
+	memcpy(b->data + b->len + sizeof(hdr), val, len);
+	b->len += sizeof(hdr) + len;
+}
+
+void uecups_bin_put_u8(struct uecups_bin_buf *b, uint8_t tag, uint8_t val)
+{
+	uecups_bin_put_ie(b, tag, &val, sizeof(val));
+}
+
+void uecups_bin_put_u32(struct uecups_bin_buf *b, uint8_t tag, uint32_t val)
+{
+	val = htonl(val);
+	uecups_bin_put_ie(b, tag, &val, sizeof(val));
+}
+
+/* finish the message; returns its total length */
+size_t uecups_bin_enc_end(struct uecups_bin_buf *b)
+{
+	uint32_t len = htonl(b->len - sizeof(struct uecups_bin_hdr));
+
+	memcpy(b->data + offsetof(struct uecups_bin_hdr, len), &len, sizeof(len));
+	return b->len;
+}
@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include <osmocom/core/utils.h>
+
+/* Compact binary encoding of the UECUPS protocol, an alternative to JSON for high-rate
+ * tunnel churn.  A client switches to it with the set_encoding command; from then on the
+ * daemon sends every message in binary, while it keeps accepting both encodings.
+ *
+ * All integers are in network byte order.  A message is a header followed by IEs:
+ *
+ *   uint8  version	UECUPS_BIN_VERSION; bit 7 set, which no JSON text starts with
+ *   uint8  type	enum uecups_msg_type
+ *   uint16 spare	0
+ *   uint32 length	of the IEs following the header
+ *
+ * Each IE is a tag/length/value:
+ *
+ *   uint8  tag		enum uecups_ie
+ *   uint8  spare	0
+ *   uint16 length	of the value
+ *
+ * Unknown IEs are skipped.  Strings include their NUL termination, so that they can be
+ * used in place.  Addresses are encoded as uint8 addr_type (1: IPv4, 2: IPv6), uint8 spare,
+ * uint16 port (0 for an end user address) and the 4 or 16 bytes of the IP address. */
+
+#define UECUPS_BIN_VERSION	0x81
+
+struct uecups_bin_hdr {
+	uint8_t version;
+	uint8_t type;
+	uint16_t spare;
+	uint32_t len;
+} __attribute__ ((packed));
+
+struct uecups_bin_ie_hdr {
+	uint8_t tag;
+	uint8_t spare;
+	uint16_t len;
+} __attribute__ ((packed));
+
+/* message types, shared by both encodings; a response is its request + 1 */
+enum uecups_msg_type {
+	UECUPS_MSGT_CREATE_TUN		= 1,
+	UECUPS_MSGT_CREATE_TUN_RES	= 2,
+	UECUPS_MSGT_DESTROY_TUN		= 3,
+	UECUPS_MSGT_DESTROY_TUN_RES	= 4,
+	UECUPS_MSGT_START_PROGRAM	= 5,
+	UECUPS_MSGT_START_PROGRAM_RES	= 6,
+	UECUPS_MSGT_PROGRAM_TERM_IND	= 7,
+	UECUPS_MSGT_RESET_ALL_STATE	= 9,
+	UECUPS_MSGT_RESET_ALL_STATE_RES	= 10,
+	UECUPS_MSGT_CREATE_TUN_BATCH	= 11,
+	UECUPS_MSGT_CREATE_TUN_BATCH_RES = 12,
+	UECUPS_MSGT_DESTROY_TUN_BATCH	= 13,
+	UECUPS_MSGT_DESTROY_TUN_BATCH_RES = 14,
+	UECUPS_MSGT_SET_ENCODING	= 15,
+	UECUPS_MSGT_SET_ENCODING_RES	= 16,
+};
+#define UECUPS_MSGT_RES(type)	((type) + 1)
+/* the keys of the JSON encoding */
+extern const struct value_string uecups_msg_type_names[];
+
+enum uecups_ie {
+	UECUPS_IE_RESULT		= 1,	/* uint8, enum uecups_result */
+	UECUPS_IE_RESULT_LIST		= 2,	/* uint8 per tunnel of a batch; may be repeated */
+	UECUPS_IE_TX_TEID		= 3,	/* uint32 */
+	UECUPS_IE_RX_TEID		= 4,	/* uint32 */
+	UECUPS_IE_USER_ADDR		= 5,	/* address */
+	UECUPS_IE_LOCAL_GTP_EP		= 6,	/* address */
+	UECUPS_IE_REMOTE_GTP_EP		= 7,	/* address */
+	UECUPS_IE_TUN_DEV_NAME		= 8,	/* string */
+	UECUPS_IE_TUN_NETNS_NAME	= 9,	/* string */
+	UECUPS_IE_TUN_NUM_QUEUES	= 10,	/* uint16 */
+	UECUPS_IE_TUNNEL		= 11,	/* IEs of one create_tun/destroy_tun of a batch */
+	UECUPS_IE_COMMAND		= 12,	/* string */
+	UECUPS_IE_ENVIRONMENT		= 13,	/* string; one IE per entry */
+	UECUPS_IE_RUN_AS_USER		= 14,	/* string */
+	UECUPS_IE_PID			= 15,	/* uint32 */
+	UECUPS_IE_EXIT_CODE		= 16,	/* uint32 */
+	UECUPS_IE_ENCODING		= 17,	/* uint8, enum uecups_encoding */
+	UECUPS_IE_TRANS_ID		= 18,	/* uint32; echoed in the response(s) to a request */
+};
+
+enum uecups_result {
+	UECUPS_RES_OK			= 1,
+	UECUPS_RES_ERR_INVALID_DATA	= 2,
+	UECUPS_RES_ERR_NOT_FOUND	= 3,
+};
+extern const struct value_string uecups_result_names[];
+
+enum uecups_encoding {
+	UECUPS_ENC_JSON			= 0,
+	UECUPS_ENC_BINARY		= 1,
+};
+extern const struct value_string uecups_encoding_names[];
+
+/* whether a message starting with the given byte is in binary encoding */
+static inline int uecups_bin_is_bin(uint8_t first)
+{
+	return first == UECUPS_BIN_VERSION;
+}
+
+/* a received message; the IEs point into the receive buffer */
+struct uecups_bin_msg {
+	uint8_t type;
+	const uint8_t *ies;
+	size_t ies_len;
+	/* total length including the header */
+	size_t len;
+};
+
+struct uecups_bin_ie {
+	uint8_t tag;
+	uint16_t len;
+	const uint8_t *val;
+};
+
+int uecups_bin_msg_dec(struct uecups_bin_msg *msg, const uint8_t *buf, size_t len);
+int uecups_bin_ie_next(struct uecups_bin_ie *ie, const uint8_t **pos, const uint8_t *end);
+unsigned int uecups_bin_ie_count(const uint8_t *ies, size_t len, uint8_t tag);
+const char *uecups_bin_ie_str(const struct uecups_bin_ie *ie);
+int uecups_bin_ie_u8(const struct uecups_bin_ie *ie);
+int uecups_bin_ie_find_u32(const uint8_t *ies, size_t len, uint8_t tag, uint32_t *out);
+
+struct gtp_tunnel_params;
+struct gtp_tunnel_id;
+int uecups_bin_dec_create_tun(struct gtp_tunnel_params *out, const uint8_t *ies, size_t len);
+int uecups_bin_dec_destroy_tun(struct gtp_tunnel_id *out, const uint8_t *ies, size_t len);
+
+/* a message being encoded; the buffer is re-used for all messages and only grows */
+struct uecups_bin_buf {
+	uint8_t *data;
+	size_t len;
+};
+
+int uecups_bin_buf_init(struct uecups_bin_buf *b, void *ctx);
+void uecups_bin_enc_begin(struct uecups_bin_buf *b, uint8_t type);
+void uecups_bin_put_ie(struct uecups_bin_buf *b, uint8_t tag, const void *val, uint16_t len);
+void uecups_bin_put_u8(struct uecups_bin_buf *b, uint8_t tag, uint8_t val);
+void uecups_bin_put_u32(struct uecups_bin_buf *b, uint8_t tag, uint32_t val);
+size_t uecups_bin_enc_end(struct uecups_bin_buf *b);
@@ -10,6 +10,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <netdb.h>
+#include <netinet/in.h>
 
 #include "internal.h"
 
@@ -49,6 +50,48 @@ bool sockaddr_equals(const struct sockaddr *a, const struct sockaddr *b)
 	return true;
 }
 
+/* compare only family + IP address of two sockaddr, ignoring the port */
+bool sockaddr_addr_equals(const struct sockaddr *a, const struct sockaddr *b)
+{
+	const struct sockaddr_in *a4, *b4;
+	const struct sockaddr_in6 *a6, *b6;
+
+	if (a->sa_family != b->sa_family)
+		return false;
+
+	switch (a->sa_family) {
+	case AF_INET:
+		a4 = (struct sockaddr_in *) a;
+		b4 = (struct sockaddr_in *) b;
+		return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	case AF_INET6:
+		a6 = (struct sockaddr_in6 *) a;
+		b6 = (struct sockaddr_in6 *) b;
+		return !memcmp(a6->sin6_addr.s6_addr, b6->sin6_addr.s6_addr, sizeof(b6->sin6_addr.s6_addr));
+	default:
+		return false;
+	}
+}
+
+/* fold the IP address of a sockaddr into a 32bit hash table key */
+uint32_t sockaddr_addr_hash(const struct sockaddr *sa)
+{
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		sin = (struct sockaddr_in *) sa;
+		return sin->sin_addr.s_addr;
+	case AF_INET6:
+		sin6 = (struct sockaddr_in6 *) sa;
+		return sin6->sin6_addr.s6_addr32[0] ^ sin6->sin6_addr.s6_addr32[1] ^
+		       sin6->sin6_addr.s6_addr32[2] ^ sin6->sin6_addr.s6_addr32[3];
+	default:
+		return 0;
+	}
+}
+
 struct addrinfo *addrinfo_helper(uint16_t family, uint16_t type, uint8_t proto,
 				 const char *host, uint16_t port, bool passive)
 {